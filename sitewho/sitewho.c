@@ -13,12 +13,11 @@
 
 #include "structonline.h"
 #include "sitewho.h"
+#include "pwcache.h"
 
 int		debug = 0;
-int		groups = 0, GROUPS = 0;
 
 static struct ONLINE *user;
-static struct GROUP **group;
 
 long long	shmid;
 struct shmid_ds	ipcbuf;
@@ -60,7 +59,6 @@ main(int argc, char **argv)
 	char		raw_output = 2;
 	int		user_idx = 2;
 #endif
-	int		gnum = 0;
 	readconfig(argv[0]);
 	if (!ipckey)
 		ipckey = def_ipckey;
@@ -87,7 +85,7 @@ main(int argc, char **argv)
 	if (threshold < 1)
 		threshold = def_threshold;
 
-	gnum = buffer_groups(glgroup, 0);
+	load_groups(glgroup);
 
 	if (argc > 1 && strlen(argv[1]) == 5) {
 		if (!strcasecmp(argv[1], "--raw")) {
@@ -160,7 +158,7 @@ main(int argc, char **argv)
 		}
 #endif
 	}
-	buffer_groups(glgroup, gnum);
+	pwc_free();
 	if (footer != def_footer)
 		free(footer);
 	if (header != def_header)
@@ -223,14 +221,9 @@ filesize(char *filename)
 char           *
 get_g_name(unsigned int gid)
 {
-	int		n;
+	const char	*name = pwc_gname((gid_t)gid, 1);
 
-	for (n = 0; n < groups; n++) {
-		if (group[n]->id == gid)
-			return group[n]->name;
-	}
-
-	return "NoGroup";
+	return name ? (char *)name : "NoGroup";
 }
 
 int 
@@ -755,71 +748,18 @@ showtotals(char raw)
 	}
 }
 
-/* Buffer groups file */
-int 
-buffer_groups(char *groupfile, int setfree)
+/* Reads the groups file */
+void
+load_groups(char *groupfile)
 {
-	char           *f_buf, *g_name, *f_name;
-	long		f, n = 0, m, f_size, g_id, g_n_size, l_start = 0;
-
-	if (setfree) {
-		for (n = 0; n < setfree; n++) {
-			free(group[n]->name);
-			free(group[n]);
-		}
-		free(group);
-		return 0;
-        }
+	char           *f_name;
 
 	f_name = malloc(strlen(glpath) + strlen(groupfile) + 2);
 	sprintf(f_name, "%s/%s", glpath, groupfile);
 	if (!check_path(f_name))
 		sprintf(f_name, "/%s", groupfile);
-	f = open(f_name, O_NONBLOCK);
-	fstat(f, &filestat);
-	f_size = filestat.st_size;
-	f_buf = malloc(f_size);
-	if (read(f, f_buf, f_size) == -1) {
+	if (pwc_load(NULL, NULL, f_name) == -1)
 		printf("Failed to read() %s: %s\n", f_name, strerror(errno));
-	}
-
-	for (n = 0; n < f_size; n++)
-		if (f_buf[n] == '\n')
-			GROUPS++;
-	group = malloc(GROUPS * sizeof(struct GROUP *));
-
-	for (n = 0; n < f_size; n++) {
-		if (f_buf[n] == '\n' || n == f_size) {
-			f_buf[n] = 0;
-			m = l_start;
-			while (f_buf[m] != ':' && m < n)
-				m++;
-			if (m != l_start) {
-				f_buf[m] = 0;
-				g_name = f_buf + l_start;
-				g_n_size = m - l_start;
-				m = n;
-				while (f_buf[m] != ':' && m > l_start)
-					m--;
-				f_buf[m] = 0;
-				while (f_buf[m] != ':' && m > l_start)
-					m--;
-				if (m != n) {
-					g_id = atoi(f_buf + m + 1);
-					group[groups] = malloc(sizeof(struct GROUP));
-					group[groups]->name = malloc(g_n_size + 1);
-					strcpy(group[groups]->name, g_name);
-					group[groups]->id = g_id;
-					groups++;
-				}
-			}
-			l_start = n + 1;
-		}
-	}
-
-	close(f);
-	free(f_buf);
 	free(f_name);
-	return groups;
 }
 
@@ -1,11 +1,6 @@
 #ifndef SITEWHO_H
 #define SITEWHO_H
 
-struct GROUP {
-	char           *name;
-	gid_t		id;
-};
-
 int check_path(char *);
 unsigned long filesize(char *);
 char *get_g_name(unsigned int);
@@ -17,7 +12,7 @@ short compareflags(char *, char *);
 void readconfig(char *);
 void show(char *);
 void showtotals(char);
-int buffer_groups(char *, int);
+void load_groups(char *);
 
 #endif
 
@@ -22,6 +22,16 @@
 #define CRC_STANDARD			0
 #define CRC_SLICEBY4			1
 #define CRC_SLICEBY8			2
+#define CRC_AUTO			3
+
+#define CRC_IO_STDIO			0
+#define CRC_IO_MMAP			1
+#define CRC_IO_PREAD			2
+#define CRC_IO_DIRECT			3
+
+#define JOURNAL_SYNC_NONE		0
+#define JOURNAL_SYNC_COMPLETE		1
+#define JOURNAL_SYNC_WRITE		2
 
 #define DISABLED			NULL
 
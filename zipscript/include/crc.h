@@ -1,6 +1,45 @@
 #ifndef _CRC_H_
 #define _CRC_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* max threads used by calc_crc32_parallel() */
+#define CRC_PARALLEL_MAXTHREADS		16
+
+/* read size and buffer alignment for CRC_IO_PREAD/CRC_IO_DIRECT,
+ * bytes mapped at a time for CRC_IO_MMAP */
+#define CRC_IO_BUFSIZE			1048576
+#define CRC_IO_ALIGN			4096
+#define CRC_MMAP_WINDOW			67108864
+
+/* crc cache (storage/<path>/crccache) layout */
+#define CRCCACHE_MAGIC			0x4343474e	/* "NGCC" */
+#define CRCCACHE_VERSION		2
+#define CRCCACHE_TAIL			65536	/* bytes covered by tail_crc */
+
+typedef struct {
+	uint32_t	magic,
+			version;
+} CRCCACHE_HEAD;
+
+typedef struct {
+	uint64_t	dev,
+			ino;
+	int64_t		size,
+			mtime;
+	uint32_t	mtime_nsec,
+			crc32,
+			tail_crc,	/* crc of the last CRCCACHE_TAIL bytes */
+			reserved;
+} CRCCACHE;
+
+unsigned int crc32_update(unsigned int, const unsigned char *, size_t);
+unsigned int crc32_concat(unsigned int, unsigned int, off_t);
 unsigned int calc_crc32(char *);
+unsigned int calc_crc32_parallel(char *);
+void crc_cache_init(const char *);
+void crc_cache_add(char *, unsigned int);
 
 #endif
@@ -1,8 +1,8 @@
 #ifndef DATACLEANER_H
 #define DATACLEANER_H
 
-void remove_dir_loop(char *);
-void check_dir_loop(char *, int);
+void remove_dir_loop(int, const char *);
+void check_dir_loop(int, const char *, char *, int);
 
 #endif
 
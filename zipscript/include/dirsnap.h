@@ -0,0 +1,57 @@
+#ifndef _DIRSNAP_H_
+#define _DIRSNAP_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "dirwalk.h"
+
+/* A snapshot of the entries of a directory, read in one go with a DIRWALK:
+ * their names, their d_type, an index by name folded
+ * the loosest way lenient_compare() or strcasecmp() would match it, and an
+ * index by extension (what follows the last '.', lowercased). The helpers
+ * that rewound and read the release dir for every question ask it instead.
+ * It is read again on the first question after dirsnap_changed(), which is
+ * called wherever the zipscript itself adds, renames or removes entries.
+ * Names handed out stay valid until dirsnap_close(). */
+
+typedef struct {
+	uint32_t	name,			// offset in the names.
+			len,
+			next_key,		// the next entry in the same bucket of
+			next_ext;		// the index by key/extension, +1 - 0 ends it.
+	unsigned char	type;			// d_type - DT_UNKNOWN if the fs doesn't say.
+} DIRSNAP_ENT;
+
+typedef struct {
+	DIRWALK		walk;
+	unsigned int	gen,			// of dirsnap_changed() when it was read, 0 if never.
+			count,
+			alloc,
+			mask;			// buckets - 1, a power of 2 minus 1.
+	uint32_t	*key,			// first entry in each bucket, +1.
+			*ext;
+	DIRSNAP_ENT	*ent;
+	char		*names;
+	size_t		len,
+			size;
+	char		**old;			// names of the earlier reads, for the
+	unsigned int	nold;			// pointers handed out of them.
+} DIRSNAP;
+
+#define DIRSNAP_EXACT		0
+#define DIRSNAP_NOCASE		1
+#define DIRSNAP_LENIENT		2
+
+extern DIRSNAP *dirsnap_open(const char *);
+extern void dirsnap_close(DIRSNAP *);
+extern void dirsnap_changed(void);
+extern unsigned int dirsnap_read(DIRSNAP *);
+extern const char *dirsnap_name(const DIRSNAP *, unsigned int);
+extern unsigned char dirsnap_type(const DIRSNAP *, unsigned int);
+extern const char **dirsnap_list(DIRSNAP *, unsigned int *);
+extern int dirsnap_find(DIRSNAP *, const char *, int, int);
+extern int dirsnap_ext(DIRSNAP *, const char *, int);
+extern int dirsnap_stat(DIRSNAP *, unsigned int, int, struct stat *);
+
+#endif
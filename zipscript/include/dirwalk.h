@@ -0,0 +1,46 @@
+#ifndef _DIRWALK_H_
+#define _DIRWALK_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+/* Walks the entries of a directory opened relative to the fd of another
+ * one, so the tools going through a tree never have to chdir() around it.
+ * The entries are read with getdents64 where there is one, a large buffer
+ * at a time, and come with their d_type - so the type of most of them is
+ * known without asking. dirwalk_statat() asks only for what it is told to,
+ * with statx where there is one, and only when the d_type doesn't say. */
+
+typedef struct {
+	int		fd;			// of the dir walked.
+	char		*buf;			// of getdents64.
+	long		len,			// read into it,
+			pos;			// and gone through.
+	DIR		*dir;			// where there is no getdents64.
+	const char	*name;			// of the entry dirwalk_next() is at.
+	unsigned char	type;			// its d_type - DT_UNKNOWN if the fs doesn't say.
+} DIRWALK;
+
+#define DIRWALK_BUFSIZE		65536
+
+#define DW_TYPE			0x01	/* the S_IFMT bits of st_mode */
+#define DW_MODE			0x02	/* all of st_mode */
+#define DW_SIZE			0x04
+#define DW_TIMES		0x08	/* st_mtime and st_ctime */
+#define DW_OWNER		0x10	/* st_uid and st_gid */
+
+#ifndef DT_UNKNOWN
+# define DT_UNKNOWN		0
+#endif
+
+extern int dirwalk_open(DIRWALK *, int, const char *);
+extern void dirwalk_close(DIRWALK *);
+extern void dirwalk_rewind(DIRWALK *);
+extern int dirwalk_next(DIRWALK *);
+extern int dirwalk_statat(int, const char *, unsigned char, int, int, struct stat *);
+extern mode_t dirwalk_type(int, const char *, unsigned char, int);
+
+#define dirwalk_stat(w, want, flags, st)	dirwalk_statat((w)->fd, (w)->name, (w)->type, want, flags, st)
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef _LOCKSHM_H_
+#define _LOCKSHM_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "race-file.h"
+
+/* With lock_shm set, the locks of the releases are kept in one SysV shared
+ * memory segment of the site (key lock_shm_key) instead of in headdata.lock:
+ * a table of LOCKSHM_ENTRIES entries, each the lock of one release - found
+ * by a hash of its storage dir - as a robust process-shared mutex, with the
+ * lock fields of its headdata next to it. Taking a lock nobody holds writes
+ * nothing to the disk, a lock given up is handed to the next process by the
+ * kernel, and the lock of a process that died holding it is given to the
+ * next one with LS_OWNERDEAD. An entry of a release nobody holds the lock of
+ * is given to another one when the table has no room left. */
+
+typedef struct {
+	uint64_t	hash;			// of the storage dir of the release, 0 if never used.
+	uint32_t	used,			// when last looked up - the oldest one goes first.
+			reserved;
+	HEADDATA	fields;			// data_in_use, data_incrementor, data_queue (the
+						// number waiting) and data_pid are used.
+	pthread_mutex_t	mutex;			// the lock of the release.
+} LOCKSHM_ENT;
+
+typedef struct {
+	uint32_t	magic,			// LOCKSHM_MAGIC, once set up.
+			entries,		// LOCKSHM_ENTRIES.
+			entsize,		// sizeof(LOCKSHM_ENT).
+			reserved;
+	pthread_mutex_t	table;			// held while looking up or giving out entries.
+	LOCKSHM_ENT	ent[];
+} LOCKSHM;
+
+#define LOCKSHM_MAGIC		0x4b4c474e	/* "NGLK" */
+#define LOCKSHM_ENTRIES		1024
+#define LOCKSHM_PROBE		64		/* entries a release may be found in */
+
+#define LS_LOCKED		0
+#define LS_OWNERDEAD		1		/* locked - the last holder died holding it */
+#define LS_BUSY			-1		/* held by another, and not given up in time */
+#define LS_MOVED		-2		/* the entry went to another release - look again */
+
+extern uint64_t ls_hash(const char *);
+extern LOCKSHM_ENT *ls_find(const char *, uint64_t *);
+extern int ls_lock(LOCKSHM_ENT *, uint64_t, const struct timespec *);
+extern void ls_unlock(LOCKSHM_ENT *);
+extern int ls_wait(unsigned int *, unsigned int, const struct timespec *);
+extern void ls_wake(unsigned int *);
+
+#endif
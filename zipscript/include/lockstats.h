@@ -0,0 +1,91 @@
+#ifndef _LOCKSTATS_H_
+#define _LOCKSTATS_H_
+
+#include <stdint.h>
+
+/* With lock_stats_file set, each process that asked for the lock of a
+ * release adds what it saw - how long it waited and held it, where in the
+ * queue it was, and what was suggested or forced - to a file of fixed size
+ * for the whole site, mapped shared and added to with atomic operations.
+ * zipscript/utils/ng-lockstat prints it. */
+
+/* the times are in microseconds, put in bucket n when < 2^n */
+#define LOCKSTAT_BUCKETS	32
+#define LOCKSTAT_QUEUE		16		/* the last bucket is for all further back */
+#define LOCKSTAT_RELEASES	1024
+#define LOCKSTAT_PROBE		16
+#define LOCKSTAT_PATHLEN	128
+
+/* the flags of a LOCKSTAT_REC */
+#define LOCKSTAT_GOT		0x01		/* got the lock */
+#define LOCKSTAT_TIMEOUT	0x02		/* gave up waiting for it */
+#define LOCKSTAT_FORCED		0x04		/* took it from a live holder */
+#define LOCKSTAT_SUGGESTED	0x08		/* asked the holder to leave */
+#define LOCKSTAT_YIELDED	0x10		/* left when asked to */
+#define LOCKSTAT_LOST		0x20		/* had it forced from us */
+#define LOCKSTAT_OWNERDEAD	0x40		/* the holder before us died holding it */
+
+/* what one process saw of one lock */
+typedef struct {
+	char		path[LOCKSTAT_PATHLEN];	// of the release, as given to create_lock().
+	unsigned int	progtype,
+			flags,
+			queue,			// processes ahead of us when we asked.
+			retries,		// tickets drawn again, entries looked up again, and
+						// waits for a process that forced the lock.
+			touches,		// incrementor writes by update_lock().
+			skips;			// update_lock() calls that lock_optimize left out.
+	uint64_t	wait_us,
+			hold_us;
+} LOCKSTAT_REC;
+
+typedef struct {
+	uint64_t	hash;			// of path, 0 for an unused slot.
+	char		path[LOCKSTAT_PATHLEN];
+	uint64_t	last,			// time of the last lock.
+			locks,
+			timeouts,
+			forced,
+			suggested,
+			yielded,
+			wait_us,
+			wait_max_us,
+			hold_us,
+			hold_max_us,
+			queue_max;
+} LOCKSTAT_REL;
+
+typedef struct {
+	uint32_t	magic,			// LOCKSTAT_MAGIC.
+			version,		// LOCKSTAT_VERSION.
+			releases,		// LOCKSTAT_RELEASES.
+			reserved;
+	uint64_t	started,		// when the file was made.
+			locks,			// processes that got the lock.
+			timeouts,
+			forced,
+			lost,
+			suggested,
+			yielded,
+			ownerdead,
+			retries,
+			touches,
+			skips,
+			waited,			// processes that did not get the lock at once.
+			wait_us,
+			hold_us,
+			wait_hist[LOCKSTAT_BUCKETS],
+			hold_hist[LOCKSTAT_BUCKETS],
+			queue_hist[LOCKSTAT_QUEUE],
+			progtype[8];		// locks by progtype, by bit - see constants.h.
+	LOCKSTAT_REL	rel[LOCKSTAT_RELEASES];	// the releases last locked - one that is
+						// not there takes the place of the one
+						// locked the longest ago near its hash.
+} LOCKSTATS;
+
+#define LOCKSTAT_MAGIC		0x54534c4e	/* "NLST" */
+#define LOCKSTAT_VERSION	1
+
+extern void lockstat_add(const LOCKSTAT_REC *);
+
+#endif
@@ -10,6 +10,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <stdint.h>
 
 #ifndef PATH_MAX
  #define _LIMITS_H_
@@ -41,7 +42,7 @@
 struct USERINFO {
 	char		name[24];	/* Username */
 	off_t		bytes;	/* Bytes uploaded */
-	unsigned long	speed;	/* Bytes per second */
+	uint64_t	speed;	/* Bytes per second */
 	unsigned int	files;	/* Files uploaded */
 	unsigned int	pos;	/* User position */
 	unsigned int	group;	/* Primary group number */
@@ -55,7 +56,7 @@ struct USERINFO {
 struct GROUPINFO {
 	char		name[24];	/* Groupname */
 	off_t		bytes;	/* Bytes uploaded */
-	unsigned long	speed;	/* Bytes per second */
+	uint64_t	speed;	/* Bytes per second */
 	unsigned int	files;	/* Files uploaded */
 	unsigned int	pos;	/* Group position */
 	unsigned int	users;	/* Users in group; */
@@ -107,7 +108,7 @@ struct current_user {
 struct current_file {
 	char		name[NAME_MAX];
 	char		unlink[NAME_MAX];
-	unsigned long	speed;
+	uint64_t	speed;	/* Bytes per second */
 	off_t		size;
 	char		compression_method;
 };
@@ -121,7 +122,7 @@ struct race_total {
 	int		files_missing;
 	int		files_bad;
 	unsigned char	nfo_present;
-	unsigned long	speed;
+	uint64_t	speed;
 	off_t		size;
 	off_t		bad_size;
 };
@@ -189,6 +190,6 @@ typedef struct {
 /* sfv_version - must be > 5. Should not be any need to add a version
  * for racedata - if either sfv_data or racedata changes, they both
  * should be removed */
-#define sfv_version	17
+#define sfv_version	19
 
 #endif
@@ -0,0 +1,54 @@
+#ifndef _PWCACHE_H_
+#define _PWCACHE_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* The users and groups of glftpd, read from its passwd and group files into
+ * one block: a PWC_HEAD, the hash tables of the users by uid and by name and
+ * of the groups by gid and by name, the entries, and their names. The block
+ * is written to a cache file, and mapped from there by the next process as
+ * long as the passwd and group files have the mtime, size and inode they had
+ * when it was made - so they are only read again when they change. */
+
+typedef struct {
+	uint32_t	id,
+			name,			// offset in the names.
+			next_id,		// the next entry in the same hash bucket
+			next_name;		// of the table by id/name, +1 - 0 ends it.
+} PWC_ENT;
+
+typedef struct {
+	uint32_t	magic,			// PWC_MAGIC.
+			version,		// PWC_VERSION.
+			size,			// of the whole block.
+			users,
+			groups,
+			ubuckets,		// of each table of the users - a power of 2.
+			gbuckets,		// of each table of the groups.
+			names;			// bytes of the names.
+	int64_t		pw_mtime,		// of the files it was read from.
+			pw_size,
+			pw_ino,
+			gr_mtime,
+			gr_size,
+			gr_ino;
+	/* followed by:
+	 * uint32_t	uid[ubuckets], uname[ubuckets], gid[gbuckets], gname[gbuckets];
+	 *		- the first entry in each bucket, +1.
+	 * PWC_ENT	user[users], group[groups];
+	 * char		names[names];
+	 */
+} PWC_HEAD;
+
+#define PWC_MAGIC		0x43575047	/* "GPWC" */
+#define PWC_VERSION		1
+
+extern int pwc_load(const char *, const char *, const char *);
+extern void pwc_free(void);
+extern const char *pwc_uname(uid_t);
+extern const char *pwc_gname(gid_t, int);
+extern int pwc_uid(const char *, uid_t *);
+extern int pwc_gid(const char *, gid_t *);
+
+#endif
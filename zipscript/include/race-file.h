@@ -2,16 +2,39 @@
 #define _RACE_FILE_H_
 
 #include <sys/stat.h>
+#include <stdint.h>
 #include "objects.h"
 #include "zsfunctions.h"
 
-/* this is what we write to racedata files */
+/* this is what we write to racedata files. The names live in the string
+ * table at the end of the file - fname and owner are offsets into it, and
+ * owner holds the user name followed by the group name. */
+typedef struct {
+	uint64_t	size,
+			speed;
+	int64_t		start_time;
+	uint32_t	crc32,
+			fname,
+			owner,
+			status;
+} RACEDATA;
+
+/* a racedata record with its names, as it is passed around in memory */
+typedef struct {
+	unsigned int	crc32;
+	unsigned char	status;
+	uint64_t	speed;
+	int64_t		size;
+	time_t		start_time;
+	char		fname[NAMEMAX],
+			uname[24],
+			group[24];
+} RACEENTRY;
+
+/* racedata record of sfv_version 18 and older */
 typedef struct {
 	unsigned int	crc32,
-			speed; /* should become unsigned long, but causes
-				* backwards incompatibility; might be overcome
-				* via sfv_version checking when using readrace()
-				*/
+			speed;
 	off_t		size;
 	time_t		start_time;
 	unsigned char	status;
@@ -19,15 +42,141 @@ typedef struct {
 	char		fname[NAMEMAX],
 			uname[24],
 			group[24],
-			dummy2[31], /* not used anymore, */
-			dummy3[31]; /* kept for compatibilty */
-} RACEDATA;
+			dummy2[31],
+			dummy3[31];
+} RACEDATA_OLD;
+
+/* racedata files start with this head, followed by the hash index
+ * (buckets RACEDATA_INDEX entries), room for capacity RACEDATA records
+ * and strsize bytes of NUL terminated names */
+typedef struct {
+	unsigned int	magic,			// RACEDATA_MAGIC.
+			count,			// records in the file, removed ones included.
+			capacity,		// records there is room for.
+			buckets,		// entries in the index - a power of 2.
+			deleted,		// removed records.
+			strsize,		// bytes in the string table.
+			gen,			// changed on every update.
+			reserved;
+} RACEDATA_HEAD;
+
+/* hash index entry - fname hash to record */
+typedef struct {
+	unsigned int	slot,			// record number + 1, 0 if unused.
+			hash;
+} RACEDATA_INDEX;
+
+#define RACEDATA_MAGIC		0x3244524e	/* "NRD2" */
+#define RACEDATA_MAGIC_OLD	0x4452474e	/* "NGRD" - sfv_version 18 */
+#define RACEDATA_TOMBSTONE	0xffffffff	/* slot of a removed entry */
+#define RACEDATA_MINCAP		64
+#define RACEDATA_PROBE		16		/* index entries read at a time */
+
+/* file offset of record n */
+#define RACEDATA_OFFSET(rh, n)	((off_t)sizeof(RACEDATA_HEAD) + (off_t)(rh)->buckets * sizeof(RACEDATA_INDEX) + (off_t)(n) * sizeof(RACEDATA))
+/* file offset of the string table */
+#define RACEDATA_STRINGS(rh)	RACEDATA_OFFSET(rh, (rh)->capacity)
+
+/* this is put in sfvdata files, after a SFVDATA_HEAD. The names follow
+ * the records, fname is an offset into them */
+typedef struct {
+	uint32_t	crc32,
+			fname;
+} SFVDATA;
+
+typedef struct {
+	uint32_t	magic,			// SFVDATA_MAGIC.
+			count,			// records.
+			strsize,		// bytes in the string table.
+			reserved;
+} SFVDATA_HEAD;
+
+#define SFVDATA_MAGIC		0x3246534e	/* "NSF2" */
 
-/* this is put in sfvdata files */
+/* a sfv entry as it is passed around in memory - and the sfvdata record
+ * of sfv_version 18 and older */
 typedef struct {
 	unsigned int	crc32;
 	char		fname[NAMEMAX];
-} SFVDATA;
+} SFVENTRY;
+
+/* read-only iterator over the records of a racedata or sfvdata file */
+typedef struct {
+	void		*map;
+	size_t		len,
+			recsize;
+	const char	*rec,			// first record in map.
+			*str;			// string table in map.
+	unsigned int	count,			// records in the file.
+			pos,			// next record rec_next() returns.
+			strsize;
+} RECITER;
+
+/* race summary - the totals readrace() adds up from racedata. It is kept
+ * after HEADDATA in the headdata file, followed by the users and then the
+ * groups, and is only used while its gen matches the one of racedata */
+typedef struct {
+	char		name[24];
+	uint64_t	bytes,
+			speed;
+	uint32_t	files,
+			group,			// group of a user.
+			first,			// first record of a user.
+			reserved;
+} RACESUMMARY_ENTRY;
+
+typedef struct {
+	uint32_t	magic,			// RACESUMMARY_MAGIC.
+			gen,			// RACEDATA_HEAD gen this matches.
+			users,
+			groups,
+			files,			// checked and unchecked files.
+			files_bad,
+			nfo,			// F_NFO records.
+			start_time,		// of the first counted record.
+			first,			// first counted record.
+			last,			// no counted record comes after this.
+			fastest_rec,
+			fastest_user,
+			slowest_rec,
+			slowest_user;
+	uint64_t	size,
+			speed,
+			bad_size,
+			fastest_speed,
+			slowest_speed;
+} RACESUMMARY_HEAD;
+
+#define RACESUMMARY_MAGIC	0x4d53474e	/* "NGSM" */
+#define RACESUMMARY_MAX		255		/* users and groups - see struct race_total */
+#define RACESUMMARY_NONE	0xffffffff
+
+typedef struct {
+	RACESUMMARY_HEAD	h;
+	RACESUMMARY_ENTRY	user[RACESUMMARY_MAX],
+				group[RACESUMMARY_MAX];
+} RACESUMMARY;
+
+/* write-ahead journal - every in-place write to racedata, sfvdata and
+ * headdata is appended to the journal file of the release first. It is
+ * emptied by remove_lock(), and replayed by create_lock() when the process
+ * holding the lock died before that. Each record is followed by len bytes
+ * of data */
+typedef struct {
+	uint32_t	magic,			// JOURNAL_MAGIC.
+			len,
+			name,			// JOURNAL_RACEDATA, ...
+			crc;			// of the record with crc 0, and the data.
+	uint64_t	dev,			// the file written to (see st_ident()) -
+			ino;			// records are not replayed on a file replaced since.
+	int64_t		offset;
+} JOURNAL_REC;
+
+#define JOURNAL_MAGIC		0x4c4a474e	/* "NGJL" */
+#define JOURNAL_RACEDATA	0
+#define JOURNAL_SFVDATA		1
+#define JOURNAL_HEADDATA	2
+#define JOURNAL_MAXLEN		(1024 * 1024)
 
 /* this is what we put in a special 'head' file for version control, lock etc */
 typedef struct {
@@ -41,9 +190,16 @@ typedef struct {
 			data_completed;		// flag to mark release as complete.
 } HEADDATA;
 
+extern int racedata_iter_open(RECITER *, const char *);
+extern int sfvdata_iter_open(RECITER *, const char *);
+extern const void *rec_next(RECITER *);
+extern const char *rec_str(const RECITER *, unsigned int);
+extern void racedata_entry(const RECITER *, const RACEDATA *, RACEENTRY *);
+extern void rec_close(RECITER *);
+extern int sfvdata_create(const char *, const SFVENTRY *, unsigned int);
 extern unsigned int readsfv(const char *, struct VARS *, int);
 extern char *get_first_filename_from_sfvdata(const char *);
-extern int parse_sfv(char *, GLOBAL *, DIR *);
+extern int parse_sfv(char *, GLOBAL *, DIRSNAP *);
 extern void update_sfvdata(const char *, const char *, const unsigned int);
 extern void delete_sfv(const char *, struct VARS *);
 extern void readrace(const char *, struct VARS *, struct USERINFO **, struct GROUPINFO **);
@@ -55,10 +211,12 @@ extern void create_indexfile(const char *, struct VARS *, char *);
 extern short clear_file(const char *, char *);
 extern void writerace(const char *, struct VARS *, unsigned int, unsigned char);
 extern void remove_from_race(const char *, const char *, struct VARS *);
+extern void compact_race(const char *);
 extern int verify_racedata(const char *, struct VARS *);
-extern int create_lock(struct VARS *, const char *, unsigned int, unsigned int, unsigned int);
+extern int create_lock(struct VARS *, const char *, unsigned int, unsigned int);
 extern void remove_lock(struct VARS *);
 extern int update_lock(struct VARS *, unsigned int, unsigned int);
+extern int lock_wanted(struct VARS *);
 extern short match_file(char *,	char *);
 extern int check_rarfile(const char *);
 extern int check_zipfile(const char *, const char *, int);
@@ -0,0 +1,15 @@
+#ifndef _RUNNER_H_
+#define _RUNNER_H_
+
+/* The external programs - unzip, zip and the scripts - are run through
+ * posix_spawn() with their arguments as they are, with no shell in between.
+ * A script setting is split into the program and its arguments at blanks,
+ * with '' and "" quoting as sh does it, and nothing expanded. */
+
+#define RUN_MAXARGS		64
+
+extern int run_argv(char *const [], const char *, const char *);
+extern int run_cmd(const char *, const char *, const char *, const char *);
+extern int run_job(const char *, const char *);
+
+#endif
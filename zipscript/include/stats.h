@@ -1,6 +1,8 @@
 #ifndef _STATS_H_
 #define _STATS_H_
 
+#include "race-file.h"
+
 struct userdata {
 	unsigned long long		allup_bytes;
 	unsigned long long		monthup_bytes;
@@ -10,7 +12,8 @@ struct userdata {
 };
 
 void updatestats_free(GLOBAL *);
-void updatestats(struct VARS *, struct USERINFO **, struct GROUPINFO **, char *, char *, off_t, unsigned long, unsigned int);
+void updatestats(struct VARS *, struct USERINFO **, struct GROUPINFO **, char *, char *, off_t, uint64_t, unsigned int);
+void summarystats(struct VARS *, struct USERINFO **, struct GROUPINFO **, const RACESUMMARY *);
 void sortstats(struct VARS *, struct USERINFO **, struct GROUPINFO **);
 void showstats(struct VARS *, struct USERINFO **, struct GROUPINFO **);
 void get_stats(struct VARS *, struct USERINFO **);
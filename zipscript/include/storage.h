@@ -0,0 +1,75 @@
+#ifndef _STORAGE_H_
+#define _STORAGE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
+/* With storage_container set, the race files of a release - racedata,
+ * sfvdata, headdata, journal, leader and sfvbackup - are sections of one
+ * 'container' file in its storage dir instead of files of their own. The
+ * st_ functions take the path the file would have, and work on either
+ * layout; a release is moved over to the one configured the first time it
+ * is used. Other paths are passed through to the file itself.
+ *
+ * The container starts with a CONTAINER_HEAD and a table of CONTAINER_SECTS
+ * sections. A section that is replaced or outgrows its room is written
+ * anew at the end of the file, and its table entry changed to point to it
+ * - so readers holding on to the old place still see the old contents, as
+ * with a file renamed over. The file is rewritten without the unused parts
+ * when they are more than half of it. headdata has a section of fixed size
+ * right after the table, which never moves. Changing the container needs
+ * the lock of the release, as writing the race files does.
+ *
+ * A release the zsd daemon keeps in memory has its race files in a
+ * container in an unlinked file (see zsd.c): st_resident() makes the st_
+ * functions use it for the release, whatever storage_container is.
+ * st_resident_load() fills it from the files, and st_resident_save() writes
+ * it back to them. */
+
+typedef struct {
+	char		name[12];
+	uint32_t	gen;			// bumped when the section is replaced.
+	uint64_t	offset,			// 0 if there is no such file.
+			len,
+			cap;			// room at offset.
+} CONTAINER_SECT;
+
+typedef struct {
+	uint32_t	magic,			// CONTAINER_MAGIC.
+			id,			// random, kept when the file is rewritten.
+			sects,			// CONTAINER_SECTS.
+			reserved;
+	uint64_t	size;			// end of the last section.
+} CONTAINER_HEAD;
+
+#define CONTAINER_MAGIC		0x4e4f434e	/* "NCON" */
+#define CONTAINER_SECTS		8
+#define CONTAINER_DATA		4096		/* where the headdata section starts */
+
+extern int st_open(const char *, int, mode_t);
+extern int st_close(int);
+extern ssize_t st_pread(int, void *, size_t, off_t);
+extern ssize_t st_pwrite(int, const void *, size_t, off_t);
+extern ssize_t st_append(int, const struct iovec *, int);
+extern int st_fstat(int, struct stat *);
+extern int st_ftruncate(int, off_t);
+extern int st_fdatasync(int);
+extern int st_ident(int, uint64_t *, uint64_t *);
+extern int st_map(const char *, void **, size_t *);
+extern void st_unmap(void *, size_t);
+extern void *st_mapshared(const char *, size_t);
+extern void st_unmapshared(void *, size_t);
+extern int st_replace(const char *, const struct iovec *, int);
+extern int st_exists(const char *);
+extern int st_unlink(const char *);
+extern int st_import(const char *, const char *);
+extern int st_export(const char *, const char *);
+extern const char *st_file(const char *);
+extern void st_resident(const char *, int);
+extern int st_isresident(const char *);
+extern int st_resident_load(const char *, int);
+extern int st_resident_save(const char *, int);
+
+#endif
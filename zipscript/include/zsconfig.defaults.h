@@ -317,7 +317,27 @@
 
 #ifndef crc_algo
 #define crc_algo_is_defaulted
-#define crc_algo                                  CRC_SLICEBY8
+#define crc_algo                                  CRC_AUTO
+#endif
+
+#ifndef crc_cache
+#define crc_cache_is_defaulted
+#define crc_cache                                 TRUE
+#endif
+
+#ifndef crc_io_mode
+#define crc_io_mode_is_defaulted
+#define crc_io_mode                               CRC_IO_PREAD
+#endif
+
+#ifndef crc_parallel_min_size
+#define crc_parallel_min_size_is_defaulted
+#define crc_parallel_min_size                     268435456
+#endif
+
+#ifndef crc_parallel_threads
+#define crc_parallel_threads_is_defaulted
+#define crc_parallel_threads                      0
 #endif
 
 #ifndef create_incomplete_links_in_group_dirs
@@ -935,11 +955,31 @@
 #define incompleteislink                          TRUE
 #endif
 
+#ifndef journal_sync
+#define journal_sync_is_defaulted
+#define journal_sync                              JOURNAL_SYNC_COMPLETE
+#endif
+
 #ifndef lock_optimize
 #define lock_optimize_is_defaulted
 #define lock_optimize                             1
 #endif
 
+#ifndef lock_shm
+#define lock_shm_is_defaulted
+#define lock_shm                                  FALSE
+#endif
+
+#ifndef lock_shm_key
+#define lock_shm_key_is_defaulted
+#define lock_shm_key                              0x4E474C4B
+#endif
+
+#ifndef lock_stats_file
+#define lock_stats_file_is_defaulted
+#define lock_stats_file                           DISABLED
+#endif
+
 #ifndef log
 #define log_is_defaulted
 #define log                                       "/ftp-data/logs/glftpd.log"
@@ -1195,6 +1235,11 @@
 #define sample_types                               "mpg,mpeg,m2v,m2p,avi,mkv,mov,mp4,wmv,vob,ts,jpg,jpeg,png,m2ts"
 #endif
 
+#ifndef script_jobs
+#define script_jobs_is_defaulted
+#define script_jobs                               0
+#endif
+
 #ifndef sfv_calc_single_fname
 #define sfv_calc_single_fname_is_defaulted
 #define sfv_calc_single_fname                     FALSE
@@ -1295,6 +1340,11 @@
 #define storage                                   "/ftp-data/pzs-ng/"
 #endif
 
+#ifndef storage_container
+#define storage_container_is_defaulted
+#define storage_container                         FALSE
+#endif
+
 #ifndef strict_path_match
 #define strict_path_match_is_defaulted
 #define strict_path_match                         FALSE
@@ -1430,6 +1480,21 @@
 #define zipscript_zip_ok                          "| + ZiP integrity: oK!                             |\n"
 #endif
 
+#ifndef zsd_flush
+#define zsd_flush_is_defaulted
+#define zsd_flush                                 1
+#endif
+
+#ifndef zsd_socket
+#define zsd_socket_is_defaulted
+#define zsd_socket                                DISABLED
+#endif
+
+#ifndef zsd_workers
+#define zsd_workers_is_defaulted
+#define zsd_workers                               0
+#endif
+
 #ifndef zsinternal_checks_completed
 #define zsinternal_checks_completed_is_defaulted
 #define zsinternal_checks_completed               "Checks completed in %0.6f seconds.\n"
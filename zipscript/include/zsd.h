@@ -0,0 +1,45 @@
+#ifndef _ZSD_H_
+#define _ZSD_H_
+
+#include <stdint.h>
+
+/* With zsd_socket set, zipscript-c sends its arguments, environment, working
+ * dir and stdin/stdout/stderr to 'zipscript-c --daemon' listening on the
+ * socket, and exits with what it replies. The daemon keeps the users and
+ * groups read, and forks for each upload - the child takes over the fds it
+ * was sent, and goes on as zipscript-c would. With zsd_workers, a release
+ * goes to the same worker every time, which does its uploads one after the
+ * other - a child at a time - while the other workers take other releases.
+ * With zsd_flush as well, a worker keeps the race files of the releases it
+ * gets in memory, in a container (see storage.h) for each, which its
+ * uploads use with no lock of their own. A keeper - a child of the daemon
+ * for each release - holds the lock of the release on storage meanwhile,
+ * and writes the container back to it when the worker has it do so: every
+ * zsd_flush seconds while it is written to, and before the release is given
+ * back - when someone else waits for the lock, or after ZSD_IDLE seconds
+ * without an upload. The worker does nothing else while it waits for that,
+ * so the container is never written back in the middle of an upload.
+ * If nothing listens on the socket, zipscript-c does the work itself.
+ * What is saved is reading the users and groups for each upload - the exec
+ * of zipscript-c and a fork are still there for every one. */
+
+typedef struct {
+	uint32_t	magic,			// ZSD_MAGIC.
+			argc,
+			envc,
+			len;			// of what follows: the working dir, the
+						// arguments and the environment, each
+						// ending with a '\0'.
+} ZSD_REQUEST;
+
+#define ZSD_MAGIC		0x44535a4e	/* "NZSD" */
+#define ZSD_MAXLEN		(256 * 1024)
+#define ZSD_CHILDREN		256		/* uploads handled at once, or waiting */
+#define ZSD_NOTRUN		-1		/* the reply when the daemon did not take it */
+#define ZSD_IDLE		60		/* seconds a release is kept in memory without uploads */
+
+extern int zsd_client(int, char **);
+extern int zsd_serve(char ***);
+extern void zsd_resident(const char *);
+
+#endif
@@ -40,6 +40,7 @@
 
 #include "objects.h"
 #include "macros.h"
+#include "dirsnap.h"
 #ifdef _WITH_SS5
 #include "constants.ss5.h"
 #else
@@ -50,7 +51,7 @@
 #include <stdarg.h>
 #endif
 
-#define createzerofile(filename) fclose(fopen(filename, "a+"))
+#define createzerofile(filename) (dirsnap_changed(), fclose(fopen(filename, "a+")))
 
 /*
  * Remove the portion of PARAM matched by PATTERN according to OP, where OP
@@ -65,16 +66,6 @@
 #define RP_LONG_RIGHT   3
 #define RP_SHORT_RIGHT  4
 
-struct GROUP {
-	char           *name;
-	gid_t		id;
-};
-
-struct USER {
-	char           *name;
-	uid_t		id;
-};
-
 /*extern struct USERINFO **userI;
 extern struct GROUPINFO **groupI;
 extern struct VARS raceI;*/
@@ -84,13 +75,13 @@ extern unsigned int direntries;
 extern void	d_log(char *,...);
 
 extern void	create_missing(char *);
-extern char    *findfileext(DIR *, char *);
+extern char    *findfileext(DIRSNAP *, char *);
 extern char    *findfileextsub(const char *, char *, char *);
-extern char    *findfileextparent(DIR *, char *);
-extern char    *findfileextfromlist(DIR *, char *);
+extern char    *findfileextparent(DIRSNAP *, char *);
+extern char    *findfileextfromlist(DIRSNAP *, char *);
 
-extern int	findfileextcount(DIR *, char *);
-extern int	file_count(DIR *);
+extern int	findfileextcount(DIRSNAP *, char *);
+extern int	file_count(DIRSNAP *);
 extern unsigned int hexstrtodec(char *);
 #if defined(__linux__) || defined(__NetBSD__)
 extern int	selector(const struct dirent *);
@@ -100,7 +91,7 @@ extern int	selector(struct dirent *);
 
 /*extern void	rescandir(int);
 extern void	rescanparent(int);*/
-extern void	del_releasedir(DIR *, char *);
+extern void	del_releasedir(DIRSNAP *, char *);
 extern void	strtolower(char *);
 extern void	space_to_dot(char *);
 extern void	unlink_missing(char *);
@@ -108,11 +99,11 @@ extern char	israr(char *);
 //extern char	isvideo(char *);
 extern void	buffer_progress_bar(struct VARS *);
 extern void	move_progress_bar(unsigned char, struct VARS *, struct USERINFO **, struct GROUPINFO **);
-extern int	check_dupefile(DIR *, char *);
-extern long	findfile(DIR *, char *);
+extern int	check_dupefile(DIRSNAP *, char *);
+extern char    *findfile(DIRSNAP *, char *);
 extern char    *findfilename(char *, char *, struct VARS *);
 extern char    *check_nocase_linkname(char *, char *);
-extern void	removedotfiles(DIR *);
+extern void	removedotfiles(DIRSNAP *);
 extern void	removecomplete(int);
 extern short	matchpath(char *, char *);
 extern short	matchpartialpath(char *, char *);
@@ -123,13 +114,11 @@ extern short	fileexists(char *);
 extern void	createlink(char *, char *, char *, char *);
 extern void	readsfv_ffile(struct VARS *);
 extern void	get_rar_info(char *, struct VARS *);
-extern int	execute(char *);
 
 #ifdef USING_GLFTPD
 extern char    *get_g_name(int);
 extern char    *get_u_name(int);
-extern int	buffer_groups(char *, int);
-extern int	buffer_users(char *, int);
+extern void	load_users_groups(void);
 #endif
 
 extern off_t	sfv_compare_size(char *, off_t);
@@ -155,7 +144,7 @@ extern void    *ng_realloc2(void *, int, int, int, int);
 extern void    *ng_free(void *);
 extern int	copyfile(char *, char *);
 extern int	make_sfv(char *);
-extern unsigned int match_lenient(DIR *, char *);
+extern unsigned int match_lenient(DIRSNAP *, char *);
 extern unsigned int insampledir(char *);
 #endif
 
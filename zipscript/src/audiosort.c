@@ -22,7 +22,7 @@ void audioSortDir(char *targetDir)
 	int cnt = 0;
 	char link_source[PATH_MAX], link_target[PATH_MAX], *file_target = NULL;
 	struct audio info;
-	DIR *ourDir;
+	DIRSNAP *ourDir;
 
 
 	if (*targetDir != '/')
@@ -47,7 +47,7 @@ void audioSortDir(char *targetDir)
 	if (chdir(targetDir) == -1) {
 		d_log("audioSortDir: Failed to chdir() to %s: %s\n", targetDir, strerror(errno));
 	}
-	if ((ourDir = opendir(targetDir)) == NULL) {
+	if ((ourDir = dirsnap_open(targetDir)) == NULL) {
 		printf("Error: Failed to open dir \"%s\" : %s\n", targetDir, strerror(errno));
 		return;
 	}
@@ -57,7 +57,7 @@ void audioSortDir(char *targetDir)
 	get_audio_info(file_target, &info);
 	audioSort(&info, link_source, link_target);
 
-	closedir(ourDir);
+	dirsnap_close(ourDir);
 }
 
 void audioSort(struct audio *info, char *link_source, char *link_target)
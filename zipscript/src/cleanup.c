@@ -29,6 +29,7 @@
 #include "scandir.h"
 #endif
 
+#include "dirwalk.h"
 #include "cleanup.h"
 struct tm      *timenow;
 time_t		tnow;
@@ -82,45 +83,37 @@ main(int argc, char **argv)
 	exit(EXIT_SUCCESS);
 }
 
-/* new try without expensive scandir() */
+/* new try without expensive scandir() - the dirs in dname are walked from
+ * its fd, and the links in them whose d_type says they are links (or that
+ * don't say) are asked if they point at anything. */
 void
 scandirectory(char *dname, int setfree)
 {
-	int		fd;
-	DIR		*dir1, *dir2;
-	struct dirent	*dp1, *dp2;
+	DIRWALK		w1, w2;
 
 	printf("[%s]\n", dname);
 
-	if (chdir(dname) != -1) {
-		if ((dir1 = opendir("."))) {
-			while ((dp1 = readdir(dir1))) {
-				if (dp1->d_name[0] != '.') {
-					if (chdir(dp1->d_name) == -1) {
-						printf("Failed to chdir(): %s\n", strerror(errno));
-					}
-					if ((dir2 = opendir("."))) {
-						while ((dp2 = readdir(dir2))) {
-							if (dp1->d_name[0] != '.') {
-								if ((fd = open(dp2->d_name, O_NDELAY, 0777)) != -1) {
-									close(fd);
-								} else if (setfree) {
-									unlink(dp2->d_name);
-									printf("Broken symbolic link \"%s\" removed.\n", dp2->d_name);
-								}
-							}
+	if (dirwalk_open(&w1, AT_FDCWD, dname) != -1) {
+		while (dirwalk_next(&w1) > 0) {
+			if (w1.name[0] != '.') {
+				if (dirwalk_open(&w2, w1.fd, w1.name) == -1) {
+					printf("Failed to open %s: %s\n", w1.name, strerror(errno));
+				} else {
+					while (dirwalk_next(&w2) > 0) {
+						if (w2.type != DT_UNKNOWN && w2.type != DT_LNK)
+							continue;
+						if (!dirwalk_type(w2.fd, w2.name, w2.type, 0) && setfree) {
+							unlinkat(w2.fd, w2.name, 0);
+							printf("Broken symbolic link \"%s\" removed.\n", w2.name);
 						}
 					}
-					closedir(dir2);
-					if (chdir("..") == -1) {
-						printf("Failed to chdir(): %s\n", strerror(errno));
-					}
-					if (setfree)
-						rmdir(dp1->d_name);
+					dirwalk_close(&w2);
 				}
+				if (setfree)
+					unlinkat(w1.fd, w1.name, AT_REMOVEDIR);
 			}
 		}
-		closedir(dir1);
+		dirwalk_close(&w1);
 	}
 }
 
@@ -246,7 +246,7 @@ convert_group(struct VARS *raceI, struct GROUPINFO *groupI, char *instr, short i
 				out_p += sprintf(out_p, "%*.*s", val1, val2, (char *)groupI->name);
 				break;
 			case 'b':
-				out_p += sprintf(out_p, "%*i", val1, (int)groupI->bytes);
+				out_p += sprintf(out_p, "%*lld", val1, (long long)groupI->bytes);
 				break;
 			case 'k':
 				out_p += sprintf(out_p, "%*.*f", val1, val2, (double)(groupI->bytes / 1024.));
@@ -517,8 +517,8 @@ convert(struct VARS *raceI, struct USERINFO **userI, struct GROUPINFO **groupI,
 						 (double)((raceI->total.size / (raceI->total.stop_time - raceI->total.start_time)) / 1024.));
 				break;
 			case 'b':
-				out_p += sprintf(out_p, "%*u", val1, (unsigned int)raceI->total.size);
-				break;	/* what about files bigger than 4gb? */
+				out_p += sprintf(out_p, "%*lld", val1, (long long)raceI->total.size);
+				break;
 /*			case 'B':
  *				out_p += sprintf(out_p, "\\002");
  *				break;
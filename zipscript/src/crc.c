@@ -2,10 +2,18 @@
  * Stephan Brumme. See http://create.stephan-brumme.com/crc32/
  */
 
+#define _GNU_SOURCE	/* O_DIRECT */
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 
 #include "crc.h"
 #include "zsfunctions.h"
@@ -338,102 +346,899 @@ const uint32_t crc32_table[8][256] = {
     0x2C8E0FFF,0xE0240F61,0x6EAB0882,0xA201081C,0xA8C40105,0x646E019B,0xEAE10678,0x264B06E6 }
 };
 
-uint32_t calc_crc32(char *f) {
-	FILE		*in;
 #if (crc_algo == CRC_STANDARD)
-	uint8_t 	buf[32768];
+
+static uint32_t crc32_standard(uint32_t crc, const uint8_t *cur, size_t i) {
+	crc = ~crc;
+
+	while (i-- > 0) {
+		crc = (crc >> 8) ^ crc32_table[0][(crc & 0xFF) ^ *cur++];
+	}
+
+	return ~crc;
+}
+#define crc32_sw crc32_standard
+
+#elif (crc_algo == CRC_SLICEBY4)
+
+static uint32_t crc32_sliceby4(uint32_t crc, const uint8_t *cur, size_t i) {
+	const uint32_t	*cur32;
+
+	crc = ~crc;
+
+	/* align to a 4 byte boundary before reading words */
+	while (i > 0 && ((uintptr_t)cur & 3)) {
+		crc = (crc >> 8) ^ crc32_table[0][(crc & 0xFF) ^ *cur++];
+		i--;
+	}
+	cur32 = (const uint32_t *)cur;
+
+	/* process four bytes at once (Slicing-by-4) */
+	while (i >= 4) {
+#if BYTE_ORDER == BIG_ENDIAN
+		uint32_t one = *cur32++ ^ swap(crc);
+		crc = crc32_table[0][ one      & 0xFF] ^
+		      crc32_table[1][(one>> 8) & 0xFF] ^
+		      crc32_table[2][(one>>16) & 0xFF] ^
+		      crc32_table[3][(one>>24) & 0xFF];
 #else
-	uint8_t		*cur;
-	uint32_t 	buf[32768];
+		uint32_t one = *cur32++ ^ crc;
+		crc = crc32_table[0][(one>>24) & 0xFF] ^
+		      crc32_table[1][(one>>16) & 0xFF] ^
+		      crc32_table[2][(one>> 8) & 0xFF] ^
+		      crc32_table[3][ one      & 0xFF];
 #endif
+
+		i -= 4;
+	}
+
+	cur = (const uint8_t *)cur32;
+	/* remaining 1 to 3 bytes (standard algorithm) */
+	while (i-- > 0) {
+		crc = (crc >> 8) ^ crc32_table[0][(crc & 0xFF) ^ *cur++];
+	}
+
+	return ~crc;
+}
+#define crc32_sw crc32_sliceby4
+
+#else /* CRC_SLICEBY8, also used as fallback by CRC_AUTO */
+
+static uint32_t crc32_sliceby8(uint32_t crc, const uint8_t *cur, size_t i) {
+	const uint32_t	*cur32;
+
+	crc = ~crc;
+
+	/* align to a 4 byte boundary before reading words */
+	while (i > 0 && ((uintptr_t)cur & 3)) {
+		crc = (crc >> 8) ^ crc32_table[0][(crc & 0xFF) ^ *cur++];
+		i--;
+	}
+	cur32 = (const uint32_t *)cur;
+
+	/* process eight bytes at once (Slicing-by-8) */
+	while (i >= 8) {
+#if BYTE_ORDER == BIG_ENDIAN
+		uint32_t one = *cur32++ ^ swap(crc);
+		uint32_t two = *cur32++;
+		crc = crc32_table[0][ two      & 0xFF] ^
+		      crc32_table[1][(two>> 8) & 0xFF] ^
+		      crc32_table[2][(two>>16) & 0xFF] ^
+		      crc32_table[3][(two>>24) & 0xFF] ^
+		      crc32_table[4][ one      & 0xFF] ^
+		      crc32_table[5][(one>> 8) & 0xFF] ^
+		      crc32_table[6][(one>>16) & 0xFF] ^
+		      crc32_table[7][(one>>24) & 0xFF];
+#else
+		uint32_t one = *cur32++ ^ crc;
+		uint32_t two = *cur32++;
+		crc = crc32_table[0][(two>>24) & 0xFF] ^
+		      crc32_table[1][(two>>16) & 0xFF] ^
+		      crc32_table[2][(two>> 8) & 0xFF] ^
+		      crc32_table[3][ two      & 0xFF] ^
+		      crc32_table[4][(one>>24) & 0xFF] ^
+		      crc32_table[5][(one>>16) & 0xFF] ^
+		      crc32_table[6][(one>> 8) & 0xFF] ^
+		      crc32_table[7][ one      & 0xFF];
+#endif
+
+		i -= 8;
+	}
+
+	cur = (const uint8_t *)cur32;
+	/* remaining 1 to 7 bytes (standard algorithm) */
+	while (i-- > 0) {
+		crc = (crc >> 8) ^ crc32_table[0][(crc & 0xFF) ^ *cur++];
+	}
+
+	return ~crc;
+}
+#define crc32_sw crc32_sliceby8
+
+#endif
+
+/* CRC_AUTO: carry-less multiplication folding on x86 cpus that support it.
+ * Based on Intel's "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction" paper, with the constants for zlib's (reflected)
+ * polynomial. The fold constants are x^(n+32) mod P and x^(n-32) mod P,
+ * bit-reflected and shifted left by one, for a fold distance of n bits.
+ */
+#if (crc_algo == CRC_AUTO) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define CRC_HAVE_PCLMUL
+#if (defined(__clang__) && __clang_major__ >= 6) || (!defined(__clang__) && __GNUC__ >= 8)
+#define CRC_HAVE_VPCLMUL
+#endif
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define CRC_CLMUL_MINLEN	64
+
+/* fold distances in bits:  512 (4x128),  128 (1x128) */
+static const uint64_t crc32_k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+static const uint64_t crc32_k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+/* 64->32 fold and Barrett reduction (P' and mu) */
+static const uint64_t crc32_k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+static const uint64_t crc32_poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+
+/* x = (x.lo * k.lo) ^ (x.hi * k.hi) ^ data */
+__attribute__((target("pclmul,sse4.1")))
+static inline __m128i crc32_fold128(__m128i x, __m128i data, __m128i k) {
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+					   _mm_clmulepi64_si128(x, k, 0x11)), data);
+}
+
+/* fold the remaining 16 byte blocks into x1 and reduce it to a 32 bit crc */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_clmul_reduce(__m128i x1, const uint8_t *buf, size_t len) {
+	__m128i		x0, x2, x3;
+
+	x0 = _mm_load_si128((const __m128i *)crc32_k3k4);
+	while (len >= 16) {
+		x1 = crc32_fold128(x1, _mm_loadu_si128((const __m128i *)buf), x0);
+		buf += 16;
+		len -= 16;
+	}
+
+	/* 128 -> 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* 64 -> 32 bits */
+	x0 = _mm_loadl_epi64((const __m128i *)crc32_k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction */
+	x0 = _mm_load_si128((const __m128i *)crc32_poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+/* len must be a multiple of 16 and at least CRC_CLMUL_MINLEN.
+ * Works on the crc register, ie. pre- and post-conditioning is up to the caller.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(const uint8_t *buf, size_t len, uint32_t crc) {
+	__m128i		x0, x1, x2, x3, x4;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	buf += 64;
+	len -= 64;
+
+	/* fold four 128 bit lanes in parallel */
+	x0 = _mm_load_si128((const __m128i *)crc32_k1k2);
+	while (len >= 64) {
+		x1 = crc32_fold128(x1, _mm_loadu_si128((const __m128i *)(buf + 0x00)), x0);
+		x2 = crc32_fold128(x2, _mm_loadu_si128((const __m128i *)(buf + 0x10)), x0);
+		x3 = crc32_fold128(x3, _mm_loadu_si128((const __m128i *)(buf + 0x20)), x0);
+		x4 = crc32_fold128(x4, _mm_loadu_si128((const __m128i *)(buf + 0x30)), x0);
+		buf += 64;
+		len -= 64;
+	}
+
+	/* fold the lanes into one */
+	x0 = _mm_load_si128((const __m128i *)crc32_k3k4);
+	x1 = crc32_fold128(x1, x2, x0);
+	x1 = crc32_fold128(x1, x3, x0);
+	x1 = crc32_fold128(x1, x4, x0);
+
+	return crc32_clmul_reduce(x1, buf, len);
+}
+
+#ifdef CRC_HAVE_VPCLMUL
+#define CRC_VPCLMUL_MINLEN	128
+
+/* fold distances in bits: 1024 (4x256), 256 (1x256) - same constants in both 128 bit lanes */
+static const uint64_t crc32_k1k2_256[4] __attribute__((aligned(32))) = { 0x01e88ef372, 0x014a7fe880, 0x01e88ef372, 0x014a7fe880 };
+static const uint64_t crc32_k3k4_256[4] __attribute__((aligned(32))) = { 0x00f1da05aa, 0x015a546366, 0x00f1da05aa, 0x015a546366 };
+
+__attribute__((target("avx2,vpclmulqdq,pclmul,sse4.1")))
+static inline __m256i crc32_fold256(__m256i x, __m256i data, __m256i k) {
+	return _mm256_xor_si256(_mm256_xor_si256(_mm256_clmulepi64_epi128(x, k, 0x00),
+						 _mm256_clmulepi64_epi128(x, k, 0x11)), data);
+}
+
+/* Same as crc32_pclmul_fold(), but on 256 bit lanes. len must be a multiple
+ * of 16 and at least CRC_VPCLMUL_MINLEN.
+ */
+__attribute__((target("avx2,vpclmulqdq,pclmul,sse4.1")))
+static uint32_t crc32_vpclmul_fold(const uint8_t *buf, size_t len, uint32_t crc) {
+	__m256i		y0, y1, y2, y3, y4;
+	__m128i		x1;
+
+	y1 = _mm256_loadu_si256((const __m256i *)(buf + 0x00));
+	y2 = _mm256_loadu_si256((const __m256i *)(buf + 0x20));
+	y3 = _mm256_loadu_si256((const __m256i *)(buf + 0x40));
+	y4 = _mm256_loadu_si256((const __m256i *)(buf + 0x60));
+	y1 = _mm256_xor_si256(y1, _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, (int)crc));
+	buf += 128;
+	len -= 128;
+
+	y0 = _mm256_load_si256((const __m256i *)crc32_k1k2_256);
+	while (len >= 128) {
+		y1 = crc32_fold256(y1, _mm256_loadu_si256((const __m256i *)(buf + 0x00)), y0);
+		y2 = crc32_fold256(y2, _mm256_loadu_si256((const __m256i *)(buf + 0x20)), y0);
+		y3 = crc32_fold256(y3, _mm256_loadu_si256((const __m256i *)(buf + 0x40)), y0);
+		y4 = crc32_fold256(y4, _mm256_loadu_si256((const __m256i *)(buf + 0x60)), y0);
+		buf += 128;
+		len -= 128;
+	}
+
+	y0 = _mm256_load_si256((const __m256i *)crc32_k3k4_256);
+	y1 = crc32_fold256(y1, y2, y0);
+	y1 = crc32_fold256(y1, y3, y0);
+	y1 = crc32_fold256(y1, y4, y0);
+
+	/* fold the low 128 bit lane into the high one */
+	x1 = crc32_fold128(_mm256_castsi256_si128(y1), _mm256_extracti128_si256(y1, 1),
+			   _mm_load_si128((const __m128i *)crc32_k3k4));
+
+	return crc32_clmul_reduce(x1, buf, len);
+}
+#endif
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *buf, size_t len) {
+	size_t		chunk;
+
+	if (len >= CRC_CLMUL_MINLEN) {
+		chunk = len & ~(size_t)15;
+		crc = ~crc32_pclmul_fold(buf, chunk, ~crc);
+		buf += chunk;
+		len -= chunk;
+	}
+	return crc32_sw(crc, buf, len);
+}
+
+#ifdef CRC_HAVE_VPCLMUL
+static uint32_t crc32_vpclmul(uint32_t crc, const uint8_t *buf, size_t len) {
+	size_t		chunk;
+
+	if (len >= CRC_VPCLMUL_MINLEN) {
+		chunk = len & ~(size_t)15;
+		crc = ~crc32_vpclmul_fold(buf, chunk, ~crc);
+		buf += chunk;
+		len -= chunk;
+	}
+	return crc32_pclmul(crc, buf, len);
+}
+#endif
+
+/* Pick the fastest kernel the cpu (and os, for the ymm registers) supports. */
+static uint32_t (*crc32_select(void))(uint32_t, const uint8_t *, size_t) {
+	unsigned int	eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_PCLMUL) || !(ecx & bit_SSE4_1)) {
+		d_log("crc32_select: no pclmulqdq support - using slice-by-8\n");
+		return crc32_sw;
+	}
+#ifdef CRC_HAVE_VPCLMUL
+	if ((ecx & bit_OSXSAVE) && __get_cpuid_max(0, 0) >= 7) {
+		unsigned int	xcr0, xcr0_hi;
+
+		__asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		/* bit 10 of ecx is vpclmulqdq, bit 5 of ebx is avx2, xcr0 bits 1-2 are sse/avx state */
+		if ((ecx & (1 << 10)) && (ebx & (1 << 5)) && (xcr0 & 6) == 6) {
+			d_log("crc32_select: using vpclmulqdq\n");
+			return crc32_vpclmul;
+		}
+	}
+#endif
+	d_log("crc32_select: using pclmulqdq\n");
+	return crc32_pclmul;
+}
+#endif /* CRC_HAVE_PCLMUL */
+
+/* Updates a running crc with the next len bytes of buf. Start with crc = 0.
+ * The result is the same as zlib's crc32(), whatever the crc_algo.
+ */
+uint32_t crc32_update(uint32_t crc, const unsigned char *buf, size_t len) {
+#ifdef CRC_HAVE_PCLMUL
+	static uint32_t	(*kernel)(uint32_t, const uint8_t *, size_t) = 0;
+
+	if (!kernel)
+		kernel = crc32_select();
+	return kernel(crc, buf, len);
+#else
+	return crc32_sw(crc, buf, len);
+#endif
+}
+
+/* Opens f for crc32_fd(). With CRC_IO_DIRECT, O_DIRECT is tried first -
+ * some filesystems (tmpfs, for one) do not support it.
+ */
+static int crc32_open(char *f) {
+#if (crc_io_mode == CRC_IO_DIRECT) && defined(O_DIRECT)
+	int		fd;
+
+	if ((fd = open(f, O_RDONLY | O_DIRECT)) != -1 || errno != EINVAL)
+		return fd;
+	d_log("crc32_open: O_DIRECT not supported for %s - using normal reads\n", f);
+#endif
+	return open(f, O_RDONLY);
+}
+
+/* Feeds len bytes of fd, starting at start, to *crc using crc_io_mode.
+ * With drop, CRC_IO_PREAD drops what it read from the page cache - for a
+ * rescan, not for an upload, whose file is read again right after.
+ * Returns 0, or an errno value on error.
+ */
+static int crc32_fd(int fd, off_t start, off_t len, uint32_t *crc, int drop) {
+#if (crc_io_mode == CRC_IO_MMAP)
+	off_t		skip;
+	size_t		maplen;
+	unsigned char	*map;
+	long		pagesize = sysconf(_SC_PAGESIZE);
+
+	(void)drop;
+	while (len > 0) {
+		skip = start % pagesize;
+		maplen = (size_t)(len + skip > CRC_MMAP_WINDOW ? CRC_MMAP_WINDOW : len + skip);
+		if ((map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, start - skip)) == MAP_FAILED)
+			return errno;
+		madvise(map, maplen, MADV_SEQUENTIAL);
+		*crc = crc32_update(*crc, map + skip, maplen - skip);
+		munmap(map, maplen);
+		start += maplen - skip;
+		len -= maplen - skip;
+	}
+	return 0;
+#else
+	unsigned char	*buf;
+	size_t		 want;
+	ssize_t		 i;
+	int		 err = 0;
+
+#if (crc_io_mode != CRC_IO_PREAD) || !defined(POSIX_FADV_DONTNEED)
+	(void)drop;
+#endif
+	/* aligned, so the same buffer works for O_DIRECT */
+	if (posix_memalign((void **)&buf, CRC_IO_ALIGN, CRC_IO_BUFSIZE))
+		return ENOMEM;
+#if (crc_io_mode != CRC_IO_STDIO) && defined(POSIX_FADV_SEQUENTIAL)
+	posix_fadvise(fd, start, len, POSIX_FADV_SEQUENTIAL);
+#endif
+	while (len > 0) {
+		want = len < CRC_IO_BUFSIZE ? (size_t)len : CRC_IO_BUFSIZE;
+#if (crc_io_mode == CRC_IO_DIRECT)
+		want = (want + CRC_IO_ALIGN - 1) & ~(size_t)(CRC_IO_ALIGN - 1);
+#endif
+		if ((i = pread(fd, buf, want, start)) <= 0) {
+			err = i < 0 ? errno : EIO;
+			break;
+		}
+		if (i > len)
+			i = (ssize_t)len;
+		*crc = crc32_update(*crc, buf, (size_t)i);
+#if (crc_io_mode == CRC_IO_PREAD) && defined(POSIX_FADV_DONTNEED)
+		/* we will not read it again - do not push others out of the page cache */
+		if (drop)
+			posix_fadvise(fd, start, i, POSIX_FADV_DONTNEED);
+#endif
+		start += i;
+		len -= i;
+	}
+	free(buf);
+	return err;
+#endif
+}
+
+static uint32_t crc32_file(char *f, int drop) {
 	uint32_t	crc = 0;
+	off_t		size = 0;
+#if (crc_io_mode == CRC_IO_STDIO)
+	FILE		*in;
+	uint32_t	buf[32768];
 	size_t		i;
-	int		k;
+#else
+	int		fd, err;
+	struct stat	st;
+#endif
+#if (benchmark_mode == TRUE)
+	struct timeval	bstart, bstop;
+	double		secs;
+
+	gettimeofday(&bstart, (struct timezone *)0);
+#endif
 
+#if (crc_io_mode == CRC_IO_STDIO)
+	(void)drop;
 	if (!(in = fopen(f, "r"))) {
 		d_log("calc_crc32: Error opening %s: %s\n", f, strerror(errno));
 		return 0;
 	}
 
 	while ((i = fread(buf, 1, sizeof(buf), in)) > 0) {
-		crc = ~crc;
-		k = 0;
+		crc = crc32_update(crc, (unsigned char *)buf, i);
+		size += i;
+	}
 
-#if (crc_algo == CRC_STANDARD)
+	fclose(in);
+#else
+	if ((fd = crc32_open(f)) == -1 || fstat(fd, &st)) {
+		d_log("calc_crc32: Error opening %s: %s\n", f, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return 0;
+	}
+	size = st.st_size;
+
+	if ((err = crc32_fd(fd, 0, size, &crc, drop))) {
+		d_log("calc_crc32: Error reading %s: %s\n", f, strerror(err));
+		crc = 0;
+	}
+
+	close(fd);
+#endif
+	d_log("calc_crc32: crc for %s calculated to %X\n", f, crc);
+#if (benchmark_mode == TRUE)
+	gettimeofday(&bstop, (struct timezone *)0);
+	secs = (bstop.tv_sec - bstart.tv_sec) + (bstop.tv_usec - bstart.tv_usec) / 1000000.;
+	d_log("calc_crc32: %lld bytes in %0.6f seconds (%0.1f MB/s, crc_io_mode %d)\n",
+		(long long)size, secs, secs > 0 ? size / secs / 1048576. : 0., crc_io_mode);
+#endif
+	return crc;
+}
+
+/* crc32_concat() - zlib's crc32_combine(), using the GF(2) matrix method.
+ * Returns the crc of the concatenation of two blocks, given the crc of
+ * each block and the length of the second one.
+ */
+#define GF2_DIM 32
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+	uint32_t	sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+	int		n;
+
+	for (n = 0; n < GF2_DIM; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
 
-		while (i-- > 0) {
-			crc = (crc >> 8) ^ crc32_table[0][(crc & 0xFF) ^ buf[k++]];
+uint32_t crc32_concat(uint32_t crc1, uint32_t crc2, off_t len2) {
+	int		n;
+	uint32_t	row;
+	uint32_t	even[GF2_DIM];	/* even-power-of-two zeros operator */
+	uint32_t	odd[GF2_DIM];	/* odd-power-of-two zeros operator */
+
+	if (len2 <= 0)
+		return crc1;
+
+	/* put operator for one zero bit in odd */
+	odd[0] = 0xedb88320UL;
+	row = 1;
+	for (n = 1; n < GF2_DIM; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	gf2_matrix_square(even, odd);	/* two zero bits */
+	gf2_matrix_square(odd, even);	/* four zero bits */
+
+	/* apply len2 zeros to crc1 (first square will put the operator for one
+	 * zero byte, eight zero bits, in even) */
+	do {
+		gf2_matrix_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(even, crc1);
+		len2 >>= 1;
+		if (!len2)
+			break;
+
+		gf2_matrix_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2);
+
+	return crc1 ^ crc2;
+}
+
+struct crc_range {
+	int		fd;
+	off_t		start;
+	off_t		len;
+	uint32_t	crc;
+	int		error;
+};
+
+static void *crc32_range_thread(void *arg) {
+	struct crc_range	*r = arg;
+
+	r->crc = 0;
+	r->error = crc32_fd(r->fd, r->start, r->len, &r->crc, 1);
+	return NULL;
+}
+
+/* Like crc32_file(), but splits files bigger than crc_parallel_min_size into
+ * one range per thread, hashes the ranges concurrently and combines the
+ * results. Smaller files, or when only one cpu is available, are passed on
+ * to crc32_file().
+ */
+static uint32_t crc32_file_parallel(char *f) {
+	struct stat		 st;
+	struct crc_range	 r[CRC_PARALLEL_MAXTHREADS];
+	pthread_t		 tid[CRC_PARALLEL_MAXTHREADS];
+	int			 started[CRC_PARALLEL_MAXTHREADS];
+	int			 fd, n, threads = crc_parallel_threads;
+	off_t			 chunk;
+	uint32_t		 crc = 0;
+
+	if (threads <= 0)
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > CRC_PARALLEL_MAXTHREADS)
+		threads = CRC_PARALLEL_MAXTHREADS;
+
+	if (threads < 2 || stat(f, &st) || !S_ISREG(st.st_mode) || st.st_size < (off_t)crc_parallel_min_size)
+		return crc32_file(f, 1);
+
+	if ((fd = crc32_open(f)) == -1) {
+		d_log("calc_crc32_parallel: Error opening %s: %s\n", f, strerror(errno));
+		return 0;
+	}
+
+	/* resolve the crc kernel before the threads race for it */
+	crc32_update(0, (const unsigned char *)"", 0);
+
+	/* keep range boundaries on a buffer boundary */
+	chunk = (st.st_size / threads + CRC_IO_BUFSIZE - 1) & ~(off_t)(CRC_IO_BUFSIZE - 1);
+	for (n = 0; n < threads; n++) {
+		r[n].fd = fd;
+		r[n].start = chunk * n;
+		r[n].len = r[n].start >= st.st_size ? 0 : (st.st_size - r[n].start < chunk ? st.st_size - r[n].start : chunk);
+		r[n].crc = 0;
+		r[n].error = 0;
+		started[n] = n && r[n].len && !pthread_create(&tid[n], NULL, crc32_range_thread, &r[n]);
+	}
+
+	/* the first range, and any range we failed to start a thread for, is done here */
+	for (n = 0; n < threads; n++)
+		if (!started[n] && r[n].len)
+			crc32_range_thread(&r[n]);
+
+	for (n = 0; n < threads; n++)
+		if (started[n])
+			pthread_join(tid[n], NULL);
+
+	for (n = 0; n < threads; n++) {
+		if (r[n].error) {
+			d_log("calc_crc32_parallel: Error reading %s: %s\n", f, strerror(r[n].error));
+			crc = 0;
+			break;
 		}
+		crc = crc32_concat(crc, r[n].crc, r[n].len);
+	}
 
-#elif (crc_algo == CRC_SLICEBY4)
+	close(fd);
+	d_log("calc_crc32_parallel: crc for %s calculated to %X using %d threads\n", f, crc, threads);
+	return crc;
+}
 
-		/* process four bytes at once (Slicing-by-4) */
-		while (i >= 4) {
-#if BYTE_ORDER == BIG_ENDIAN
-			uint32_t one = buf[k++] ^ swap(crc);
-			crc = crc32_table[0][ one      & 0xFF] ^
-			      crc32_table[1][(one>> 8) & 0xFF] ^
-			      crc32_table[2][(one>>16) & 0xFF] ^
-			      crc32_table[3][(one>>24) & 0xFF];
+/* The crc cache - storage/<path>/crccache.
+ * A CRCCACHE_HEAD followed by CRCCACHE records, only ever appended to. A
+ * file is known by its device, inode, size and mtime, so any change to it
+ * gives a new key. The last record for a key wins. On first use the file is
+ * read once and an open addressed hash index on (dev, ino) is built over the
+ * records in memory.
+ */
+static char		 crc_cache_path[PATH_MAX];
+static CRCCACHE		*crc_cache_recs;
+static unsigned int	 crc_cache_count, crc_cache_size;
+static unsigned int	*crc_cache_index, crc_cache_buckets;
+static int		 crc_cache_loaded;
+
+#if defined(_BSD_) || defined(_OSX_)
+#define st_mtime_nsec(st)	((st)->st_mtimespec.tv_nsec)
 #else
-			uint32_t one = buf[k++] ^ crc;
-			crc = crc32_table[0][(one>>24) & 0xFF] ^
-			      crc32_table[1][(one>>16) & 0xFF] ^
-			      crc32_table[2][(one>> 8) & 0xFF] ^
-			      crc32_table[3][ one      & 0xFF];
+#define st_mtime_nsec(st)	((st)->st_mtim.tv_nsec)
 #endif
 
-			i -= 4;
+static unsigned int crc_cache_hash(uint64_t dev, uint64_t ino) {
+	uint64_t	h = (ino ^ (dev << 32 | dev >> 32)) * 0x9E3779B97F4A7C15ULL;
+
+	return (unsigned int)(h >> 32);
+}
+
+static void crc_cache_key(CRCCACHE *rec, struct stat *st) {
+	memset(rec, 0, sizeof(CRCCACHE));
+	rec->dev = (uint64_t)st->st_dev;
+	rec->ino = (uint64_t)st->st_ino;
+	rec->size = (int64_t)st->st_size;
+	rec->mtime = (int64_t)st->st_mtime;
+	rec->mtime_nsec = (uint32_t)st_mtime_nsec(st);
+}
+
+/* insert record n in the index - replaces an older record with the same dev/ino */
+static void crc_cache_insert(unsigned int n) {
+	unsigned int	i, mask = crc_cache_buckets - 1;
+	CRCCACHE	*rec = &crc_cache_recs[n];
+
+	for (i = crc_cache_hash(rec->dev, rec->ino) & mask; crc_cache_index[i]; i = (i + 1) & mask) {
+		CRCCACHE *old = &crc_cache_recs[crc_cache_index[i] - 1];
+
+		if (old->dev == rec->dev && old->ino == rec->ino)
+			break;
+	}
+	crc_cache_index[i] = n + 1;
+}
+
+/* keep the index at most half full */
+static int crc_cache_grow(unsigned int need) {
+	unsigned int	n, buckets = crc_cache_buckets ? crc_cache_buckets : 64;
+
+	if (need > crc_cache_size) {
+		CRCCACHE *recs = realloc(crc_cache_recs, (need + 64) * sizeof(CRCCACHE));
+
+		if (!recs)
+			return 0;
+		crc_cache_recs = recs;
+		crc_cache_size = need + 64;
+	}
+	while (buckets < need * 2)
+		buckets <<= 1;
+	if (buckets != crc_cache_buckets) {
+		free(crc_cache_index);
+		if (!(crc_cache_index = calloc(buckets, sizeof(unsigned int)))) {
+			crc_cache_buckets = 0;
+			return 0;
 		}
+		crc_cache_buckets = buckets;
+		for (n = 0; n < crc_cache_count; n++)
+			crc_cache_insert(n);
+	}
+	return 1;
+}
+
+static void crc_cache_load(void) {
+	int		fd;
+	struct stat	st;
+	CRCCACHE_HEAD	head;
+	unsigned int	n, count;
+
+	crc_cache_loaded = 1;
+	crc_cache_count = 0;
+	if ((fd = open(crc_cache_path, O_RDONLY)) == -1)
+		return;
+	if (fstat(fd, &st) || read(fd, &head, sizeof(head)) != sizeof(head) ||
+	    head.magic != CRCCACHE_MAGIC || head.version != CRCCACHE_VERSION) {
+		close(fd);
+		d_log("crc_cache_load: %s is not a valid crc cache - removing it\n", crc_cache_path);
+		unlink(crc_cache_path);
+		return;
+	}
+	/* a record still being appended by someone else is skipped */
+	count = (unsigned int)((st.st_size - sizeof(head)) / sizeof(CRCCACHE));
+	if (count && crc_cache_grow(count)) {
+		ssize_t i = read(fd, crc_cache_recs, count * sizeof(CRCCACHE));
+
+		count = i > 0 ? (unsigned int)(i / sizeof(CRCCACHE)) : 0;
+		for (n = 0; n < count; n++)
+			crc_cache_insert(crc_cache_count++);
+	}
+	close(fd);
+	d_log("crc_cache_load: %u records in %s\n", crc_cache_count, crc_cache_path);
+}
+
+/* returns the latest record for the file's dev/ino, whatever its size and mtime */
+static CRCCACHE *crc_cache_find(struct stat *st) {
+	unsigned int	i, mask;
+	CRCCACHE	key, *rec;
 
-		cur = (uint8_t*) &buf[k];
-		/* remaining 1 to 3 bytes (standard algorithm) */
-		while (i-- > 0) {
-			crc = (crc >> 8) ^ crc32_table[0][(crc & 0xFF) ^ *cur++];
+	if (!crc_cache_loaded)
+		crc_cache_load();
+	if (!crc_cache_count || !crc_cache_buckets)
+		return NULL;
+
+	crc_cache_key(&key, st);
+	mask = crc_cache_buckets - 1;
+	for (i = crc_cache_hash(key.dev, key.ino) & mask; crc_cache_index[i]; i = (i + 1) & mask) {
+		rec = &crc_cache_recs[crc_cache_index[i] - 1];
+		if (rec->dev == key.dev && rec->ino == key.ino)
+			return rec;
+	}
+	return NULL;
+}
+
+/* crc of the last CRCCACHE_TAIL bytes before offset - used to check that a
+ * file which grew since it was cached still starts with the same data.
+ */
+static int crc_cache_tail(int fd, off_t offset, uint32_t *crc) {
+	off_t		start = offset > CRCCACHE_TAIL ? offset - CRCCACHE_TAIL : 0;
+	unsigned char	buf[CRCCACHE_TAIL];
+
+	if (pread(fd, buf, (size_t)(offset - start), start) != offset - start)
+		return 0;
+	*crc = crc32_update(0, buf, (size_t)(offset - start));
+	return 1;
+}
+
+static void crc_cache_store(char *f, struct stat *st, uint32_t crc) {
+	int		fd;
+	char		tmp[PATH_MAX + 16];
+	CRCCACHE	rec;
+	CRCCACHE_HEAD	head;
+
+	crc_cache_key(&rec, st);
+	rec.crc32 = crc;
+	if ((fd = open(f, O_RDONLY)) == -1)
+		return;
+	if (!crc_cache_tail(fd, st->st_size, &rec.tail_crc)) {
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	/* a new cache is written with its head under a name of its own and
+	 * linked into place, so nobody can append to it before the head */
+	if ((fd = open(crc_cache_path, O_WRONLY | O_APPEND)) == -1 && errno == ENOENT) {
+		snprintf(tmp, sizeof(tmp), "%s.%d", crc_cache_path, (int)getpid());
+		if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+			d_log("crc_cache_store: open(%s): %s\n", tmp, strerror(errno));
+			return;
 		}
+		head.magic = CRCCACHE_MAGIC;
+		head.version = CRCCACHE_VERSION;
+		if (write(fd, &head, sizeof(head)) != sizeof(head)) {
+			d_log("crc_cache_store: write to %s failed: %s\n", tmp, strerror(errno));
+			close(fd);
+			unlink(tmp);
+			return;
+		}
+		close(fd);
+		if (link(tmp, crc_cache_path) && errno != EEXIST)
+			d_log("crc_cache_store: link(%s, %s): %s\n", tmp, crc_cache_path, strerror(errno));
+		unlink(tmp);
+		fd = open(crc_cache_path, O_WRONLY | O_APPEND);
+	}
+	if (fd == -1) {
+		d_log("crc_cache_store: open(%s): %s\n", crc_cache_path, strerror(errno));
+		return;
+	}
+	if (write(fd, &rec, sizeof(rec)) != sizeof(rec))
+		d_log("crc_cache_store: write to %s failed: %s\n", crc_cache_path, strerror(errno));
+	close(fd);
 
-#else /* CRC_SLICEBY8 */
+	if (crc_cache_loaded && crc_cache_grow(crc_cache_count + 1)) {
+		crc_cache_recs[crc_cache_count] = rec;
+		crc_cache_insert(crc_cache_count++);
+	}
+}
 
-		/* process eight bytes at once (Slicing-by-8) */
-		 while (i >= 8) {
-#if BYTE_ORDER == BIG_ENDIAN
-			uint32_t one = buf[k++] ^ swap(crc);
-			uint32_t two = buf[k++];
-			crc = crc32_table[0][ two      & 0xFF] ^
-			      crc32_table[1][(two>> 8) & 0xFF] ^
-			      crc32_table[2][(two>>16) & 0xFF] ^
-			      crc32_table[3][(two>>24) & 0xFF] ^
-			      crc32_table[4][ one      & 0xFF] ^
-			      crc32_table[5][(one>> 8) & 0xFF] ^
-			      crc32_table[6][(one>>16) & 0xFF] ^
-			      crc32_table[7][(one>>24) & 0xFF];
-#else
-			uint32_t one = buf[k++] ^ crc;
-			uint32_t two = buf[k++];
-			crc = crc32_table[0][(two>>24) & 0xFF] ^
-			      crc32_table[1][(two>>16) & 0xFF] ^
-			      crc32_table[2][(two>> 8) & 0xFF] ^
-			      crc32_table[3][ two      & 0xFF] ^
-			      crc32_table[4][(one>>24) & 0xFF] ^
-			      crc32_table[5][(one>>16) & 0xFF] ^
-			      crc32_table[6][(one>> 8) & 0xFF] ^
-			      crc32_table[7][ one      & 0xFF];
+/* Sets the release (path in storage) whose crc cache calc_crc32() and
+ * calc_crc32_parallel() should use. An empty path turns the cache off.
+ */
+void crc_cache_init(const char *path) {
+	if (crc_cache == TRUE && path && *path)
+		snprintf(crc_cache_path, sizeof(crc_cache_path), storage "/%s/crccache", path);
+	else
+		*crc_cache_path = '\0';
+	crc_cache_loaded = 0;
+	crc_cache_count = 0;
+	crc_cache_buckets = 0;
+	free(crc_cache_index);
+	crc_cache_index = NULL;
+}
+
+#if (allow_file_resume == TRUE)
+/* The file grew since rec was cached - if it is the same file, written to
+ * since, and the data before rec->size is unchanged as far as its last
+ * CRCCACHE_TAIL bytes tell, only hash what was added to it. It is read
+ * through a normal fd whatever crc_io_mode is - rec->size is hardly ever
+ * aligned the way O_DIRECT wants it. Returns 0 if it could not.
+ */
+static uint32_t crc32_file_resume(char *f, CRCCACHE *rec, struct stat *st) {
+	int		fd, err;
+	uint32_t	tail, crc;
+
+	if (rec->dev != (uint64_t)st->st_dev || rec->ino != (uint64_t)st->st_ino ||
+	    rec->mtime > (int64_t)st->st_mtime ||
+	    (rec->mtime == (int64_t)st->st_mtime && rec->mtime_nsec >= (uint32_t)st_mtime_nsec(st)))
+		return 0;
+	if ((fd = open(f, O_RDONLY)) == -1)
+		return 0;
+	if (!crc_cache_tail(fd, rec->size, &tail) || tail != rec->tail_crc) {
+		close(fd);
+		d_log("calc_crc32: %s changed since it was cached at %lld bytes - checking all of it\n", f, (long long)rec->size);
+		return 0;
+	}
+	crc = rec->crc32;
+	err = crc32_fd(fd, rec->size, st->st_size - rec->size, &crc, 0);
+	close(fd);
+	if (err) {
+		d_log("calc_crc32: Error reading %s: %s\n", f, strerror(err));
+		return 0;
+	}
+	d_log("calc_crc32: crc for %s resumed from %lld bytes, calculated to %X\n", f, (long long)rec->size, crc);
+	return crc;
+}
 #endif
 
-			i -= 8;
-		}
+static uint32_t crc32_cached(char *f, int parallel) {
+	struct stat	st, st2;
+	uint32_t	crc = 0;
+	int		cacheable;
+	CRCCACHE	*rec = NULL;
 
-		cur = (uint8_t*) &buf[k];
-		/* remaining 1 to 7 bytes (standard algorithm) */
-		while (i-- > 0) {
-			crc = (crc >> 8) ^ crc32_table[0][(crc & 0xFF) ^ *cur++];
+	cacheable = *crc_cache_path && !stat(f, &st) && S_ISREG(st.st_mode);
+	if (cacheable && (rec = crc_cache_find(&st))) {
+		if (rec->size == st.st_size && rec->mtime == st.st_mtime &&
+		    rec->mtime_nsec == (uint32_t)st_mtime_nsec(&st)) {
+			d_log("calc_crc32: crc for %s found in cache: %X\n", f, rec->crc32);
+			return rec->crc32;
 		}
-
+#if (allow_file_resume == TRUE)
+		if (rec->size > 0 && rec->size < st.st_size)
+			crc = crc32_file_resume(f, rec, &st);
 #endif
-		crc = ~crc;
 	}
 
-	fclose(in);
-	d_log("calc_crc32: crc for %s calculated to %X\n", f, crc);
+	if (!crc)
+		crc = parallel ? crc32_file_parallel(f) : crc32_file(f, 0);
+
+	/* only cache it if the file did not change while we read it */
+	if (cacheable && crc && !stat(f, &st2) && st.st_size == st2.st_size &&
+	    st.st_mtime == st2.st_mtime && st_mtime_nsec(&st) == st_mtime_nsec(&st2))
+		crc_cache_store(f, &st, crc);
 	return crc;
 }
+
+/* Adds a crc calculated elsewhere (ie. by the ftpd) for f to the cache. */
+void crc_cache_add(char *f, unsigned int crc) {
+	struct stat	st;
+
+	if (*crc_cache_path && crc && !stat(f, &st) && S_ISREG(st.st_mode))
+		crc_cache_store(f, &st, crc);
+}
+
+uint32_t calc_crc32(char *f) {
+	return crc32_cached(f, 0);
+}
+
+uint32_t calc_crc32_parallel(char *f) {
+	return crc32_cached(f, 1);
+}
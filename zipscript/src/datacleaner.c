@@ -26,6 +26,7 @@
 #include "scandir.h"
 #endif
 
+#include "dirwalk.h"
 #include "datacleaner.h"
 
 int 
@@ -34,12 +35,12 @@ main(int argc, char **argv)
 	int		zd_length;
 	char		st[PATH_MAX];
 	char		*wd;
-	DIR		*od;
+	int		fd;
 
 	zd_length = (int)strlen(storage);
 
 	if (argc == 1) {
-		check_dir_loop(storage, zd_length);
+		check_dir_loop(AT_FDCWD, storage, storage, zd_length);
 	} else {
 		if ((zd_length + 1 + (int)strlen(argv[1])) < PATH_MAX) {
 			if ( !strncmp(argv[1], "RMD ", 4)) {
@@ -71,85 +72,69 @@ main(int argc, char **argv)
 			}
 		}
 		/* check subdirs */
-		check_dir_loop(st, zd_length);
+		check_dir_loop(AT_FDCWD, st, st, zd_length);
 
 		/* check current dir */
-		if (( od = opendir(st + zd_length)) == NULL) {
-			remove_dir_loop(st);
+		if (( fd = open(st + zd_length, O_RDONLY | O_DIRECTORY)) == -1) {
+			remove_dir_loop(AT_FDCWD, st);
 			rmdir(st);
 		} else {
-			closedir(od);
+			close(fd);
 		}
 	}
 	return 0;
 }
 
+/* Empties the dir name in dirfd - the dirs in it are emptied and removed,
+ * the rest unlinked. A link to a dir is unlinked, not followed. */
 void 
-remove_dir_loop(char *path)
+remove_dir_loop(int dirfd, const char *name)
 {
-	DIR 		*dir;
-	struct dirent	*dp;
-	char		target[PATH_MAX];
-	struct stat	sb;
+	DIRWALK		w;
 
-	if ((chdir(path)) == -1) {
-		perror(path);
+	if (dirwalk_open(&w, dirfd, name) == -1) {
+		perror(name);
 		exit(EXIT_FAILURE);
 	}
-	
-	dir = opendir(path);
-	while ((dp = readdir(dir))) {
-		if (dp->d_name[0] != '.' || (dp->d_name[0] == '.' && strlen(dp->d_name) > 2)) {
-			stat(dp->d_name, &sb);
-			if (S_ISDIR(sb.st_mode)) {
-				sprintf(target, "%s/%s", path, dp->d_name);
-				remove_dir_loop(target);
-				rmdir(target);
-				if (chdir(path) == -1) {
-					perror(path);
-				}
-			} else
-				unlink(dp->d_name);
-		}
+	while (dirwalk_next(&w) > 0) {
+		if (!strcmp(w.name, ".") || !strcmp(w.name, ".."))
+			continue;
+		if (S_ISDIR(dirwalk_type(w.fd, w.name, w.type, AT_SYMLINK_NOFOLLOW))) {
+			remove_dir_loop(w.fd, w.name);
+			unlinkat(w.fd, w.name, AT_REMOVEDIR);
+		} else
+			unlinkat(w.fd, w.name, 0);
 	}
-	closedir(dir);
+	dirwalk_close(&w);
 }
 
+/* Goes through the dir name in dirfd - path in the storage - and removes the
+ * dirs in it that have no dir of the same path in the site. */
 void 
-check_dir_loop(char *path, int zd_length)
+check_dir_loop(int dirfd, const char *name, char *path, int zd_length)
 {
-	DIR 		*dir1, *dir2;
-	struct dirent	*dp;
+	DIRWALK		w;
 	char		target    [PATH_MAX];
-	struct stat	sb;
+	int		fd;
 
-	if (chdir(path) == -1) {
+	if (dirwalk_open(&w, dirfd, name) == -1) {
 		perror(path);
 		exit(EXIT_FAILURE);
 	}
 
-	dir1 = opendir(path);
-	while ((dp = readdir(dir1))) {
-		if (dp->d_name[0] != '.') {
-			stat(dp->d_name, &sb);
-			if (S_ISDIR(sb.st_mode)) {
-				sprintf(target, "%s/%s", path, dp->d_name);
-				if ((dir2 = opendir(target + zd_length))) {
-					closedir(dir2);
-					check_dir_loop(target, zd_length);
-					if (chdir(path) == -1) {
-						perror(path);
-					}
+	while (dirwalk_next(&w) > 0) {
+		if (w.name[0] != '.') {
+			if (S_ISDIR(dirwalk_type(w.fd, w.name, w.type, 0))) {
+				snprintf(target, PATH_MAX, "%s/%s", path, w.name);
+				if ((fd = open(target + zd_length, O_RDONLY | O_DIRECTORY)) != -1) {
+					close(fd);
+					check_dir_loop(w.fd, w.name, target, zd_length);
 				} else {
-					remove_dir_loop(target);
-					rmdir(target);
-					if (chdir(path) == -1) {
-						perror(path);
-					}
+					remove_dir_loop(w.fd, w.name);
+					unlinkat(w.fd, w.name, AT_REMOVEDIR);
 				}
 			}
 		}
 	}
-	closedir(dir1);
+	dirwalk_close(&w);
 }
-
@@ -0,0 +1,267 @@
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include "dirsnap.h"
+#include "zsfunctions.h"
+#include "race-file.h"
+
+#include "../conf/zsconfig.h"
+#include "../include/zsconfig.defaults.h"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+static unsigned int	dirsnap_gen = 1;
+static DIRSNAP		*dirsnap_dot;		/* the one of ".", shared by those opening it */
+static unsigned int	dirsnap_dot_refs;
+
+/* FNV-1a of the lowercased name - with fold, also with the chars
+ * lenient_compare() takes as the same made one. */
+static uint32_t
+dirsnap_hash(const char *s, size_t len, int fold)
+{
+	uint32_t	h = 2166136261U;
+	unsigned char	c;
+
+	while (len--) {
+		c = (unsigned char)tolower((unsigned char)*s++);
+		if (fold && (c == ' ' || c == ',' || c == '.' || c == '-' || c == '_'))
+			c = '*';
+		h ^= c;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void
+dirsnap_add(DIRSNAP *ds, const char *name, unsigned char type)
+{
+	size_t		len = strlen(name);
+
+	if (ds->count == ds->alloc) {
+		ds->alloc = ds->alloc ? ds->alloc * 2 : 64;
+		ds->ent = ng_realloc2(ds->ent, ds->alloc * sizeof(DIRSNAP_ENT), 0, 1, 0);
+	}
+	if (ds->len + len + 1 > ds->size) {
+		ds->size = (ds->len + len + 1) * 2 + 4096;
+		ds->names = ng_realloc2(ds->names, ds->size, 0, 1, 0);
+	}
+	memcpy(ds->names + ds->len, name, len + 1);
+	ds->ent[ds->count].name = (uint32_t)ds->len;
+	ds->ent[ds->count].len = (uint32_t)len;
+	ds->ent[ds->count].type = type;
+	ds->len += len + 1;
+	ds->count++;
+}
+
+/* Reads the entries again, and indexes them. The buckets are chained in
+ * directory order, so the first match is the one readdir() gave first. */
+static void
+dirsnap_load(DIRSNAP *ds)
+{
+	unsigned int	i, cap = 16;
+	uint32_t	*b;
+	const char	*name, *dot;
+	int		n;
+
+	if (ds->names) {
+		ds->old = ng_realloc2(ds->old, (ds->nold + 1) * sizeof(char *), 0, 1, 0);
+		ds->old[ds->nold++] = ds->names;
+		ds->names = NULL;
+		ds->size = 0;
+	}
+	ds->count = 0;
+	ds->len = 0;
+	ds->gen = dirsnap_gen;
+
+	dirwalk_rewind(&ds->walk);
+	while ((n = dirwalk_next(&ds->walk)) > 0)
+		dirsnap_add(ds, ds->walk.name, ds->walk.type);
+	if (n == -1)
+		d_log("dirsnap_load: failed to read the dir: %s\n", strerror(errno));
+
+	while (cap < ds->count * 2)
+		cap <<= 1;
+	if (cap - 1 != ds->mask || !ds->key) {
+		ds->key = ng_realloc2(ds->key, cap * sizeof(uint32_t), 0, 1, 0);
+		ds->ext = ng_realloc2(ds->ext, cap * sizeof(uint32_t), 0, 1, 0);
+		ds->mask = cap - 1;
+	}
+	memset(ds->key, 0, cap * sizeof(uint32_t));
+	memset(ds->ext, 0, cap * sizeof(uint32_t));
+	for (i = ds->count; i--; ) {
+		name = ds->names + ds->ent[i].name;
+		b = &ds->key[dirsnap_hash(name, ds->ent[i].len, 1) & ds->mask];
+		ds->ent[i].next_key = *b;
+		*b = i + 1;
+		if ((dot = strrchr(name, '.'))) {
+			b = &ds->ext[dirsnap_hash(dot + 1, strlen(dot + 1), 0) & ds->mask];
+			ds->ent[i].next_ext = *b;
+			*b = i + 1;
+		} else
+			ds->ent[i].next_ext = 0;
+	}
+}
+
+/* Opens a snapshot of path, read on the first question. Everyone opening
+ * "." gets the same one, so the helpers share the release dir's with the
+ * program that opened it. NULL if path can't be opened. */
+DIRSNAP *
+dirsnap_open(const char *path)
+{
+	int		dot = !strcmp(path, ".");
+	DIRSNAP		*ds;
+
+	if (dot && dirsnap_dot) {
+		dirsnap_dot_refs++;
+		return dirsnap_dot;
+	}
+	ds = ng_realloc2(NULL, sizeof(DIRSNAP), 1, 1, 1);
+	if (dirwalk_open(&ds->walk, AT_FDCWD, path) == -1) {
+		ng_free(ds);
+		return NULL;
+	}
+	if (dot) {
+		dirsnap_dot = ds;
+		dirsnap_dot_refs = 1;
+	}
+	return ds;
+}
+
+void
+dirsnap_close(DIRSNAP *ds)
+{
+	if (!ds)
+		return;
+	if (ds == dirsnap_dot) {
+		if (--dirsnap_dot_refs)
+			return;
+		dirsnap_dot = NULL;
+	}
+	dirwalk_close(&ds->walk);
+	while (ds->nold)
+		ng_free(ds->old[--ds->nold]);
+	ng_free(ds->old);
+	ng_free(ds->names);
+	ng_free(ds->ent);
+	ng_free(ds->key);
+	ng_free(ds->ext);
+	ng_free(ds);
+}
+
+/* Every snapshot is read again on its next question. */
+void
+dirsnap_changed(void)
+{
+	if (!++dirsnap_gen)
+		dirsnap_gen = 1;
+}
+
+/* Reads the entries if they changed since the last time, and returns how
+ * many there are - dirsnap_name() and dirsnap_type() take 0 up to that. */
+unsigned int
+dirsnap_read(DIRSNAP *ds)
+{
+	if (ds->gen != dirsnap_gen)
+		dirsnap_load(ds);
+	return ds->count;
+}
+
+const char *
+dirsnap_name(const DIRSNAP *ds, unsigned int i)
+{
+	return i < ds->count ? ds->names + ds->ent[i].name : NULL;
+}
+
+unsigned char
+dirsnap_type(const DIRSNAP *ds, unsigned int i)
+{
+	return i < ds->count ? ds->ent[i].type : 0;
+}
+
+/* The names as they are now, in a list of its own that stays the same while
+ * the caller changes the dir and asks the snapshot about it. The list is
+ * freed with ng_free(), the names go with the snapshot. */
+const char **
+dirsnap_list(DIRSNAP *ds, unsigned int *count)
+{
+	unsigned int	i, n = dirsnap_read(ds);
+	const char	**list;
+
+	list = ng_realloc2(NULL, (n + 1) * sizeof(char *), 0, 1, 1);
+	for (i = 0; i < n; i++)
+		list[i] = ds->names + ds->ent[i].name;
+	list[n] = NULL;
+	*count = n;
+	return list;
+}
+
+/* The first entry after entry after (-1 to start at the first) matching
+ * name - with strcmp(), strcasecmp() or lenient_compare() as how says.
+ * -1 if there is none. */
+int
+dirsnap_find(DIRSNAP *ds, const char *name, int how, int after)
+{
+	uint32_t	i;
+	size_t		len = strlen(name);
+	const char	*s;
+
+	if (!dirsnap_read(ds))
+		return -1;
+	i = after < 0 ? ds->key[dirsnap_hash(name, len, 1) & ds->mask] : ds->ent[after].next_key;
+	for (; i; i = ds->ent[i - 1].next_key) {
+		if (ds->ent[i - 1].len != len)
+			continue;
+		s = ds->names + ds->ent[i - 1].name;
+		if (how == DIRSNAP_EXACT ? !strcmp(s, name) :
+		    how == DIRSNAP_NOCASE ? !strcasecmp(s, name) : lenient_compare((char *)s, (char *)name))
+			return (int)i - 1;
+	}
+	return -1;
+}
+
+/* The first entry after entry after (-1 to start at the first) at least 4
+ * long whose name ends in ext, ignoring case. The index is used when ext is
+ * a '.' and an extension with no '.' in it - the others are looked for one
+ * by one. -1 if there is none. */
+int
+dirsnap_ext(DIRSNAP *ds, const char *ext, int after)
+{
+	int		indexed = *ext == '.' && !strchr(ext + 1, '.');
+	uint32_t	i;
+	size_t		elen = strlen(ext);
+	DIRSNAP_ENT	*e;
+
+	if (!dirsnap_read(ds))
+		return -1;
+	if (indexed)
+		i = after < 0 ? ds->ext[dirsnap_hash(ext + 1, elen - 1, 0) & ds->mask] : ds->ent[after].next_ext;
+	else
+		i = (uint32_t)(after + 2);
+	while (i && i <= ds->count) {
+		e = &ds->ent[i - 1];
+		if (e->len >= 4 && e->len >= elen && !strcasecmp(ds->names + e->name + e->len - elen, ext))
+			return (int)i - 1;
+		i = indexed ? e->next_ext : i + 1;
+	}
+	return -1;
+}
+
+/* What want (DW_*) asks for of entry i, in st - as stat() would tell it,
+ * without asking when its d_type tells. -1 if it can't be stat'ed. */
+int
+dirsnap_stat(DIRSNAP *ds, unsigned int i, int want, struct stat *st)
+{
+	if (i >= ds->count)
+		return -1;
+	return dirwalk_statat(ds->walk.fd, ds->names + ds->ent[i].name, ds->ent[i].type, want, 0, st);
+}
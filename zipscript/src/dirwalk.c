@@ -0,0 +1,201 @@
+#define _GNU_SOURCE	/* statx */
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "dirwalk.h"
+
+#ifndef O_DIRECTORY
+# define O_DIRECTORY	0
+#endif
+
+#ifndef DT_LNK
+# define DT_LNK		10
+#endif
+
+#ifndef DTTOIF
+# define DTTOIF(type)	((type) << 12)
+#endif
+
+#if defined(__linux__) && defined(SYS_getdents64)
+# define DIRWALK_GETDENTS
+struct dirwalk_dirent64 {
+	uint64_t	d_ino;
+	int64_t		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char		d_name[];
+};
+#endif
+
+/* Opens path, relative to dirfd (AT_FDCWD for the cwd), to be walked.
+ * -1 with errno set if it can't be. */
+int
+dirwalk_open(DIRWALK *w, int dirfd, const char *path)
+{
+	memset(w, 0, sizeof(DIRWALK));
+	if ((w->fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY)) == -1)
+		return -1;
+	fcntl(w->fd, F_SETFD, FD_CLOEXEC);
+#ifdef DIRWALK_GETDENTS
+	if (!(w->buf = malloc(DIRWALK_BUFSIZE))) {
+		close(w->fd);
+		w->fd = -1;
+		errno = ENOMEM;
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+void
+dirwalk_close(DIRWALK *w)
+{
+	if (w->dir)
+		closedir(w->dir);
+	if (w->fd != -1)
+		close(w->fd);
+	free(w->buf);
+	w->dir = NULL;
+	w->buf = NULL;
+	w->fd = -1;
+}
+
+/* The next dirwalk_next() starts at the first entry again. */
+void
+dirwalk_rewind(DIRWALK *w)
+{
+	w->len = w->pos = 0;
+	if (w->dir)
+		rewinddir(w->dir);
+	else
+		lseek(w->fd, 0, SEEK_SET);
+}
+
+/* Goes to the next entry - its name and d_type are in w. 1 if there is
+ * one, 0 at the end, -1 with errno set if the dir couldn't be read. "."
+ * and ".." are entries like the others. */
+int
+dirwalk_next(DIRWALK *w)
+{
+#ifdef DIRWALK_GETDENTS
+	struct dirwalk_dirent64 *de;
+
+	if (w->pos >= w->len) {
+		w->pos = 0;
+		if ((w->len = syscall(SYS_getdents64, w->fd, w->buf, DIRWALK_BUFSIZE)) <= 0) {
+			if (w->len == -1) {
+				w->len = 0;
+				return -1;
+			}
+			return 0;
+		}
+	}
+	de = (struct dirwalk_dirent64 *)(w->buf + w->pos);
+	w->pos += de->d_reclen;
+	w->name = de->d_name;
+	w->type = de->d_type;
+	return 1;
+#else
+	struct dirent	*dp;
+	int		fd;
+
+	if (!w->dir) {
+		if ((fd = dup(w->fd)) == -1)
+			return -1;
+		if (!(w->dir = fdopendir(fd))) {
+			close(fd);
+			return -1;
+		}
+		rewinddir(w->dir);
+	}
+	errno = 0;
+	if (!(dp = readdir(w->dir)))
+		return errno ? -1 : 0;
+	w->name = dp->d_name;
+# ifdef DT_REG
+	w->type = dp->d_type;
+# else
+	w->type = DT_UNKNOWN;
+# endif
+	return 1;
+#endif
+}
+
+/* What want asks for of name, in dirfd, in st - the rest of st is zero
+ * with statx, and whatever fstatat gave without.
+ * flags are those of fstatat(): AT_SYMLINK_NOFOLLOW to be told about a
+ * link rather than what it points at. When only the type is wanted and
+ * type (the d_type of name) tells it, nothing is asked; otherwise statx is
+ * asked for just what is wanted, or fstatat where there is no statx.
+ * -1 with errno set if name can't be stat'ed. */
+int
+dirwalk_statat(int dirfd, const char *name, unsigned char type, int want, int flags, struct stat *st)
+{
+#ifdef STATX_TYPE
+	static int	nostatx = 0;
+	struct statx	stx;
+	unsigned int	mask = 0;
+#endif
+
+	memset(st, 0, sizeof(struct stat));
+	if (!(want & ~DW_TYPE) && type != DT_UNKNOWN && (type != DT_LNK || (flags & AT_SYMLINK_NOFOLLOW))) {
+		st->st_mode = DTTOIF(type);
+		return 0;
+	}
+#ifdef STATX_TYPE
+	if (!nostatx) {
+		if (want & (DW_TYPE | DW_MODE))
+			mask |= STATX_TYPE;
+		if (want & DW_MODE)
+			mask |= STATX_MODE;
+		if (want & DW_SIZE)
+			mask |= STATX_SIZE;
+		if (want & DW_TIMES)
+			mask |= STATX_MTIME | STATX_CTIME;
+		if (want & DW_OWNER)
+			mask |= STATX_UID | STATX_GID;
+		if (!statx(dirfd, name, flags, mask, &stx)) {
+			if (want & (DW_TYPE | DW_MODE))
+				st->st_mode = want & DW_MODE ? stx.stx_mode : stx.stx_mode & S_IFMT;
+			if (want & DW_SIZE)
+				st->st_size = (off_t)stx.stx_size;
+			if (want & DW_TIMES) {
+				st->st_mtime = (time_t)stx.stx_mtime.tv_sec;
+				st->st_ctime = (time_t)stx.stx_ctime.tv_sec;
+			}
+			if (want & DW_OWNER) {
+				st->st_uid = stx.stx_uid;
+				st->st_gid = stx.stx_gid;
+			}
+			return 0;
+		}
+		if (errno != ENOSYS)
+			return -1;
+		nostatx = 1;
+	}
+#endif
+	return fstatat(dirfd, name, st, flags);
+}
+
+/* The S_IFMT bits of the st_mode of name in dirfd, 0 if it can't be
+ * stat'ed - like a link pointing at nothing, unless flags has
+ * AT_SYMLINK_NOFOLLOW. */
+mode_t
+dirwalk_type(int dirfd, const char *name, unsigned char type, int flags)
+{
+	struct stat	st;
+
+	if (dirwalk_statat(dirfd, name, type, DW_TYPE, flags, &st))
+		return 0;
+	return st.st_mode & S_IFMT;
+}
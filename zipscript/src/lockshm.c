@@ -0,0 +1,264 @@
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "lockshm.h"
+#include "zsfunctions.h"
+
+#include "../conf/zsconfig.h"
+#include "../include/zsconfig.defaults.h"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+static LOCKSHM		*ls_shm;
+static int		ls_failed;
+
+#define LS_SIZE		(sizeof(LOCKSHM) + LOCKSHM_ENTRIES * sizeof(LOCKSHM_ENT))
+
+uint64_t
+ls_hash(const char *s)
+{
+	uint64_t	h = 14695981039346656037ULL;	/* FNV-1a */
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+	return h ? h : 1;
+}
+
+static int
+ls_mutex_init(pthread_mutex_t *m)
+{
+	pthread_mutexattr_t	ma;
+	int			ret;
+
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	ret = pthread_mutex_init(m, &ma);
+	pthread_mutexattr_destroy(&ma);
+	return ret;
+}
+
+/* Attaches the segment - the first process to get here creates and sets it
+ * up, the others wait for it to be set up. */
+static LOCKSHM *
+ls_attach(void)
+{
+	int		shmid, i, created = 0;
+	void		*p;
+
+	if (ls_shm || ls_failed)
+		return ls_shm;
+	ls_failed = 1;
+	if ((shmid = shmget((key_t)lock_shm_key, LS_SIZE, IPC_CREAT | IPC_EXCL | 0666)) != -1)
+		created = 1;
+	else if (errno != EEXIST || (shmid = shmget((key_t)lock_shm_key, 0, 0)) == -1) {
+		d_log("ls_attach: shmget(0x%08x): %s\n", (unsigned int)lock_shm_key, strerror(errno));
+		return NULL;
+	}
+	if ((p = shmat(shmid, NULL, 0)) == (void *)-1) {
+		d_log("ls_attach: shmat(): %s\n", strerror(errno));
+		return NULL;
+	}
+	ls_shm = p;
+	if (created) {
+		for (i = 0; i < LOCKSHM_ENTRIES; i++)
+			if (ls_mutex_init(&ls_shm->ent[i].mutex))
+				break;
+		if (i < LOCKSHM_ENTRIES || ls_mutex_init(&ls_shm->table)) {
+			d_log("ls_attach: pthread_mutex_init() failed\n");
+			shmdt(p);
+			shmctl(shmid, IPC_RMID, NULL);
+			ls_shm = NULL;
+			return NULL;
+		}
+		ls_shm->entries = LOCKSHM_ENTRIES;
+		ls_shm->entsize = sizeof(LOCKSHM_ENT);
+		atomic_store((atomic_uint *)&ls_shm->magic, LOCKSHM_MAGIC);
+	} else
+		for (i = 0; i < 1000 && atomic_load((atomic_uint *)&ls_shm->magic) != LOCKSHM_MAGIC; i++)
+			usleep(1000);
+	if (ls_shm->magic != LOCKSHM_MAGIC || ls_shm->entries != LOCKSHM_ENTRIES || ls_shm->entsize != sizeof(LOCKSHM_ENT)) {
+		d_log("ls_attach: segment 0x%08x is not set up, or of another version - remove it with ipcrm.\n", (unsigned int)lock_shm_key);
+		shmdt(p);
+		ls_shm = NULL;
+		return NULL;
+	}
+	ls_failed = 0;
+	return ls_shm;
+}
+
+static void
+ls_table(int lock)
+{
+	if (!lock)
+		pthread_mutex_unlock(&ls_shm->table);
+	else if (pthread_mutex_lock(&ls_shm->table) == EOWNERDEAD)
+		pthread_mutex_consistent(&ls_shm->table);	/* the entries are set one field at a time */
+}
+
+/* an entry nobody holds, and that no live process took by force, may go to
+ * another release - it is given with its mutex held. */
+static int
+ls_take(LOCKSHM_ENT *e)
+{
+	unsigned int	pid;
+
+	switch (pthread_mutex_trylock(&e->mutex)) {
+	case EOWNERDEAD:
+		pthread_mutex_consistent(&e->mutex);
+		/* fall through */
+	case 0:
+		if ((pid = atomic_load((atomic_uint *)&e->fields.data_pid)) && atomic_load((atomic_uint *)&e->fields.data_in_use) &&
+		    (kill((pid_t)pid, 0) != -1 || errno != ESRCH)) {
+			pthread_mutex_unlock(&e->mutex);
+			return 0;
+		}
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Returns the entry of the release in storage dir dir, giving it one if it
+ * has none, and puts the hash ls_lock() takes in hash. NULL if the segment
+ * cannot be used, or has no room left.
+ */
+LOCKSHM_ENT *
+ls_find(const char *dir, uint64_t *hash)
+{
+	uint64_t	h;
+	unsigned int	i, k;
+	LOCKSHM_ENT	*e, *best = NULL;
+
+	if (!ls_attach())
+		return NULL;
+	*hash = h = ls_hash(dir);
+	i = (unsigned int)(h % LOCKSHM_ENTRIES);
+	ls_table(1);
+	for (k = 0; k < LOCKSHM_PROBE; k++) {
+		e = &ls_shm->ent[(i + k) % LOCKSHM_ENTRIES];
+		if (e->hash == h) {
+			e->used = (uint32_t)time(NULL);
+			ls_table(0);
+			return e;
+		}
+		if (!e->hash)
+			break;
+	}
+	/* not there - the one unused the longest goes to it */
+	for (k = 0; k < LOCKSHM_PROBE; k++) {
+		e = &ls_shm->ent[(i + k) % LOCKSHM_ENTRIES];
+		if (best && e->used >= best->used)
+			continue;
+		if (!ls_take(e))
+			continue;
+		if (best)
+			pthread_mutex_unlock(&best->mutex);
+		best = e;
+		if (!e->hash)
+			break;
+	}
+	if (best) {
+		memset(&best->fields, 0, sizeof(HEADDATA));
+		best->hash = h;
+		best->used = (uint32_t)time(NULL);
+		pthread_mutex_unlock(&best->mutex);
+	} else
+		d_log("ls_find: no room for the lock of %s - raise LOCKSHM_ENTRIES.\n", dir);
+	ls_table(0);
+	return best;
+}
+
+/* Takes the mutex of e, waiting for it until deadline - or just tries, if
+ * deadline is NULL. Returns LS_LOCKED, LS_OWNERDEAD, LS_BUSY or LS_MOVED.
+ */
+int
+ls_lock(LOCKSHM_ENT *e, uint64_t hash, const struct timespec *deadline)
+{
+	int	ret;
+
+	ret = deadline ? pthread_mutex_timedlock(&e->mutex, deadline) : pthread_mutex_trylock(&e->mutex);
+	if (ret == EOWNERDEAD) {
+		pthread_mutex_consistent(&e->mutex);
+		ret = LS_OWNERDEAD;
+	} else if (ret) {
+		if (ret != ETIMEDOUT && ret != EBUSY)
+			d_log("ls_lock: %s\n", strerror(ret));
+		return LS_BUSY;
+	}
+	if (e->hash != hash) {
+		pthread_mutex_unlock(&e->mutex);
+		return LS_MOVED;
+	}
+	return ret;
+}
+
+void
+ls_unlock(LOCKSHM_ENT *e)
+{
+	pthread_mutex_unlock(&e->mutex);
+}
+
+/* Waits while *word is val, until ls_wake() is called on it, for a second
+ * at most - so the caller can see whether who it waits for is still there.
+ * Returns -1 once deadline is past.
+ */
+int
+ls_wait(unsigned int *word, unsigned int val, const struct timespec *deadline)
+{
+	struct timespec	now, ts;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	ts.tv_sec = deadline->tv_sec - now.tv_sec;
+	ts.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+	if (ts.tv_nsec < 0) {
+		ts.tv_sec--;
+		ts.tv_nsec += 1000000000L;
+	}
+	if (ts.tv_sec < 0)
+		return -1;
+	if (ts.tv_sec) {
+		ts.tv_sec = 1;
+		ts.tv_nsec = 0;
+	}
+	if (atomic_load((atomic_uint *)word) != val)
+		return 0;
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+	if (ts.tv_sec || ts.tv_nsec > 10000000L) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 10000000L;
+	}
+	nanosleep(&ts, NULL);
+#endif
+	return 0;
+}
+
+void
+ls_wake(unsigned int *word)
+{
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+	(void)word;
+#endif
+}
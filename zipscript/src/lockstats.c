@@ -0,0 +1,175 @@
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <strings.h>
+#include <time.h>
+
+#include "lockstats.h"
+#include "lockshm.h"
+#include "zsfunctions.h"
+
+#ifdef _WITH_SS5
+#include "constants.ss5.h"
+#else
+#include "constants.h"
+#endif
+
+#include "../conf/zsconfig.h"
+#include "../include/zsconfig.defaults.h"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifndef HAVE_STRLCPY
+# include "strl/strl.h"
+#endif
+
+#define LST_ADD(f, v)	atomic_fetch_add((_Atomic uint64_t *)&(f), (uint64_t)(v))
+
+static void
+lockstat_max(uint64_t *f, uint64_t v)
+{
+	uint64_t	old = atomic_load((_Atomic uint64_t *)f);
+
+	while (old < v && !atomic_compare_exchange_weak((_Atomic uint64_t *)f, &old, v))
+		;
+}
+
+static unsigned int
+lockstat_bucket(uint64_t us)
+{
+	unsigned int	n = 0;
+
+	while (n < LOCKSTAT_BUCKETS - 1 && us >= (uint64_t)1 << n)
+		n++;
+	return n;
+}
+
+/* The slot of the release, which a release not there yet takes from the one
+ * near its hash locked the longest ago. NULL if another process took that
+ * one at the same time. */
+static LOCKSTAT_REL *
+lockstat_rel(LOCKSTATS *ls, const char *path, time_t now)
+{
+	uint64_t	h = ls_hash(path), old;
+	unsigned int	i = (unsigned int)(h % LOCKSTAT_RELEASES), k;
+	LOCKSTAT_REL	*r, *oldest = NULL;
+
+	for (k = 0; k < LOCKSTAT_PROBE; k++) {
+		r = &ls->rel[(i + k) % LOCKSTAT_RELEASES];
+		if ((old = atomic_load((_Atomic uint64_t *)&r->hash)) == h)
+			return r;
+		if (!old || !oldest || r->last < oldest->last)
+			oldest = r;
+		if (!old)
+			break;
+	}
+	old = atomic_load((_Atomic uint64_t *)&oldest->hash);
+	if (!atomic_compare_exchange_strong((_Atomic uint64_t *)&oldest->hash, &old, h))
+		return old == h ? oldest : NULL;
+	memset((char *)oldest + sizeof(oldest->hash), 0, sizeof(LOCKSTAT_REL) - sizeof(oldest->hash));
+	strlcpy(oldest->path, path, LOCKSTAT_PATHLEN);
+	oldest->last = (uint64_t)now;
+	return oldest;
+}
+
+/* Adds what a process saw of a lock to lock_stats_file, making it if there
+ * is none.
+ */
+void
+lockstat_add(const LOCKSTAT_REC *rec)
+{
+	int		fd, created = 0;
+	const char	*file = lock_stats_file;
+	struct stat	sb;
+	time_t		now = time(NULL);
+	LOCKSTATS	*ls;
+	LOCKSTAT_REL	*r;
+
+	if (file == DISABLED)
+		return;
+	if ((fd = open(file, O_CREAT | O_EXCL | O_RDWR, 0666)) != -1)
+		created = 1;
+	else if (errno != EEXIST || (fd = open(file, O_RDWR)) == -1) {
+		d_log("lockstat_add: open(%s): %s\n", file, strerror(errno));
+		return;
+	}
+	if (created && ftruncate(fd, sizeof(LOCKSTATS)) == -1)
+		d_log("lockstat_add: ftruncate(%s): %s\n", file, strerror(errno));
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(LOCKSTATS) ||
+	    (ls = mmap(NULL, sizeof(LOCKSTATS), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	close(fd);
+	if (created) {
+		/* the magic goes last - till then, the others leave the file be */
+		ls->version = LOCKSTAT_VERSION;
+		ls->releases = LOCKSTAT_RELEASES;
+		ls->started = (uint64_t)now;
+		atomic_store((_Atomic uint32_t *)&ls->magic, LOCKSTAT_MAGIC);
+	}
+	if (atomic_load((_Atomic uint32_t *)&ls->magic) != LOCKSTAT_MAGIC || ls->version != LOCKSTAT_VERSION || ls->releases != LOCKSTAT_RELEASES) {
+		if (ls->magic)
+			d_log("lockstat_add: %s is not a lock stats file of this version - remove it.\n", file);
+		munmap(ls, sizeof(LOCKSTATS));
+		return;
+	}
+
+	if (rec->flags & LOCKSTAT_GOT) {
+		LST_ADD(ls->locks, 1);
+		LST_ADD(ls->hold_us, rec->hold_us);
+		LST_ADD(ls->hold_hist[lockstat_bucket(rec->hold_us)], 1);
+		if (rec->progtype && ffs((int)rec->progtype) <= 8)
+			LST_ADD(ls->progtype[ffs((int)rec->progtype) - 1], 1);
+	}
+	if (rec->flags & LOCKSTAT_TIMEOUT)
+		LST_ADD(ls->timeouts, 1);
+	if (rec->flags & LOCKSTAT_FORCED)
+		LST_ADD(ls->forced, 1);
+	if (rec->flags & LOCKSTAT_LOST)
+		LST_ADD(ls->lost, 1);
+	if (rec->flags & LOCKSTAT_SUGGESTED)
+		LST_ADD(ls->suggested, 1);
+	if (rec->flags & LOCKSTAT_YIELDED)
+		LST_ADD(ls->yielded, 1);
+	if (rec->flags & LOCKSTAT_OWNERDEAD)
+		LST_ADD(ls->ownerdead, 1);
+	if (rec->queue)
+		LST_ADD(ls->waited, 1);
+	LST_ADD(ls->retries, rec->retries);
+	LST_ADD(ls->touches, rec->touches);
+	LST_ADD(ls->skips, rec->skips);
+	LST_ADD(ls->wait_us, rec->wait_us);
+	LST_ADD(ls->wait_hist[lockstat_bucket(rec->wait_us)], 1);
+	LST_ADD(ls->queue_hist[rec->queue < LOCKSTAT_QUEUE ? rec->queue : LOCKSTAT_QUEUE - 1], 1);
+
+	if ((r = lockstat_rel(ls, rec->path, now))) {
+		atomic_store((_Atomic uint64_t *)&r->last, (uint64_t)now);
+		if (rec->flags & LOCKSTAT_GOT)
+			LST_ADD(r->locks, 1);
+		if (rec->flags & LOCKSTAT_TIMEOUT)
+			LST_ADD(r->timeouts, 1);
+		if (rec->flags & LOCKSTAT_FORCED)
+			LST_ADD(r->forced, 1);
+		if (rec->flags & LOCKSTAT_SUGGESTED)
+			LST_ADD(r->suggested, 1);
+		if (rec->flags & LOCKSTAT_YIELDED)
+			LST_ADD(r->yielded, 1);
+		LST_ADD(r->wait_us, rec->wait_us);
+		LST_ADD(r->hold_us, rec->hold_us);
+		lockstat_max(&r->wait_max_us, rec->wait_us);
+		lockstat_max(&r->hold_max_us, rec->hold_us);
+		lockstat_max(&r->queue_max, rec->queue);
+	}
+	munmap(ls, sizeof(LOCKSTATS));
+}
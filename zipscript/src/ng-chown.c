@@ -48,6 +48,7 @@
 #include "zsconfig.defaults.h"
 
 #include "ng-chown.h"
+#include "pwcache.h"
 
 struct dirent	**dirlist;
 unsigned int	direntries, n = 0;
@@ -256,15 +257,12 @@ myscan(int my_result, int new_user, int new_group, int user_flag, int group_flag
 uid_t
 get_gluid(char *passwdfile, char *user_name)
 {
-	char	       *f_buf = 0;
-	char	       *u_name = 0;
 	uid_t		u_id = 0;
-	off_t		f_size;
-	int		f, i, m, l, l_start = 0;
-	struct stat	fileinfo;
+	char		cache[PATH_MAX];
 
 #if (change_spaces_to_underscore_in_ng_chown)
 	char	       *u_modname = 0;
+	int		i;
 
 	u_modname = ng_realloc3(u_modname, (int)strlen(user_name) * sizeof(char) + 1);
 	for (i = 0; i < ((int)strlen(user_name) + 1); i++) {
@@ -275,47 +273,14 @@ get_gluid(char *passwdfile, char *user_name)
 	}
 #endif
 
-	f = open(passwdfile, O_NONBLOCK);
-	fstat(f, &fileinfo);
-	f_size = fileinfo.st_size;
-	f_buf = ng_realloc3(f_buf, f_size);
-	if (!read(f, f_buf, f_size)) {
-		printf("Warning: read() failed: %s\n", strerror(errno));
-	}
-
-	for (i = 0; i < f_size; i++) {
-		if (f_buf[i] == '\n' || i == f_size) {
-			f_buf[i] = 0;
-			m = l_start;
-			while (f_buf[m] != ':' && m < i)
-				m++;
-			if (m != l_start) {
-				f_buf[m] = 0;
-				u_name = f_buf + l_start;
-				m = i;
-				for (l = 0; l < 4; l++) {
-					while (f_buf[m] != ':' && m > l_start)
-						m--;
-					f_buf[m] = 0;
-				}
-				while (f_buf[m] != ':' && m > l_start)
-					m--;
-#if (change_spaces_to_underscore_in_ng_chown)
-				if ((m != i) && !strcmp(u_name, u_modname)) {
-#else
-				if ((m != i) && !strcmp(u_name, user_name)) {
-#endif
-					u_id = strtol(f_buf + m + 1, NULL, 10);
-					break;
-				}
-			}
-			l_start = i + 1;
-		}
-	}
-	close(f);
-	ng_free3(f_buf);
+	snprintf(cache, sizeof(cache), "%s/.pwcache", storage);
+	if (pwc_load(cache, passwdfile, GROUPFILE) == -1)
+		printf("Warning: could not read %s: %s\n", passwdfile, strerror(errno));
 #if (change_spaces_to_underscore_in_ng_chown)
+	pwc_uid(u_modname, &u_id);
 	ng_free3(u_modname);
+#else
+	pwc_uid(user_name, &u_id);
 #endif
 	return u_id;
 }
@@ -323,15 +288,12 @@ get_gluid(char *passwdfile, char *user_name)
 gid_t
 get_glgid(char *groupfile, char *group_name)
 {
-	char	       *f_buf = 0;
-	char	       *g_name = 0;
 	gid_t		g_id = 0;
-	off_t		f_size;
-	int		f, i, m, l_start = 0;
-	struct stat	fileinfo;
+	char		cache[PATH_MAX];
 
 #if (change_spaces_to_underscore_in_ng_chown)
 	char	       *g_modname = 0;
+	int		i;
 
 	g_modname = ng_realloc3(g_modname, (int)strlen(group_name) * sizeof(char) + 1);
 	for (i = 0; i < ((int)strlen(group_name) + 1); i++) {
@@ -342,46 +304,14 @@ get_glgid(char *groupfile, char *group_name)
 	}
 #endif
 
-	f = open(groupfile, O_NONBLOCK);
-	fstat(f, &fileinfo);
-	f_size = fileinfo.st_size;
-	f_buf = ng_realloc3(f_buf, f_size);
-	if (!read(f, f_buf, f_size)) {
-		printf("Warning: read() failed: %s\n", strerror(errno));
-	}
-
-	for (i = 0; i < f_size; i++) {
-		if (f_buf[i] == '\n' || i == f_size) {
-			f_buf[i] = 0;
-			m = l_start;
-			while (f_buf[m] != ':' && m < i)
-				m++;
-			if (m != l_start) {
-				f_buf[m] = 0;
-				g_name = f_buf + l_start;
-				m = i;
-				while (f_buf[m] != ':' && m > l_start)
-					m--;
-				f_buf[m] = 0;
-				while (f_buf[m] != ':' && m > l_start)
-					m--;
-#if (change_spaces_to_underscore_in_ng_chown)
-				if ((m != i) && !strcmp(g_name, g_modname)){
-#else
-				if ((m != i) && !strcmp(g_name, group_name)){
-#endif
-					g_id = strtol(f_buf + m + 1, NULL, 10);
-					break;
-				}
-			}
-			l_start = i + 1;
-		}
-	}
-
-	close(f);
-	ng_free3(f_buf);
+	snprintf(cache, sizeof(cache), "%s/.pwcache", storage);
+	if (pwc_load(cache, PASSWDFILE, groupfile) == -1)
+		printf("Warning: could not read %s: %s\n", groupfile, strerror(errno));
 #if (change_spaces_to_underscore_in_ng_chown)
+	pwc_gid(g_modname, &g_id);
 	ng_free3(g_modname);
+#else
+	pwc_gid(group_name, &g_id);
 #endif
 	return g_id;
 }
@@ -13,6 +13,8 @@
 #include "helpfunctions.h"
 #include "zsfunctions.h"
 #include "race-file.h"
+#include "runner.h"
+#include "storage.h"
 #include "objects.h"
 #include "macros.h"
 #include "convert.h"
@@ -39,7 +41,7 @@ main(int argc, char **argv)
 	char		fileext[4];
 	char		*name_p = 0;
 	char		*temp_p;
-	char		*target = NULL;
+	char		*unzip_argv[5];
 	char		*fname;
 
 #ifdef USING_GLFTPD
@@ -55,7 +57,7 @@ main(int argc, char **argv)
 	
 	GLOBAL		g;
 	
-	DIR		*dir, *parent;
+	DIRSNAP		*dir, *parent;
 
 #ifdef USING_GLFTPD
 	if (argc == 1) {
@@ -129,8 +131,8 @@ main(int argc, char **argv)
 	if (!strcmp(fname, "debug"))
 		d_log("postdel: Reading directory structure\n");
 
-	dir = opendir(".");
-	parent = opendir("..");
+	dir = dirsnap_open(".");
+	parent = dirsnap_open("..");
 
 	if (fileexists(fname)) {
 		d_log("postdel: File (%s) still exists\n", fname);
@@ -138,8 +140,8 @@ main(int argc, char **argv)
 		if (strcmp(fname, "debug"))
 			unlink(fname);
 #endif
-		closedir(dir);
-		closedir(parent);
+		dirsnap_close(dir);
+		dirsnap_close(parent);
 		return 0;
 	}
 	umask(0666 & 000);
@@ -189,58 +191,28 @@ main(int argc, char **argv)
 
 	d_log("postdel: Locking release\n");
 	while(1) {
-		if ((m = create_lock(&g.v, g.l.path, PROGTYPE_POSTDEL, 3, 0))) {
+		if ((m = create_lock(&g.v, g.l.path, PROGTYPE_POSTDEL, 3))) {
 			d_log("postdel: Failed to lock release.\n");
 			if (m == 1) {
 				d_log("postdel: version mismatch. Exiting.\n");
 				exit(EXIT_FAILURE);
 			}
-			if (m == PROGTYPE_RESCAN) {
-				d_log("postdel: Detected rescan running - will try to make it quit.\n");
-				update_lock(&g.v, 0, 0);
-			}
-			if (m == PROGTYPE_POSTDEL) {
-				n = (signed int)g.v.data_incrementor;
-				d_log("postdel: Detected postdel running - sleeping for one second.\n");
-				if (!create_lock(&g.v, g.l.path, PROGTYPE_POSTDEL, 0, g.v.data_queue))
-					break;
-				usleep(1000000);
-				if (!create_lock(&g.v, g.l.path, PROGTYPE_POSTDEL, 0, g.v.data_queue))
-					break;
-				if ( n == (signed int)g.v.data_incrementor) {
-					d_log("postdel: Failed to get lock. Forcing unlock.\n");
-					if (create_lock(&g.v, g.l.path, PROGTYPE_POSTDEL, 2, g.v.data_queue)) {
-						d_log("postdel: Failed to force a lock.\n");
-						d_log("postdel: Exiting with error.\n");
-						exit(EXIT_FAILURE);
-					}
-					break;
+			if (m == PROGTYPE_RESCAN || m == PROGTYPE_POSTDEL) {
+				d_log("postdel: Failed to get lock. Forcing unlock.\n");
+				if (create_lock(&g.v, g.l.path, PROGTYPE_POSTDEL, 2)) {
+					d_log("postdel: Failed to force a lock.\n");
+					d_log("postdel: Exiting with error.\n");
+					exit(EXIT_FAILURE);
 				}
 			} else {
-				for ( n = 0; n <= max_seconds_wait_for_lock * 10; n++) {
-					d_log("postdel: sleeping for .1 second before trying to get a lock.\n");
-					usleep(100000);
-					if (!(m = create_lock(&g.v, g.l.path, PROGTYPE_POSTDEL, 0, g.v.data_queue)))
-						break;
-
-				}
-				if (n >= max_seconds_wait_for_lock * 10) {
-					if (m == PROGTYPE_RESCAN) {
-						d_log("postdel: Failed to get lock. Forcing unlock.\n");
-						if (create_lock(&g.v, g.l.path, PROGTYPE_POSTDEL, 2, g.v.data_queue))
-						d_log("postdel: Failed to force a lock.\n");
-					} else
-						d_log("postdel: Failed to get a lock.\n");
-					if (!g.v.data_in_use && !ignore_lock_timeout) {
-						d_log("postdel: Exiting with error.\n");
-						exit(EXIT_FAILURE);
-					}
+				d_log("postdel: Failed to get a lock.\n");
+				if (!ignore_lock_timeout) {
+					d_log("postdel: Exiting with error.\n");
+					exit(EXIT_FAILURE);
 				}
 			}
-			rewinddir(dir);
-			rewinddir(parent);
+			dirsnap_changed();
 		}
-		usleep(10000);
 		if (update_lock(&g.v, 1, 0) != -1)
 			break;
 	}
@@ -249,7 +221,6 @@ main(int argc, char **argv)
 	g.l.sfv = ng_realloc(g.l.sfv, n, 1, 1, &g.v, 1);
 	g.l.sfvbackup = ng_realloc(g.l.sfvbackup, n, 1, 1, &g.v, 1);
 	g.l.leader = ng_realloc(g.l.leader, n, 1, 1, &g.v, 1);
-	target = ng_realloc(target, 4096, 1, 1, &g.v, 1);
 
 	if (getenv("SECTION") == NULL)
 		sprintf(g.v.sectionname, "DEFAULT");
@@ -272,14 +243,14 @@ main(int argc, char **argv)
 		d_log("postdel: Freeing memory, removing lock and exiting\n");
 		ng_free(g.ui);
 		ng_free(g.gi);
-		if (fileexists(g.l.race))
-			unlink(g.l.race);
-		if (fileexists(g.l.sfv))
-			unlink(g.l.sfv);
-		if (fileexists(g.l.sfvbackup))
-			unlink(g.l.sfvbackup);
-		if (fileexists(g.l.leader))
-			unlink(g.l.leader);
+		if (st_exists(g.l.race))
+			st_unlink(g.l.race);
+		if (st_exists(g.l.sfv))
+			st_unlink(g.l.sfv);
+		if (st_exists(g.l.sfvbackup))
+			st_unlink(g.l.sfvbackup);
+		if (st_exists(g.l.leader))
+			st_unlink(g.l.leader);
 		ng_free(g.l.race);
 		ng_free(g.l.sfv);
 		ng_free(g.l.sfvbackup);
@@ -339,8 +310,12 @@ main(int argc, char **argv)
 			if (temp_p != NULL) {
 				_err_file_banned(temp_p, &g.v);
 				d_log("postdel: file_id.diz does not exist, trying to extract it from %s\n", temp_p);
-				sprintf(target, "%s -qqjnCLL \"%s\" file_id.diz", unzip_bin, temp_p);
-				execute(target);
+				unzip_argv[0] = unzip_bin;
+				unzip_argv[1] = "-qqjnCLL";
+				unzip_argv[2] = temp_p;
+				unzip_argv[3] = "file_id.diz";
+				unzip_argv[4] = NULL;
+				run_argv(unzip_argv, NULL, NULL);
 				if (chmod("file_id.diz", 0666))
 					d_log("postdel: Failed to chmod %s: %s\n", "file_id.diz", strerror(errno));
 			}
@@ -381,13 +356,14 @@ main(int argc, char **argv)
 			empty_dir = 1;
 		}
 		remove_from_race(g.l.race, g.v.file.name, &g.v);
+		compact_race(g.l.race);
 		break;
 	case 1: /* SFV */
 		ftype = g.v.misc.release_type;
 		d_log("postdel: Reading file count from sfvdata\n");
 		readsfv(g.l.sfv, &g.v, 0);
 
-		if (fileexists(g.l.race)) {
+		if (st_exists(g.l.race)) {
 			d_log("postdel: Reading race data from file to memory\n");
 			readrace(g.l.race, &g.v, g.ui, g.gi);
 		}
@@ -401,12 +377,12 @@ main(int argc, char **argv)
 		removecomplete(g.v.misc.release_type);
 
 		d_log("postdel: removing files created\n");
-		if (fileexists(g.l.sfv)) {
+		if (st_exists(g.l.sfv)) {
 			delete_sfv(g.l.sfv, &g.v);
-			unlink(g.l.sfv);
+			st_unlink(g.l.sfv);
 		}
-		if (fileexists(g.l.sfvbackup))
-			unlink(g.l.sfvbackup);
+		if (st_exists(g.l.sfvbackup))
+			st_unlink(g.l.sfvbackup);
 
 		if (g.l.nfo_incomplete)
 			unlink(g.l.nfo_incomplete);
@@ -425,13 +401,13 @@ main(int argc, char **argv)
 
 		g.v.misc.write_log = matchpath(sfv_dirs, g.l.path) > 0 ? 1 - matchpath(group_dirs, g.l.path) : 0;
 
-		if (fileexists(g.l.race)) {
+		if (st_exists(g.l.race)) {
 			d_log("postdel: Reading race data from file to memory\n");
 			readrace(g.l.race, &g.v, g.ui, g.gi);
 		} else {
 			empty_dir = 1;
 		}
-		if (fileexists(g.l.sfv)) {
+		if (st_exists(g.l.sfv)) {
 #if ( create_missing_files == TRUE )
 #if ( sfv_cleanup_lowercase == TRUE )
 			strtolower(g.v.file.name);
@@ -454,7 +430,7 @@ main(int argc, char **argv)
 			_incomplete = 1;
 		} else {
 			d_log("postdel: Removing old race data\n");
-			unlink(g.l.race);
+			st_unlink(g.l.race);
 			if (findfileext(dir, ".sfv") == NULL) {
 				empty_dir = 1;
 			} else {
@@ -462,20 +438,21 @@ main(int argc, char **argv)
 			}
 		}
 		remove_from_race(g.l.race, g.v.file.name, &g.v);
+		compact_race(g.l.race);
 		break;
 	case 4:
 		ftype = g.v.misc.release_type;
-		if (!fileexists(g.l.race))
+		if (!st_exists(g.l.race))
 			empty_dir = 1;
 		break;
 	case 255:
 		ftype = g.v.misc.release_type;
-		if (!fileexists(g.l.race))
+		if (!st_exists(g.l.race))
 			empty_dir = 1;
 		break;
 	case 2:
 		ftype = g.v.misc.release_type;
-		if (!fileexists(g.l.race)) {
+		if (!st_exists(g.l.race)) {
 			empty_dir = 1;
 		} else {
 			d_log("postdel: Reading race data from file to memory\n");
@@ -492,7 +469,7 @@ main(int argc, char **argv)
 
 		d_log("postdel: Removing all files and directories created by zipscript\n");
 		removecomplete(g.v.misc.release_type);
-		if (fileexists(g.l.sfv))
+		if (st_exists(g.l.sfv))
 			delete_sfv(g.l.sfv, &g.v);
 		if (g.l.nfo_incomplete)
 			unlink(g.l.nfo_incomplete);
@@ -501,14 +478,14 @@ main(int argc, char **argv)
 
 		if (fileexists("file_id.diz"))
 			unlink("file_id.diz");
-		if (fileexists(g.l.race))
-			unlink(g.l.race);
-		if (fileexists(g.l.sfv))
-			unlink(g.l.sfv);
-		if (fileexists(g.l.sfvbackup))
-			unlink(g.l.sfvbackup);
-		if (fileexists(g.l.leader))
-			unlink(g.l.leader);
+		if (st_exists(g.l.race))
+			st_unlink(g.l.race);
+		if (st_exists(g.l.sfv))
+			st_unlink(g.l.sfv);
+		if (st_exists(g.l.sfvbackup))
+			st_unlink(g.l.sfvbackup);
+		if (st_exists(g.l.leader))
+			st_unlink(g.l.leader);
 
 		g.v.misc.release_type = ftype;
 		move_progress_bar(1, &g.v, g.ui, g.gi);
@@ -604,11 +581,10 @@ main(int argc, char **argv)
 	}
 
 	d_log("postdel: Releasing memory and removing lock.\n");
-	closedir(dir);
-	closedir(parent);
+	dirsnap_close(dir);
+	dirsnap_close(parent);
 	remove_lock(&g.v);
 	updatestats_free(&g);
-	ng_free(target);
 	ng_free(g.l.race);
 	ng_free(g.l.sfv);
 	ng_free(g.l.sfvbackup);
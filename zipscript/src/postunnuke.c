@@ -12,6 +12,8 @@
 #include "zsfunctions.h"
 #include "helpfunctions.h"
 #include "race-file.h"
+#include "runner.h"
+#include "storage.h"
 #include "objects.h"
 #include "macros.h"
 #include "multimedia.h"
@@ -39,11 +41,8 @@ main(int argc, char *argv[])
 {
 	int		k, n, m, l, complete_type = 0;
 
-#ifdef USING_GLFTPD
-        int             gnum = 0, unum = 0;
-#endif
-
 	char           *ext, exec[4096], *complete_bar = 0, *inc_point[2];
+	char           *unzip_argv[5];
 	unsigned int	crc;
 	struct stat	fileinfo;
 
@@ -51,9 +50,10 @@ main(int argc, char *argv[])
 	gid_t		f_gid;
 	double		temp_time = 0;
 
-	DIR		*dir, *parent;
-	struct dirent	*dp;
-	long		loc;
+	DIRSNAP		*dir, *parent;
+	const char	**names;
+	char		*name;
+	unsigned int	i, entries;
 	time_t		timenow;
 
 	char		*temp_p = NULL, *temp_p2 = NULL;
@@ -168,8 +168,7 @@ main(int argc, char *argv[])
 	getrelname(&g);
 
 #ifdef USING_GLFTPD
-	gnum = buffer_groups(GROUPFILE, 0);
-	unum = buffer_users(PASSWDFILE, 0);
+	load_users_groups();
 #endif
 
 	sprintf(g.l.sfv, storage "/%s/sfvdata", g.l.path);
@@ -178,10 +177,11 @@ main(int argc, char *argv[])
 	sprintf(g.l.race, storage "/%s/racedata", g.l.path);
 	d_log("ng-post_unnuke: Creating directory to store racedata in\n");
  	maketempdir(g.l.path);
+	crc_cache_init(g.l.path);
 
 	d_log("ng-post_unnuke: Locking release\n");
 	while (1) {
-		if ((k = create_lock(&g.v, g.l.path, PROGTYPE_RESCAN, 3, 0))) {
+		if ((k = create_lock(&g.v, g.l.path, PROGTYPE_RESCAN, 3))) {
 			d_log("ng-post_unnuke: Failed to lock release.\n");
 			if (k == 1) {
 				d_log("ng-post_unnuke: version mismatch. Exiting.\n");
@@ -189,36 +189,17 @@ main(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 			}
 			if (k == PROGTYPE_POSTDEL) {
-				n = (signed int)g.v.data_incrementor;
-				d_log("ng-post_unnuke: Detected postdel running - sleeping for one second.\n");
-				if (!create_lock(&g.v, g.l.path, PROGTYPE_RESCAN, 0, g.v.data_queue))
-					break;
-				usleep(1000000);
-				if (!create_lock(&g.v, g.l.path, PROGTYPE_RESCAN, 0, g.v.data_queue))
-					break;
-				if ( n == (signed int)g.v.data_incrementor) {
-					d_log("ng-post_unnuke: Failed to get lock. Forcing unlock.\n");
-					if (create_lock(&g.v, g.l.path, PROGTYPE_RESCAN, 2, g.v.data_queue)) {
-						d_log("ng-post_unnuke: Failed to force a lock.\n");
-						d_log("ng-post_unnuke: Exiting with error.\n");
-						exit(EXIT_FAILURE);
-					}
-					break;
-				}
-			} else {
-				for ( k = 0; k <= max_seconds_wait_for_lock * 10; k++) {
-					d_log("ng-post_unnuke: sleeping for .1 second before trying to get a lock (queue: %d).\n", g.v.data_queue);
-					usleep(100000);
-					if (!create_lock(&g.v, g.l.path, PROGTYPE_RESCAN, 0, g.v.data_queue))
-						break;
-				}
-				if (k >= max_seconds_wait_for_lock * 10) {
-					d_log("ng-post_unnuke: Failed to get lock. Will not force unlock.\n");
+				d_log("ng-post_unnuke: Failed to get lock. Forcing unlock.\n");
+				if (create_lock(&g.v, g.l.path, PROGTYPE_RESCAN, 2)) {
+					d_log("ng-post_unnuke: Failed to force a lock.\n");
+					d_log("ng-post_unnuke: Exiting with error.\n");
 					exit(EXIT_FAILURE);
 				}
+			} else {
+				d_log("ng-post_unnuke: Failed to get lock. Will not force unlock.\n");
+				exit(EXIT_FAILURE);
 			}
 		}
-		usleep(10000);
 		if (update_lock(&g.v, 1, 0) != -1)
 			break;
 	}
@@ -228,14 +209,14 @@ main(int argc, char *argv[])
 		unlink(g.l.incomplete);
 	removecomplete(g.v.misc.release_type);
 
-	dir = opendir(".");
-	parent = opendir("..");
+	dir = dirsnap_open(".");
+	parent = dirsnap_open("..");
 
 	if (!findfileext(dir, ".sfv")) {
 		if (g.l.sfv)
-			unlink(g.l.sfv);
+			st_unlink(g.l.sfv);
 		if (g.l.race)
-			unlink(g.l.race);
+			st_unlink(g.l.race);
 	}
 
 	if (findfileext(dir, ".zip")) {
@@ -244,22 +225,23 @@ main(int argc, char *argv[])
 		stat(g.v.file.name, &fileinfo);
 		//n = direntries;
 		crc = 0;
-		rewinddir(dir);
 		timenow = time(NULL);
-		while ((dp = readdir(dir))) {
-			m = l = (int)strlen(dp->d_name);
+		names = dirsnap_list(dir, &entries);
+		for (i = 0; i < entries; i++) {
+			name = (char *)names[i];
+			m = l = (int)strlen(name);
 			
-			ext = find_last_of(dp->d_name, ".");
+			ext = find_last_of(name, ".");
 			if (*ext == '.')
 				ext++;
 
 			if (!strcasecmp(ext, "zip")) {
-				stat(dp->d_name, &fileinfo);
+				stat(name, &fileinfo);
 				f_uid = fileinfo.st_uid;
 				f_gid = fileinfo.st_gid;
 
 				if ((timenow == fileinfo.st_ctime) && (fileinfo.st_mode & 0111)) {
-					d_log("ng-post_unnuke: Seems this file (%s) is in the process of being uploaded. Ignoring for now.\n", dp->d_name);
+					d_log("ng-post_unnuke: Seems this file (%s) is in the process of being uploaded. Ignoring for now.\n", name);
 					continue;
 				}
 
@@ -271,28 +253,30 @@ main(int argc, char *argv[])
                                 strncpy(g.v.user.group, argv[5], sizeof(g.v.user.group));
 #endif
 
-				strlcpy(g.v.file.name, dp->d_name, NAME_MAX);
+				strlcpy(g.v.file.name, name, NAME_MAX);
 				g.v.file.speed = 2005 * 1024;
 				g.v.file.size = fileinfo.st_size;
 				g.v.total.start_time = 0;
 
 				_err_file_banned(g.v.file.name, &g.v);
+				unzip_argv[0] = unzip_bin;
+				unzip_argv[2] = g.v.file.name;
+				unzip_argv[4] = NULL;
 				if (!fileexists("file_id.diz")) {
-					sprintf(exec, "%s -qqjnCLL \"%s\" file_id.diz 2>.delme", unzip_bin, g.v.file.name);
-					if (execute(exec) != 0) {
+					unzip_argv[1] = "-qqjnCLL";
+					unzip_argv[3] = "file_id.diz";
+					if (run_argv(unzip_argv, NULL, ".delme") != 0) {
 						d_log("ng-post_unnuke: No file_id.diz found (#%d): %s\n", errno, strerror(errno));
 					} else {
-						if ((loc = findfile(dir, "file_id.diz.bad"))) {
-							seekdir(dir, loc);
-							dp = readdir(dir);
-							unlink(dp->d_name);
-						}
+						if ((temp_p = findfile(dir, "file_id.diz.bad")) && !unlink(temp_p))
+							dirsnap_changed();
 						if (chmod("file_id.diz", 0666))
 							d_log("ng-post_unnuke: Failed to chmod %s: %s\n", "file_id.diz", strerror(errno));
 					}
 				}
-				sprintf(exec, "%s -qqt \"%s\" >.delme", unzip_bin, g.v.file.name);
-				if (system(exec) == 0) {
+				unzip_argv[1] = "-qqt";
+				unzip_argv[3] = NULL;
+				if (run_argv(unzip_argv, ".delme", NULL) == 0) {
 					writerace(g.l.race, &g.v, crc, F_CHECKED);
 				} else {
 					writerace(g.l.race, &g.v, crc, F_BAD);
@@ -301,6 +285,7 @@ main(int argc, char *argv[])
 				}
 			}
 		}
+		ng_free(names);
 //		g.v.total.files = read_diz("file_id.diz");
 		g.v.total.files = read_diz();
 		if (!g.v.total.files) {
@@ -365,10 +350,10 @@ main(int argc, char *argv[])
 			make_sfv(g.l.path);
 			if (!findfileext(dir, ".sfv")) {
 				d_log("ng-post_unnuke: Freeing memory, removing lock and exiting\n");
-				unlink(g.l.sfv);
-				if (fileexists(g.l.sfvbackup))
-				unlink(g.l.sfvbackup);
-				unlink(g.l.race);
+				st_unlink(g.l.sfv);
+				if (st_exists(g.l.sfvbackup))
+				st_unlink(g.l.sfvbackup);
+				st_unlink(g.l.race);
 				ng_free(g.ui);
 				ng_free(g.gi);
 				ng_free(g.l.race);
@@ -389,18 +374,20 @@ main(int argc, char *argv[])
 		stat(g.v.file.name, &fileinfo);
 
 		if (copysfv(g.v.file.name, g.l.sfv, &g.v)) {
-			while ((dp = readdir(dir))) {
-				m = l = (int)strlen(dp->d_name);
-				ext = find_last_of(dp->d_name, "-");
+			names = dirsnap_list(dir, &entries);
+			for (i = 0; i < entries; i++) {
+				ext = find_last_of((char *)names[i], "-");
 				if (!strncmp(ext, "-missing", 8))
-					unlink(dp->d_name);
+					unlink(names[i]);
 			}
+			ng_free(names);
+			dirsnap_changed();
 
 			d_log("ng-post_unnuke: Freeing memory, removing lock and exiting\n");
-			unlink(g.l.sfv);
-			if (fileexists(g.l.sfvbackup))
-			unlink(g.l.sfvbackup);
-			unlink(g.l.race);
+			st_unlink(g.l.sfv);
+			if (st_exists(g.l.sfvbackup))
+			st_unlink(g.l.sfvbackup);
+			st_unlink(g.l.race);
 			ng_free(g.ui);
 			ng_free(g.gi);
 			ng_free(g.l.race);
@@ -413,11 +400,12 @@ main(int argc, char *argv[])
 			return 0;
 		}
 		g.v.total.start_time = 0;
-		rewinddir(dir);
-		while ((dp = readdir(dir))) {
-			m = l = (int)strlen(dp->d_name);
+		names = dirsnap_list(dir, &entries);
+		for (i = 0; i < entries; i++) {
+			name = (char *)names[i];
+			m = l = (int)strlen(name);
 
-			ext = find_last_of(dp->d_name, ".");
+			ext = find_last_of(name, ".");
 			if (*ext == '.')
 				ext++;
 
@@ -433,11 +421,11 @@ main(int argc, char *argv[])
 				strcasecmp("sfv", ext) &&
 				strcasecmp("nfo", ext) &&
 				strcasecmp("bad", ext) &&
-				strcmp(dp->d_name + l - 8, "-missing") &&
-				strncmp(dp->d_name, ".", 1)
+				strcmp(name + l - 8, "-missing") &&
+				strncmp(name, ".", 1)
 				) {
 				
-				stat(dp->d_name, &fileinfo);
+				stat(name, &fileinfo);
 
 				if (S_ISDIR(fileinfo.st_mode))
 					continue;
@@ -455,7 +443,7 @@ main(int argc, char *argv[])
                                 strncpy(g.v.user.group, argv[5], sizeof(g.v.user.group));
 #endif
 
-				strlcpy(g.v.file.name, dp->d_name, NAME_MAX);
+				strlcpy(g.v.file.name, name, NAME_MAX);
 				g.v.file.speed = 2005 * 1024;
 				g.v.file.size = fileinfo.st_size;
 
@@ -487,8 +475,8 @@ main(int argc, char *argv[])
 #endif
 				}
 
-				if (g.l.race && !match_file(g.l.race, dp->d_name))
-					crc = calc_crc32(dp->d_name);
+				if (g.l.race && !match_file(g.l.race, name))
+					crc = calc_crc32(name);
 				else
  					crc = 1;
 
@@ -496,10 +484,11 @@ main(int argc, char *argv[])
 					if (g.v.file.name)
 						unlink_missing(g.v.file.name);
 				}
-				if ((g.l.race && !match_file(g.l.race, dp->d_name)) || !fileexists(dp->d_name))
+				if ((g.l.race && !match_file(g.l.race, name)) || !fileexists(name))
 					writerace(g.l.race, &g.v, crc, F_NOTCHECKED);
 			}
 		}
+		ng_free(names);
 
 		testfiles(&g.l, &g.v, 0);
 
@@ -631,8 +620,8 @@ main(int argc, char *argv[])
 	}
 
 	d_log("ng-post_unnuke: Freeing memory and removing lock.\n");
-	closedir(dir);
-	closedir(parent);
+	dirsnap_close(dir);
+	dirsnap_close(parent);
 	remove_lock(&g.v);
 	updatestats_free(&g);
 	ng_free(g.l.race);
@@ -643,10 +632,5 @@ main(int argc, char *argv[])
 	if (fileexists(".delme"))
 		unlink(".delme");
 
-#ifdef USING_GLFTPD
-	buffer_groups(GROUPFILE, gnum);
-	buffer_users(PASSWDFILE, unum);
-#endif
-
 	exit(0);
 }
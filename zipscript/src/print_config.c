@@ -244,7 +244,23 @@ printf("#define complete_script                           %s\n", stringify(compl
 #ifndef crc_algo_is_defaulted
 printf("#define crc_algo                                  %s\n", (crc_algo == CRC_STANDARD ? "CRC_STANDARD" :
 								 (crc_algo == CRC_SLICEBY4 ? "CRC_SLICEBY4" :
-								 (crc_algo == CRC_SLICEBY8 ? "CRC_SLICEBY8" : stringify(crc_algo)))));
+								 (crc_algo == CRC_SLICEBY8 ? "CRC_SLICEBY8" :
+								 (crc_algo == CRC_AUTO ? "CRC_AUTO" : stringify(crc_algo))))));
+#endif
+#ifndef crc_cache_is_defaulted
+printf("#define crc_cache                                 %s\n", (crc_cache == FALSE ? "FALSE" : "TRUE"));
+#endif
+#ifndef crc_io_mode_is_defaulted
+printf("#define crc_io_mode                               %s\n", (crc_io_mode == CRC_IO_STDIO ? "CRC_IO_STDIO" :
+								 (crc_io_mode == CRC_IO_MMAP ? "CRC_IO_MMAP" :
+								 (crc_io_mode == CRC_IO_PREAD ? "CRC_IO_PREAD" :
+								 (crc_io_mode == CRC_IO_DIRECT ? "CRC_IO_DIRECT" : stringify(crc_io_mode))))));
+#endif
+#ifndef crc_parallel_min_size_is_defaulted
+printf("#define crc_parallel_min_size                     %s\n", stringify(crc_parallel_min_size));
+#endif
+#ifndef crc_parallel_threads_is_defaulted
+printf("#define crc_parallel_threads                      %s\n", stringify(crc_parallel_threads));
 #endif
 #ifndef create_incomplete_links_in_group_dirs_is_defaulted
 printf("#define create_incomplete_links_in_group_dirs     %s\n", (create_incomplete_links_in_group_dirs == FALSE ? "FALSE" : "TRUE"));
@@ -615,9 +631,21 @@ printf("#define incomplete_sfv_indicator                  %s\n", stringify(incom
 #ifndef incompleteislink_is_defaulted
 printf("#define incompleteislink                          %s\n", stringify(incompleteislink));
 #endif
+#ifndef journal_sync_is_defaulted
+printf("#define journal_sync                              %s\n", stringify(journal_sync));
+#endif
 #ifndef lock_optimize_is_defaulted
 printf("#define lock_optimize                             %s\n", stringify(lock_optimize));
 #endif
+#ifndef lock_shm_is_defaulted
+printf("#define lock_shm                                  %s\n", (lock_shm == FALSE ? "FALSE" : "TRUE"));
+#endif
+#ifndef lock_shm_key_is_defaulted
+printf("#define lock_shm_key                              %s\n", stringify(lock_shm_key));
+#endif
+#ifndef lock_stats_file_is_defaulted
+printf("#define lock_stats_file                           %s\n", (lock_stats_file == DISABLED ? "DISABLED" : stringify(lock_stats_file)));
+#endif
 #ifndef log_is_defaulted
 printf("#define log                                       %s\n", stringify(log));
 #endif
@@ -771,6 +799,9 @@ printf("#define sample_script                             %s\n", stringify(sampl
 #ifndef sample_types_is_defaulted
 printf("#define sample_types                               %s\n", stringify(sample_types));
 #endif
+#ifndef script_jobs_is_defaulted
+printf("#define script_jobs                               %s\n", stringify(script_jobs));
+#endif
 #ifndef sfv_calc_single_fname_is_defaulted
 printf("#define sfv_calc_single_fname                     %s\n", (sfv_calc_single_fname == FALSE ? "FALSE" : "TRUE"));
 #endif
@@ -833,6 +864,9 @@ printf("#define status_bar_type                           %s\n", (status_bar_typ
 #ifndef storage_is_defaulted
 printf("#define storage                                   %s\n", stringify(storage));
 #endif
+#ifndef storage_container_is_defaulted
+printf("#define storage_container                         %s\n", (storage_container == FALSE ? "FALSE" : "TRUE"));
+#endif
 #ifndef strict_path_match_is_defaulted
 printf("#define strict_path_match                         %s\n", (strict_path_match == FALSE ? "FALSE" : "TRUE"));
 #endif
@@ -914,6 +948,15 @@ printf("#define zipscript_sfv_ok                          %s\n", stringify(zipsc
 #ifndef zipscript_zip_ok_is_defaulted
 printf("#define zipscript_zip_ok                          %s\n", stringify(zipscript_zip_ok));
 #endif
+#ifndef zsd_flush_is_defaulted
+printf("#define zsd_flush                                 %s\n", stringify(zsd_flush));
+#endif
+#ifndef zsd_socket_is_defaulted
+printf("#define zsd_socket                                %s\n", (zsd_socket == DISABLED ? "DISABLED" : stringify(zsd_socket)));
+#endif
+#ifndef zsd_workers_is_defaulted
+printf("#define zsd_workers                               %s\n", stringify(zsd_workers));
+#endif
 #ifndef zsinternal_checks_completed_is_defaulted
 printf("#define zsinternal_checks_completed               %s\n", stringify(zsinternal_checks_completed));
 #endif
@@ -1004,7 +1047,15 @@ printf("#define combine_path                              %s\n", (combine_path =
 printf("#define complete_script                           %s\n", stringify(complete_script));
 printf("#define crc_algo                                  %s\n", (crc_algo == CRC_STANDARD ? "CRC_STANDARD" :
 								 (crc_algo == CRC_SLICEBY4 ? "CRC_SLICEBY4" :
-								 (crc_algo == CRC_SLICEBY8 ? "CRC_SLICEBY8" : stringify(crc_algo)))));
+								 (crc_algo == CRC_SLICEBY8 ? "CRC_SLICEBY8" :
+								 (crc_algo == CRC_AUTO ? "CRC_AUTO" : stringify(crc_algo))))));
+printf("#define crc_cache                                 %s\n", (crc_cache == FALSE ? "FALSE" : "TRUE"));
+printf("#define crc_io_mode                               %s\n", (crc_io_mode == CRC_IO_STDIO ? "CRC_IO_STDIO" :
+								 (crc_io_mode == CRC_IO_MMAP ? "CRC_IO_MMAP" :
+								 (crc_io_mode == CRC_IO_PREAD ? "CRC_IO_PREAD" :
+								 (crc_io_mode == CRC_IO_DIRECT ? "CRC_IO_DIRECT" : stringify(crc_io_mode))))));
+printf("#define crc_parallel_min_size                     %s\n", stringify(crc_parallel_min_size));
+printf("#define crc_parallel_threads                      %s\n", stringify(crc_parallel_threads));
 printf("#define create_incomplete_links_in_group_dirs     %s\n", (create_incomplete_links_in_group_dirs == FALSE ? "FALSE" : "TRUE"));
 printf("#define create_m3u                                %s\n", (create_m3u == FALSE ? "FALSE" : "TRUE"));
 printf("#define create_missing_files                      %s\n", (create_missing_files == FALSE ? "FALSE" : "TRUE"));
@@ -1128,7 +1179,11 @@ printf("#define incomplete_nfo_indicator                  %s\n", stringify(incom
 printf("#define incomplete_sample_indicator               %s\n", stringify(incomplete_sample_indicator));
 printf("#define incomplete_sfv_indicator                  %s\n", stringify(incomplete_sfv_indicator));
 printf("#define incompleteislink                          %s\n", stringify(incompleteislink));
+printf("#define journal_sync                              %s\n", stringify(journal_sync));
 printf("#define lock_optimize                             %s\n", stringify(lock_optimize));
+printf("#define lock_shm                                  %s\n", (lock_shm == FALSE ? "FALSE" : "TRUE"));
+printf("#define lock_shm_key                              %s\n", stringify(lock_shm_key));
+printf("#define lock_stats_file                           %s\n", (lock_stats_file == DISABLED ? "DISABLED" : stringify(lock_stats_file)));
 printf("#define log                                       %s\n", stringify(log));
 printf("#define mark_empty_dirs_as_incomplete_on_rescan   %s\n", (mark_empty_dirs_as_incomplete_on_rescan == FALSE ? "FALSE" : "TRUE"));
 printf("#define mark_file_as_bad                          %s\n", (mark_file_as_bad == FALSE ? "FALSE" : "TRUE"));
@@ -1180,6 +1235,7 @@ printf("#define rescan_script                             %s\n", stringify(resca
 printf("#define sample_list                               %s\n", stringify(sample_list));
 printf("#define sample_script                             %s\n", stringify(sample_script));
 printf("#define sample_types                              %s\n", stringify(sample_types));
+printf("#define script_jobs                               %s\n", stringify(script_jobs));
 printf("#define sfv_calc_single_fname                     %s\n", (sfv_calc_single_fname == FALSE ? "FALSE" : "TRUE"));
 printf("#define sfv_cleanup                               %s\n", (sfv_cleanup == FALSE ? "FALSE" : "TRUE"));
 printf("#define sfv_cleanup_comments                      %s\n", (sfv_cleanup_comments == FALSE ? "FALSE" : "TRUE"));
@@ -1202,6 +1258,7 @@ printf("#define status_bar_type                           %s\n", (status_bar_typ
 								 (status_bar_type == BAR_DIR ? "BAR_DIR" :
 								 (status_bar_type == BAR_FILE ? "BAR_FILE" : stringify(status_bar_type)))));
 printf("#define storage                                   %s\n", stringify(storage));
+printf("#define storage_container                         %s\n", (storage_container == FALSE ? "FALSE" : "TRUE"));
 printf("#define strict_path_match                         %s\n", (strict_path_match == FALSE ? "FALSE" : "TRUE"));
 printf("#define strict_sfv_check                          %s\n", (strict_sfv_check == FALSE ? "FALSE" : "TRUE"));
 printf("#define subdir_list                               %s\n", stringify(subdir_list));
@@ -1229,6 +1286,9 @@ printf("#define zipscript_footer_unknown                  %s\n", stringify(zipsc
 printf("#define zipscript_header                          %s\n", stringify(zipscript_header));
 printf("#define zipscript_sfv_ok                          %s\n", stringify(zipscript_sfv_ok));
 printf("#define zipscript_zip_ok                          %s\n", stringify(zipscript_zip_ok));
+printf("#define zsd_flush                                 %s\n", stringify(zsd_flush));
+printf("#define zsd_socket                                %s\n", (zsd_socket == DISABLED ? "DISABLED" : stringify(zsd_socket)));
+printf("#define zsd_workers                               %s\n", stringify(zsd_workers));
 printf("#define zsinternal_checks_completed               %s\n", stringify(zsinternal_checks_completed));
 #ifdef USING_GLFTPD
 printf("  Compiled for glftpd!\n");
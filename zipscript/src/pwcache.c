@@ -0,0 +1,346 @@
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "pwcache.h"
+
+/* The tables of the groups are by gid / 100, so the first group in the file
+ * in the same hundred as a gid - what zipscript-c has always named the group
+ * of a file by - is found as fast as the one of that exact gid. */
+
+#define PWC_UID(h)	((uint32_t *)((h) + 1))
+#define PWC_UNAME(h)	(PWC_UID(h) + (h)->ubuckets)
+#define PWC_GID(h)	(PWC_UNAME(h) + (h)->ubuckets)
+#define PWC_GNAME(h)	(PWC_GID(h) + (h)->gbuckets)
+#define PWC_USER(h)	((PWC_ENT *)(PWC_GNAME(h) + (h)->gbuckets))
+#define PWC_GROUP(h)	(PWC_USER(h) + (h)->users)
+#define PWC_NAMES(h)	((char *)(PWC_GROUP(h) + (h)->groups))
+
+static PWC_HEAD	*pwc = NULL;
+static size_t	pwc_len = 0;
+static int	pwc_mapped = 0;
+
+static uint32_t
+pwc_hash_id(uint32_t id, uint32_t buckets)
+{
+	return (id * 2654435761u) & (buckets - 1);
+}
+
+static uint32_t
+pwc_hash_name(const char *s, uint32_t buckets)
+{
+	uint32_t	h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h & (buckets - 1);
+}
+
+static size_t
+pwc_size(uint32_t ub, uint32_t gb, uint32_t users, uint32_t groups, uint32_t names)
+{
+	return sizeof(PWC_HEAD) + 2 * (ub + gb) * sizeof(uint32_t) + (users + groups) * sizeof(PWC_ENT) + names;
+}
+
+static int
+pwc_same(const PWC_HEAD *h, const struct stat *pw, const struct stat *gr)
+{
+	return h->pw_mtime == (int64_t)pw->st_mtime && h->pw_size == (int64_t)pw->st_size && h->pw_ino == (int64_t)pw->st_ino &&
+	       h->gr_mtime == (int64_t)gr->st_mtime && h->gr_size == (int64_t)gr->st_size && h->gr_ino == (int64_t)gr->st_ino;
+}
+
+/* the whole file, with a '\0' after it - NULL, and sb zeroed, if it could
+ * not be read */
+static char *
+pwc_read(const char *path, struct stat *sb, size_t *len)
+{
+	int	fd;
+	ssize_t	n;
+	char	*buf;
+
+	*len = 0;
+	if (!path || (fd = open(path, O_RDONLY)) == -1) {
+		memset(sb, 0, sizeof(*sb));
+		return NULL;
+	}
+	if (fstat(fd, sb) == -1 || !(buf = malloc(sb->st_size + 1))) {
+		memset(sb, 0, sizeof(*sb));
+		close(fd);
+		return NULL;
+	}
+	while (*len < (size_t)sb->st_size && (n = read(fd, buf + *len, sb->st_size - *len)) > 0)
+		*len += n;
+	buf[*len] = '\0';
+	close(fd);
+	return buf;
+}
+
+/* Adds the entries of a passwd or group file - the name is the first field,
+ * and the id the fifth from the end in passwd and the second from the end in
+ * group, as glftpd writes them.
+ */
+static uint32_t
+pwc_parse(char *buf, size_t len, int users, PWC_ENT *ent, char *names, uint32_t *nlen)
+{
+	int		c, k;
+	uint32_t	n = 0;
+	char		*s, *e, *p, *end = buf + len;
+
+	for (s = buf; s < end; s = e + 1) {
+		if (!(e = memchr(s, '\n', end - s)))
+			e = end;
+		for (c = 0, p = s; p < e; p++)
+			if (*p == ':')
+				c++;
+		if ((k = users ? c - 4 : c - 1) < 1 || *s == ':')
+			continue;
+		for (c = 0, p = s; c < k; p++)
+			if (*p == ':')
+				c++;
+		ent[n].id = (uint32_t)strtoul(p, NULL, 10);
+		ent[n].name = *nlen;
+		for (p = s; *p != ':'; p++)
+			names[(*nlen)++] = *p;
+		names[(*nlen)++] = '\0';
+		n++;
+	}
+	return n;
+}
+
+/* makes the block from the files */
+static PWC_HEAD *
+pwc_build(char *pwbuf, size_t pwlen, const struct stat *pw, char *grbuf, size_t grlen, const struct stat *gr)
+{
+	uint32_t	i, nu = 0, ng = 0, nlen = 0, ub, gb, *b;
+	char		*names;
+	PWC_ENT		*ue, *ge;
+	PWC_HEAD	*h;
+
+	/* at most a line per byte, a name per line */
+	ue = malloc((pwlen / 2 + 1) * sizeof(PWC_ENT));
+	ge = malloc((grlen / 2 + 1) * sizeof(PWC_ENT));
+	names = malloc(pwlen + grlen + 2);
+	if (!ue || !ge || !names) {
+		free(ue);
+		free(ge);
+		free(names);
+		return NULL;
+	}
+	if (pwbuf)
+		nu = pwc_parse(pwbuf, pwlen, 1, ue, names, &nlen);
+	if (grbuf)
+		ng = pwc_parse(grbuf, grlen, 0, ge, names, &nlen);
+	for (ub = 1; ub < nu * 2; ub <<= 1)
+		;
+	for (gb = 1; gb < ng * 2; gb <<= 1)
+		;
+
+	if (!(h = calloc(1, pwc_size(ub, gb, nu, ng, nlen)))) {
+		free(ue);
+		free(ge);
+		free(names);
+		return NULL;
+	}
+	h->magic = PWC_MAGIC;
+	h->version = PWC_VERSION;
+	h->size = (uint32_t)pwc_size(ub, gb, nu, ng, nlen);
+	h->users = nu;
+	h->groups = ng;
+	h->ubuckets = ub;
+	h->gbuckets = gb;
+	h->names = nlen;
+	h->pw_mtime = (int64_t)pw->st_mtime;
+	h->pw_size = (int64_t)pw->st_size;
+	h->pw_ino = (int64_t)pw->st_ino;
+	h->gr_mtime = (int64_t)gr->st_mtime;
+	h->gr_size = (int64_t)gr->st_size;
+	h->gr_ino = (int64_t)gr->st_ino;
+	memcpy(PWC_USER(h), ue, nu * sizeof(PWC_ENT));
+	memcpy(PWC_GROUP(h), ge, ng * sizeof(PWC_ENT));
+	memcpy(PWC_NAMES(h), names, nlen);
+	free(ue);
+	free(ge);
+	free(names);
+
+	/* from the last, so each bucket is in the order of the file - and each
+	 * entry is followed by a later one, which the lookups hold it to */
+	for (i = nu; i-- > 0;) {
+		ue = &PWC_USER(h)[i];
+		b = &PWC_UID(h)[pwc_hash_id(ue->id, ub)];
+		ue->next_id = *b;
+		*b = i + 1;
+		b = &PWC_UNAME(h)[pwc_hash_name(PWC_NAMES(h) + ue->name, ub)];
+		ue->next_name = *b;
+		*b = i + 1;
+	}
+	for (i = ng; i-- > 0;) {
+		ge = &PWC_GROUP(h)[i];
+		b = &PWC_GID(h)[pwc_hash_id(ge->id / 100, gb)];
+		ge->next_id = *b;
+		*b = i + 1;
+		b = &PWC_GNAME(h)[pwc_hash_name(PWC_NAMES(h) + ge->name, gb)];
+		ge->next_name = *b;
+		*b = i + 1;
+	}
+	return h;
+}
+
+static void
+pwc_write(const char *cache, const PWC_HEAD *h)
+{
+	int	fd;
+	size_t	done = 0;
+	ssize_t	n = 0;
+	char	tmp[4096];
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%d", cache, (int)getpid()) >= sizeof(tmp) ||
+	    (fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666)) == -1)
+		return;
+	while (done < h->size && (n = write(fd, (const char *)h + done, h->size - done)) > 0)
+		done += n;
+	if (close(fd) == -1 || done < h->size || rename(tmp, cache) == -1)
+		unlink(tmp);
+}
+
+void
+pwc_free(void)
+{
+	if (pwc_mapped)
+		munmap(pwc, pwc_len);
+	else
+		free(pwc);
+	pwc = NULL;
+	pwc_len = 0;
+	pwc_mapped = 0;
+}
+
+/* Makes the users of passwd and the groups of group the ones looked up, from
+ * the cache file when it is of the same files, and else from the files - and
+ * then writes the cache again. Each of the three may be NULL. Nothing is done
+ * if what is loaded is of the files as they are now. Returns -1 if passwd or
+ * group could not be read, or there was no memory.
+ */
+int
+pwc_load(const char *cache, const char *passwd, const char *group)
+{
+	int		fd, ret = 0;
+	size_t		pwlen, grlen;
+	char		*pwbuf, *grbuf;
+	struct stat	pw, gr, sb;
+	PWC_HEAD	*h;
+
+	if (!passwd || stat(passwd, &pw) == -1)
+		memset(&pw, 0, sizeof(pw));
+	if (!group || stat(group, &gr) == -1)
+		memset(&gr, 0, sizeof(gr));
+	if (pwc && pwc_same(pwc, &pw, &gr))
+		return 0;
+	pwc_free();
+
+	if (cache && (fd = open(cache, O_RDONLY)) != -1) {
+		if (fstat(fd, &sb) == 0 && sb.st_size >= (off_t)sizeof(PWC_HEAD) &&
+		    (h = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+			if (h->magic == PWC_MAGIC && h->version == PWC_VERSION && h->size == (uint32_t)sb.st_size &&
+			    h->ubuckets && !(h->ubuckets & (h->ubuckets - 1)) && h->gbuckets && !(h->gbuckets & (h->gbuckets - 1)) &&
+			    pwc_size(h->ubuckets, h->gbuckets, h->users, h->groups, h->names) == (size_t)sb.st_size &&
+			    (!h->names || !PWC_NAMES(h)[h->names - 1]) && pwc_same(h, &pw, &gr)) {
+				pwc = h;
+				pwc_len = sb.st_size;
+				pwc_mapped = 1;
+				close(fd);
+				return 0;
+			}
+			munmap(h, sb.st_size);
+		}
+		close(fd);
+	}
+
+	pwbuf = pwc_read(passwd, &pw, &pwlen);
+	grbuf = pwc_read(group, &gr, &grlen);
+	if ((passwd && !pwbuf) || (group && !grbuf))
+		ret = -1;
+	if ((pwc = pwc_build(pwbuf, pwlen, &pw, grbuf, grlen, &gr))) {
+		pwc_len = pwc->size;
+		if (cache)
+			pwc_write(cache, pwc);
+	} else
+		ret = -1;
+	free(pwbuf);
+	free(grbuf);
+	return ret;
+}
+
+/* the name of uid - NULL if there is none */
+const char *
+pwc_uname(uid_t uid)
+{
+	uint32_t	i;
+	PWC_ENT		*e;
+
+	if (!pwc || !pwc->users)
+		return NULL;
+	for (i = PWC_UID(pwc)[pwc_hash_id((uint32_t)uid, pwc->ubuckets)]; i && i <= pwc->users; i = e->next_id > i ? e->next_id : 0)
+		if ((e = &PWC_USER(pwc)[i - 1])->id == (uint32_t)uid && e->name < pwc->names)
+			return PWC_NAMES(pwc) + e->name;
+	return NULL;
+}
+
+/* the name of gid - or, if exact is 0, of the first group in the same
+ * hundred. NULL if there is none.
+ */
+const char *
+pwc_gname(gid_t gid, int exact)
+{
+	uint32_t	i;
+	PWC_ENT		*e;
+
+	if (!pwc || !pwc->groups)
+		return NULL;
+	for (i = PWC_GID(pwc)[pwc_hash_id((uint32_t)gid / 100, pwc->gbuckets)]; i && i <= pwc->groups; i = e->next_id > i ? e->next_id : 0) {
+		e = &PWC_GROUP(pwc)[i - 1];
+		if ((exact ? e->id == (uint32_t)gid : e->id / 100 == (uint32_t)gid / 100) && e->name < pwc->names)
+			return PWC_NAMES(pwc) + e->name;
+	}
+	return NULL;
+}
+
+/* the uid of a user - -1 if there is none */
+int
+pwc_uid(const char *name, uid_t *uid)
+{
+	uint32_t	i;
+	PWC_ENT		*e;
+
+	if (!pwc || !pwc->users)
+		return -1;
+	for (i = PWC_UNAME(pwc)[pwc_hash_name(name, pwc->ubuckets)]; i && i <= pwc->users; i = e->next_name > i ? e->next_name : 0)
+		if ((e = &PWC_USER(pwc)[i - 1])->name < pwc->names && !strcmp(PWC_NAMES(pwc) + e->name, name)) {
+			*uid = (uid_t)e->id;
+			return 0;
+		}
+	return -1;
+}
+
+/* the gid of a group - -1 if there is none */
+int
+pwc_gid(const char *name, gid_t *gid)
+{
+	uint32_t	i;
+	PWC_ENT		*e;
+
+	if (!pwc || !pwc->groups)
+		return -1;
+	for (i = PWC_GNAME(pwc)[pwc_hash_name(name, pwc->gbuckets)]; i && i <= pwc->groups; i = e->next_name > i ? e->next_name : 0)
+		if ((e = &PWC_GROUP(pwc)[i - 1])->name < pwc->names && !strcmp(PWC_NAMES(pwc) + e->name, name)) {
+			*gid = (gid_t)e->id;
+			return 0;
+		}
+	return -1;
+}
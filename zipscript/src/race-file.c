@@ -1,3 +1,4 @@
+#define _GNU_SOURCE	/* F_OFD_SETLKW */
 #include <ctype.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -6,10 +7,19 @@
 #include <string.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <stdatomic.h>
 
 #include "race-file.h"
+#include "runner.h"
+#include "storage.h"
+#include "lockshm.h"
+#include "lockstats.h"
 
 #include "objects.h"
 #include "macros.h"
@@ -68,6 +78,994 @@ maketempdir(char *path)
 		d_log("maketempdir: Failed to create tempdir (%s): %s\n", full_path, strerror(errno));
 }
 
+/*
+ * Racedata layout (sfv_version 19): a RACEDATA_HEAD, an open addressed hash
+ * index of RACEDATA_INDEX entries (fname -> record), room for capacity
+ * RACEDATA records kept in the order they were added, and a string table
+ * with the names. Offset 0 of the string table is an empty string.
+ * Removed records are zeroed (and so have status F_DELETED and an empty
+ * fname) and left in place, so record numbers never change until the file
+ * is rebuilt. Their names stay in the string table until then too.
+ *
+ * sfvdata is a SFVDATA_HEAD, the SFVDATA records and then their names.
+ */
+
+static unsigned int
+racedata_hash(const char *fname)
+{
+	unsigned int	h = 2166136261U;	/* FNV-1a */
+	int		n;
+
+	for (n = 0; n < NAME_MAX && fname[n]; n++) {
+#if (sfv_cleanup_lowercase)
+		h ^= (unsigned char)tolower((unsigned char)fname[n]);
+#else
+		h ^= (unsigned char)fname[n];
+#endif
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static int
+racedata_namecmp(const char *a, const char *b)
+{
+#if (sfv_cleanup_lowercase)
+	return strncasecmp(a, b, NAME_MAX);
+#else
+	return strncmp(a, b, NAME_MAX);
+#endif
+}
+
+/* string table being built in memory */
+typedef struct {
+	char		*buf;
+	unsigned int	len, size;
+} STRTAB;
+
+/* Appends s (and s2, if given) to st. Returns the offset of s. */
+static unsigned int
+strtab_add(STRTAB *st, const char *s, const char *s2)
+{
+	unsigned int	off = st->len;
+	size_t		l1 = strlen(s) + 1, l2 = s2 ? strlen(s2) + 1 : 0;
+
+	if (!st->buf || st->len + l1 + l2 > st->size) {
+		st->size = (st->len + l1 + l2) * 2 + 256;
+		st->buf = ng_realloc2(st->buf, st->size, 0, 1, st->buf == NULL);
+	}
+	memcpy(st->buf + st->len, s, l1);
+	if (s2)
+		memcpy(st->buf + st->len + l1, s2, l2);
+	st->len += l1 + l2;
+	return off;
+}
+
+#if ( sfv_cleanup == TRUE )
+/* Appends the len bytes at s to st, without a NUL. */
+static void
+strtab_put(STRTAB *st, const char *s, size_t len)
+{
+	if (!st->buf || st->len + len > st->size) {
+		st->size = (st->len + len) * 2 + 256;
+		st->buf = ng_realloc2(st->buf, st->size, 0, 1, st->buf == NULL);
+	}
+	memcpy(st->buf + st->len, s, len);
+	st->len += len;
+}
+#endif
+
+static const char *journal_names[] = { "racedata", "sfvdata", "headdata" };
+
+/* the journal of the release we hold the lock of, if any */
+static int	journal_fd = -1;
+static char	journal_dir[PATH_MAX];
+
+static unsigned int
+journal_crc(const JOURNAL_REC *jr, const void *buf)
+{
+	JOURNAL_REC	tmp = *jr;
+
+	tmp.crc = 0;
+	return crc32_update(crc32_update(0, (const unsigned char *)&tmp, sizeof(JOURNAL_REC)), buf, jr->len);
+}
+
+/* Starts journaling writes to the race files next to headpath. */
+static void
+journal_open(const char *headpath)
+{
+	const char	*p = strrchr(headpath, '/');
+	char		path[PATH_MAX + 8];
+
+	if (journal_fd != -1)
+		st_close(journal_fd);
+	snprintf(journal_dir, sizeof(journal_dir), "%.*s", p ? (int)(p - headpath + 1) : 0, headpath);
+	snprintf(path, sizeof(path), "%sjournal", journal_dir);
+	if ((journal_fd = st_open(path, O_CREAT | O_WRONLY | O_APPEND, 0666)) == -1)
+		d_log("journal_open: open(%s): %s\n", path, strerror(errno));
+}
+
+/* Flushes the race files to disk. */
+static void
+journal_sync_files(const char *dir)
+{
+	int		fd;
+	unsigned int	n;
+	char		path[PATH_MAX + 16];
+
+	for (n = 0; n < sizeof(journal_names) / sizeof(*journal_names); n++) {
+		snprintf(path, sizeof(path), "%s%s", dir, journal_names[n]);
+		if ((fd = st_open(path, O_RDONLY, 0)) != -1) {
+			st_fdatasync(fd);
+			st_close(fd);
+		}
+	}
+}
+
+/* Ends journaling - all writes are done, so the journal is emptied. */
+static void
+journal_close(int completed)
+{
+	if (journal_fd == -1)
+		return;
+	if (journal_sync == JOURNAL_SYNC_WRITE || (journal_sync == JOURNAL_SYNC_COMPLETE && completed))
+		journal_sync_files(journal_dir);
+	if (st_ftruncate(journal_fd, 0) == -1)
+		d_log("journal_close: ftruncate failed: %s\n", strerror(errno));
+	st_close(journal_fd);
+	journal_fd = -1;
+}
+
+/* pwrite() to one of the race files at path, logging it to the journal
+ * first if it is one of the release we hold the lock of.
+ */
+static ssize_t
+journal_pwrite(const char *path, int fd, const void *buf, size_t len, off_t offset)
+{
+	size_t		dirlen = strlen(journal_dir);
+	unsigned int	n;
+	struct iovec	iov[2];
+	JOURNAL_REC	jr;
+
+	if (journal_fd == -1 || len > JOURNAL_MAXLEN || strncmp(path, journal_dir, dirlen))
+		return st_pwrite(fd, buf, len, offset);
+	for (n = 0; n < sizeof(journal_names) / sizeof(*journal_names) && strcmp(path + dirlen, journal_names[n]); n++);
+	if (n == sizeof(journal_names) / sizeof(*journal_names) || st_ident(fd, &jr.dev, &jr.ino) == -1)
+		return st_pwrite(fd, buf, len, offset);
+
+	jr.magic = JOURNAL_MAGIC;
+	jr.len = len;
+	jr.name = n;
+	jr.offset = offset;
+	jr.crc = journal_crc(&jr, buf);
+	iov[0].iov_base = &jr;
+	iov[0].iov_len = sizeof(JOURNAL_REC);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+	if (st_append(journal_fd, iov, 2) != (ssize_t)(sizeof(JOURNAL_REC) + len) ||
+	    (journal_sync == JOURNAL_SYNC_WRITE && st_fdatasync(journal_fd) == -1))
+		d_log("journal_pwrite: write to journal failed: %s\n", strerror(errno));
+	return st_pwrite(fd, buf, len, offset);
+}
+
+/* Redoes the writes in the journal of the race files in dir, up to the
+ * first torn record, and empties it. Only to be called while nobody else
+ * is writing to them.
+ */
+static void
+journal_replay(const char *dir)
+{
+	int		fd, fds[3] = { -1, -1, -1 };
+	unsigned int	n, done = 0, skipped = 0;
+	char		path[PATH_MAX + 16], *buf = NULL;
+	off_t		off = 0;
+	uint64_t	dev, ino;
+	struct stat	jst;
+	JOURNAL_REC	jr;
+
+	snprintf(path, sizeof(path), "%sjournal", dir);
+	if ((fd = st_open(path, O_RDWR, 0)) == -1)
+		return;
+	if (st_fstat(fd, &jst) == -1 || !jst.st_size) {
+		st_close(fd);
+		return;
+	}
+
+	buf = ng_realloc2(NULL, JOURNAL_MAXLEN, 0, 1, 1);
+	while (st_pread(fd, &jr, sizeof(JOURNAL_REC), off) == sizeof(JOURNAL_REC) &&
+	       jr.magic == JOURNAL_MAGIC && jr.len <= JOURNAL_MAXLEN && jr.name < 3 &&
+	       st_pread(fd, buf, jr.len, off + sizeof(JOURNAL_REC)) == (ssize_t)jr.len &&
+	       jr.crc == journal_crc(&jr, buf)) {
+		off += sizeof(JOURNAL_REC) + jr.len;
+		if (fds[jr.name] == -1) {
+			snprintf(path, sizeof(path), "%s%s", dir, journal_names[jr.name]);
+			fds[jr.name] = st_open(path, O_WRONLY, 0);
+		}
+		if (fds[jr.name] == -1 || st_ident(fds[jr.name], &dev, &ino) == -1 || dev != jr.dev || ino != jr.ino) {
+			skipped++;
+			continue;
+		}
+		if (st_pwrite(fds[jr.name], buf, jr.len, jr.offset) != (ssize_t)jr.len)
+			d_log("journal_replay: write to %s failed: %s\n", journal_names[jr.name], strerror(errno));
+		done++;
+	}
+	for (n = 0; n < 3; n++)
+		if (fds[n] != -1) {
+			if (journal_sync != JOURNAL_SYNC_NONE)
+				st_fdatasync(fds[n]);
+			st_close(fds[n]);
+		}
+	d_log("journal_replay: redid %u writes, skipped %u, dropped %lld bytes\n", done, skipped, (long long)(jst.st_size - off));
+	if (st_ftruncate(fd, 0) == -1)
+		d_log("journal_replay: ftruncate failed: %s\n", strerror(errno));
+	st_close(fd);
+	ng_free(buf);
+}
+
+/* Writes ents as a new racedata file. Entries with an empty fname are kept
+ * as removed records. Returns 0 on success.
+ */
+static int
+racedata_create(const char *path, const RACEENTRY *ents, unsigned int count)
+{
+	int		ret;
+	unsigned int	n, b, h, owner = 0;
+	RACEDATA_HEAD	rh;
+	RACEDATA_INDEX	*idx;
+	RACEDATA	*recs;
+	STRTAB		st;
+	struct iovec	iov[4];
+
+	bzero(&rh, sizeof(RACEDATA_HEAD));
+	rh.magic = RACEDATA_MAGIC;
+	rh.count = count;
+	rh.gen = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+	rh.capacity = RACEDATA_MINCAP;
+	while (rh.capacity < count * 2)
+		rh.capacity *= 2;
+	rh.buckets = rh.capacity * 2;
+
+	idx = ng_realloc2(NULL, rh.buckets * sizeof(RACEDATA_INDEX), 1, 1, 1);
+	recs = ng_realloc2(NULL, rh.capacity * sizeof(RACEDATA), 1, 1, 1);
+	bzero(&st, sizeof(STRTAB));
+	strtab_add(&st, "", NULL);
+
+	for (n = 0; n < count; n++) {
+		if (!*ents[n].fname) {
+			rh.deleted++;
+			continue;
+		}
+		recs[n].size = ents[n].size;
+		recs[n].speed = ents[n].speed;
+		recs[n].start_time = ents[n].start_time;
+		recs[n].crc32 = ents[n].crc32;
+		recs[n].status = ents[n].status;
+		recs[n].fname = strtab_add(&st, ents[n].fname, NULL);
+		/* uploaders usually send several files in a row */
+		if (!owner || strcmp(st.buf + owner, ents[n].uname) ||
+		    strcmp(st.buf + owner + strlen(st.buf + owner) + 1, ents[n].group))
+			owner = strtab_add(&st, ents[n].uname, ents[n].group);
+		recs[n].owner = owner;
+
+		h = racedata_hash(ents[n].fname);
+		for (b = h & (rh.buckets - 1); idx[b].slot; b = (b + 1) & (rh.buckets - 1));
+		idx[b].slot = n + 1;
+		idx[b].hash = h;
+	}
+	rh.strsize = st.len;
+
+	iov[0].iov_base = &rh;
+	iov[0].iov_len = sizeof(RACEDATA_HEAD);
+	iov[1].iov_base = idx;
+	iov[1].iov_len = rh.buckets * sizeof(RACEDATA_INDEX);
+	iov[2].iov_base = recs;
+	iov[2].iov_len = rh.capacity * sizeof(RACEDATA);
+	iov[3].iov_base = st.buf;
+	iov[3].iov_len = st.len;
+	ret = st_replace(path, iov, 4);
+
+	ng_free(idx);
+	ng_free(recs);
+	ng_free(st.buf);
+	return ret;
+}
+
+/* Expands a record and its names from the string table str into e. */
+static void
+racedata_expand(const RACEDATA *rd, const char *str, unsigned int strsize, RACEENTRY *e)
+{
+	const char	*owner;
+
+	e->crc32 = rd->crc32;
+	e->status = (unsigned char)rd->status;
+	e->speed = rd->speed;
+	e->size = (int64_t)rd->size;
+	e->start_time = (time_t)rd->start_time;
+	strlcpy(e->fname, rd->fname < strsize ? str + rd->fname : "", sizeof(e->fname));
+	owner = rd->owner < strsize ? str + rd->owner : "";
+	strlcpy(e->uname, owner, sizeof(e->uname));
+	owner += strlen(owner) + 1;
+	strlcpy(e->group, owner < str + strsize ? owner : "", sizeof(e->group));
+}
+
+/* Converts a racedata file of sfv_version 17 (just records) or 18 (head,
+ * index and records) to the current layout.
+ * Returns 1 if it was converted, 0 if there was nothing to do, -1 on error.
+ */
+static int
+racedata_upgrade(const char *path)
+{
+	int		fd, ret;
+	unsigned int	n, count;
+	off_t		off = 0;
+	struct stat	st;
+	RACEDATA_HEAD	rh;
+	RACEDATA_OLD	*old;
+	RACEENTRY	*ents;
+
+	if ((fd = st_open(path, O_RDONLY, 0)) == -1)
+		return errno == ENOENT ? 0 : -1;
+	if (st_fstat(fd, &st) == -1 || !st.st_size || (st_pread(fd, &rh, sizeof(RACEDATA_HEAD), 0) == sizeof(RACEDATA_HEAD) && rh.magic == RACEDATA_MAGIC)) {
+		st_close(fd);
+		return 0;
+	}
+	if (st.st_size >= (off_t)sizeof(RACEDATA_HEAD) && rh.magic == RACEDATA_MAGIC_OLD) {
+		off = sizeof(RACEDATA_HEAD) + (off_t)rh.buckets * sizeof(RACEDATA_INDEX);
+		count = off < st.st_size ? (unsigned int)((st.st_size - off) / sizeof(RACEDATA_OLD)) : 0;
+		if (rh.count < count)
+			count = rh.count;
+	} else
+		count = (unsigned int)(st.st_size / sizeof(RACEDATA_OLD));
+
+	old = ng_realloc2(NULL, (count ? count : 1) * sizeof(RACEDATA_OLD), 0, 1, 1);
+	ents = ng_realloc2(NULL, (count ? count : 1) * sizeof(RACEENTRY), 1, 1, 1);
+	if (st_pread(fd, old, count * sizeof(RACEDATA_OLD), off) != (ssize_t)(count * sizeof(RACEDATA_OLD))) {
+		d_log("racedata_upgrade: read(%s) failed: %s\n", path, strerror(errno));
+		st_close(fd);
+		ng_free(old);
+		ng_free(ents);
+		return -1;
+	}
+	st_close(fd);
+
+	for (n = 0; n < count; n++) {
+		ents[n].crc32 = old[n].crc32;
+		ents[n].status = old[n].status;
+		ents[n].speed = old[n].speed;
+		ents[n].size = old[n].size;
+		ents[n].start_time = old[n].start_time;
+		strlcpy(ents[n].fname, old[n].fname, sizeof(ents[n].fname));
+		strlcpy(ents[n].uname, old[n].uname, sizeof(ents[n].uname));
+		strlcpy(ents[n].group, old[n].group, sizeof(ents[n].group));
+	}
+	ret = racedata_create(path, ents, count);
+	d_log("racedata_upgrade: converted %u records in %s (%s)\n", count, path, ret ? "failed" : "ok");
+	ng_free(old);
+	ng_free(ents);
+	return ret ? -1 : 1;
+}
+
+/* Opens a racedata file and reads its head. An empty file reads as a file
+ * without records, and is given a head when opened with O_CREAT. Files
+ * in an older layout are converted first.
+ * Returns the fd, or -1 on error.
+ */
+static int
+racedata_open(const char *path, int flags, RACEDATA_HEAD *rh)
+{
+	int		fd;
+	ssize_t		n;
+
+	if ((fd = st_open(path, flags, 0666)) == -1)
+		return -1;
+
+	if ((n = st_pread(fd, rh, sizeof(RACEDATA_HEAD), 0)) == 0) {
+		bzero(rh, sizeof(RACEDATA_HEAD));
+		if (flags & O_CREAT) {
+			st_close(fd);
+			if (racedata_create(path, NULL, 0) || (fd = st_open(path, flags & ~(O_CREAT | O_EXCL | O_TRUNC), 0666)) == -1 ||
+			    st_pread(fd, rh, sizeof(RACEDATA_HEAD), 0) != sizeof(RACEDATA_HEAD))
+				return -1;
+		}
+		return fd;
+	}
+	if (n != sizeof(RACEDATA_HEAD) || rh->magic != RACEDATA_MAGIC) {
+		st_close(fd);
+		if (racedata_upgrade(path) == 1)
+			return racedata_open(path, flags, rh);
+	} else if (rh->buckets && !(rh->buckets & (rh->buckets - 1)) && rh->count <= rh->capacity && rh->strsize)
+		return fd;
+	else
+		st_close(fd);
+
+	d_log("racedata_open: %s is not a valid racedata file\n", path);
+	errno = EINVAL;
+	return -1;
+}
+
+/* Reads the string at off in the string table into buf. */
+static char *
+racedata_pstr(int fd, const RACEDATA_HEAD *rh, unsigned int off, char *buf, size_t len)
+{
+	ssize_t		n = 0;
+
+	if (len - 1 > rh->strsize - off)
+		len = rh->strsize - off + 1;
+	if (off < rh->strsize && (n = st_pread(fd, buf, len - 1, RACEDATA_STRINGS(rh) + off)) < 0)
+		n = 0;
+	buf[n] = '\0';
+	return buf;
+}
+
+/* Appends s (and s2, if given) to the string table and updates rh - the
+ * caller writes the head. Returns the offset of s, or 0 on error.
+ */
+static unsigned int
+racedata_pstr_add(const char *path, int fd, RACEDATA_HEAD *rh, const char *s, const char *s2)
+{
+	char		buf[NAMEMAX + 24 + 24];
+	size_t		l1 = strlen(s) + 1, l2 = s2 ? strlen(s2) + 1 : 0;
+	unsigned int	off = rh->strsize;
+
+	if (l1 + l2 > sizeof(buf))
+		return 0;
+	memcpy(buf, s, l1);
+	if (s2)
+		memcpy(buf + l1, s2, l2);
+	if (journal_pwrite(path, fd, buf, l1 + l2, RACEDATA_STRINGS(rh) + off) != (ssize_t)(l1 + l2)) {
+		d_log("racedata_pstr_add: write failed: %s\n", strerror(errno));
+		return 0;
+	}
+	rh->strsize += l1 + l2;
+	return off;
+}
+
+/* Returns 1 if the owner string at off is uname and group. */
+static int
+racedata_owner_is(int fd, const RACEDATA_HEAD *rh, unsigned int off, const char *uname, const char *group)
+{
+	char		buf[24 + 24 + 1];
+	size_t		l = strlen(uname) + 1;
+
+	racedata_pstr(fd, rh, off, buf, sizeof(buf));
+	return !strcmp(buf, uname) && l < sizeof(buf) && !strncmp(buf + l, group, sizeof(buf) - l - 1);
+}
+
+/* Looks fname up in the index. Returns the record number and reads the
+ * record into rd, or returns -1 if not found. *bucket is set to the index
+ * entry of fname, or to the one a new entry for it should use.
+ */
+static int
+racedata_find(int fd, RACEDATA_HEAD *rh, const char *fname, RACEDATA *rd, unsigned int *bucket)
+{
+	RACEDATA_INDEX	idx[RACEDATA_PROBE];
+	unsigned int	h, b, i, cnt, seen = 0, avail = rh->buckets;
+	char		name[NAMEMAX];
+
+	if (!rh->buckets)
+		return -1;
+
+	h = racedata_hash(fname);
+	b = h & (rh->buckets - 1);
+	while (seen < rh->buckets) {
+		cnt = rh->buckets - b < RACEDATA_PROBE ? rh->buckets - b : RACEDATA_PROBE;
+		if (st_pread(fd, idx, cnt * sizeof(RACEDATA_INDEX), sizeof(RACEDATA_HEAD) + b * sizeof(RACEDATA_INDEX)) != (ssize_t)(cnt * sizeof(RACEDATA_INDEX)))
+			break;
+		for (i = 0; i < cnt; i++, seen++) {
+			if (!idx[i].slot) {
+				*bucket = avail < rh->buckets ? avail : b + i;
+				return -1;
+			}
+			if (idx[i].slot == RACEDATA_TOMBSTONE) {
+				if (avail == rh->buckets)
+					avail = b + i;
+			} else if (idx[i].hash == h && idx[i].slot <= rh->count &&
+				   st_pread(fd, rd, sizeof(RACEDATA), RACEDATA_OFFSET(rh, idx[i].slot - 1)) == sizeof(RACEDATA) &&
+				   !racedata_namecmp(racedata_pstr(fd, rh, rd->fname, name, sizeof(name)), fname)) {
+				*bucket = b + i;
+				return (int)idx[i].slot - 1;
+			}
+		}
+		b = (b + cnt) & (rh->buckets - 1);
+	}
+	*bucket = avail;
+	return -1;
+}
+
+/* Reads the records of an open racedata file. Removed records are left out
+ * unless keep_removed is set. Returns the number of entries in *ents, which
+ * should be freed, or -1 on error.
+ */
+static int
+racedata_read(int fd, RACEDATA_HEAD *rh, RACEENTRY **ents, int keep_removed)
+{
+	unsigned int	n, m;
+	RACEDATA	*recs;
+	char		*str;
+
+	*ents = NULL;
+	if (!rh->count)
+		return 0;
+	recs = ng_realloc2(NULL, rh->count * sizeof(RACEDATA), 0, 1, 1);
+	str = ng_realloc2(NULL, rh->strsize, 0, 1, 1);
+	*ents = ng_realloc2(NULL, rh->count * sizeof(RACEENTRY), 0, 1, 1);
+	if (st_pread(fd, recs, rh->count * sizeof(RACEDATA), RACEDATA_OFFSET(rh, 0)) != (ssize_t)(rh->count * sizeof(RACEDATA)) ||
+	    st_pread(fd, str, rh->strsize, RACEDATA_STRINGS(rh)) != (ssize_t)rh->strsize) {
+		ng_free(recs);
+		ng_free(str);
+		*ents = ng_free(*ents);
+		return -1;
+	}
+	str[rh->strsize - 1] = '\0';
+	for (n = m = 0; n < rh->count; n++)
+		if (keep_removed || recs[n].fname)
+			racedata_expand(&recs[n], str, rh->strsize, &(*ents)[m++]);
+	ng_free(recs);
+	ng_free(str);
+	return (int)m;
+}
+
+/* Writes the records of it that keep(it, rd, arg) accepts (all of them if
+ * keep is NULL) to a new racedata file, in the same order and with the same string
+ * table. Removed records are dropped. The new index and records share one
+ * allocation and go out with a single writev. Returns the number of records
+ * kept, or -1 on error.
+ */
+static int
+racedata_compact(const char *path, RECITER *it, int (*keep)(const RECITER *, const RACEDATA *, void *), void *arg)
+{
+	unsigned int	cap, n = 0, m, b, h;
+	char		*buf;
+	RACEDATA_HEAD	rh;
+	RACEDATA_INDEX	*idx;
+	RACEDATA	*recs;
+	struct iovec	iov[4];
+
+	const RACEDATA	*rd;
+
+	/* room for all of them, the survivors can only be fewer */
+	for (cap = RACEDATA_MINCAP; cap < it->count * 2; cap *= 2);
+	buf = ng_realloc2(NULL, cap * 2 * sizeof(RACEDATA_INDEX) + cap * sizeof(RACEDATA), 1, 1, 1);
+	idx = (RACEDATA_INDEX *)buf;
+	recs = (RACEDATA *)(buf + cap * 2 * sizeof(RACEDATA_INDEX));
+	while ((rd = rec_next(it)))
+		if (rd->fname && (!keep || keep(it, rd, arg)))
+			recs[n++] = *rd;
+
+	bzero(&rh, sizeof(RACEDATA_HEAD));
+	rh.magic = RACEDATA_MAGIC;
+	rh.count = n;
+	rh.gen = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+	rh.strsize = it->strsize;
+	for (rh.capacity = RACEDATA_MINCAP; rh.capacity < n * 2; rh.capacity *= 2);
+	rh.buckets = rh.capacity * 2;
+	for (m = 0; m < n; m++) {
+		h = racedata_hash(rec_str(it, recs[m].fname));
+		for (b = h & (rh.buckets - 1); idx[b].slot; b = (b + 1) & (rh.buckets - 1));
+		idx[b].slot = m + 1;
+		idx[b].hash = h;
+	}
+
+	iov[0].iov_base = &rh;
+	iov[0].iov_len = sizeof(RACEDATA_HEAD);
+	iov[1].iov_base = idx;
+	iov[1].iov_len = rh.buckets * sizeof(RACEDATA_INDEX);
+	iov[2].iov_base = recs;
+	iov[2].iov_len = rh.capacity * sizeof(RACEDATA);
+	iov[3].iov_base = (void *)it->str;
+	iov[3].iov_len = it->strsize;
+	if (st_replace(path, iov, 4))
+		n = (unsigned int)-1;
+	ng_free(buf);
+	return (int)n;
+}
+
+/* Reads the owner and counters of a record into e - the file name is left
+ * out, as the race summary has no use for it.
+ */
+static void
+racedata_pentry(int fd, const RACEDATA_HEAD *rh, const RACEDATA *rd, RACEENTRY *e)
+{
+	char		buf[24 + 24 + 1];
+	size_t		l;
+
+	bzero(e, sizeof(RACEENTRY));
+	racedata_pstr(fd, rh, rd->owner, buf, sizeof(buf));
+	l = strlen(buf) + 1;
+	strlcpy(e->uname, buf, sizeof(e->uname));
+	strlcpy(e->group, l < sizeof(buf) ? buf + l : "", sizeof(e->group));
+	e->status = rd->status;
+	e->size = rd->size;
+	e->speed = rd->speed;
+	e->start_time = rd->start_time;
+	e->crc32 = rd->crc32;
+}
+
+/* The race summary lives after HEADDATA in the headdata file next to the
+ * racedata file.
+ */
+static void
+race_summary_path(const char *racepath, char *buf, size_t len)
+{
+	const char	*p = strrchr(racepath, '/');
+
+	if (p)
+		snprintf(buf, len, "%.*s/headdata", (int)(p - racepath), racepath);
+	else
+		strlcpy(buf, "headdata", len);
+}
+
+static void
+race_summary_init(RACESUMMARY *s, unsigned int gen)
+{
+	bzero(&s->h, sizeof(RACESUMMARY_HEAD));
+	s->h.magic = RACESUMMARY_MAGIC;
+	s->h.gen = gen;
+	s->h.first = s->h.fastest_rec = s->h.slowest_rec = RACESUMMARY_NONE;
+	s->h.slowest_speed = UINT64_MAX;
+}
+
+/* Reads the race summary of racepath. Returns 0 if it is there and
+ * matches gen, -1 otherwise.
+ */
+static int
+race_summary_read(const char *racepath, unsigned int gen, RACESUMMARY *s)
+{
+	int		fd;
+	ssize_t		n = -1;
+	char		path[PATH_MAX];
+
+	race_summary_path(racepath, path, sizeof(path));
+	if ((fd = st_open(path, O_RDONLY, 0)) == -1)
+		return -1;
+	if (st_pread(fd, &s->h, sizeof(RACESUMMARY_HEAD), sizeof(HEADDATA)) == sizeof(RACESUMMARY_HEAD) &&
+	    s->h.magic == RACESUMMARY_MAGIC && s->h.gen == gen &&
+	    s->h.users <= RACESUMMARY_MAX && s->h.groups <= RACESUMMARY_MAX &&
+	    st_pread(fd, s->user, s->h.users * sizeof(RACESUMMARY_ENTRY), sizeof(HEADDATA) + sizeof(RACESUMMARY_HEAD)) == (ssize_t)(s->h.users * sizeof(RACESUMMARY_ENTRY)))
+		n = st_pread(fd, s->group, s->h.groups * sizeof(RACESUMMARY_ENTRY),
+			  sizeof(HEADDATA) + sizeof(RACESUMMARY_HEAD) + s->h.users * sizeof(RACESUMMARY_ENTRY));
+	st_close(fd);
+	return n == (ssize_t)(s->h.groups * sizeof(RACESUMMARY_ENTRY)) ? 0 : -1;
+}
+
+static void
+race_summary_write(const char *racepath, const RACESUMMARY *s)
+{
+	int		fd;
+	char		path[PATH_MAX];
+	size_t		len = sizeof(RACESUMMARY_HEAD) + s->h.users * sizeof(RACESUMMARY_ENTRY);
+
+	race_summary_path(racepath, path, sizeof(path));
+	if ((fd = st_open(path, O_WRONLY, 0)) == -1) {
+		d_log("race_summary_write: open(%s): %s\n", path, strerror(errno));
+		return;
+	}
+	/* the head and users are next to each other in s as well */
+	if (journal_pwrite(path, fd, &s->h, len, sizeof(HEADDATA)) != (ssize_t)len ||
+	    journal_pwrite(path, fd, s->group, s->h.groups * sizeof(RACESUMMARY_ENTRY), sizeof(HEADDATA) + len) != (ssize_t)(s->h.groups * sizeof(RACESUMMARY_ENTRY)))
+		d_log("race_summary_write: write failed: %s\n", strerror(errno));
+	st_close(fd);
+}
+
+static int
+race_summary_user(const RACESUMMARY *s, const char *uname)
+{
+	unsigned int	n;
+
+	for (n = 0; n < s->h.users; n++)
+		if (!strncmp(s->user[n].name, uname, 24))
+			return (int)n;
+	return -1;
+}
+
+/* Adds record n to the summary, the way readrace() would count it. Returns
+ * -1 if the summary can't follow - a new user showing up before the last
+ * counted record would change the order users are listed in.
+ */
+static int
+race_summary_add(RACESUMMARY *s, unsigned int n, const RACEENTRY *e)
+{
+	int		u;
+	unsigned int	g;
+
+	switch (e->status) {
+		case F_NOTCHECKED:
+		case F_CHECKED:
+			break;
+		case F_BAD:
+			s->h.files_bad++;
+			s->h.bad_size += e->size;
+			return 0;
+		case F_NFO:
+			s->h.nfo++;
+			return 0;
+		default:
+			return 0;
+	}
+
+	if (s->h.first != RACESUMMARY_NONE && n < s->h.first)
+		return -1;
+	if ((u = race_summary_user(s, e->uname)) == -1) {
+		if ((s->h.first != RACESUMMARY_NONE && n < s->h.last) || s->h.users >= RACESUMMARY_MAX)
+			return -1;
+		for (g = 0; g < s->h.groups && strncmp(s->group[g].name, e->group, 24); g++);
+		if (g == s->h.groups) {
+			if (s->h.groups >= RACESUMMARY_MAX)
+				return -1;
+			bzero(&s->group[g], sizeof(RACESUMMARY_ENTRY));
+			memcpy(s->group[g].name, e->group, 24);
+			s->h.groups++;
+		}
+		u = (int)s->h.users++;
+		bzero(&s->user[u], sizeof(RACESUMMARY_ENTRY));
+		memcpy(s->user[u].name, e->uname, 24);
+		s->user[u].group = g;
+		s->user[u].first = n;
+	} else if (n < s->user[u].first)
+		return -1;
+
+	if (s->h.first == RACESUMMARY_NONE) {
+		s->h.first = n;
+		s->h.start_time = (uint32_t)e->start_time;
+	}
+	if (n > s->h.last || s->h.files == 0)
+		s->h.last = n;
+
+	s->user[u].bytes += e->size;
+	s->user[u].speed += e->speed;
+	s->user[u].files++;
+	g = s->user[u].group;
+	s->group[g].bytes += e->size;
+	s->group[g].speed += e->speed;
+	s->group[g].files++;
+	s->h.size += e->size;
+	s->h.speed += e->speed;
+	s->h.files++;
+
+	/* ties go to the earliest record, as in updatestats() */
+	if (e->speed > s->h.fastest_speed || (e->speed == s->h.fastest_speed && s->h.fastest_rec != RACESUMMARY_NONE && n < s->h.fastest_rec)) {
+		s->h.fastest_speed = e->speed;
+		s->h.fastest_rec = n;
+		s->h.fastest_user = (uint32_t)u;
+	}
+	if (e->speed < s->h.slowest_speed || (e->speed == s->h.slowest_speed && s->h.slowest_rec != RACESUMMARY_NONE && n < s->h.slowest_rec)) {
+		s->h.slowest_speed = e->speed;
+		s->h.slowest_rec = n;
+		s->h.slowest_user = (uint32_t)u;
+	}
+	return 0;
+}
+
+/* Takes record n out of the summary. Returns -1 if the summary can't
+ * follow, i.e. if n held the first record of a user or the release, or
+ * the fastest or slowest upload.
+ */
+static int
+race_summary_del(RACESUMMARY *s, unsigned int n, const RACEENTRY *e)
+{
+	int		u;
+	unsigned int	g;
+
+	switch (e->status) {
+		case F_NOTCHECKED:
+		case F_CHECKED:
+			break;
+		case F_BAD:
+			s->h.files_bad--;
+			s->h.bad_size -= e->size;
+			return 0;
+		case F_NFO:
+			s->h.nfo--;
+			return 0;
+		default:
+			return 0;
+	}
+
+	if ((u = race_summary_user(s, e->uname)) == -1 || n == s->user[u].first ||
+	    n == s->h.first || n == s->h.fastest_rec || n == s->h.slowest_rec)
+		return -1;
+
+	s->user[u].bytes -= e->size;
+	s->user[u].speed -= e->speed;
+	s->user[u].files--;
+	g = s->user[u].group;
+	s->group[g].bytes -= e->size;
+	s->group[g].speed -= e->speed;
+	s->group[g].files--;
+	s->h.size -= e->size;
+	s->h.speed -= e->speed;
+	s->h.files--;
+	return 0;
+}
+
+/* Writes ents as a new sfvdata file. Returns 0 on success. */
+int
+sfvdata_create(const char *path, const SFVENTRY *ents, unsigned int count)
+{
+	int		ret;
+	unsigned int	n;
+	SFVDATA_HEAD	sh;
+	SFVDATA		*recs;
+	STRTAB		st;
+	struct iovec	iov[3];
+
+	bzero(&sh, sizeof(SFVDATA_HEAD));
+	sh.magic = SFVDATA_MAGIC;
+	sh.count = count;
+
+	recs = ng_realloc2(NULL, (count ? count : 1) * sizeof(SFVDATA), 1, 1, 1);
+	bzero(&st, sizeof(STRTAB));
+	strtab_add(&st, "", NULL);
+	for (n = 0; n < count; n++) {
+		recs[n].crc32 = ents[n].crc32;
+		recs[n].fname = strtab_add(&st, ents[n].fname, NULL);
+	}
+	sh.strsize = st.len;
+
+	iov[0].iov_base = &sh;
+	iov[0].iov_len = sizeof(SFVDATA_HEAD);
+	iov[1].iov_base = recs;
+	iov[1].iov_len = count * sizeof(SFVDATA);
+	iov[2].iov_base = st.buf;
+	iov[2].iov_len = st.len;
+	ret = st_replace(path, iov, 3);
+
+	ng_free(recs);
+	ng_free(st.buf);
+	return ret;
+}
+
+/* Converts a sfvdata file of sfv_version 18 and older (just SFVENTRY
+ * records) to the current layout.
+ * Returns 1 if it was converted, 0 if there was nothing to do, -1 on error.
+ */
+static int
+sfvdata_upgrade(const char *path)
+{
+	int		fd, ret;
+	struct stat	st;
+	SFVENTRY	*ents;
+	unsigned int	magic = 0;
+
+	if ((fd = st_open(path, O_RDONLY, 0)) == -1)
+		return errno == ENOENT ? 0 : -1;
+	if (st_fstat(fd, &st) == -1 || !st.st_size || st.st_size % sizeof(SFVENTRY) ||
+	    (st_pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == SFVDATA_MAGIC)) {
+		st_close(fd);
+		return 0;
+	}
+	ents = ng_realloc2(NULL, st.st_size, 0, 1, 1);
+	if (st_pread(fd, ents, st.st_size, 0) != st.st_size) {
+		d_log("sfvdata_upgrade: read(%s) failed: %s\n", path, strerror(errno));
+		st_close(fd);
+		ng_free(ents);
+		return -1;
+	}
+	st_close(fd);
+
+	ret = sfvdata_create(path, ents, (unsigned int)(st.st_size / sizeof(SFVENTRY)));
+	d_log("sfvdata_upgrade: converted %u records in %s (%s)\n", (unsigned int)(st.st_size / sizeof(SFVENTRY)), path, ret ? "failed" : "ok");
+	ng_free(ents);
+	return ret ? -1 : 1;
+}
+
+/* Maps path read-only into it. Returns 0, or -1 on error. */
+static int
+rec_map(RECITER *it, const char *path, size_t recsize)
+{
+	bzero(it, sizeof(RECITER));
+	it->recsize = recsize;
+	it->str = "";
+	return st_map(path, &it->map, &it->len);
+}
+
+/* Checks that the records and string table described by the head fit in
+ * the mapping, and points it at them. Returns 0, or -1 if they don't.
+ */
+static int
+rec_setup(RECITER *it, size_t recoff, unsigned int count, size_t stroff, unsigned int strsize)
+{
+	if (recoff + (size_t)count * it->recsize > it->len || stroff < recoff + (size_t)count * it->recsize ||
+	    !strsize || stroff + strsize > it->len || ((const char *)it->map)[stroff + strsize - 1])
+		return -1;
+	it->rec = (const char *)it->map + recoff;
+	it->count = count;
+	it->str = (const char *)it->map + stroff;
+	it->strsize = strsize;
+	return 0;
+}
+
+/* Opens the records of a racedata file for reading with rec_next(). Removed
+ * entries are returned too, and have fname 0. Files in an older layout are
+ * converted first. Returns 0, or -1 on error.
+ */
+int
+racedata_iter_open(RECITER *it, const char *path)
+{
+	const RACEDATA_HEAD	*rh;
+
+	if (rec_map(it, path, sizeof(RACEDATA)) == -1)
+		return -1;
+	if (!it->len)
+		return 0;
+
+	rh = it->map;
+	if (it->len < sizeof(RACEDATA_HEAD) || rh->magic != RACEDATA_MAGIC) {
+		rec_close(it);
+		if (racedata_upgrade(path) == 1)
+			return racedata_iter_open(it, path);
+	} else if (rh->buckets && !(rh->buckets & (rh->buckets - 1)) && rh->count <= rh->capacity &&
+		   !rec_setup(it, RACEDATA_OFFSET(rh, 0), rh->count, RACEDATA_STRINGS(rh), rh->strsize))
+		return 0;
+	else
+		rec_close(it);
+
+	d_log("racedata_iter_open: %s is not a valid racedata file\n", path);
+	errno = EINVAL;
+	return -1;
+}
+
+/* Opens the records of a sfvdata file for reading with rec_next(). Files
+ * in an older layout are converted first. Returns 0, or -1 on error.
+ */
+int
+sfvdata_iter_open(RECITER *it, const char *path)
+{
+	const SFVDATA_HEAD	*sh;
+
+	if (rec_map(it, path, sizeof(SFVDATA)) == -1)
+		return -1;
+	if (!it->len)
+		return 0;
+
+	sh = it->map;
+	if (it->len < sizeof(SFVDATA_HEAD) || sh->magic != SFVDATA_MAGIC) {
+		rec_close(it);
+		if (sfvdata_upgrade(path) == 1)
+			return sfvdata_iter_open(it, path);
+	} else if (!rec_setup(it, sizeof(SFVDATA_HEAD), sh->count, sizeof(SFVDATA_HEAD) + (size_t)sh->count * sizeof(SFVDATA), sh->strsize))
+		return 0;
+	else
+		rec_close(it);
+
+	d_log("sfvdata_iter_open: %s is not a valid sfvdata file\n", path);
+	errno = EINVAL;
+	return -1;
+}
+
+/* Returns the next record, or NULL at the end. The record number of the
+ * last one returned is it->pos - 1.
+ */
+const void *
+rec_next(RECITER *it)
+{
+	if (it->pos >= it->count)
+		return NULL;
+	return it->rec + (size_t)it->pos++ * it->recsize;
+}
+
+/* Returns the string at off in the string table. */
+const char *
+rec_str(const RECITER *it, unsigned int off)
+{
+	return off < it->strsize ? it->str + off : "";
+}
+
+/* Expands a racedata record returned by rec_next() into e. */
+void
+racedata_entry(const RECITER *it, const RACEDATA *rd, RACEENTRY *e)
+{
+	racedata_expand(rd, it->str, it->strsize, e);
+}
+
+void
+rec_close(RECITER *it)
+{
+	if (it->map)
+		st_unmap(it->map, it->len);
+	bzero(it, sizeof(RECITER));
+}
+
 /*
  * Modified	: 2002.01.16	Author	: Dark0n3
  * Modified	: 2011.08.10	by	: Sked
@@ -77,19 +1075,20 @@ unsigned int
 readsfv(const char *path, struct VARS *raceI, int getfcount)
 {
 	unsigned int	crc = 0;
-	FILE		*sfvfile;
-	DIR		*dir;
+	DIRSNAP		*dir;
+	RECITER		it;
 
-	SFVDATA		sd;
+	const SFVDATA	*sd;
+	const char	*fname;
 
-	if (!(sfvfile = fopen(path, "r"))) {
+	if (sfvdata_iter_open(&it, path) == -1) {
 		d_log("readsfv: Failed to open sfv (%s): %s\n", path, strerror(errno));
 		return 0;
 	}
 
 	if (!update_lock(raceI, 1, 0)) {
 		d_log("readsfv: Lock is suggested removed. Will comply and exit\n");
-		fclose(sfvfile);
+		rec_close(&it);
 		remove_lock(raceI);
 		exit(EXIT_FAILURE);
 	}
@@ -98,25 +1097,26 @@ readsfv(const char *path, struct VARS *raceI, int getfcount)
 
 	d_log("readsfv: Reading data from sfv for (%s)\n", raceI->file.name);
 
-	dir = opendir(".");
+	dir = dirsnap_open(".");
 
 	raceI->total.files = 0;
 
-	while (fread(&sd, sizeof(SFVDATA), 1, sfvfile)) {
+	while ((sd = rec_next(&it))) {
 		raceI->total.files++;
 
-		if (lenient_compare(raceI->file.name, sd.fname)) {
-			d_log("readsfv: crc read from sfv-file (%s): %.8x\n", sd.fname, (unsigned int)sd.crc32);
-			crc = (unsigned int)sd.crc32;
-			strncpy(raceI->file.unlink, sd.fname, sizeof(raceI->file.unlink));
+		fname = rec_str(&it, sd->fname);
+		if (lenient_compare(raceI->file.name, (char *)fname)) {
+			d_log("readsfv: crc read from sfv-file (%s): %.8x\n", fname, (unsigned int)sd->crc32);
+			crc = (unsigned int)sd->crc32;
+			strncpy(raceI->file.unlink, fname, sizeof(raceI->file.unlink));
 		}
 
-		if (getfcount && findfile(dir, sd.fname))
+		if (getfcount && dir && findfile(dir, (char *)fname))
 			raceI->total.files_missing--;
 	}
 
-	closedir(dir);
-	fclose(sfvfile);
+	dirsnap_close(dir);
+	rec_close(&it);
 
 	raceI->total.files_missing += raceI->total.files;
 
@@ -135,20 +1135,23 @@ readsfv(const char *path, struct VARS *raceI, int getfcount)
 char *
 get_first_filename_from_sfvdata(const char *sfvdatafile)
 {
-	char	*firstfile;
-	FILE	*sfvfile;
-	SFVDATA	sd;
+	char		*firstfile;
+	const char	*fname = "";
+	RECITER		it;
 
-	if (!(sfvfile = fopen(sfvdatafile, "r"))) {
+	const SFVDATA	*sd;
+
+	if (sfvdata_iter_open(&it, sfvdatafile) == -1) {
 		d_log("readsfv: Failed to open sfv (%s): %s\n", sfvdatafile, strerror(errno));
 		return 0;
 	}
 
-	fread(&sd, sizeof(SFVDATA), 1, sfvfile);
-	fclose(sfvfile);
+	if ((sd = rec_next(&it)))
+		fname = rec_str(&it, sd->fname);
 
-	firstfile = ng_realloc2(firstfile, (strlen(sd.fname) + 1), 0, 1, 1);
-	strcpy(firstfile, sd.fname);
+	firstfile = ng_realloc2(NULL, (strlen(fname) + 1), 0, 1, 1);
+	strcpy(firstfile, fname);
+	rec_close(&it);
 
 	return firstfile;
 }
@@ -156,29 +1159,28 @@ get_first_filename_from_sfvdata(const char *sfvdatafile)
 void
 update_sfvdata(const char *path, const char *fname, const unsigned int crc)
 {
-	int		fd, count;
+	int		fd;
+	RECITER		it;
 
-	SFVDATA		sd;
+	const SFVDATA	*sd;
+	uint32_t	crc32 = crc;
 
-	if ((fd = open(path, O_RDWR, 0666)) == -1) {
+	if (sfvdata_iter_open(&it, path) == -1 || (fd = st_open(path, O_WRONLY, 0)) == -1) {
 		d_log("update_sfvdata: Failed to open sfvdata (%s): %s\n", path, strerror(errno));
+		rec_close(&it);
 		return;
 	}
 
-	sd.crc32 = crc;
-	count = 0;
-	while (read(fd, &sd, sizeof(SFVDATA))) {
-		if (!strcasecmp(fname, sd.fname)) {
-			sd.crc32 = crc;
+	while ((sd = rec_next(&it)))
+		if (!strcasecmp(fname, rec_str(&it, sd->fname)))
 			break;
-		}
-		count++;
-	}
 
-	lseek(fd, sizeof(SFVDATA) * count, SEEK_SET);
-	if (write(fd, &sd, sizeof(SFVDATA)) != sizeof(SFVDATA))
+	if (!sd)
+		d_log("update_sfvdata: %s not found in sfvdata\n", fname);
+	else if (journal_pwrite(path, fd, &crc32, sizeof(crc32), (const char *)&sd->crc32 - (const char *)it.map) != sizeof(crc32))
 		d_log("update_sfvdata: write failed: %s\n", strerror(errno));
-	close(fd);
+	st_close(fd);
+	rec_close(&it);
 }
 
 /*
@@ -190,26 +1192,31 @@ void
 delete_sfv(const char *path, struct VARS *raceI)
 {
 	char		*f = 0, missing_fname[NAME_MAX];
-	FILE		*sfvfile;
+	DIRSNAP		*dir;
+	RECITER		it;
 
-	SFVDATA		sd;
+	const SFVDATA	*sd;
 
-	if (!(sfvfile = fopen(path, "r"))) {
-		d_log("delete_sfv: Couldn't fopen %s: %s\n", path, strerror(errno));
+	if (sfvdata_iter_open(&it, path) == -1) {
+		d_log("delete_sfv: Couldn't open %s: %s\n", path, strerror(errno));
 		remove_lock(raceI);
 		exit(EXIT_FAILURE);
 	}
 
-	while (fread(&sd, sizeof(SFVDATA), 1, sfvfile)) {
-		snprintf(missing_fname, NAME_MAX, "%s-missing", sd.fname);
+	/* keeps "." open, so findfilename() asks the same snapshot every time */
+	dir = dirsnap_open(".");
+	while ((sd = rec_next(&it))) {
+		snprintf(missing_fname, NAME_MAX, "%s-missing", rec_str(&it, sd->fname));
 		if ((f = findfilename(missing_fname, f, raceI)))
                 {
 			if (unlink(missing_fname) < 0)
                             d_log("delete_sfv: Couldn't unlink missing-indicator '%s': %s\n", missing_fname, strerror(errno));
                 }
 	}
+	dirsnap_changed();
+	dirsnap_close(dir);
 	ng_free(f);
-	fclose(sfvfile);
+	rec_close(&it);
 }
 
 /*
@@ -225,33 +1232,162 @@ read_write_leader(const char *path, struct VARS *raceI, struct USERINFO *userI)
 	int		fd;
 	struct stat	sb;
 
-	if ((fd = open(path, O_CREAT | O_RDWR, 0666)) == -1) {
+	if ((fd = st_open(path, O_CREAT | O_RDWR, 0666)) == -1) {
 		d_log("read_write_leader: open(%s): %s\n", path, strerror(errno));
 		return;
 	}
 
 	if (!update_lock(raceI, 1, 0)) {
 		d_log("read_write_leader: Lock is suggested removed. Will comply and exit\n");
-		close(fd);
+		st_close(fd);
 		remove_lock(raceI);
 		exit(EXIT_FAILURE);
 	}
 
-	fstat(fd, &sb);
+	st_fstat(fd, &sb);
 
 	if (sb.st_size == 0) {
 		*raceI->misc.old_leader = '\0';
 	} else {
-		if (read(fd, &raceI->misc.old_leader, 24) == -1) {
+		if (st_pread(fd, &raceI->misc.old_leader, 24, 0) == -1) {
 			d_log("read_write_leader: read() failed: %s\n", strerror(errno));
 		}
-		lseek(fd, 0L, SEEK_SET);
 	}
 
-	if (write(fd, userI->name, 24) != 24)
+	if (st_pwrite(fd, userI->name, 24, 0) != 24)
 		d_log("read_write_leader: write failed: %s\n", strerror(errno));
 
-	close(fd);
+	st_close(fd);
+}
+
+/* Small open addressed string table used by testfiles() for the sfvdata
+ * entries (keyed by lenient name) and for its directory snapshot.
+ */
+typedef struct {
+	char		*names;		/* all keys, NUL separated */
+	unsigned int	*slot;		/* offset + 1 into names, 0 if empty */
+	unsigned int	*crc;
+	unsigned int	mask, used;
+	size_t		len, size;
+} NAMEMAP;
+
+static void
+namemap_init(NAMEMAP *m, unsigned int count)
+{
+	unsigned int	cap = 64;
+
+	while (cap < count * 2)
+		cap <<= 1;
+	m->slot = ng_realloc2(NULL, cap * sizeof(unsigned int), 1, 1, 1);
+	m->crc = ng_realloc2(NULL, cap * sizeof(unsigned int), 1, 1, 1);
+	m->mask = cap - 1;
+	m->used = 0;
+	m->size = count * 32 + 256;
+	m->names = ng_realloc2(NULL, m->size, 0, 1, 1);
+	m->len = 0;
+}
+
+static void
+namemap_free(NAMEMAP *m)
+{
+	m->names = ng_free(m->names);
+	m->slot = ng_free(m->slot);
+	m->crc = ng_free(m->crc);
+}
+
+/* Returns the bucket holding key, or -(free bucket) - 1 if it's not there. */
+static int
+namemap_find(NAMEMAP *m, const char *key)
+{
+	unsigned int	i = racedata_hash(key) & m->mask;
+
+	while (m->slot[i]) {
+		if (!strcmp(m->names + m->slot[i] - 1, key))
+			return i;
+		i = (i + 1) & m->mask;
+	}
+	return -(int)i - 1;
+}
+
+static void
+namemap_add(NAMEMAP *m, const char *key, unsigned int crc)
+{
+	int		i;
+	unsigned int	n, *oslot, *ocrc, omask;
+	size_t		klen = strlen(key) + 1;
+
+	if ((m->used + 1) * 2 > m->mask + 1) {
+		oslot = m->slot;
+		ocrc = m->crc;
+		omask = m->mask;
+		m->slot = ng_realloc2(NULL, (omask + 1) * 2 * sizeof(unsigned int), 1, 1, 1);
+		m->crc = ng_realloc2(NULL, (omask + 1) * 2 * sizeof(unsigned int), 1, 1, 1);
+		m->mask = omask * 2 + 1;
+		for (n = 0; n <= omask; n++) {
+			if (!oslot[n])
+				continue;
+			i = -namemap_find(m, m->names + oslot[n] - 1) - 1;
+			m->slot[i] = oslot[n];
+			m->crc[i] = ocrc[n];
+		}
+		ng_free(oslot);
+		ng_free(ocrc);
+	}
+	if ((i = namemap_find(m, key)) < 0) {
+		i = -i - 1;
+		if (m->len + klen > m->size) {
+			m->size = (m->len + klen) * 2;
+			m->names = ng_realloc2(m->names, m->size, 0, 1, 0);
+		}
+		memcpy(m->names + m->len, key, klen);
+		m->slot[i] = m->len + 1;
+		m->len += klen;
+		m->used++;
+	}
+	m->crc[i] = crc;
+}
+
+/* Folds name the same way lenient_compare() does, so that equal keys mean
+ * lenient_compare() would have matched the names.
+ */
+static void
+lenient_key(const char *name, char *key, size_t len)
+{
+	size_t		n;
+
+	for (n = 0; name[n] && n < len - 1; n++) {
+		key[n] = name[n];
+#if (sfv_cleanup_lowercase)
+		key[n] = tolower((unsigned char)key[n]);
+#endif
+#if (sfv_lenient)
+		if (strchr(" ,.-_", key[n]))
+			key[n] = '*';
+#endif
+	}
+	key[n] = '\0';
+}
+
+/* Loads sfvdata into m, keyed by lenient name. Returns the entry count or -1. */
+static int
+namemap_load_sfv(NAMEMAP *m, const char *path)
+{
+	int		count = 0;
+	char		key[NAME_MAX];
+	RECITER		it;
+
+	const SFVDATA	*sd;
+
+	if (sfvdata_iter_open(&it, path) == -1)
+		return -1;
+	namemap_init(m, it.count);
+	while ((sd = rec_next(&it))) {
+		lenient_key(rec_str(&it, sd->fname), key, sizeof(key));
+		namemap_add(m, key, (unsigned int)sd->crc32);
+		count++;
+	}
+	rec_close(&it);
+	return count;
 }
 
 /*
@@ -264,52 +1400,65 @@ read_write_leader(const char *path, struct VARS *raceI, struct USERINFO *userI)
 void
 testfiles(struct LOCATIONS *locations, struct VARS *raceI, int rstatus)
 {
-	int		fd, lret, count;
-	char		*ext, target[PATH_MAX], real_file[PATH_MAX];
-	FILE		*racefile;
+	int		fd, count, nents, n, i;
+	char		*ext, target[PATH_MAX], key[NAME_MAX];
 	unsigned int	Tcrc;
+	uint32_t	status;
 	struct stat	filestat;
 	time_t		timenow;
-	RACEDATA	rd;
+	RACEENTRY	rd, *ents;
+	RACEDATA_HEAD	rh;
+	NAMEMAP		sfv;
+	DIRSNAP		*dir;
 
 	/* create if it doesn't exist yet and don't truncate if it does */
-	if ((fd = open(locations->race, O_CREAT | O_RDWR, 0666)) == -1) {
-		if (errno != EEXIST) {
-			d_log("testfiles: open(%s): %s\n", locations->race, strerror(errno));
-			remove_lock(raceI);
-			exit(EXIT_FAILURE);
-		}
+	if ((fd = racedata_open(locations->race, O_CREAT | O_RDWR, &rh)) == -1) {
+		d_log("testfiles: open(%s): %s\n", locations->race, strerror(errno));
+		remove_lock(raceI);
+		exit(EXIT_FAILURE);
 	}
-	close(fd);
 
-	if (!(racefile = fopen(locations->race, "r+"))) {
-		d_log("testfiles: fopen(%s) failed\n", locations->race);
+	if ((nents = racedata_read(fd, &rh, &ents, 1)) == -1) {
+		d_log("testfiles: read(%s) failed\n", locations->race);
+		st_close(fd);
 		remove_lock(raceI);
 		exit(EXIT_FAILURE);
 	}
 
-	strlcpy(real_file, raceI->file.name, sizeof(real_file));
+	/* read sfvdata and the directory once, instead of once per file */
+	if (namemap_load_sfv(&sfv, locations->sfv) == -1) {
+		d_log("testfiles: Failed to open sfv (%s): %s\n", locations->sfv, strerror(errno));
+		namemap_init(&sfv, 0);
+	}
+	if (!(dir = dirsnap_open(".")))
+		d_log("testfiles: opendir(.): %s\n", strerror(errno));
+	raceI->misc.release_type = raceI->data_type;
 
 	if (rstatus)
 		printf("\n");
 
 	count = 0;
-	rd.status = F_NOTCHECKED;
-	while ((fread(&rd, sizeof(RACEDATA), 1, racefile))) {
+	while (count < nents) {
+		rd = ents[count];
 		if (!update_lock(raceI, 1, 0)) {
 			d_log("testfiles: Lock is suggested removed. Will comply and exit\n");
-			fclose(racefile);
+			st_close(fd);
 			remove_lock(raceI);
 			exit(EXIT_FAILURE);
 		}
+		if (!*rd.fname) {	/* removed entry */
+			++count;
+			continue;
+		}
 		ext = find_last_of(rd.fname, ".");
 		if (*ext == '.')
 			ext++;
-		strlcpy(raceI->file.name, rd.fname, NAME_MAX);
-		Tcrc = readsfv(locations->sfv, raceI, 0);
+		lenient_key(rd.fname, key, sizeof(key));
+		Tcrc = (n = namemap_find(&sfv, key)) >= 0 ? sfv.crc[n] : 0;
 		timenow = time(NULL);
-		stat(rd.fname, &filestat);
-		if (fileexists(rd.fname)) {
+		bzero(&filestat, sizeof(filestat));
+		if (dir && (i = dirsnap_find(dir, rd.fname, DIRSNAP_EXACT, -1)) != -1 &&
+		    !dirsnap_stat(dir, (unsigned int)i, DW_MODE | DW_TIMES, &filestat)) {
 			d_log("testfiles: Processing %s\n", rd.fname);
 			if (S_ISDIR(filestat.st_mode))
 				rd.status = F_IGNORED;
@@ -330,7 +1479,8 @@ testfiles(struct LOCATIONS *locations, struct VARS *raceI, int rstatus)
 				rd.status = F_IGNORED;
 				create_missing(rd.fname);
 			}
-		} else if (snprintf(target, sizeof(target), "%s.bad", rd.fname) > 4 && fileexists(target)) {
+		} else if (snprintf(target, sizeof(target), "%s.bad", rd.fname) > 4 && dir &&
+			   dirsnap_find(dir, target, DIRSNAP_EXACT, -1) != -1) {
        	                d_log("testfiles: File doesnt exist (%s), bad version of it does, keeping it marked as bad.\n", rd.fname);
 			rd.status = F_BAD;
 			if (rstatus)
@@ -341,7 +1491,6 @@ testfiles(struct LOCATIONS *locations, struct VARS *raceI, int rstatus)
 			if (rstatus)
 				printf("File: %s MISSING!\n", rd.fname);
 			remove_from_race(locations->race, rd.fname, raceI);
-			--count;
 		}
 
 		if (rd.status == F_MISSING || rd.status == F_NOTCHECKED) {
@@ -364,24 +1513,18 @@ testfiles(struct LOCATIONS *locations, struct VARS *raceI, int rstatus)
 			if (!fileexists(unduper_script)) {
 				d_log("Failed to undupe '%s' - '%s' does not exist.\n", rd.fname, unduper_script);
 			} else {
-				sprintf(target, unduper_script " \"%s\"", rd.fname);
 				_err_file_banned(rd.fname, NULL);
-				if (execute(target) == 0)
-					d_log("testfiles: undupe of %s successful (%s).\n", rd.fname, target);
+				if (run_cmd(unduper_script, rd.fname, NULL, NULL) == 0)
+					d_log("testfiles: undupe of %s successful (%s).\n", rd.fname, unduper_script);
 				else
-					d_log("testfiles: undupe of %s failed (%s).\n", rd.fname, target);
+					d_log("testfiles: undupe of %s failed (%s).\n", rd.fname, unduper_script);
 			}
 #endif
 		}
 
 		if (rd.status != F_MISSING) {
-			if ((lret = fseek(racefile, sizeof(RACEDATA) * count, SEEK_SET)) == -1) {
-				d_log("testfiles: fseek: %s\n", strerror(errno));
-				fclose(racefile);
-				remove_lock(raceI);
-				exit(EXIT_FAILURE);
-			}
-			if (fwrite(&rd, sizeof(RACEDATA), 1, racefile) == 0)
+			status = rd.status;
+			if (journal_pwrite(locations->race, fd, &status, sizeof(status), RACEDATA_OFFSET(&rh, count) + offsetof(RACEDATA, status)) != sizeof(status))
 				d_log("testfiles: write failed: %s\n", strerror(errno));
 
 			if (rd.status != F_BAD && !((timenow == filestat.st_ctime) && (filestat.st_mode & 0111)))
@@ -389,9 +1532,19 @@ testfiles(struct LOCATIONS *locations, struct VARS *raceI, int rstatus)
 		}
 		++count;
 	}
-	strlcpy(raceI->file.name, real_file, strlen(real_file)+1);
+	/* statuses changed - the race summary has to be rebuilt */
+	if (st_pread(fd, &rh, sizeof(RACEDATA_HEAD), 0) == sizeof(RACEDATA_HEAD)) {
+		rh.gen++;
+		if (journal_pwrite(locations->race, fd, &rh, sizeof(RACEDATA_HEAD), 0) != sizeof(RACEDATA_HEAD))
+			d_log("testfiles: write failed: %s\n", strerror(errno));
+	}
 	raceI->total.files = raceI->total.files_missing = 0;
-	fclose(racefile);
+	st_close(fd);
+	ng_free(ents);
+	namemap_free(&sfv);
+	dirsnap_close(dir);
+	/* the missing ones are removed - only now that fd is closed */
+	compact_race(locations->race);
 	d_log("testfiles: finished checking\n");
 }
 
@@ -407,70 +1560,101 @@ testfiles(struct LOCATIONS *locations, struct VARS *raceI, int rstatus)
 int
 copysfv(const char *source, const char *target, struct VARS *raceI)
 {
-	int		outfd, i, retval = 0;
+	int		i, fd, retval = 0;
+	unsigned int	nents = 0, maxents = 0;
 	short int	music, rars, video, others, type;
 
-	char		*ptr, fbuf[2048];
-	FILE		*insfv;
+	char		*ptr, *buf, *line, *eol, *end, fbuf[2048];
+	size_t		n;
+	ssize_t		len;
+	struct stat	st;
 
-	DIR		*dir;
+	DIRSNAP		*dir;
 
-	SFVDATA		sd;
+	SFVENTRY	sd, *ents = NULL;
+	unsigned char	*missing = NULL;
+	NAMEMAP		seen;
 
 //#if ( sfv_dupecheck == TRUE )
 	int		skip = 0;
-	SFVDATA		tempsd;
 //#endif
 
 #if ( sfv_cleanup == TRUE )
 	int		tmpfd;
 	char		crctmp[16];
+	STRTAB		out = { NULL, 0, 0 };	/* what goes to .tmpsfv */
 
 	if ((tmpfd = open(".tmpsfv", O_CREAT | O_TRUNC | O_RDWR, 0644)) == -1)
 		d_log("copysfv: open(.tmpsfv): %s\n", strerror(errno));
 #endif
 
-	if ((insfv = fopen(source, "r")) == NULL) {
-		d_log("copysfv: fopen(%s): %s\n", source, strerror(errno));
+	/* the whole sfv is read at once, and split into lines in memory */
+	buf = NULL;
+	len = -1;
+	if ((fd = open(source, O_RDONLY)) != -1) {
+		if (fstat(fd, &st) != -1) {
+			buf = ng_realloc2(NULL, st.st_size + 1, 0, 1, 1);
+			len = read(fd, buf, st.st_size);
+		}
+		close(fd);
+	}
+	if (len == -1) {
+		d_log("copysfv: read(%s): %s\n", source, strerror(errno));
+		ng_free(buf);
+#if ( sfv_cleanup == TRUE )
+		close(tmpfd);
+		unlink(".tmpsfv");
+#endif
+		remove_lock(raceI);
+		exit(EXIT_FAILURE);
+	}
+
+	if (sfvdata_create(target, NULL, 0)) {
+		d_log("copysfv: create(%s) failed\n", target);
+		ng_free(buf);
 #if ( sfv_cleanup == TRUE )
 		close(tmpfd);
 		unlink(".tmpsfv");
 #endif
+		st_unlink(target);
 		remove_lock(raceI);
 		exit(EXIT_FAILURE);
 	}
 
-	if ((outfd = open(target, O_CREAT | O_TRUNC | O_RDWR, 0666)) == -1) {
-		d_log("copysfv: open(%s): %s\n", target, strerror(errno));
-		fclose(insfv);
+	video = music = rars = others = type = 0;
+
+	if (!(dir = dirsnap_open("."))) {
+		d_log("copysfv: opendir(.): %s\n", strerror(errno));
+		ng_free(buf);
 #if ( sfv_cleanup == TRUE )
 		close(tmpfd);
 		unlink(".tmpsfv");
 #endif
-		unlink(target);
+		st_unlink(target);
 		remove_lock(raceI);
 		exit(EXIT_FAILURE);
 	}
 
-	video = music = rars = others = type = 0;
-
-	dir = opendir(".");
-
 	if (!update_lock(raceI, 1, 0)) {
 		d_log("copysfv: Lock is suggested removed. Will comply and exit\n");
-		fclose(insfv);
-		closedir(dir);
+		ng_free(buf);
+		dirsnap_close(dir);
 #if ( sfv_cleanup == TRUE )
 		close(tmpfd);
 		unlink(".tmpsfv");
 #endif
-		close(outfd);
-		unlink(target);
+		st_unlink(target);
 		remove_lock(raceI);
 		exit(EXIT_FAILURE);
 	}
 
-	while ((fgets(fbuf, sizeof(fbuf), insfv))) {
+	namemap_init(&seen, (unsigned int)(len / 32));
+	for (line = buf, end = buf + len; line < end; line = eol + 1) {
+		if (!(eol = memchr(line, '\n', end - line)))
+			eol = end;
+		n = (size_t)(eol - line) < sizeof(fbuf) ? (size_t)(eol - line) : sizeof(fbuf) - 1;
+		memcpy(fbuf, line, n);
+		fbuf[n] = '\0';
 
 		tailstrip_chars(fbuf, WHITESPACE_STR);
 		ptr = prestrip_chars(fbuf, WHITESPACE_STR);
@@ -481,14 +1665,11 @@ copysfv(const char *source, const char *target, struct VARS *raceI)
 		if ((ptr == find_first_of(ptr, ";"))) {
 #if ( sfv_cleanup == TRUE && sfv_cleanup_comments == FALSE )
 			/* comments can be written away immediately to .tmpsfv */
-			if (write(tmpfd, ptr, strlen(ptr)) != (int)strlen(ptr))
-				d_log("copysfv: write of comment failed: %s\n", strerror(errno));
+			strtab_put(&out, ptr, strlen(ptr));
 #if (sfv_cleanup_crlf == TRUE )
-			if (write(tmpfd, "\r", 1) != 1)
-				d_log("copysfv: write of \\r failed: %s\n", strerror(errno));
+			strtab_put(&out, "\r", 1);
 #endif
-			if (write(tmpfd, "\n", 1) != 1)
-				d_log("copysfv: write of \\n failed: %s\n", strerror(errno));
+			strtab_put(&out, "\n", 1);
 #endif
 			/* clear comment to prevent further processing */
 			*ptr = '\0';
@@ -586,16 +1767,8 @@ copysfv(const char *source, const char *target, struct VARS *raceI)
 
 			if (!strcomp(ignored_types, ptr) && !(strcomp(allowed_types, ptr) && !matchpath(allowed_types_exemption_dirs, raceI->misc.current_path)) && !strcomp("sfv", ptr) && !strcomp("nfo", ptr)) {
 
-				skip = 0;
-//#if ( sfv_dupecheck == TRUE )
-				/* read from sfvdata - no parsing */
-				lseek(outfd, 0L, SEEK_SET);
-				while (read(outfd, &tempsd, sizeof(SFVDATA)))
-//					if (!strcmp(sd.fname, tempsd.fname) || (sd.crc32 == tempsd.crc32 && sd.crc32))
-					if (!strcmp(sd.fname, tempsd.fname))
-						skip = 1;
-
-				lseek(outfd, 0L, SEEK_END);
+				/* check the entries so far - no parsing */
+				skip = namemap_find(&seen, sd.fname) >= 0;
 
 #if ( sfv_dupecheck == TRUE )
 				if (skip)
@@ -605,22 +1778,14 @@ copysfv(const char *source, const char *target, struct VARS *raceI)
 				d_log("copysfv:  File in sfv: '%s' (%x)\n", sd.fname, sd.crc32);
 
 #if ( sfv_cleanup == TRUE )
-				/* write good stuff to .tmpsfv */
-				if (tmpfd != -1) {
-					sprintf(crctmp, "%.8x", sd.crc32);
-					if (write(tmpfd, sd.fname, strlen(sd.fname)) != (int)strlen(sd.fname))
-						d_log("copysfv: write failed: %s\n", strerror(errno));
-					if (write(tmpfd, " ", 1) != 1)
-						d_log("copysfv: write failed: %s\n", strerror(errno));
-					if (write(tmpfd, crctmp, 8) != 8)
-						d_log("copysfv: write failed: %s\n", strerror(errno));
+				/* good stuff goes to .tmpsfv */
+				sprintf(crctmp, " %.8x", sd.crc32);
+				strtab_put(&out, sd.fname, strlen(sd.fname));
+				strtab_put(&out, crctmp, 9);
 #if (sfv_cleanup_crlf == TRUE )
-					if (write(tmpfd, "\r", 1) != 1)
-						d_log("copysfv: write failed: %s\n", strerror(errno));
+				strtab_put(&out, "\r", 1);
 #endif
-					if (write(tmpfd, "\n", 1) != 1)
-						d_log("copysfv: write failed: %s\n", strerror(errno));
-				}
+				strtab_put(&out, "\n", 1);
 #endif
 
 				if (strcomp(audio_types, ptr))
@@ -632,13 +1797,21 @@ copysfv(const char *source, const char *target, struct VARS *raceI)
 				else
 					others++;
 
+				if (nents == maxents) {
+					maxents = maxents ? maxents * 2 : 64;
+					ents = ng_realloc2(ents, maxents * sizeof(SFVENTRY), 0, 1, ents == NULL);
+					missing = ng_realloc2(missing, maxents, 0, 1, missing == NULL);
+				}
+				/* the -missing files are made after the loop - making
+				 * them here would have the snapshot read again for
+				 * every entry */
+				missing[nents] = 0;
 #if ( create_missing_files == TRUE )
 				if (!findfile(dir, sd.fname) && !(matchpath(allowed_types_exemption_dirs, raceI->misc.current_path) && strcomp(allowed_types, ptr)))
-					create_missing(sd.fname);
+					missing[nents] = 1;
 #endif
-
-				if (write(outfd, &sd, sizeof(SFVDATA)) != sizeof(SFVDATA))
-					d_log("copysfv: write failed: %s\n", strerror(errno));
+				ents[nents++] = sd;
+				namemap_add(&seen, sd.fname, sd.crc32);
 			}
 		}
 	}
@@ -660,15 +1833,27 @@ END:
 #endif
 #if ( sfv_cleanup == TRUE )
 	if (tmpfd != -1) {
+		if (out.len && write(tmpfd, out.buf, out.len) != (ssize_t)out.len)
+			d_log("copysfv: write failed: %s\n", strerror(errno));
 		close(tmpfd);
 		unlink(source);
 		rename(".tmpsfv", source);
 	}
+	ng_free(out.buf);
 #endif
 
-	closedir(dir);
-	close(outfd);
-	fclose(insfv);
+	for (n = 0; n < nents; n++)
+		if (missing[n])
+			create_missing(ents[n].fname);
+
+	if (sfvdata_create(target, ents, nents))
+		d_log("copysfv: write(%s) failed\n", target);
+	ng_free(ents);
+	ng_free(missing);
+	namemap_free(&seen);
+	ng_free(buf);
+
+	dirsnap_close(dir);
 	if (!update_lock(raceI, 1, type)) {
 		d_log("copysfv: Lock is suggested removed. Will comply and exit\n");
 		remove_lock(raceI);
@@ -678,6 +1863,24 @@ END:
 	return retval;
 }
 
+/* a name in the index create_indexfile() writes, and its place in racedata */
+typedef struct {
+	const char	*name;
+	unsigned int	pos;
+} INDEXNAME;
+
+/* Sorts case-insensitively, names that compare equal in racedata order. */
+static int
+indexname_cmp(const void *a, const void *b)
+{
+	const INDEXNAME	*x = a, *y = b;
+	int		r;
+
+	if ((r = strcasecmp(x->name, y->name)))
+		return r;
+	return x->pos < y->pos ? -1 : 1;
+}
+
 /*
  * Modified	: 01.17.2002 Author	: Dark0n3
  *
@@ -688,15 +1891,15 @@ void
 create_indexfile(const char *racefile, struct VARS *raceI, char *f)
 {
 	int		fd;
-	FILE		*r;
-	int		l, n, m, c;
-	int		pos[raceI->total.files],
-			t_pos[raceI->total.files];
-	char		fname[raceI->total.files][NAME_MAX];
+	unsigned int	c, n, max = raceI->total.files > 0 ? (unsigned int)raceI->total.files : 0;
+	size_t		len = 0;
+	char		*buf, *p;
+	RECITER		it;
+	INDEXNAME	*names;
 
-	RACEDATA	rd;
+	const RACEDATA	*rd;
 
-	if ((fd = open(racefile, O_RDONLY)) == -1) {
+	if (racedata_iter_open(&it, racefile) == -1) {
 		d_log("create_indexfile: open(%s): %s\n", racefile, strerror(errno));
 		remove_lock(raceI);
 		exit(EXIT_FAILURE);
@@ -704,42 +1907,38 @@ create_indexfile(const char *racefile, struct VARS *raceI, char *f)
 
 	if (!update_lock(raceI, 1, 0)) {
 		d_log("create_indexfile: Lock is suggested removed. Will comply and exit\n");
-		close(fd);
+		rec_close(&it);
 		remove_lock(raceI);
 		exit(EXIT_FAILURE);
 	}
 
-	/* Read filenames from race file */
+	/* Read filenames from race file - they are used where they are in the map */
+	names = ng_realloc2(NULL, (max ? max : 1) * sizeof(INDEXNAME), 0, 1, 1);
 	c = 0;
-	while ((read(fd, &rd, sizeof(RACEDATA)))) {
-		if (rd.status == F_CHECKED) {
-			strlcpy(fname[c], rd.fname, NAME_MAX);
-			t_pos[c] = 0;
+	while ((rd = rec_next(&it)) && c < max) {
+		if (rd->fname && rd->status == F_CHECKED) {
+			names[c].name = rec_str(&it, rd->fname);
+			names[c].pos = c;
+			len += strlen(names[c].name) + 1;
 			c++;
 		}
 	}
-	close(fd);
 
-	/* Sort with cache */
-	for (n = 0; n < c; n++) {
-		m = t_pos[n];
-		for (l = n + 1; l < c; l++) {
-			if (strcasecmp(fname[l], fname[n]) < 0)
-				m++;
-			else
-				t_pos[l]++;
-		}
-		pos[m] = n;
-	}
+	qsort(names, c, sizeof(INDEXNAME), indexname_cmp);
 
-	/* Write to file and free memory */
-	if ((r = fopen(f, "w"))) {
-		for (n = 0; n < c; n++) {
-			m = pos[n];
-			fprintf(r, "%s\n", fname[m]);
-		}
-		fclose(r);
-	}
+	/* Write to file in one go */
+	buf = p = ng_realloc2(NULL, len + 1, 0, 1, 1);
+	for (n = 0; n < c; n++)
+		p += sprintf(p, "%s\n", names[n].name);
+	rec_close(&it);
+	if ((fd = open(f, O_CREAT | O_TRUNC | O_WRONLY, 0666)) != -1) {
+		if (write(fd, buf, len) != (ssize_t)len)
+			d_log("create_indexfile: write(%s) failed: %s\n", f, strerror(errno));
+		close(fd);
+	} else
+		d_log("create_indexfile: open(%s): %s\n", f, strerror(errno));
+	ng_free(buf);
+	ng_free(names);
 }
 
 /*
@@ -752,27 +1951,33 @@ create_indexfile(const char *racefile, struct VARS *raceI, char *f)
 short int
 clear_file(const char *path, char *f)
 {
-	int		n = 0, count = 0, retval = -1;
-	FILE           *file;
+	int		fd, pos, n = 0, valid;
+	unsigned int	bucket;
 
 	RACEDATA	rd;
-
-	if ((file = fopen(path, "r+"))) {
-		while (fread(&rd, sizeof(RACEDATA), 1, file)) {
-#if (sfv_cleanup_lowercase)
-			if (sizeof(rd.fname) && strncasecmp(rd.fname, f, NAME_MAX) == 0) {
-#else
-			if (sizeof(rd.fname) && strncmp(rd.fname, f, NAME_MAX) == 0) {
-#endif
-				rd.status = F_DELETED;
-				fseek(file, sizeof(RACEDATA) * count, SEEK_SET);
-				if ((retval = fwrite(&rd, sizeof(RACEDATA), 1, file)) != 1)
-					d_log("clear_file: write failed (%d != %d): %s\n", sizeof(RACEDATA), retval, strerror(errno));
-				n++;
+	RACEDATA_HEAD	rh;
+	RACEENTRY	e;
+	RACESUMMARY	sum;
+
+	if ((fd = racedata_open(path, O_RDWR, &rh)) != -1) {
+		if ((pos = racedata_find(fd, &rh, f, &rd, &bucket)) != -1) {
+			valid = !race_summary_read(path, rh.gen, &sum);
+			if (valid) {
+				racedata_pentry(fd, &rh, &rd, &e);
+				valid = !race_summary_del(&sum, (unsigned int)pos, &e);
+			}
+			rd.status = F_DELETED;
+			rh.gen++;
+			if (journal_pwrite(path, fd, &rd.status, sizeof(rd.status), RACEDATA_OFFSET(&rh, pos) + offsetof(RACEDATA, status)) != sizeof(rd.status) ||
+			    journal_pwrite(path, fd, &rh, sizeof(RACEDATA_HEAD), 0) != sizeof(RACEDATA_HEAD))
+				d_log("clear_file: write failed: %s\n", strerror(errno));
+			else if (valid) {
+				sum.h.gen = rh.gen;
+				race_summary_write(path, &sum);
 			}
-			count++;
+			n++;
 		}
-		fclose(file);
+		st_close(fd);
 	}
 
 	return n;
@@ -787,42 +1992,65 @@ clear_file(const char *path, char *f)
 void
 readrace(const char *path, struct VARS *raceI, struct USERINFO **userI, struct GROUPINFO **groupI)
 {
-	int		fd, rlength = 0;
+	int		valid;
+	RECITER		it;
+	RACEENTRY	e;
+	RACESUMMARY	sum;
 
-	RACEDATA	rd;
-
-	if ((fd = open(path, O_RDONLY)) != -1) {
+	const RACEDATA	*rd;
 
+	if (racedata_iter_open(&it, path) != -1) {
 		if (!update_lock(raceI, 1, 0)) {
 			d_log("readrace: Lock is suggested removed. Will comply and exit\n");
-			close(fd);
+			rec_close(&it);
 			remove_lock(raceI);
 			exit(EXIT_FAILURE);
 		}
 
-		while ((rlength = read(fd, &rd, sizeof(RACEDATA)))) {
-			if (rlength != sizeof(RACEDATA)) {
-				d_log("readrace: Agh! racedata seems to be broken!\n");
-				close(fd);
-				remove_lock(raceI);
-				exit(EXIT_FAILURE);
-			}
-			switch (rd.status) {
+		if (!it.len) {
+			rec_close(&it);
+			return;
+		}
+
+		/* the summary only stands in for an empty set of stats */
+		if (!raceI->total.users && !raceI->total.groups &&
+		    !race_summary_read(path, ((const RACEDATA_HEAD *)it.map)->gen, &sum)) {
+			d_log("readrace: using race summary\n");
+			summarystats(raceI, userI, groupI, &sum);
+			rec_close(&it);
+			return;
+		}
+
+		race_summary_init(&sum, ((const RACEDATA_HEAD *)it.map)->gen);
+		valid = 1;
+		while ((rd = rec_next(&it))) {
+			if (!rd->fname)
+				continue;
+			racedata_entry(&it, rd, &e);
+			if (valid && race_summary_add(&sum, it.pos - 1, &e))
+				valid = 0;
+			switch (rd->status) {
 				case F_NOTCHECKED:
 				case F_CHECKED:
-					updatestats(raceI, userI, groupI, rd.uname, rd.group,
-						    rd.size, (unsigned long)rd.speed, rd.start_time);
+					updatestats(raceI, userI, groupI, e.uname, e.group,
+						    e.size, e.speed, e.start_time);
 					break;
 				case F_BAD:
 					raceI->total.files_bad++;
-					raceI->total.bad_size += rd.size;
+					raceI->total.bad_size += rd->size;
 					break;
 				case F_NFO:
 					raceI->total.nfo_present = 1;
 					break;
 			}
 		}
-		close(fd);
+		rec_close(&it);
+		if (valid)
+			race_summary_write(path, &sum);
+	} else if (errno == EINVAL) {
+		d_log("readrace: Agh! racedata seems to be broken!\n");
+		remove_lock(raceI);
+		exit(EXIT_FAILURE);
 	}
 }
 
@@ -834,305 +2062,636 @@ readrace(const char *path, struct VARS *raceI, struct USERINFO **userI, struct G
 void
 writerace(const char *path, struct VARS *raceI, unsigned int crc, unsigned char status)
 {
-	int		fd, count, ret;
+	int		fd, pos, valid;
+	unsigned int	bucket, owner = 0;
+	char		buf[NAMEMAX];
+	RACEDATA_INDEX	idx;
+	RACEDATA_HEAD	rh;
+	RACEENTRY	e;
+	RACESUMMARY	sum;
 
 	RACEDATA	rd;
 
 	d_log("writerace: writing racedata to file %s\n", path);
 	/* create file if it doesn't exist */
-	if ((fd = open(path, O_CREAT | O_RDWR, 0666)) == -1) {
-		if (errno != EEXIST) {
-			d_log("writerace: open(%s): %s\n", path, strerror(errno));
-			remove_lock(raceI);
-			exit(EXIT_FAILURE);
-		}
+	if ((fd = racedata_open(path, O_CREAT | O_RDWR, &rh)) == -1) {
+		d_log("writerace: open(%s): %s\n", path, strerror(errno));
+		remove_lock(raceI);
+		exit(EXIT_FAILURE);
 	}
 
 	if (!update_lock(raceI, 1, 0)) {
 		d_log("writerace: Lock is suggested removed. Will comply and exit\n");
-		close(fd);
+		st_close(fd);
 		remove_lock(raceI);
 		exit(EXIT_FAILURE);
 	}
 
+	valid = !race_summary_read(path, rh.gen, &sum);
+
 	/* find an existing entry that we will overwrite */
-	count = 0;
-	while ((ret = read(fd, &rd, sizeof(RACEDATA)))) {
-		if (ret == -1) {
-			d_log("writerace: read(%s): %s\n", path, strerror(errno));
-			close(fd);
-			remove_lock(raceI);
-			exit(EXIT_FAILURE);
+	if ((pos = racedata_find(fd, &rh, raceI->file.name, &rd, &bucket)) != -1) {
+		if (valid) {
+			racedata_pentry(fd, &rh, &rd, &e);
+			valid = !race_summary_del(&sum, (unsigned int)pos, &e);
 		}
-#if (sfv_cleanup_lowercase)
-		if (strncasecmp(rd.fname, raceI->file.name, NAME_MAX) == 0) {
-#else
-		if (strncmp(rd.fname, raceI->file.name, NAME_MAX) == 0) {
-#endif
-			lseek(fd, sizeof(RACEDATA) * count, SEEK_SET);
-			break;
+	} else {
+		if (rh.count >= rh.capacity || bucket >= rh.buckets) {
+			/* full - rebuild it with room for more */
+			RACEENTRY	*recs;
+			int		n;
+
+			if ((n = racedata_read(fd, &rh, &recs, 0)) == -1 || racedata_create(path, recs, (unsigned int)n)) {
+				d_log("writerace: failed to grow %s\n", path);
+				free(recs);
+				st_close(fd);
+				remove_lock(raceI);
+				exit(EXIT_FAILURE);
+			}
+			free(recs);
+			st_close(fd);
+			if ((fd = racedata_open(path, O_RDWR, &rh)) == -1) {
+				d_log("writerace: open(%s): %s\n", path, strerror(errno));
+				remove_lock(raceI);
+				exit(EXIT_FAILURE);
+			}
+			racedata_find(fd, &rh, raceI->file.name, &rd, &bucket);
+			valid = 0;	/* records moved */
 		}
-		count++;
-	}
-
-	bzero(&rd, sizeof(RACEDATA));
+		pos = (int)rh.count;
+		rd.fname = rd.owner = 0;
+	}
+	/* reuse the names already in the string table where they match -
+	 * the owner of this entry, or else that of the one before it */
+	if (!rd.fname || strncmp(racedata_pstr(fd, &rh, rd.fname, buf, sizeof(buf)), raceI->file.name, NAMEMAX - 1))
+		rd.fname = racedata_pstr_add(path, fd, &rh, raceI->file.name, NULL);
+	if (rd.owner && racedata_owner_is(fd, &rh, rd.owner, raceI->user.name, raceI->user.group))
+		owner = rd.owner;
+	else if (pos && st_pread(fd, &rd.owner, sizeof(rd.owner), RACEDATA_OFFSET(&rh, pos - 1) + offsetof(RACEDATA, owner)) == sizeof(rd.owner) &&
+		 rd.owner && racedata_owner_is(fd, &rh, rd.owner, raceI->user.name, raceI->user.group))
+		owner = rd.owner;
+	else
+		owner = racedata_pstr_add(path, fd, &rh, raceI->user.name, raceI->user.group);
+
+	rd.owner = owner;
 	rd.status = status;
 	rd.crc32 = crc;
-
-	strlcpy(rd.fname, raceI->file.name, NAMEMAX);
-	strlcpy(rd.uname, raceI->user.name, 24);
-	strlcpy(rd.group, raceI->user.group, 24);
 	rd.size = raceI->file.size;
 	rd.speed = raceI->file.speed;
 	rd.start_time = raceI->total.start_time;
 
-	if (write(fd, &rd, sizeof(RACEDATA)) != sizeof(RACEDATA))
+	if (!rd.fname || !rd.owner || journal_pwrite(path, fd, &rd, sizeof(RACEDATA), RACEDATA_OFFSET(&rh, pos)) != sizeof(RACEDATA)) {
 		d_log("writerace: write failed: %s\n", strerror(errno));
+		valid = 0;
+	}
 
-	close(fd);
+	if ((unsigned int)pos == rh.count) {
+		/* a new entry - index it */
+		idx.slot = (unsigned int)pos + 1;
+		idx.hash = racedata_hash(raceI->file.name);
+		rh.count++;
+		if (journal_pwrite(path, fd, &idx, sizeof(RACEDATA_INDEX), sizeof(RACEDATA_HEAD) + bucket * sizeof(RACEDATA_INDEX)) != sizeof(RACEDATA_INDEX))
+			d_log("writerace: write failed: %s\n", strerror(errno));
+	}
+	rh.gen++;
+	if (journal_pwrite(path, fd, &rh, sizeof(RACEDATA_HEAD), 0) != sizeof(RACEDATA_HEAD)) {
+		d_log("writerace: write failed: %s\n", strerror(errno));
+		valid = 0;
+	}
+	st_close(fd);
+
+	if (valid) {
+		bzero(&e, sizeof(RACEENTRY));
+		strlcpy(e.uname, raceI->user.name, sizeof(e.uname));
+		strlcpy(e.group, raceI->user.group, sizeof(e.group));
+		e.status = status;
+		e.size = raceI->file.size;
+		e.speed = raceI->file.speed;
+		e.start_time = raceI->total.start_time;
+		if (!race_summary_add(&sum, (unsigned int)pos, &e)) {
+			sum.h.gen = rh.gen;
+			race_summary_write(path, &sum);
+		}
+	}
 }
 
 /* remove file entry from racedata file */
 void
 remove_from_race(const char *path, const char *f, struct VARS *raceI)
 {
-	int		fd, i, max;
+	int		fd, pos, valid;
+	unsigned int	bucket;
+	RACEDATA_INDEX	idx;
+	RACEDATA_HEAD	rh;
+	RACEENTRY	e;
+	RACESUMMARY	sum;
 
-	RACEDATA	rd, *tmprd = 0;
+	RACEDATA	rd;
 
-	if ((fd = open(path, O_RDONLY)) == -1) {
+	(void)raceI;
+	if ((fd = racedata_open(path, O_RDWR, &rh)) == -1) {
 		d_log("remove_from_race: open(%s): %s\n", path, strerror(errno));
 		return;
 	}
 
-	for (i = 0; (read(fd, &rd, sizeof(RACEDATA)));) {
-#if (sfv_cleanup_lowercase)
-		if (strcasecmp(rd.fname, f) != 0) {
-#else
-		if (strcmp(rd.fname, f) != 0) {
-#endif
-			tmprd = ng_realloc(tmprd, sizeof(RACEDATA)*(i+1), 0, 1, raceI, 0);
-			memcpy(&tmprd[i], &rd, sizeof(RACEDATA));
-			i++;
-		}
+	if ((pos = racedata_find(fd, &rh, f, &rd, &bucket)) == -1) {
+		st_close(fd);
+		return;
 	}
 
-	close(fd);
-
-	if ((fd = open(path, O_TRUNC | O_WRONLY)) == -1) {
-		d_log("remove_from_race: open(%s): %s\n", path, strerror(errno));
-		ng_free(tmprd);
+	valid = !race_summary_read(path, rh.gen, &sum);
+	if (valid) {
+		racedata_pentry(fd, &rh, &rd, &e);
+		valid = !race_summary_del(&sum, (unsigned int)pos, &e);
+	}
+	bzero(&rd, sizeof(RACEDATA));
+	idx.slot = RACEDATA_TOMBSTONE;
+	idx.hash = 0;
+	rh.deleted++;
+	rh.gen++;
+	if (journal_pwrite(path, fd, &rd, sizeof(RACEDATA), RACEDATA_OFFSET(&rh, pos)) != sizeof(RACEDATA) ||
+	    journal_pwrite(path, fd, &idx, sizeof(RACEDATA_INDEX), sizeof(RACEDATA_HEAD) + bucket * sizeof(RACEDATA_INDEX)) != sizeof(RACEDATA_INDEX) ||
+	    journal_pwrite(path, fd, &rh, sizeof(RACEDATA_HEAD), 0) != sizeof(RACEDATA_HEAD)) {
+		d_log("remove_from_race: write failed: %s\n", strerror(errno));
+		st_close(fd);
 		return;
 	}
+	st_close(fd);
 
-	max = i;
-	for (i = 0; i < max; i++)
-		if (write(fd, &tmprd[i], sizeof(RACEDATA)) != sizeof(RACEDATA))
-			d_log("remove_from_race: write failed: %s\n", strerror(errno));
+	if (valid) {
+		sum.h.gen = rh.gen;
+		race_summary_write(path, &sum);
+	}
+}
 
-	close(fd);
-	ng_free(tmprd);
+/* Compacts racedata once most of it is removed records. The records move,
+ * and the file is replaced - so it is never called with racedata open, or
+ * with record numbers that are still to be used.
+ */
+void
+compact_race(const char *path)
+{
+	int		fd;
+	RACEDATA_HEAD	rh;
+	RECITER		it;
+
+	if ((fd = racedata_open(path, O_RDONLY, &rh)) == -1)
+		return;
+	st_close(fd);
+	if (rh.deleted * 2 <= rh.count)
+		return;
+	if (racedata_iter_open(&it, path) == -1 || racedata_compact(path, &it, NULL, NULL) == -1)
+		d_log("compact_race: failed to compact %s\n", path);
+	rec_close(&it);
+}
+
+/* Keeps the records whose file is there - the first *verified are known to be. */
+static int
+verify_racedata_keep(const RECITER *it, const RACEDATA *rd, void *verified)
+{
+	char		*fname = (char *)rec_str(it, rd->fname);
+
+	if (it->pos <= *(unsigned int *)verified)
+		return 1;
+	d_log("  verify_racedata: Verifying %s..\n", fname);
+	if (fileexists(fname))
+		return 1;
+	d_log("verify_racedata: Oops! %s is missing - removing from racedata\n", fname);
+	create_missing(fname);
+	return 0;
 }
 
 int
 verify_racedata(const char *path, struct VARS *raceI)
 {
-	int		fd, i, ret, max;
+	unsigned int	n = 0, live, verified;
+	RECITER		it;
 
-	RACEDATA	rd, *tmprd = 0;
+	const RACEDATA	*rd;
 
-	if ((fd = open(path, O_RDWR, 0666)) == -1) {
+	(void)raceI;
+	if (racedata_iter_open(&it, path) == -1) {
 		d_log("verify_racedata: open(%s): %s\n", path, strerror(errno));
 		return 0;
 	}
 
-	for (i = 0; (ret = read(fd, &rd, sizeof(RACEDATA)));) {
-		d_log("  verify_racedata: Verifying %s..\n", rd.fname);
-		if (!strlen(rd.fname)) {
-			d_log("  verify_racedata: ERROR! Something is wrong with the racedata!\n");
-		} else if (fileexists(rd.fname)) {
-			tmprd = ng_realloc(tmprd, sizeof(RACEDATA)*(i+1), 0, 1, raceI, 0);
-			memcpy(&tmprd[i], &rd, sizeof(RACEDATA));
-			i++;
-		} else {
-			d_log("verify_racedata: Oops! %s is missing - removing from racedata (ret=%d)\n", rd.fname, ret);
-			create_missing(rd.fname);
-		}
+	/* nothing to drop - leave it be, and the race summary with it. The
+	 * removed records are left for racedata_compact() to drop when there
+	 * are enough of them. */
+	live = it.count ? it.count - ((const RACEDATA_HEAD *)it.map)->deleted : 0;
+	while ((rd = rec_next(&it))) {
+		if (!rd->fname)
+			continue;
+		d_log("  verify_racedata: Verifying %s..\n", rec_str(&it, rd->fname));
+		if (!fileexists((char *)rec_str(&it, rd->fname)))
+			break;
+		n++;
 	}
-
-	close(fd);
-
-	if ((fd = open(path, O_TRUNC | O_WRONLY)) == -1) {
-		d_log("verify_racedata: open(%s): %s\n", path, strerror(errno));
-		ng_free(tmprd);
-		return 0;
+	if (n == live) {
+		rec_close(&it);
+		return 1;
 	}
 
-	max = i;
 	d_log("  verify_racedata: write(%s)\n", path);
-	for (i = 0; i < max; i++) {
-		d_log("  verify_racedata: write (%i)\n", i);
-		if (write(fd, &tmprd[i], sizeof(RACEDATA)) != sizeof(RACEDATA))
-			d_log("remove_from_race: write failed: %s\n", strerror(errno));
-		d_log("  verify_racedata: write (%i) done.\n", i);
+	verified = it.pos - 1;
+	it.pos = 0;
+	if (racedata_compact(path, &it, verify_racedata_keep, &verified) == -1) {
+		rec_close(&it);
+		return 0;
 	}
-	close(fd);
+	rec_close(&it);
 	d_log("  verify_racedata: write(%s) done.\n", path);
-	ng_free(tmprd);
 
 	return 1;
 }
 
-/* Locking mechanism and version control.
- * Not yet fully functional, but we're getting there.
- * progtype == a code for what program calls the lock is found in constants.h
- * force_lock == int used to suggest/force a lock on the file.
- *		set to 1 to suggest a lock,2 to force a lock, 3 to put in queue.
+/* The lock of a release is held with fcntl() locks on headdata.lock, next to
+ * headdata: byte 0 guards the lock fields of headdata while they are changed,
+ * and byte 1 + n is held by the process that drew ticket n from data_queue.
+ * Waiting for the lock is waiting in the kernel for the tickets before yours
+ * to be given up - by remove_lock(), or by their process going away - so the
+ * lock goes around in the order it was asked for, and nobody polls for it.
+ * The locks are of the open file description where the system has them, and
+ * the file is never removed. headdata itself is mapped shared, and its lock
+ * fields read and written with atomic operations - so that update_lock(),
+ * called for every file, needs no system calls.
+ * With lock_shm, the lock is the mutex of the entry of the release in the
+ * segment of lockshm.c instead, and the lock fields are kept in the entry -
+ * headdata is only written when the release changes.
  */
+#ifndef F_OFD_SETLK
+#define F_OFD_GETLK		F_GETLK
+#define F_OFD_SETLK		F_SETLK
+#define F_OFD_SETLKW		F_SETLKW
+#endif
 
-int
-create_lock(struct VARS *raceI, const char *path, unsigned int progtype, unsigned int force_lock, unsigned int queue)
+#define LOCK_GUARD		0
+#define LOCK_TICKET(n)		(1 + (off_t)(n))
+
+static int			lock_fd = -1;
+static volatile sig_atomic_t	lock_timeout;
+static HEADDATA			*lock_hd;		/* headdata, mapped while we have a ticket */
+static unsigned int		lock_pid;
+static time_t			lock_touched;		/* when update_lock() last wrote the incrementor */
+static LOCKSHM_ENT		*lock_ent;		/* the entry in the lock_shm segment, if used */
+static uint64_t			lock_hash;
+static int			lock_owned;		/* we hold the mutex of lock_ent - not if we forced it */
+static LOCKSTAT_REC		lock_rec;		/* what we saw of the lock, for lock_stats_file */
+static struct timespec		lock_since;		/* when we asked for the lock, then got it */
+
+/* the fields of the mapped headdata are changed by several processes at once */
+#define HD_GET(f)		atomic_load((atomic_uint *)&lock_hd->f)
+#define HD_SET(f, v)		atomic_store((atomic_uint *)&lock_hd->f, (v))
+
+/* the lock fields - data_in_use, data_incrementor, data_queue, data_qcurrent
+ * and data_pid - are those of the entry when there is one */
+#define LK(f)			((atomic_uint *)(lock_ent ? &lock_ent->fields.f : &lock_hd->f))
+#define LK_GET(f)		atomic_load(LK(f))
+#define LK_SET(f, v)		atomic_store(LK(f), (v))
+#define LK_CAS(f, o, n)		atomic_compare_exchange_strong(LK(f), &(o), (n))
+
+static int
+lock_range(int cmd, short type, off_t start, off_t len)
 {
-	int		fd, cnt;
-	HEADDATA	hd;
-	struct stat	sp, sb;
-	char		lockfile[PATH_MAX + 1];
+	struct flock	fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = len;
+	if (fcntl(lock_fd, cmd, &fl) == -1)
+		return -1;
+	return cmd == F_OFD_GETLK ? fl.l_type != F_UNLCK : 0;
+}
 
-	/* this should really be moved out of the proc - we'll worry about it later */
-	snprintf(raceI->headpath, PATH_MAX, "%s/%s/headdata", storage, path);
+/* takes (F_WRLCK) or drops (F_UNLCK) the guard of headdata. */
+static void
+lock_guard(short type)
+{
+	if (lock_fd == -1)
+		return;
+	while (lock_range(F_OFD_SETLKW, type, LOCK_GUARD, 1) == -1)
+		if (errno != EINTR) {
+			d_log("lock_guard: fcntl(): %s\n", strerror(errno));
+			break;
+		}
+}
 
-	if ((fd = open(raceI->headpath, O_CREAT | O_RDWR, 0666)) == -1) {
-		d_log("create_lock: open(%s): %s\n", raceI->headpath, strerror(errno));
-		exit(EXIT_FAILURE);
+/* Waits until nobody else holds a byte of start..start+len-1, or until the
+ * alarm set by create_lock() goes off. Returns 0 once they are free.
+ */
+static int
+lock_wait(off_t start, off_t len, int wait)
+{
+	if (lock_fd == -1 || !len)
+		return 0;
+	while (lock_range(wait ? F_OFD_SETLKW : F_OFD_SETLK, F_WRLCK, start, len) == -1)
+		if (errno != EINTR || lock_timeout)
+			return -1;
+	lock_range(F_OFD_SETLK, F_UNLCK, start, len);
+	return 0;
+}
+
+/* microseconds since *since */
+static uint64_t
+lock_us(const struct timespec *since)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+static void
+lock_alarm(int sig)
+{
+	(void)sig;
+	lock_timeout = 1;
+}
+
+/* gives up the ticket, and the lock with it. */
+static void
+lock_release(void)
+{
+	if (lock_fd != -1) {
+		close(lock_fd);
+		lock_fd = -1;
+	}
+	if (lock_ent) {
+		if (lock_owned)
+			ls_unlock(lock_ent);
+		lock_ent = NULL;
+		lock_owned = 0;
 	}
+}
 
-	snprintf(lockfile, PATH_MAX, "%s.lock", raceI->headpath);
-	if (!stat(lockfile, &sp) && (time(NULL) - sp.st_ctime >= max_seconds_wait_for_lock * 5))
-		unlink(lockfile);
-	cnt = 0;
-	while (cnt < 10 && link(raceI->headpath, lockfile)) {
-		cnt++;
-		d_log("create_lock: link failed (%d/10) - sleeping .1 seconds: %s\n", cnt, strerror(errno));
-		usleep(100000);
+static void
+lock_unmap(void)
+{
+	if (lock_hd) {
+		st_unmapshared(lock_hd, sizeof(HEADDATA));
+		lock_hd = NULL;
 	}
-	if (cnt == 10 ) {
-		close(fd);
-		d_log("create_lock: link failed: %s\n", strerror(errno));
-		return -1;
-	} else if (cnt)
-		d_log("create_lock: link ok.\n");
+}
+
+/* Maps headdata - a new one is given the version first. Done under the
+ * guard, each time create_lock() looks at it, as a container may have been
+ * rewritten in the meantime.
+ */
+static void
+lock_map(const char *headpath)
+{
+	int		fd;
+	struct stat	sb;
+	HEADDATA	hd;
 
-	fstat(fd, &sb);
-	if (!sb.st_size) {
-		/* no lock file exists - let's create one with default values. */
+	lock_unmap();
+	if ((fd = st_open(headpath, O_CREAT | O_RDWR, 0666)) == -1) {
+		d_log("create_lock: open(%s): %s\n", headpath, strerror(errno));
+		lock_release();
+		exit(EXIT_FAILURE);
+	}
+	if (st_fstat(fd, &sb) != -1 && !sb.st_size) {
+		memset(&hd, 0, sizeof(HEADDATA));
 		hd.data_version = sfv_version;
-		raceI->data_type = hd.data_type = 0;
-		raceI->data_in_use = hd.data_in_use = progtype;
-		raceI->data_incrementor = hd.data_incrementor = 1;
-		raceI->data_queue = hd.data_queue = 1;
-		hd.data_qcurrent = 0;
-		raceI->misc.data_completed = hd.data_completed = 0;
-		hd.data_pid = (unsigned int)getpid();
-		if (write(fd, &hd, sizeof(HEADDATA)) != sizeof(HEADDATA))
+		if (st_pwrite(fd, &hd, sizeof(HEADDATA), 0) != sizeof(HEADDATA))
 			d_log("create_lock: write failed: %s\n", strerror(errno));
-		close(fd);
-		d_log("create_lock: lock set. (no previous lockfile found) pid: %d\n", hd.data_pid);
-		return 0;
-	} else {
-		if (read(fd, &hd, sizeof(HEADDATA)) == -1) {
-			d_log("create_lock: read() failed: %s\n", strerror(errno));
+	}
+	st_close(fd);
+	if (!(lock_hd = st_mapshared(headpath, sizeof(HEADDATA)))) {
+		d_log("create_lock: mmap(%s): %s\n", headpath, strerror(errno));
+		lock_release();
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* create_lock() with lock_shm: waits for the mutex of the entry of the
+ * release, and then for a process that forced the lock from the one that
+ * held it to be done with it. headdata is mapped on return. Returns 0 with
+ * the lock, -1 without it.
+ */
+static int
+lock_shm_wait(const char *dir, const char *headpath, unsigned int progtype, unsigned int force_lock)
+{
+	int		ret;
+	unsigned int	in_use, pid;
+	struct timespec	deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += max_seconds_wait_for_lock;
+	while (1) {
+		if ((ret = ls_lock(lock_ent, lock_hash, NULL)) == LS_BUSY && force_lock != 0 && force_lock != 2) {
+			if ((in_use = LK_GET(data_in_use)) && (force_lock == 1 || (in_use == PROGTYPE_RESCAN && progtype != PROGTYPE_RESCAN))) {
+				d_log("create_lock: Unlock suggested.\n");
+				LK_SET(data_incrementor, 0);
+				lock_rec.flags |= LOCKSTAT_SUGGESTED;
+			}
+			lock_rec.queue = atomic_fetch_add(LK(data_queue), 1) + 1;
+			d_log("create_lock: lock active - putting you in queue. (%d waiting)\n", lock_rec.queue);
+			ret = ls_lock(lock_ent, lock_hash, &deadline);
+			atomic_fetch_sub(LK(data_queue), 1);
 		}
-		if (hd.data_version != sfv_version) {
+		if (ret != LS_MOVED || !(lock_ent = ls_find(dir, &lock_hash)))
+			break;
+		lock_rec.retries++;
+	}
+	lock_owned = ret == LS_LOCKED || ret == LS_OWNERDEAD;
+	lock_map(headpath);
+	if (ret == LS_OWNERDEAD)
+		d_log("create_lock: the last holder of the lock died holding it.\n");
+	if (!lock_owned)
+		return force_lock == 2 && lock_ent ? 0 : -1;
+
+	/* the lock was forced from the one we waited for - wait for the one who forced it */
+	while (force_lock != 2 && (pid = LK_GET(data_pid)) && pid != lock_pid && LK_GET(data_in_use) &&
+	       (kill((pid_t)pid, 0) != -1 || errno != ESRCH)) {
+		if (!force_lock || ls_wait(&lock_ent->fields.data_pid, pid, &deadline) == -1) {
+			ls_unlock(lock_ent);
+			lock_owned = 0;
+			return -1;
+		}
+		lock_rec.retries++;
+	}
+	return 0;
+}
+
+/* Locking mechanism and version control.
+ * progtype == a code for what program calls the lock is found in constants.h
+ * force_lock == int used to suggest/force a lock on the file.
+ *		set to 1 to suggest a lock, 2 to force a lock, 3 to put in queue.
+ *		0 only takes the lock if it is free and nobody is queued for it.
+ * Queued, we wait up to max_seconds_wait_for_lock, and a rescan holding the
+ * lock is suggested to leave it to any other program. Forcing takes the lock
+ * from its holder, who finds out with update_lock().
+ * Returns 0 with the lock held, 1 when headdata is of a different version,
+ * and else the progtype of the holder, or -1 if not known.
+ */
+int
+create_lock(struct VARS *raceI, const char *path, unsigned int progtype, unsigned int force_lock)
+{
+	int			ret = 0;
+	unsigned int		ticket = 0, owner, version, in_use, pid;
+	struct sigaction	sa, osa;
+	char			lockfile[PATH_MAX + 1], dir[PATH_MAX];
+
+	/* this should really be moved out of the proc - we'll worry about it later */
+	snprintf(raceI->headpath, PATH_MAX, "%s/%s/headdata", storage, path);
+	snprintf(dir, sizeof(dir), "%s/%s/", storage, path);
+	lock_pid = (unsigned int)getpid();
+
+	lock_unmap();
+	lock_release();
+	memset(&lock_rec, 0, sizeof(lock_rec));
+	strlcpy(lock_rec.path, path, sizeof(lock_rec.path));
+	lock_rec.progtype = progtype;
+	clock_gettime(CLOCK_MONOTONIC, &lock_since);
+	if (lock_shm && !st_isresident(dir) && (lock_ent = ls_find(dir, &lock_hash)))
+		ret = lock_shm_wait(dir, raceI->headpath, progtype, force_lock);
+	else {
+		snprintf(lockfile, PATH_MAX, "%s.lock", raceI->headpath);
+		/* kept in memory by the zsd worker it goes to, whose keeper holds the lock */
+		if (st_isresident(dir))
+			d_log("create_lock: release kept in memory by zsd - no lock needed\n");
+		else if ((lock_fd = open(lockfile, O_CREAT | O_RDWR, 0666)) == -1)
+			d_log("create_lock: open(%s): %s - going on without it\n", lockfile, strerror(errno));
+
+		/* draw a ticket */
+		lock_guard(F_WRLCK);
+		lock_map(raceI->headpath);
+		version = HD_GET(data_version);
+		if (version != sfv_version && version != 17 && version != 18) {
 			d_log("create_lock: version of datafile mismatch. Stopping and suggesting a cleanup.\n");
-			close(fd);
-			unlink(lockfile);
+			lock_unmap();
+			lock_release();
 			return 1;
 		}
-		if ((time(NULL) - sb.st_ctime >= max_seconds_wait_for_lock * 5)) {
-			raceI->misc.release_type = hd.data_type;
-			raceI->data_in_use = hd.data_in_use = progtype;
-			raceI->data_incrementor = hd.data_incrementor = 1;
-			raceI->data_queue = hd.data_queue = 1;
-			hd.data_qcurrent = 0;
-			raceI->misc.data_completed = hd.data_completed;
-			hd.data_pid = (unsigned int)getpid();
-			lseek(fd, 0L, SEEK_SET);
-			if (write(fd, &hd, sizeof(HEADDATA)) != sizeof(HEADDATA))
-				d_log("create_lock: write failed: %s\n", strerror(errno));
-			close(fd);
-			d_log("create_lock: lock set. (lockfile exceeded max life time) pid: %d\n", hd.data_pid);
-			return 0;
-		}
-		if (hd.data_in_use) {						/* the lock is active */
-			if (force_lock == 2) {
-				raceI->data_queue = hd.data_queue = 1;
-				hd.data_qcurrent = 0;
-				d_log("create_lock: Unlock forced.\n");
-			} else {
-				if (force_lock == 3) {				/* we got a request to queue a lock if active */
-					raceI->data_queue = hd.data_queue;	/* we give the current queue number to the calling process */
-					hd.data_queue++;			/* we increment the number in the queue */
-					lseek(fd, 0L, SEEK_SET);
-					if (write(fd, &hd, sizeof(HEADDATA)) != sizeof(HEADDATA))
-						d_log("create_lock: write failed: %s\n", strerror(errno));
-					d_log("create_lock: lock active - putting you in queue. (%d/%d)\n", hd.data_qcurrent, hd.data_queue);
-				}
-				raceI->misc.release_type = hd.data_type;
-				raceI->misc.data_completed = hd.data_completed;
-				close(fd);
-				return hd.data_in_use;
+		ticket = LK_GET(data_queue);
+		if ((in_use = LK_GET(data_in_use)) && ticket <= LK_GET(data_qcurrent))
+			ticket = LK_GET(data_qcurrent) + 1;
+		while (lock_fd != -1 && lock_range(F_OFD_SETLK, F_WRLCK, LOCK_TICKET(ticket), 1) == -1) {
+			if (errno != EAGAIN && errno != EACCES) {
+				d_log("create_lock: fcntl(%s): %s - going on without it\n", lockfile, strerror(errno));
+				lock_release();
+				break;
 			}
+			ticket++;				/* drawn already - headdata was written back since */
+			lock_rec.retries++;
 		}
-		if (!hd.data_in_use) {						/* looks like the lock is inactive */
-			if (force_lock == 2) {
-				raceI->data_queue = hd.data_queue = 1;
-				hd.data_qcurrent = 0;
-				d_log("create_lock: Unlock forced.\n");
-			} else if (force_lock == 3 && hd.data_queue > hd.data_qcurrent) {		/* we got a request to queue a lock if active, */
-										/* and there seems to be others in queue. Will not allow the */
-										/* process to lock, but wait for the queued process to do so. */
-				raceI->data_queue = hd.data_queue;		/* we give the queue number to the calling process */
-				hd.data_queue++;				/* we increment the number in the queue */
-				raceI->data_incrementor = hd.data_incrementor;
-				raceI->misc.release_type = hd.data_type;
-				raceI->misc.data_completed = hd.data_completed;
-				lseek(fd, 0L, SEEK_SET);
-				if (write(fd, &hd, sizeof(HEADDATA)) != sizeof(HEADDATA))
-					d_log("create_lock: write failed: %s\n", strerror(errno));
-				close(fd);
-				d_log("create_lock: putting you in queue. (%d/%d)\n", hd.data_qcurrent, hd.data_queue);
-				unlink(lockfile);
-				return -1;
-			} else if (hd.data_queue && (queue > hd.data_qcurrent) && !force_lock) {
-										/* seems there is a queue, and the calling process' place in */
-										/* the queue is still less than current. */
-				raceI->data_incrementor = hd.data_incrementor;	/* feed back the current incrementor */
-				raceI->misc.release_type = hd.data_type;
-				raceI->misc.data_completed = hd.data_completed;
-				close(fd);
-				unlink(lockfile);
-				return -1;
+		raceI->data_queue = ticket;
+		LK_SET(data_queue, ticket + 1);
+		if (in_use && (force_lock == 1 || (in_use == PROGTYPE_RESCAN && progtype != PROGTYPE_RESCAN))) {
+			d_log("create_lock: Unlock suggested.\n");
+			LK_SET(data_incrementor, 0);
+			lock_rec.flags |= LOCKSTAT_SUGGESTED;
+		}
+		if (ticket > LK_GET(data_qcurrent))		/* the holder, and the tickets in between */
+			lock_rec.queue = ticket - LK_GET(data_qcurrent) - !in_use;
+		lock_guard(F_UNLCK);
+		if (in_use)
+			d_log("create_lock: lock active - putting you in queue. (%d/%d)\n", LK_GET(data_qcurrent), ticket);
+
+		/* wait for our turn */
+		if (force_lock != 2) {
+			lock_timeout = 0;
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_handler = lock_alarm;
+			sigemptyset(&sa.sa_mask);
+			sigaction(SIGALRM, &sa, &osa);
+			alarm(max_seconds_wait_for_lock);
+		}
+		while (1) {
+			if (force_lock != 2 && lock_wait(LOCK_TICKET(0), ticket, force_lock) == -1) {
+				lock_guard(F_WRLCK);
+				lock_map(raceI->headpath);
+				ret = -1;
+				break;
+			}
+			lock_guard(F_WRLCK);
+			lock_map(raceI->headpath);
+			pid = LK_GET(data_pid);
+			if (force_lock == 2 || !LK_GET(data_in_use) || pid == lock_pid || (kill((pid_t)pid, 0) == -1 && errno == ESRCH) ||
+			    lock_fd == -1 || lock_range(F_OFD_GETLK, F_WRLCK, LOCK_TICKET(LK_GET(data_qcurrent)), 1) != 1)
+				break;
+			/* the lock was forced by one behind us - wait for it as well */
+			owner = LK_GET(data_qcurrent);
+			lock_guard(F_UNLCK);
+			lock_rec.retries++;
+			if (lock_wait(LOCK_TICKET(owner), 1, force_lock) == -1) {
+				lock_guard(F_WRLCK);
+				lock_map(raceI->headpath);
+				ret = -1;
+				break;
 			}
 		}
-		if (force_lock == 1) {						/* lock suggested - reseting the incrementor to 0 */
-			d_log("create_lock: Unlock suggested.\n");
-			hd.data_incrementor = 0;
-		} else {							/* either no lock and queue, or unlock is forced. */
-			hd.data_incrementor = 1;
-			hd.data_in_use = progtype;
+		if (force_lock != 2) {
+			alarm(0);
+			sigaction(SIGALRM, &osa, NULL);
+		}
+	}
+	if (ret) {
+		raceI->data_incrementor = LK_GET(data_incrementor);
+		raceI->misc.release_type = HD_GET(data_type);
+		raceI->misc.data_completed = HD_GET(data_completed);
+		if ((in_use = LK_GET(data_in_use)))
+			ret = (int)in_use;
+		d_log("create_lock: did not get the lock. (%d/%d)\n", LK_GET(data_qcurrent), ticket);
+		lock_unmap();
+		lock_release();
+		lock_rec.flags |= LOCKSTAT_TIMEOUT;
+		lock_rec.wait_us = lock_us(&lock_since);
+		lockstat_add(&lock_rec);
+		return ret;
+	}
+
+	/* finish what a process that died holding the lock was writing */
+	if (!(pid = LK_GET(data_pid)) || (kill((pid_t)pid, 0) == -1 && errno == ESRCH)) {
+		journal_replay(dir);
+		if ((pid = LK_GET(data_pid)) && LK_GET(data_in_use)) {
+			d_log("create_lock: pid %d died holding the lock - removing it.\n", pid);
+			lock_rec.flags |= LOCKSTAT_OWNERDEAD;
 		}
-		raceI->data_incrementor = hd.data_incrementor;
-		raceI->misc.data_completed = hd.data_completed;
-		raceI->misc.release_type = hd.data_type;
-		hd.data_pid = (unsigned int)getpid();
-		lseek(fd, 0L, SEEK_SET);
-		if (write(fd, &hd, sizeof(HEADDATA)) != sizeof(HEADDATA))
-			d_log("create_lock: write failed: %s\n", strerror(errno));
-		close(fd);
-		raceI->data_in_use = progtype;
-		d_log("create_lock: lock set. pid: %d\n", hd.data_pid);
-		return 0;
 	}
+	if ((version = HD_GET(data_version)) == 17 || version == 18) {
+		char	racefile[PATH_MAX], sfvfile[PATH_MAX];
+
+		/* only the racedata and sfvdata layouts changed since - convert them */
+		snprintf(racefile, sizeof(racefile), "%s/%s/racedata", storage, path);
+		snprintf(sfvfile, sizeof(sfvfile), "%s/%s/sfvdata", storage, path);
+		if (racedata_upgrade(racefile) != -1 && sfvdata_upgrade(sfvfile) != -1)
+			HD_SET(data_version, sfv_version);
+	}
+	if (HD_GET(data_version) != sfv_version) {
+		d_log("create_lock: version of datafile mismatch. Stopping and suggesting a cleanup.\n");
+		lock_unmap();
+		lock_release();
+		return 1;
+	}
+	if (LK_GET(data_in_use) && pid != lock_pid && force_lock == 2) {
+		d_log("create_lock: Unlock forced.\n");
+		if (!(lock_rec.flags & LOCKSTAT_OWNERDEAD))
+			lock_rec.flags |= LOCKSTAT_FORCED;
+	}
+	raceI->misc.release_type = HD_GET(data_type);
+	raceI->misc.data_completed = HD_GET(data_completed);
+	LK_SET(data_in_use, progtype);
+	LK_SET(data_incrementor, 1);
+	if (!lock_ent) {
+		LK_SET(data_qcurrent, ticket);
+		if (LK_GET(data_queue) <= ticket)
+			LK_SET(data_queue, ticket + 1);
+	}
+	LK_SET(data_pid, lock_pid);
+	lock_guard(F_UNLCK);
+	raceI->data_in_use = progtype;
+	raceI->data_incrementor = 1;
+	lock_touched = time(NULL);
+	lock_rec.flags |= LOCKSTAT_GOT;
+	lock_rec.wait_us = lock_us(&lock_since);
+	clock_gettime(CLOCK_MONOTONIC, &lock_since);
+	journal_open(raceI->headpath);
+	d_log("create_lock: lock set. pid: %d (%d/%d)\n", lock_pid, ticket, ticket + 1);
+	return 0;
 }
 
 /* Remove the lock
@@ -1142,146 +2701,147 @@ remove_lock(struct VARS *raceI)
 {
 	if (!raceI->data_in_use)
 		d_log("remove_lock: lock not removed - no lock was set\n");
+	else if (!lock_hd)
+		d_log("remove_lock: lock not removed - headdata is not mapped\n");
 	else {
-		int		fd;
-		HEADDATA	hd;
-		char		lockfile[PATH_MAX + 1];
-
-		if ((fd = open(raceI->headpath, O_RDWR, 0666)) == -1) {
-			d_log("remove_lock: open(%s): %s\n", raceI->headpath, strerror(errno));
-			exit(EXIT_FAILURE);
+		/* all written - nothing left to replay */
+		journal_close(raceI->misc.data_completed);
+
+		lock_guard(F_WRLCK);
+		if (LK_GET(data_pid) == lock_pid) {	/* not if it was forced from us */
+			LK_SET(data_in_use, 0);
+			LK_SET(data_pid, 0);
+			LK_SET(data_incrementor, 0);
+			if (lock_ent)
+				ls_wake(&lock_ent->fields.data_pid);
 		}
-
-		if (read(fd, &hd, sizeof(HEADDATA)) == -1) {
-			d_log("remove_lock: read() failed: %s\n", strerror(errno));
-			hd.data_queue = 0;
-			hd.data_qcurrent = 0;
-		}
-
-		hd.data_in_use = 0;
-		hd.data_pid = 0;
-		hd.data_completed = raceI->misc.data_completed;
-		hd.data_incrementor = 0;
-		if (hd.data_queue)			/* if queue, increase the number in current so the next */
-			++hd.data_qcurrent;		/* process can start. */
-		if (hd.data_queue < hd.data_qcurrent) {	/* If the next in line is bigger than the queue itself, */
-			hd.data_queue = 0;		/* it should be fair to assume there is noone else in queue */
-			hd.data_qcurrent = 0;		/* and reset the queue. Normally, this should not happen. */
+		if (HD_GET(data_completed) != raceI->misc.data_completed)
+			HD_SET(data_completed, raceI->misc.data_completed);
+		if (lock_fd != -1 && !lock_range(F_OFD_GETLK, F_WRLCK, LOCK_TICKET(0), 0)) {
+			LK_SET(data_queue, 0);		/* nobody else holds a ticket - start over */
+			LK_SET(data_qcurrent, 0);
 		}
-		lseek(fd, 0L, SEEK_SET);
-		if (write(fd, &hd, sizeof(HEADDATA)) != sizeof(HEADDATA))
-			d_log("remove_lock: write failed: %s\n", strerror(errno));
-		close(fd);
-		snprintf(lockfile, sizeof lockfile, "%s.lock", raceI->headpath);
-		unlink(lockfile);
-		d_log("remove_lock: queue %d/%d\n", hd.data_qcurrent, hd.data_queue);
+		d_log("remove_lock: queue %d/%d\n", LK_GET(data_qcurrent), LK_GET(data_queue));
+		lock_unmap();
+		lock_release();				/* next in queue goes on from here */
+		lock_rec.hold_us = lock_us(&lock_since);
+		lockstat_add(&lock_rec);
 	}
 }
 
+/* For a process that keeps the lock while it is of no use to others, as the
+ * keeper of a release zsd holds in memory does: 0 while nobody else wants
+ * it, 1 if another process waits for it or asked us to leave it, and -1 if
+ * it was forced from us.
+ */
+int
+lock_wanted(struct VARS *raceI)
+{
+	if (!raceI->data_in_use || !lock_hd || LK_GET(data_pid) != lock_pid)
+		return -1;
+	if (!LK_GET(data_incrementor))
+		return 1;
+	if (lock_ent)
+		return LK_GET(data_queue) > 0;
+	/* the tickets after ours are held by those waiting */
+	return lock_fd != -1 && lock_range(F_OFD_GETLK, F_WRLCK, LOCK_TICKET(raceI->data_queue + 1), 0) == 1;
+}
+
 /* update a lock. This should be used after each file checked.
  * This procs task is mainly to 'touch' the lock and to check that nothing else wants the lock.
  * Please note:
  *   if counter == 0 a suggested lock-removal will be written. if >0 it's used as normal.
  *   if datatype != 0, this datatype will be written.
+ * headdata is mapped, so this takes no system calls - the incrementor is only
+ * written every lock_optimize seconds.
  */
 
 int
 update_lock(struct VARS *raceI, unsigned int counter, unsigned int datatype)
 {
-	int		fd, retval;
-	HEADDATA	hd;
-	struct stat	sb;
+	unsigned int	inc;
+	time_t		now;
 
 	if (!raceI->headpath[0]) {
 		d_log("update_lock: variable 'headpath' empty - assuming no lock is set\n");
 		return -1;
 	}
 
-	if (!raceI->data_in_use) {
+	if (!raceI->data_in_use || !lock_hd) {
 		d_log("update_lock: not updating lock - no lock set\n");
 		return 1;
 	}
 
-	if ((fd = open(raceI->headpath, O_RDWR, 0666)) == -1) {
-		d_log("update_lock: open(%s): %s\n", raceI->headpath, strerror(errno));
-		remove_lock(raceI);
-		exit(EXIT_FAILURE);
-	}
-	if (read(fd, &hd, sizeof(HEADDATA)) == -1) {
-		d_log("update_lock: read() failed: %s\n", strerror(errno));
-	}
-
-	if (hd.data_version != sfv_version) {
-		d_log("create_lock: version of datafile mismatch. Stopping and suggesting a cleanup.\n");
-		close(fd);
+	if (HD_GET(data_version) != sfv_version) {
+		d_log("update_lock: version of datafile mismatch. Stopping and suggesting a cleanup.\n");
 		return 1;
 	}
-	if ((hd.data_in_use != raceI->data_in_use) && counter) {
+	if ((LK_GET(data_in_use) != raceI->data_in_use) && counter) {
 		d_log("update_lock: Lock not active or progtype mismatch - no choice but to exit.\n");
-		close(fd);
+		lock_rec.flags |= LOCKSTAT_LOST;
 		remove_lock(raceI);
 		exit(EXIT_FAILURE);
 	}
-	if (!hd.data_incrementor) {
-		d_log("update_lock: Lock suggested removed by a different process (%d/%d).\n", hd.data_incrementor, raceI->data_incrementor);
-		retval = 0;
-	} else {
-		if (counter)
-			hd.data_incrementor++;
-		else
-			hd.data_incrementor = 0;
-
-		retval = hd.data_incrementor;
+	raceI->misc.release_type = HD_GET(data_type);
+	raceI->misc.data_completed = HD_GET(data_completed);
+	if (!counter) {
+		LK_SET(data_incrementor, 0);
+		d_log("update_lock: lock removal suggested\n");
+		return 0;
 	}
-	raceI->misc.release_type = hd.data_type;
-	raceI->misc.data_completed = hd.data_completed;
-	if (hd.data_pid != (unsigned int)getpid() && hd.data_incrementor) {
-		d_log("update_lock: Oops! Race condition - another process has the lock. pid: %d != %d\n", hd.data_pid, (unsigned int)getpid());
-		hd.data_queue = raceI->data_queue - 1;
-		lseek(fd, 0L, SEEK_SET);
-		if (write(fd, &hd, sizeof(HEADDATA)) != sizeof(HEADDATA))
-			d_log("create_lock: write failed: %s\n", strerror(errno));
-		close(fd);
+	if (!(inc = LK_GET(data_incrementor))) {
+		d_log("update_lock: Lock suggested removed by a different process (%d/%d).\n", inc, raceI->data_incrementor);
+		raceI->data_incrementor = 0;
+		raceI->data_in_use = LK_GET(data_in_use);
+		lock_rec.flags |= LOCKSTAT_YIELDED;
+		return 0;
+	}
+	if (LK_GET(data_pid) != lock_pid) {
+		d_log("update_lock: Oops! Race condition - another process has the lock. pid: %d != %d\n", LK_GET(data_pid), lock_pid);
+		lock_rec.flags |= LOCKSTAT_LOST;
 		return -1;
 	}
-	if (datatype && counter)
-		hd.data_type = datatype;
+	if (datatype && HD_GET(data_type) != datatype)
+		HD_SET(data_type, datatype);
 
-	fstat(fd, &sb);
-	if ((retval && !lock_optimize) || datatype || !retval || !hd.data_incrementor || (time(NULL) - sb.st_ctime >= lock_optimize && hd.data_incrementor > 1)) {
-		lseek(fd, 0L, SEEK_SET);
-		if (write(fd, &hd, sizeof(HEADDATA)) != sizeof(HEADDATA))
-			d_log("create_lock: write failed: %s\n", strerror(errno));
-		d_log("update_lock: updating lock (%d)\n", raceI->data_incrementor);
-	}
-	close(fd);
-	if (counter) {
-		raceI->data_incrementor = hd.data_incrementor;
-		raceI->data_in_use = hd.data_in_use;
-	}
-	return retval;
+	now = time(NULL);
+	if (!lock_optimize || datatype || now - lock_touched >= lock_optimize) {
+		if (!LK_CAS(data_incrementor, inc, inc + 1)) {
+			/* changed under us - asked to leave, or forced from us */
+			d_log("update_lock: lock changed by a different process (%d).\n", inc);
+			lock_rec.flags |= inc ? LOCKSTAT_LOST : LOCKSTAT_YIELDED;
+			return inc ? -1 : 0;
+		}
+		lock_touched = now;
+		lock_rec.touches++;
+		d_log("update_lock: updating lock (%d)\n", inc + 1);
+	} else
+		lock_rec.skips++;
+	raceI->data_incrementor = inc + 1;
+	raceI->data_in_use = LK_GET(data_in_use);
+	return inc + 1;
 }
 
 short int
 match_file(char *rname, char *f)
 {
-	int		n;
-	FILE	       *file = NULL;
+	int		fd, n;
+	unsigned int	bucket;
+	char		name[NAMEMAX];
 
 	RACEDATA	rd;
+	RACEDATA_HEAD	rh;
 
 	n = 0;
-	if ((file = fopen(rname, "r+"))) {
-		while (fread(&rd, sizeof(RACEDATA), 1, file)) {
-			if (strncmp(rd.fname, f, NAME_MAX) == 0	&& rd.status == F_CHECKED) {
-				d_log("match_file: '%s' == '%s'\n", rd.fname, f);
-				n = 1;
-				break;
-			}
+	if ((fd = racedata_open(rname, O_RDONLY, &rh)) != -1) {
+		if (racedata_find(fd, &rh, f, &rd, &bucket) != -1 &&
+		    strncmp(racedata_pstr(fd, &rh, rd.fname, name, sizeof(name)), f, NAME_MAX) == 0 && rd.status == F_CHECKED) {
+			d_log("match_file: '%s' == '%s'\n", name, f);
+			n = 1;
 		}
-		fclose(file);
+		st_close(fd);
 	} else {
-		d_log("match_file: Error fopen(%s): %s\n", rname, strerror(errno));
+		d_log("match_file: Error open(%s): %s\n", rname, strerror(errno));
 	}
 	return n;
 }
@@ -1386,7 +2946,7 @@ int
 check_zipfile(const char *dirname, const char *zipfile, int do_nfo)
 {
 	int             ret = 0;
-	char            path_buf[PATH_MAX], target[PATH_MAX];
+	char            path_buf[PATH_MAX], *zip_argv[5];
 #if (extract_nfo)
 	char            nfo_buf[NAME_MAX];
 	time_t          t = 0;
@@ -1417,8 +2977,12 @@ check_zipfile(const char *dirname, const char *zipfile, int do_nfo)
 			if (!fileexists(zip_bin))
 				d_log("check_zipfile: ERROR! Not able to remove banned file from zip - zip_bin (%s) does not exist!\n", zip_bin);
 			else {
-				sprintf(target, "%s -qqd \"%s\" \"%s\"", zip_bin, zipfile, dp->d_name);
-				if (execute(target))
+				zip_argv[0] = zip_bin;
+				zip_argv[1] = "-qqd";
+				zip_argv[2] = (char *)zipfile;
+				zip_argv[3] = dp->d_name;
+				zip_argv[4] = NULL;
+				if (run_argv(zip_argv, NULL, NULL))
 					d_log("check_zipfile: Failed to remove banned (%s) file from zip.\n", dp->d_name);
 			}
 			continue;
@@ -1476,6 +3040,7 @@ void removedir(const char *dirname)
 	}
 	closedir(dir);
 	rmdir(dirname);
+	dirsnap_changed();
 	return;
 }
 
@@ -1583,15 +3148,16 @@ read_headdata(const char *headpath)
 	int fd = 0;
 	HEADDATA hd;
 
-	if ((fd = open(headpath, O_RDONLY)) == -1) {
+	if ((fd = st_open(headpath, O_RDONLY, 0)) == -1) {
 		d_log("read_headdata: failed to open(%s): %s - returning '0' as data_type\n", headpath, strerror(errno));
 		return 0;
 	}
-	if ((read(fd, &hd, sizeof(HEADDATA))) != sizeof(HEADDATA)) {
+	if ((st_pread(fd, &hd, sizeof(HEADDATA), 0)) != sizeof(HEADDATA)) {
 		d_log("read_headdata: failed to read %s : %s - returning '0' as data_type\n", headpath, strerror(errno));
+		st_close(fd);
 		return 0;
 	}
-	close(fd);
+	st_close(fd);
 
 	return hd.data_type;
 }
@@ -1603,22 +3169,24 @@ read_headdata(const char *headpath)
  * Returns 0 if everything went fine, 2 if there were problems with the SFV
  */
 int
-parse_sfv(char *sfvfile, GLOBAL *g, DIR *dir) {
+parse_sfv(char *sfvfile, GLOBAL *g, DIRSNAP *dir) {
 	int cnt, cnt2;
 	char *ext = 0;
-	struct dirent *dp;
+	const char *name;
+	unsigned int i, n;
 
 	d_log("parse_sfv: Parsing sfv and creating sfv data from %s\n", sfvfile);
 	if (copysfv(sfvfile, g->l.sfv, &g->v)) {
 		d_log("parse_sfv: Found invalid entries in SFV.\n");
 		mark_as_bad(sfvfile);
-		unlink(g->l.race);
-		unlink(g->l.sfv);
-
-		rewinddir(dir);
-		while ((dp = readdir(dir))) {
-			cnt = cnt2 = (int)strlen(dp->d_name);
-			ext = dp->d_name;
+		st_unlink(g->l.race);
+		st_unlink(g->l.sfv);
+
+		n = dirsnap_read(dir);
+		for (i = 0; i < n; i++) {
+			name = dirsnap_name(dir, i);
+			cnt = cnt2 = (int)strlen(name);
+			ext = (char *)name;
 			while (ext[cnt] != '-' && cnt > 0)
 				cnt--;
 			if (ext[cnt] != '-')
@@ -1627,8 +3195,9 @@ parse_sfv(char *sfvfile, GLOBAL *g, DIR *dir) {
 				cnt++;
 			ext += cnt;
 			if (!strncmp(ext, "missing", 7))
-				unlink(dp->d_name);
+				unlink(name);
 		}
+		dirsnap_changed();
 		return 2;
 	}
 
@@ -1645,7 +3214,7 @@ parse_sfv(char *sfvfile, GLOBAL *g, DIR *dir) {
 	if ( (force_sfv_first == FALSE) || matchpath(noforce_sfv_first_dirs, g->l.path))
 #endif
 	{
-		if (fileexists(g->l.race) && fileexists(g->l.sfv)) {
+		if (st_exists(g->l.race) && st_exists(g->l.sfv)) {
 			d_log("parse_sfv: Testing files marked as untested\n");
 			testfiles(&g->l, &g->v, 0);
 		}
@@ -1655,12 +3224,12 @@ parse_sfv(char *sfvfile, GLOBAL *g, DIR *dir) {
 
 	if (g->v.total.files == 0) {
 		d_log("parse_sfv: SFV seems to have no files of accepted types, or has errors.\n");
-		unlink(g->l.sfv);
+		st_unlink(g->l.sfv);
 		mark_as_bad(sfvfile);
 		return 2;
 	}
 
-	if (fileexists(g->l.race)) {
+	if (st_exists(g->l.race)) {
 		d_log("parse_sfv: Reading race data from file to memory\n");
 		readrace(g->l.race, &g->v, g->ui, g->gi);
 	}
@@ -1668,7 +3237,7 @@ parse_sfv(char *sfvfile, GLOBAL *g, DIR *dir) {
 	removecomplete(g->v.misc.release_type);
 
 	if (deny_resume_sfv == TRUE) {
-		if (copyfile(sfvfile, g->l.sfvbackup))
+		if (st_import(sfvfile, g->l.sfvbackup))
 			d_log("parse_sfv: failed to make backup of sfv (%s)\n", sfvfile);
 		else
 			d_log("parse_sfv: created backup of sfv (%s)\n", sfvfile);
@@ -9,6 +9,7 @@
 
 #include "zsfunctions.h"
 #include "race-file.h"
+#include "storage.h"
 #include "objects.h"
 #include "macros.h"
 #include "convert.h"
@@ -61,14 +62,14 @@ main(int argc, char **argv)
 	getrelname(&g);
 
 	sprintf(g.l.race, storage "/%s/racedata", argv[1]);
-	if (!fileexists(g.l.race))
+	if (!st_exists(g.l.race))
 		goto END;
 
 	readrace(g.l.race, &g.v, g.ui, g.gi);
 	sprintf(g.l.sfv, storage "/%s/sfvdata", argv[1]);
 
-	if (!fileexists(g.l.sfv)) {
-		if (fileexists(g.l.sfv)) {
+	if (!st_exists(g.l.sfv)) {
+		if (st_exists(g.l.sfv)) {
 //			g.v.total.files = read_diz("file_id.diz");
 			g.v.total.files = read_diz();
 			g.v.total.files_missing += g.v.total.files;
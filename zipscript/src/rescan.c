@@ -10,6 +10,7 @@
 #include "zsfunctions.h"
 #include "helpfunctions.h"
 #include "race-file.h"
+#include "storage.h"
 #include "objects.h"
 #include "macros.h"
 #include "multimedia.h"
@@ -20,6 +21,7 @@
 #include "crc.h"
 #include "ng-version.h"
 #include "audiosort.h"
+#include "runner.h"
 
 #include "../conf/zsconfig.h"
 #include "../include/zsconfig.defaults.h"
@@ -40,11 +42,11 @@ main(int argc, char *argv[])
 	int		n, l, complete_type = 0, not_allowed = 0, argv_mode = 0;
 
 #ifdef USING_GLFTPD
-        int             gnum = 0, unum = 0;
 	char		myflags[20];
 #endif
 
 	char           *ext, exec[4096], *complete_bar = 0, *inc_point[2];
+	char           *unzip_argv[6] = { NULL };
 	unsigned int	crc;
 	struct stat	fileinfo;
 
@@ -52,22 +54,17 @@ main(int argc, char *argv[])
 	gid_t		f_gid;
 	double		temp_time = 0;
 
-	DIR		*dir, *parent;
-	struct dirent	*dp;
-	long		loc;
+	DIRSNAP		*dir, *parent;
+	const char	**names;
+	char		*name;
+	unsigned int	i, entries;
 	time_t		timenow;
-#if (test_for_password || extract_nfo || zip_clean)
-	off_t		tempstream;
-#endif
 
 	short		rescan_quick = rescan_default_to_quick;
 	char		one_name[NAME_MAX];
 	char		*temp_p = NULL;
 	int		chdir_allowed = 0, argnum = 0;
 	GLOBAL		g;
-#if (enable_rescan_script)
-	char		target[PATH_MAX+NAME_MAX];
-#endif
 
 #if ( program_uid > 0 )
 	setegid(program_gid);
@@ -248,8 +245,7 @@ main(int argc, char *argv[])
 	getrelname(&g);
 
 #ifdef USING_GLFTPD
-	gnum = buffer_groups(GROUPFILE, 0);
-	unum = buffer_users(PASSWDFILE, 0);
+	load_users_groups();
 #endif
 
 	sprintf(g.l.sfv, storage "/%s/sfvdata", g.l.path);
@@ -258,10 +254,11 @@ main(int argc, char *argv[])
 	sprintf(g.l.race, storage "/%s/racedata", g.l.path);
 	d_log("rescan: Creating directory to store racedata in\n");
  	maketempdir(g.l.path);
+	crc_cache_init(g.l.path);
 
 	d_log("rescan: Locking release\n");
 	while (1) {
-		if ((l = create_lock(&g.v, g.l.path, PROGTYPE_RESCAN, 3, 0))) {
+		if ((l = create_lock(&g.v, g.l.path, PROGTYPE_RESCAN, 3))) {
 			d_log("rescan: Failed to lock release.\n");
 			if (l == 1) {
 				d_log("rescan: version mismatch. Exiting.\n");
@@ -272,63 +269,32 @@ main(int argc, char *argv[])
 				ng_free(g.l.sfvbackup);
 				ng_free(g.l.leader);
 				ng_free(g.l.race);
-#ifdef USING_GLFTPD
-				buffer_groups(GROUPFILE, gnum);
-				buffer_users(PASSWDFILE, unum);
-#endif
 				exit(EXIT_FAILURE);
 			}
 			if (l == PROGTYPE_POSTDEL) {
-				n = (signed int)g.v.data_incrementor;
-				d_log("rescan: Detected postdel running - sleeping for one second.\n");
-				if (!create_lock(&g.v, g.l.path, PROGTYPE_RESCAN, 0, g.v.data_queue))
-					break;
-				usleep(1000000);
-				if (!create_lock(&g.v, g.l.path, PROGTYPE_RESCAN, 0, g.v.data_queue))
-					break;
-				if ( n == (signed int)g.v.data_incrementor) {
-					d_log("rescan: Failed to get lock. Forcing unlock.\n");
-					if (create_lock(&g.v, g.l.path, PROGTYPE_RESCAN, 2, g.v.data_queue)) {
-						d_log("rescan: Failed to force a lock.\n");
-						d_log("rescan: Exiting with error.\n");
-						ng_free(g.ui);
-						ng_free(g.gi);
-						ng_free(g.l.sfv);
-						ng_free(g.l.sfvbackup);
-						ng_free(g.l.leader);
-						ng_free(g.l.race);
-#ifdef USING_GLFTPD
-						buffer_groups(GROUPFILE, gnum);
-						buffer_users(PASSWDFILE, unum);
-#endif
-						exit(EXIT_FAILURE);
-					}
-					break;
-				}
-			} else {
-				for (l = 0; l <= max_seconds_wait_for_lock * 10; ++l) {
-					d_log("rescan: sleeping for .1 second before trying to get a lock (queue: %d).\n", g.v.data_queue);
-					usleep(100000);
-					if (!create_lock(&g.v, g.l.path, PROGTYPE_RESCAN, 0, g.v.data_queue))
-						break;
-				}
-				if (l >= max_seconds_wait_for_lock * 10) {
-					d_log("rescan: Failed to get lock. Will not force unlock.\n");
+				d_log("rescan: Failed to get lock. Forcing unlock.\n");
+				if (create_lock(&g.v, g.l.path, PROGTYPE_RESCAN, 2)) {
+					d_log("rescan: Failed to force a lock.\n");
+					d_log("rescan: Exiting with error.\n");
 					ng_free(g.ui);
 					ng_free(g.gi);
 					ng_free(g.l.sfv);
 					ng_free(g.l.sfvbackup);
 					ng_free(g.l.leader);
 					ng_free(g.l.race);
-#ifdef USING_GLFTPD
-					buffer_groups(GROUPFILE, gnum);
-					buffer_users(PASSWDFILE, unum);
-#endif
 					exit(EXIT_FAILURE);
 				}
+			} else {
+				d_log("rescan: Failed to get lock. Will not force unlock.\n");
+				ng_free(g.ui);
+				ng_free(g.gi);
+				ng_free(g.l.sfv);
+				ng_free(g.l.sfvbackup);
+				ng_free(g.l.leader);
+				ng_free(g.l.race);
+				exit(EXIT_FAILURE);
 			}
 		}
-		usleep(10000);
 		if (update_lock(&g.v, 1, 0) != -1)
 			break;
 	}
@@ -338,48 +304,45 @@ main(int argc, char *argv[])
 		unlink(g.l.incomplete);
 	removecomplete(g.v.misc.release_type);
 
-	dir = opendir(".");
-	parent = opendir("..");
+	dir = dirsnap_open(".");
+	parent = dirsnap_open("..");
 
 	if (!((rescan_quick && findfileext(dir, ".sfv")) || *one_name)) {
 		if (g.l.sfv)
-			unlink(g.l.sfv);
+			st_unlink(g.l.sfv);
 		if (g.l.race)
-			unlink(g.l.race);
+			st_unlink(g.l.race);
 	}
 	printf("Rescanning files...\n");
 
 	if (findfileext(dir, ".zip")) {
 		if (!fileexists(unzip_bin)) {
 			printf("rescan: ERROR! Not able to check zip-files - %s does not exist!\n", unzip_bin);
-			closedir(dir);
-			closedir(parent);
+			dirsnap_close(dir);
+			dirsnap_close(parent);
 			ng_free(g.ui);
 			ng_free(g.gi);
 			ng_free(g.l.sfv);
 			ng_free(g.l.sfvbackup);
 			ng_free(g.l.leader);
 			ng_free(g.l.race);
-#ifdef USING_GLFTPD
-			buffer_groups(GROUPFILE, gnum);
-			buffer_users(PASSWDFILE, unum);
-#endif
 			remove_lock(&g.v);
 			exit(EXIT_FAILURE);
 		} else {
 			crc = 0;
-			rewinddir(dir);
 			timenow = time(NULL);
-			while ((dp = readdir(dir))) {
-				ext = find_last_of(dp->d_name, ".");
+			names = dirsnap_list(dir, &entries);
+			for (i = 0; i < entries; i++) {
+				name = (char *)names[i];
+				ext = find_last_of(name, ".");
 				if (*ext == '.')
 					ext++;
 				if (!strcasecmp(ext, "zip")) {
-					stat(dp->d_name, &fileinfo);
+					stat(name, &fileinfo);
 					f_uid = fileinfo.st_uid;
 					f_gid = fileinfo.st_gid;
 					if ((timenow == fileinfo.st_ctime) && (fileinfo.st_mode & 0111)) {
-						d_log("rescan.c: Seems this file (%s) is in the process of being uploaded. Ignoring for now.\n", dp->d_name);
+						d_log("rescan.c: Seems this file (%s) is in the process of being uploaded. Ignoring for now.\n", name);
 						continue;
 					}
 #ifdef USING_GLFTPD
@@ -389,22 +352,24 @@ main(int argc, char *argv[])
 					strlcpy(g.v.user.name, argv[1], sizeof(g.v.user.name));
 					strlcpy(g.v.user.group, argv[2], sizeof(g.v.user.group));
 #endif
-					strlcpy(g.v.file.name, dp->d_name, sizeof(g.v.file.name));
+					strlcpy(g.v.file.name, name, sizeof(g.v.file.name));
 					g.v.file.speed = 2005 * 1024;
 					g.v.file.size = fileinfo.st_size;
 					g.v.total.start_time = 0;
 					_err_file_banned(g.v.file.name, &g.v);
+					unzip_argv[0] = unzip_bin;
+					unzip_argv[1] = "-qqt";
+					unzip_argv[2] = g.v.file.name;
+					unzip_argv[3] = NULL;
 #if (test_for_password || extract_nfo)
-					tempstream = telldir(dir);
-					if ((!findfileextcount(dir, ".nfo") || findfileextcount(dir, ".zip")) && !mkdir(".unzipped", 0777))
-						snprintf(exec, sizeof(exec), "%s -qqjo \"%s\" -d .unzipped 2>.delme", unzip_bin, g.v.file.name);
-					else
-						snprintf(exec, sizeof(exec), "%s -qqt \"%s\" 2>.delme", unzip_bin, g.v.file.name);
-					seekdir(dir, tempstream);
-#else
-					snprintf(exec, sizeof(exec), "%s -qqt \"%s\" 2>.delme", unzip_bin, g.v.file.name);
+					if ((!findfileextcount(dir, ".nfo") || findfileextcount(dir, ".zip")) && !mkdir(".unzipped", 0777)) {
+						unzip_argv[1] = "-qqjo";
+						unzip_argv[3] = "-d";
+						unzip_argv[4] = ".unzipped";
+						unzip_argv[5] = NULL;
+					}
 #endif
-					if (system(exec) == 0 || (allow_error2_in_unzip == TRUE && errno < 3 )) {
+					if (run_argv(unzip_argv, NULL, ".delme") == 0 || (allow_error2_in_unzip == TRUE && errno < 3 )) {
 						writerace(g.l.race, &g.v, crc, F_CHECKED);
 					} else {
 						writerace(g.l.race, &g.v, crc, F_BAD);
@@ -414,34 +379,30 @@ main(int argc, char *argv[])
 						continue;
 					}
 #if (test_for_password || extract_nfo || zip_clean)
-					tempstream = telldir(dir);
                         	        if ((!findfileextcount(dir, ".nfo") || findfileextcount(dir, ".zip")) && check_zipfile(".unzipped", g.v.file.name, findfileextcount(dir, ".nfo"))) {
                                 	        d_log("rescan: File %s is password protected.\n", g.v.file.name);
 						writerace(g.l.race, &g.v, crc, F_BAD);
-						if (g.v.file.name)
-							unlink(g.v.file.name);
-						seekdir(dir, tempstream);
+						if (g.v.file.name && !unlink(g.v.file.name))
+							dirsnap_changed();
 						continue;
 	                                }
-					seekdir(dir, tempstream);
 #endif
 					if (!fileexists("file_id.diz")) {
-						snprintf(exec, sizeof(exec), "%s -qqjnCLL \"%s\" file_id.diz 2>.delme", unzip_bin, g.v.file.name);
-						if (execute(exec) != 0) {
+						unzip_argv[1] = "-qqjnCLL";
+						unzip_argv[3] = "file_id.diz";
+						unzip_argv[4] = NULL;
+						if (run_argv(unzip_argv, NULL, ".delme") != 0) {
 							d_log("rescan: No file_id.diz found (#%d): %s\n", errno, strerror(errno));
 						} else {
-							if (fileexists("file_id.diz.bad")) {
-								loc = findfile(dir, "file_id.diz.bad");
-								seekdir(dir, loc);
-								dp = readdir(dir);
-								unlink(dp->d_name);
-							}
+							if ((temp_p = findfile(dir, "file_id.diz.bad")) && !unlink(temp_p))
+								dirsnap_changed();
 							if (chmod("file_id.diz", 0666))
 								d_log("rescan: Failed to chmod %s: %s\n", "file_id.diz", strerror(errno));
 						}
 					}
 				}
 			}
+			ng_free(names);
 
 			if (fileexists(".delme"))
 				unlink(".delme");
@@ -509,22 +470,18 @@ main(int argc, char *argv[])
 			make_sfv(g.l.path);
 			if (!(temp_p = findfileext(dir, ".sfv"))) {
 				d_log("rescan: Freeing memory, removing lock and exiting.\n");
-				unlink(g.l.sfv);
-				if (fileexists(g.l.sfvbackup))
-				unlink(g.l.sfvbackup);
-				unlink(g.l.race);
-				closedir(dir);
-				closedir(parent);
+				st_unlink(g.l.sfv);
+				if (st_exists(g.l.sfvbackup))
+				st_unlink(g.l.sfvbackup);
+				st_unlink(g.l.race);
+				dirsnap_close(dir);
+				dirsnap_close(parent);
 				ng_free(g.ui);
 				ng_free(g.gi);
 				ng_free(g.l.sfv);
 				ng_free(g.l.sfvbackup);
 				ng_free(g.l.leader);
 				ng_free(g.l.race);
-#ifdef USING_GLFTPD
-				buffer_groups(GROUPFILE, gnum);
-				buffer_users(PASSWDFILE, unum);
-#endif
 				remove_lock(&g.v);
 				return 0;
 			}
@@ -541,59 +498,55 @@ main(int argc, char *argv[])
 		if (copysfv(g.v.file.name, g.l.sfv, &g.v)) {
 			printf("Found invalid entries in SFV - Exiting.\n");
 
-			while ((dp = readdir(dir))) {
-				ext = find_last_of(dp->d_name, "-");
+			names = dirsnap_list(dir, &entries);
+			for (i = 0; i < entries; i++) {
+				ext = find_last_of((char *)names[i], "-");
 				if (!strcasecmp(ext, "-missing"))
-					unlink(dp->d_name);
+					unlink(names[i]);
 			}
+			ng_free(names);
 
 			d_log("rescan: Freeing memory, removing lock and exiting\n");
-			unlink(g.l.sfv);
-			if (fileexists(g.l.sfvbackup))
-			unlink(g.l.sfvbackup);
-			unlink(g.l.race);
-			closedir(dir);
-			closedir(parent);
+			st_unlink(g.l.sfv);
+			if (st_exists(g.l.sfvbackup))
+			st_unlink(g.l.sfvbackup);
+			st_unlink(g.l.race);
+			dirsnap_close(dir);
+			dirsnap_close(parent);
 			ng_free(g.ui);
 			ng_free(g.gi);
 			ng_free(g.l.sfv);
 			ng_free(g.l.sfvbackup);
 			ng_free(g.l.leader);
 			ng_free(g.l.race);
-#ifdef USING_GLFTPD
-			buffer_groups(GROUPFILE, gnum);
-			buffer_users(PASSWDFILE, unum);
-#endif
 			remove_lock(&g.v);
 
 			return 0;
 		}
 		g.v.total.start_time = 0;
-		rewinddir(dir);
-		while ((dp = readdir(dir))) {
-			if (*one_name && strncasecmp(one_name, dp->d_name, strlen(one_name)))
+		names = dirsnap_list(dir, &entries);
+		for (i = 0; i < entries; i++) {
+			name = (char *)names[i];
+			if (*one_name && strncasecmp(one_name, name, strlen(one_name)))
 				continue;
 
-			l = (int)strlen(dp->d_name);
+			l = (int)strlen(name);
 
-			ext = find_last_of(dp->d_name, ".-");
+			ext = find_last_of(name, ".-");
 			if (*ext == '.')
 				ext++;
 
 			if (!update_lock(&g.v, 1, 0)) {
 				d_log("rescan: Another process wants the lock - will comply and remove lock, then exit.\n");
-				closedir(dir);
-				closedir(parent);
+				dirsnap_close(dir);
+				dirsnap_close(parent);
 				ng_free(g.ui);
 				ng_free(g.gi);
 				ng_free(g.l.sfv);
 				ng_free(g.l.sfvbackup);
 				ng_free(g.l.leader);
 				ng_free(g.l.race);
-#ifdef USING_GLFTPD
-				buffer_groups(GROUPFILE, gnum);
-				buffer_users(PASSWDFILE, unum);
-#endif
+				ng_free(names);
 				remove_lock(&g.v);
 				exit(EXIT_FAILURE);
 			}
@@ -605,10 +558,10 @@ main(int argc, char *argv[])
 				strcasecmp("nfo", ext) &&
 				strcasecmp("bad", ext) &&
 				strcasecmp("-missing", ext) &&
-				strncmp(dp->d_name, ".", 1)
+				strncmp(name, ".", 1)
 				) {
 
-				stat(dp->d_name, &fileinfo);
+				stat(name, &fileinfo);
 
 				if (S_ISDIR(fileinfo.st_mode))
 					continue;
@@ -626,7 +579,7 @@ main(int argc, char *argv[])
 				strlcpy(g.v.user.group, argv[2], sizeof(g.v.user.group));
 #endif
 
-				strlcpy(g.v.file.name, dp->d_name, sizeof(g.v.file.name));
+				strlcpy(g.v.file.name, name, sizeof(g.v.file.name));
 				g.v.file.speed = 2005 * 1024;
 				g.v.file.size = fileinfo.st_size;
 
@@ -658,8 +611,8 @@ main(int argc, char *argv[])
 #endif
 				}
 
-				if (!rescan_quick || (g.l.race && !match_file(g.l.race, dp->d_name)))
-					crc = calc_crc32(dp->d_name);
+				if (!rescan_quick || (g.l.race && !match_file(g.l.race, name)))
+					crc = calc_crc32_parallel(name);
 				else
  					crc = 1;
 
@@ -668,22 +621,23 @@ main(int argc, char *argv[])
 						unlink_missing(g.v.file.name);
 					if (l > 44) {
 						if (crc == 1)
-							printf("\nFile: %s CHECKED", dp->d_name + l - 44);
+							printf("\nFile: %s CHECKED", name + l - 44);
 						else
-							printf("\nFile: %s %.8x", dp->d_name + l - 44, crc);
+							printf("\nFile: %s %.8x", name + l - 44, crc);
 					} else {
 						if (crc == 1)
-							printf("\nFile: %-44s CHECKED", dp->d_name);
+							printf("\nFile: %-44s CHECKED", name);
 						else
-							printf("\nFile: %-44s %.8x", dp->d_name, crc);
+							printf("\nFile: %-44s %.8x", name, crc);
 					}
 				}
 				if(fflush(stdout))
 					d_log("rescan: ERROR: %s\n", strerror(errno));
-				if (!rescan_quick || (g.l.race && !match_file(g.l.race,	dp->d_name)) || !fileexists(dp->d_name))
+				if (!rescan_quick || (g.l.race && !match_file(g.l.race,	name)) || !fileexists(name))
 					writerace(g.l.race, &g.v, crc, F_NOTCHECKED);
 			}
 		}
+		ng_free(names);
 		printf("\n");
 		testfiles(&g.l, &g.v, 1);
 		printf("\n");
@@ -805,9 +759,8 @@ main(int argc, char *argv[])
 			if (!fileexists(rescan_script)) {
 				d_log("rescan: Warning - rescan_script (%s) - file does not exist!\n", rescan_script);
 			} else {
-				snprintf(target, sizeof(target), rescan_script " \"%s\"", g.v.file.name);
 				_err_file_banned(g.v.file.name, &g.v);
-				if (execute(target) != 0)
+				if (run_cmd(rescan_script, g.v.file.name, NULL, NULL) != 0)
 					d_log("rescan: Failed to execute rescan_script: %s\n", strerror(errno));
 			}
 #endif
@@ -823,11 +776,12 @@ main(int argc, char *argv[])
 		int empty = 1;
 #if (create_missing_sfv_link == TRUE)
 		if ((!matchpath(group_dirs, g.l.path) || create_incomplete_links_in_group_dirs) && g.l.sfv_incomplete && !matchpath(nocheck_dirs, g.l.path) && !matchpath(allowed_types_exemption_dirs, g.l.path)) {
-			rewinddir(dir);
-			while ((dp = readdir(dir))) {
-				stat(dp->d_name, &fileinfo);
+			entries = dirsnap_read(dir);
+			for (i = 0; i < entries; i++) {
+				name = (char *)dirsnap_name(dir, i);
+				stat(name, &fileinfo);
 				if (S_ISREG(fileinfo.st_mode)) {
-					ext = find_last_of(dp->d_name, ".");
+					ext = find_last_of(name, ".");
 					if (*ext == '.')
 						ext++;
 					if (*ext && get_filetype(&g, ext) == 3) {
@@ -849,8 +803,8 @@ main(int argc, char *argv[])
 		}
 	}
 
-	closedir(dir);
-	closedir(parent);
+	dirsnap_close(dir);
+	dirsnap_close(parent);
 
 	printf(" Passed : %i\n", (int)g.v.total.files - (int)g.v.total.files_missing);
 	printf(" Failed : %i\n", (int)g.v.total.files_bad);
@@ -872,10 +826,6 @@ main(int argc, char *argv[])
 
 	updatestats_free(&g);
 
-#ifdef USING_GLFTPD
-	buffer_groups(GROUPFILE, gnum);
-	buffer_users(PASSWDFILE, unum);
-#endif
 
 	exit(0);
 }
@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <spawn.h>
+
+#include "runner.h"
+#include "zsfunctions.h"
+
+#include "../conf/zsconfig.h"
+#include "../include/zsconfig.defaults.h"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+extern char	**environ;
+
+/* Splits cmd into buf and argv, adding arg last. Returns the number of
+ * arguments, or -1 if there were too many or a quote was not closed.
+ */
+static int
+run_split(const char *cmd, const char *arg, char *buf, char **argv)
+{
+	int		argc = 0;
+	char		quote;
+
+	while (*cmd) {
+		while (*cmd == ' ' || *cmd == '\t' || *cmd == '\n')
+			cmd++;
+		if (!*cmd)
+			break;
+		if (argc == RUN_MAXARGS - 2)
+			return -1;
+		argv[argc++] = buf;
+		while (*cmd && *cmd != ' ' && *cmd != '\t' && *cmd != '\n') {
+			if (*cmd == '\'' || *cmd == '"') {
+				quote = *cmd++;
+				while (*cmd && *cmd != quote) {
+					if (quote == '"' && *cmd == '\\' && strchr("\"\\$`", cmd[1]) && cmd[1])
+						cmd++;
+					*buf++ = *cmd++;
+				}
+				if (!*cmd)
+					return -1;
+				cmd++;
+			} else if (*cmd == '\\' && cmd[1]) {
+				*buf++ = cmd[1];
+				cmd += 2;
+			} else
+				*buf++ = *cmd++;
+		}
+		*buf++ = '\0';
+	}
+	if (arg)
+		argv[argc++] = (char *)arg;
+	argv[argc] = NULL;
+	return argv[0] ? argc : -1;
+}
+
+/* Runs argv[0] - looked for in PATH if it has no '/' - with stdout and
+ * stderr to the files out and err when they are not NULL, and waits for it.
+ * Returns its status as waitpid() gives it, or -1 if it could not be run.
+ */
+int
+run_argv(char *const argv[], const char *out, const char *err)
+{
+	int			st, e;
+	pid_t			pid;
+	posix_spawn_file_actions_t	fa;
+
+	posix_spawn_file_actions_init(&fa);
+	if (out)
+		posix_spawn_file_actions_addopen(&fa, 1, out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (err)
+		posix_spawn_file_actions_addopen(&fa, 2, err, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	e = posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	/* whatever it made or removed isn't in the snapshots */
+	dirsnap_changed();
+	if (e) {
+		d_log("run_argv: %s: %s\n", argv[0], strerror(e));
+		errno = e;
+		return -1;
+	}
+	while (waitpid(pid, &st, 0) == -1)
+		if (errno != EINTR) {
+			d_log("run_argv: waitpid(%d): %s\n", (int)pid, strerror(errno));
+			return -1;
+		}
+	return st;
+}
+
+/* run_argv() for the command line cmd, with arg as the last argument when
+ * it is not NULL.
+ */
+int
+run_cmd(const char *cmd, const char *arg, const char *out, const char *err)
+{
+	char	*argv[RUN_MAXARGS], *buf;
+	int	ret;
+
+	buf = ng_realloc2(NULL, strlen(cmd) + 1, 0, 1, 1);
+	if (run_split(cmd, arg, buf, argv) == -1) {
+		d_log("run_cmd: could not split '%s'\n", cmd);
+		ng_free(buf);
+		return -1;
+	}
+	ret = run_argv(argv, out, err);
+	ng_free(buf);
+	return ret;
+}
+
+/* run_cmd() for a script whose outcome zipscript-c does not wait on. With
+ * script_jobs set, it is run by a detached process instead, which waits for
+ * one of the script_jobs slots of the site - a byte of storage/.jobs it keeps
+ * a lock on till the script exits - with no stdin or stdout. Returns 0 once
+ * that process is started.
+ */
+int
+run_job(const char *cmd, const char *arg)
+{
+	int		fd, i, st, slots = script_jobs;
+	char		*argv[RUN_MAXARGS], *buf;
+	pid_t		pid;
+	struct flock	fl;
+
+	if (slots <= 0)
+		return run_cmd(cmd, arg, NULL, NULL);
+
+	buf = ng_realloc2(NULL, strlen(cmd) + 1, 0, 1, 1);
+	if (run_split(cmd, arg, buf, argv) == -1) {
+		d_log("run_job: could not split '%s'\n", cmd);
+		ng_free(buf);
+		return -1;
+	}
+	switch ((pid = fork())) {
+	case -1:
+		d_log("run_job: fork(): %s\n", strerror(errno));
+		ng_free(buf);
+		return run_cmd(cmd, arg, NULL, NULL);
+	case 0:
+		break;
+	default:
+		/* the child leaves at once - its own child is then init's */
+		ng_free(buf);
+		while (waitpid(pid, &st, 0) == -1 && errno == EINTR)
+			;
+		return 0;
+	}
+
+	setsid();
+	if (fork())
+		_exit(EXIT_SUCCESS);
+	for (fd = sysconf(_SC_OPEN_MAX) > 0 && sysconf(_SC_OPEN_MAX) < 65536 ? sysconf(_SC_OPEN_MAX) : 65536; fd-- > 0;)
+		close(fd);
+	if ((fd = open("/dev/null", O_RDWR)) == 0) {
+		dup(fd);
+		dup(fd);
+	}
+	if ((fd = open(storage "/.jobs", O_RDWR | O_CREAT, 0666)) != -1) {
+		memset(&fl, 0, sizeof(fl));
+		fl.l_type = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_len = 1;
+		for (i = 0; i < slots; i++) {
+			fl.l_start = i;
+			if (fcntl(fd, F_SETLK, &fl) == 0)
+				break;
+		}
+		if (i == slots) {
+			fl.l_start = getpid() % slots;
+			while (fcntl(fd, F_SETLKW, &fl) == -1 && errno == EINTR)
+				;
+		}
+	}
+	/* the lock is held through the exec, till the script exits */
+	execvp(argv[0], argv);
+	_exit(127);
+}
@@ -43,7 +43,7 @@ updatestats_free(GLOBAL *g)
  * old doesnt exist
  */
 void 
-updatestats(struct VARS *raceI, struct USERINFO **userI, struct GROUPINFO **groupI, char *usern, char *group, off_t filesize, unsigned long speed, unsigned int start_time)
+updatestats(struct VARS *raceI, struct USERINFO **userI, struct GROUPINFO **groupI, char *usern, char *group, off_t filesize, uint64_t speed, unsigned int start_time)
 {
 	int		u_no = -1;
 	int		g_no = -1;
@@ -117,6 +117,58 @@ updatestats(struct VARS *raceI, struct USERINFO **userI, struct GROUPINFO **grou
  */
 }
 
+/*
+ * Fills userI, groupI and the totals from a race summary, the same way
+ * calling updatestats() for every record in racedata would.
+ */
+void
+summarystats(struct VARS *raceI, struct USERINFO **userI, struct GROUPINFO **groupI, const RACESUMMARY *s)
+{
+	unsigned int	n;
+
+	for (n = 0; n < s->h.users; n++) {
+		ng_free(userI[n]);
+		userI[n] = ng_realloc(userI[n], sizeof(struct USERINFO), 1, 1, raceI, 1);
+		memcpy(userI[n]->name, s->user[n].name, 24);
+		userI[n]->bytes = s->user[n].bytes;
+		userI[n]->speed = s->user[n].speed;
+		userI[n]->files = s->user[n].files;
+		userI[n]->group = s->user[n].group;
+	}
+	for (n = 0; n < s->h.groups; n++) {
+		ng_free(groupI[n]);
+		groupI[n] = ng_realloc(groupI[n], sizeof(struct GROUPINFO), 1, 1, raceI, 1);
+		memcpy(groupI[n]->name, s->group[n].name, 24);
+		groupI[n]->bytes = s->group[n].bytes;
+		groupI[n]->speed = s->group[n].speed;
+		groupI[n]->files = s->group[n].files;
+	}
+	raceI->total.users = s->h.users;
+	raceI->total.groups = s->h.groups;
+
+	if (s->h.users) {
+		raceI->total.start_time = s->h.start_time;
+		if ((int)(raceI->total.stop_time - raceI->total.start_time) < 1)
+			raceI->total.stop_time = raceI->total.start_time + 1;
+	}
+	raceI->total.size += s->h.size;
+	raceI->total.speed += s->h.speed;
+	raceI->total.files_missing -= s->h.files;
+	raceI->total.files_bad += s->h.files_bad;
+	raceI->total.bad_size += s->h.bad_size;
+	if (s->h.nfo)
+		raceI->total.nfo_present = 1;
+
+	if (s->h.fastest_rec != RACESUMMARY_NONE && s->h.fastest_speed > raceI->misc.fastest_user[0]) {
+		raceI->misc.fastest_user[1] = s->h.fastest_user;
+		raceI->misc.fastest_user[0] = s->h.fastest_speed;
+	}
+	if (s->h.slowest_rec != RACESUMMARY_NONE && s->h.slowest_speed < raceI->misc.slowest_user[0]) {
+		raceI->misc.slowest_user[1] = s->h.slowest_user;
+		raceI->misc.slowest_user[0] = s->h.slowest_speed;
+	}
+}
+
 /*
  * Modified   : 01.17.2002 Author     : Dark0n3
  * 
@@ -0,0 +1,1048 @@
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "storage.h"
+#include "race-file.h"
+#include "zsfunctions.h"
+
+#include "../conf/zsconfig.h"
+#include "../include/zsconfig.defaults.h"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifndef HAVE_STRLCPY
+# include "strl/strl.h"
+#endif
+
+/* the race files that go in a container, in the order of its sections */
+static const char *st_names[] = { "racedata", "sfvdata", "headdata", "journal", "leader", "sfvbackup" };
+
+#define ST_NAMES	(int)(sizeof(st_names) / sizeof(*st_names))
+#define ST_HEADDATA	2
+#define ST_JOURNAL	3
+#define ST_HANDLE	0x40000000	/* the handle of a section is ST_HANDLE + its number */
+#define ST_SECT(h)	((h) >= ST_HANDLE && (h) < ST_HANDLE + CONTAINER_SECTS)
+#define ST_ROUND(n)	(((uint64_t)(n) + 511) & ~(uint64_t)511)
+#define ST_HEADCAP	ST_ROUND(sizeof(HEADDATA) + sizeof(RACESUMMARY))
+#define ST_COMPACT	65536		/* smallest container worth rewriting */
+
+/* the container in use - there is one at a time */
+static int		ct_fd = -1;
+static dev_t		ct_dev;
+static ino_t		ct_ino;
+static char		ct_dir[PATH_MAX];
+static CONTAINER_HEAD	ct_head;
+static CONTAINER_SECT	ct_sect[CONTAINER_SECTS];
+
+/* the mapping st_mapshared() made of headdata in a container - moved over
+ * to the container that is written in its place */
+static char		*ct_wmap;
+static size_t		ct_wlen;
+static dev_t		ct_wdev;
+static ino_t		ct_wino;
+static char		ct_wdir[PATH_MAX];
+
+/* the release kept in memory by st_resident(), and its container */
+static int		ct_rfd = -1;
+static char		ct_rdir[PATH_MAX];
+
+/* Returns the section path is, and puts its dir (with the trailing /) in
+ * dir - or returns -1 if it is not one of the race files.
+ */
+static int
+st_section(const char *path, char *dir, size_t size)
+{
+	const char	*p = strrchr(path, '/');
+	int		n;
+
+	if (!p)
+		return -1;
+	for (n = 0; n < ST_NAMES && strcmp(p + 1, st_names[n]); n++);
+	if (n == ST_NAMES)
+		return -1;
+	snprintf(dir, size, "%.*s", (int)(p - path + 1), path);
+	return n;
+}
+
+/* 1 if the race files in dir are in a container - their own, or the one in
+ * memory of st_resident().
+ */
+static int
+st_contained(const char *dir)
+{
+	return storage_container || (ct_rfd != -1 && !strcmp(dir, ct_rdir));
+}
+
+/* Reads all of the file at path into a new buffer. Returns its length,
+ * or -1 on error.
+ */
+static ssize_t
+st_slurp(const char *path, char **buf)
+{
+	int		fd;
+	ssize_t		n = -1;
+	struct stat	st;
+
+	*buf = NULL;
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+		*buf = ng_realloc2(NULL, st.st_size + 1, 0, 1, 1);
+		if ((n = pread(fd, *buf, st.st_size, 0)) != st.st_size) {
+			d_log("st_slurp: read(%s) failed: %s\n", path, strerror(errno));
+			*buf = ng_free(*buf);
+			n = -1;
+		}
+	}
+	close(fd);
+	return n;
+}
+
+/* Writes the iovcnt buffers in iov to a temp file next to path, and
+ * renames it over path - or, with keep set, links it there unless path
+ * exists already. Returns 0 on success.
+ */
+static int
+st_write_file(const char *path, const struct iovec *iov, int iovcnt, int keep)
+{
+	int		fd, n, ret = 0;
+	size_t		len = 0;
+	char		tmppath[PATH_MAX + 16];
+
+	if (keep)
+		snprintf(tmppath, sizeof(tmppath), "%s.%d.tmp", path, (int)getpid());
+	else
+		snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	if ((fd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY, 0666)) == -1) {
+		d_log("st_write_file: open(%s): %s\n", tmppath, strerror(errno));
+		return -1;
+	}
+	for (n = 0; n < iovcnt; n++)
+		len += iov[n].iov_len;
+	if (writev(fd, iov, iovcnt) != (ssize_t)len) {
+		d_log("st_write_file: write(%s) failed: %s\n", tmppath, strerror(errno));
+		ret = -1;
+	}
+	close(fd);
+
+	if (!ret && keep && link(tmppath, path) == -1 && errno != EEXIST) {
+		d_log("st_write_file: link(%s, %s): %s\n", tmppath, path, strerror(errno));
+		ret = -1;
+	} else if (!ret && !keep && rename(tmppath, path) == -1) {
+		d_log("st_write_file: rename(%s, %s): %s\n", tmppath, path, strerror(errno));
+		ret = -1;
+	}
+	if (ret || keep)
+		unlink(tmppath);
+	return ret;
+}
+
+/* Lays out a container with the sections in data (NULL for none) in a new
+ * buffer, and puts its length in size.
+ */
+static char *
+ct_image(uint32_t id, const uint32_t *gen, char *const *data, const uint64_t *len, uint64_t *size)
+{
+	int		n;
+	uint64_t	off = CONTAINER_DATA + ST_HEADCAP;
+	char		*buf;
+	CONTAINER_HEAD	h;
+	CONTAINER_SECT	s[CONTAINER_SECTS];
+
+	bzero(&h, sizeof(h));
+	bzero(s, sizeof(s));
+	h.magic = CONTAINER_MAGIC;
+	h.id = id;
+	h.sects = CONTAINER_SECTS;
+	for (n = 0; n < ST_NAMES; n++) {
+		strlcpy(s[n].name, st_names[n], sizeof(s[n].name));
+		s[n].gen = gen ? gen[n] : 1;
+		if (n == ST_HEADDATA) {
+			/* always there, so that opening it never changes the table */
+			s[n].offset = CONTAINER_DATA;
+			s[n].cap = ST_HEADCAP;
+			s[n].len = data[n] && len[n] < ST_HEADCAP ? len[n] : 0;
+		} else if (data[n]) {
+			s[n].offset = off;
+			s[n].len = len[n];
+			s[n].cap = ST_ROUND(len[n] + len[n] / 4 + 1);
+			off += s[n].cap;
+		}
+	}
+	h.size = off;
+
+	buf = ng_realloc2(NULL, off, 1, 1, 1);
+	memcpy(buf, &h, sizeof(h));
+	memcpy(buf + sizeof(h), s, sizeof(s));
+	for (n = 0; n < ST_NAMES; n++)
+		if (s[n].len)
+			memcpy(buf + s[n].offset, data[n], s[n].len);
+	*size = off;
+	return buf;
+}
+
+/* Writes a container in dir with the sections in data (NULL for none),
+ * over the one there - or, with keep set, only if there is none.
+ * Returns 0 on success.
+ */
+static int
+ct_build(const char *dir, uint32_t id, const uint32_t *gen, char *const *data, const uint64_t *len, int keep)
+{
+	int		ret;
+	uint64_t	size;
+	char		*buf, path[PATH_MAX + 16];
+	struct iovec	iov;
+
+	buf = ct_image(id, gen, data, len, &size);
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	snprintf(path, sizeof(path), "%scontainer", dir);
+	ret = st_write_file(path, &iov, 1, keep);
+	ng_free(buf);
+	return ret;
+}
+
+/* Creates the container in dir from the race files there, and removes
+ * them - or creates an empty one if there are none and create is set.
+ * Returns 0, or -1 with errno set.
+ */
+static int
+ct_import(const char *dir, int create)
+{
+	int		n, found = 0, ret;
+	ssize_t		l;
+	char		*data[CONTAINER_SECTS], path[PATH_MAX + 16];
+	uint64_t	len[CONTAINER_SECTS];
+
+	bzero(data, sizeof(data));
+	bzero(len, sizeof(len));
+	for (n = 0; n < ST_NAMES; n++) {
+		/* the journal is of the files, so of no use once they are gone */
+		if (n == ST_JOURNAL)
+			continue;
+		snprintf(path, sizeof(path), "%s%s", dir, st_names[n]);
+		if ((l = st_slurp(path, &data[n])) != -1) {
+			len[n] = (uint64_t)l;
+			found++;
+		}
+	}
+	if (!found && !create) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (!(ret = ct_build(dir, (uint32_t)(time(NULL) ^ (getpid() << 16)), NULL, data, len, 1)) && found) {
+		for (n = 0; n < ST_NAMES; n++) {
+			snprintf(path, sizeof(path), "%s%s", dir, st_names[n]);
+			if (data[n] || n == ST_JOURNAL)
+				unlink(path);
+		}
+		d_log("ct_import: moved %d race files in %s to a container\n", found, dir);
+	}
+	for (n = 0; n < ST_NAMES; n++)
+		ng_free(data[n]);
+	if (ret)
+		errno = EIO;
+	return ret;
+}
+
+/* Reads the head and section table of the container in use. */
+static int
+ct_load(void)
+{
+	char		buf[sizeof(CONTAINER_HEAD) + sizeof(ct_sect)];
+
+	if (pread(ct_fd, buf, sizeof(buf), 0) == sizeof(buf)) {
+		memcpy(&ct_head, buf, sizeof(CONTAINER_HEAD));
+		memcpy(ct_sect, buf + sizeof(CONTAINER_HEAD), sizeof(ct_sect));
+		if (ct_head.magic == CONTAINER_MAGIC && ct_head.sects == CONTAINER_SECTS)
+			return 0;
+	}
+	d_log("ct_load: %scontainer is not a valid container\n", ct_dir);
+	close(ct_fd);
+	ct_fd = -1;
+	errno = EINVAL;
+	return -1;
+}
+
+/* Moves the mapping of headdata over to the container in use, at the same
+ * address - headdata is at the same place in every container.
+ */
+static void
+ct_remap(void)
+{
+	size_t		skew = CONTAINER_DATA % sysconf(_SC_PAGESIZE);
+
+	if (mmap(ct_wmap - skew, ct_wlen + skew, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, ct_fd, CONTAINER_DATA - skew) == MAP_FAILED) {
+		d_log("ct_remap: mmap(%scontainer): %s\n", ct_dir, strerror(errno));
+		return;
+	}
+	ct_wdev = ct_dev;
+	ct_wino = ct_ino;
+}
+
+/* Makes the container in dir the one in use, and reads its section table.
+ * With storage_container set, it is created - from the race files there,
+ * if there are any - when it does not exist yet. The container of the
+ * release kept in memory is the one st_resident() was given. Returns 0, or
+ * -1 with errno set.
+ */
+static int
+ct_attach(const char *dir, int create)
+{
+	int		resident = ct_rfd != -1 && !strcmp(dir, ct_rdir);
+	char		path[PATH_MAX + 16];
+	struct stat	st;
+
+	snprintf(path, sizeof(path), "%scontainer", dir);
+	if (resident) {
+		if (fstat(ct_rfd, &st) == -1)
+			return -1;
+	} else if (stat(path, &st) == -1 &&
+	    (errno != ENOENT || !storage_container || ct_import(dir, create) == -1 || stat(path, &st) == -1))
+		return -1;
+	if (ct_fd == -1 || st.st_dev != ct_dev || st.st_ino != ct_ino) {
+		if (ct_fd != -1)
+			close(ct_fd);
+		if (resident)
+			ct_fd = dup(ct_rfd);
+		else if ((ct_fd = open(path, O_RDWR)) == -1 && errno == EACCES)
+			ct_fd = open(path, O_RDONLY);
+		if (ct_fd == -1)
+			return -1;
+		if (fstat(ct_fd, &st) == -1) {
+			close(ct_fd);
+			ct_fd = -1;
+			return -1;
+		}
+		ct_dev = st.st_dev;
+		ct_ino = st.st_ino;
+	}
+	strlcpy(ct_dir, dir, sizeof(ct_dir));
+	if (ct_load() == -1)
+		return -1;
+	if (ct_wmap && (ct_wdev != ct_dev || ct_wino != ct_ino) && !strcmp(ct_wdir, dir))
+		ct_remap();
+	return 0;
+}
+
+static int
+ct_put_head(void)
+{
+	return pwrite(ct_fd, &ct_head, sizeof(CONTAINER_HEAD), 0) == sizeof(CONTAINER_HEAD) ? 0 : -1;
+}
+
+static int
+ct_put_sect(int n)
+{
+	return pwrite(ct_fd, &ct_sect[n], sizeof(CONTAINER_SECT), sizeof(CONTAINER_HEAD) + n * sizeof(CONTAINER_SECT)) == sizeof(CONTAINER_SECT) ? 0 : -1;
+}
+
+/* Reserves len bytes at the end of the container. The head is written
+ * before anything is put there, so a crash only ever leaks the room.
+ */
+static uint64_t
+ct_alloc(uint64_t len)
+{
+	uint64_t	off = ct_head.size;
+
+	ct_head.size += len;
+	if (ct_put_head() == -1)
+		d_log("ct_alloc: write to %scontainer failed: %s\n", ct_dir, strerror(errno));
+	return off;
+}
+
+/* Moves section n to a place with room for need bytes. */
+static int
+ct_grow(int n, uint64_t need)
+{
+	uint64_t	off, cap = ST_ROUND(need > ct_sect[n].cap * 2 ? need : ct_sect[n].cap * 2);
+	char		*buf = NULL;
+
+	if (n == ST_HEADDATA) {
+		errno = EFBIG;
+		return -1;
+	}
+	if (ct_sect[n].len) {
+		buf = ng_realloc2(NULL, ct_sect[n].len, 0, 1, 1);
+		if (pread(ct_fd, buf, ct_sect[n].len, ct_sect[n].offset) != (ssize_t)ct_sect[n].len) {
+			ng_free(buf);
+			return -1;
+		}
+	}
+	off = ct_alloc(cap);
+	if (buf && pwrite(ct_fd, buf, ct_sect[n].len, off) != (ssize_t)ct_sect[n].len) {
+		ng_free(buf);
+		return -1;
+	}
+	ng_free(buf);
+	ct_sect[n].offset = off;
+	ct_sect[n].cap = cap;
+	return ct_put_sect(n);
+}
+
+/* Rewrites the container in use without the room no section uses, if that
+ * is more than half of it.
+ */
+static void
+ct_compact(void)
+{
+	int		n;
+	uint64_t	used = CONTAINER_DATA + ST_HEADCAP, len[CONTAINER_SECTS];
+	uint32_t	gen[CONTAINER_SECTS];
+	char		*data[CONTAINER_SECTS], dir[PATH_MAX];
+
+	/* the one in memory is laid out anew by st_resident_save() */
+	if (ct_rfd != -1 && !strcmp(ct_dir, ct_rdir))
+		return;
+	for (n = 0; n < CONTAINER_SECTS; n++)
+		if (n != ST_HEADDATA && ct_sect[n].offset)
+			used += ct_sect[n].cap;
+	if (ct_head.size < ST_COMPACT || (ct_head.size - used) * 2 < ct_head.size)
+		return;
+
+	bzero(data, sizeof(data));
+	for (n = 0; n < ST_NAMES; n++) {
+		gen[n] = ct_sect[n].gen;
+		len[n] = ct_sect[n].len;
+		if (!ct_sect[n].offset)
+			continue;
+		data[n] = ng_realloc2(NULL, len[n] + 1, 0, 1, 1);
+		if (pread(ct_fd, data[n], len[n], ct_sect[n].offset) != (ssize_t)len[n])
+			break;
+	}
+	strlcpy(dir, ct_dir, sizeof(dir));
+	if (n == ST_NAMES && !ct_build(dir, ct_head.id, gen, data, len, 0)) {
+		d_log("ct_compact: rewrote %scontainer (%llu of %llu bytes were unused)\n", dir,
+		      (unsigned long long)(ct_head.size - used), (unsigned long long)ct_head.size);
+		ct_attach(dir, 0);
+	}
+	for (n = 0; n < ST_NAMES; n++)
+		ng_free(data[n]);
+}
+
+/* Moves the sections of the container in dir, if there is one, back to
+ * files of their own. Returns 1 if it did, 0 if there was no container.
+ */
+static int
+ct_export(const char *dir)
+{
+	int		n;
+	char		*buf, path[PATH_MAX + 16];
+	struct iovec	iov;
+
+	snprintf(path, sizeof(path), "%scontainer", dir);
+	if (access(path, F_OK) == -1 || ct_attach(dir, 0) == -1)
+		return 0;
+	for (n = 0; n < ST_NAMES; n++) {
+		if (n == ST_JOURNAL || !ct_sect[n].offset)
+			continue;
+		buf = ng_realloc2(NULL, ct_sect[n].len + 1, 0, 1, 1);
+		if (pread(ct_fd, buf, ct_sect[n].len, ct_sect[n].offset) == (ssize_t)ct_sect[n].len) {
+			snprintf(path, sizeof(path), "%s%s", dir, st_names[n]);
+			iov.iov_base = buf;
+			iov.iov_len = ct_sect[n].len;
+			st_write_file(path, &iov, 1, 1);
+		}
+		ng_free(buf);
+	}
+	snprintf(path, sizeof(path), "%scontainer", dir);
+	unlink(path);
+	close(ct_fd);
+	ct_fd = -1;
+	d_log("ct_export: moved the race files in %s out of their container\n", dir);
+	return 1;
+}
+
+/* open() for the race files. Returns a handle for the other st_
+ * functions, or -1 on error.
+ */
+int
+st_open(const char *path, int flags, mode_t mode)
+{
+	int		n, fd;
+	char		dir[PATH_MAX];
+
+	if ((n = st_section(path, dir, sizeof(dir))) == -1)
+		return open(path, flags, mode);
+	if (!st_contained(dir)) {
+		if ((fd = open(path, flags & ~O_CREAT, mode)) == -1 && errno == ENOENT && (ct_export(dir) || (flags & O_CREAT)))
+			fd = open(path, flags, mode);
+		return fd;
+	}
+
+	if (ct_attach(dir, flags & O_CREAT) == -1)
+		return -1;
+	if (!ct_sect[n].offset) {
+		if (!(flags & O_CREAT)) {
+			errno = ENOENT;
+			return -1;
+		}
+		ct_sect[n].cap = ST_ROUND(1);
+		ct_sect[n].offset = ct_alloc(ct_sect[n].cap);
+		ct_sect[n].len = 0;
+		ct_sect[n].gen++;
+		if (ct_put_sect(n) == -1)
+			return -1;
+	} else if ((flags & O_TRUNC) && ct_sect[n].len) {
+		ct_sect[n].len = 0;
+		if (ct_put_sect(n) == -1)
+			return -1;
+	}
+	return ST_HANDLE + n;
+}
+
+int
+st_close(int h)
+{
+	return ST_SECT(h) ? 0 : close(h);
+}
+
+ssize_t
+st_pread(int h, void *buf, size_t len, off_t off)
+{
+	CONTAINER_SECT	*s;
+
+	if (!ST_SECT(h))
+		return pread(h, buf, len, off);
+	s = &ct_sect[h - ST_HANDLE];
+	if ((uint64_t)off >= s->len)
+		return 0;
+	if ((uint64_t)off + len > s->len)
+		len = s->len - off;
+	return pread(ct_fd, buf, len, s->offset + off);
+}
+
+ssize_t
+st_pwrite(int h, const void *buf, size_t len, off_t off)
+{
+	ssize_t		ret;
+	CONTAINER_SECT	*s;
+
+	if (!ST_SECT(h))
+		return pwrite(h, buf, len, off);
+	s = &ct_sect[h - ST_HANDLE];
+	if ((uint64_t)off + len > s->cap && ct_grow(h - ST_HANDLE, off + len) == -1)
+		return -1;
+	if ((ret = pwrite(ct_fd, buf, len, s->offset + off)) > 0 && (uint64_t)off + ret > s->len) {
+		s->len = off + ret;
+		if (ct_put_sect(h - ST_HANDLE) == -1)
+			return -1;
+	}
+	return ret;
+}
+
+/* writev() to the end of a file opened with O_APPEND. */
+ssize_t
+st_append(int h, const struct iovec *iov, int iovcnt)
+{
+	int		n;
+	ssize_t		ret = 0;
+
+	if (!ST_SECT(h))
+		return writev(h, iov, iovcnt);
+	for (n = 0; n < iovcnt; n++) {
+		if (st_pwrite(h, iov[n].iov_base, iov[n].iov_len, ct_sect[h - ST_HANDLE].len) != (ssize_t)iov[n].iov_len)
+			return -1;
+		ret += iov[n].iov_len;
+	}
+	return ret;
+}
+
+/* fstat() - a section gets the times of the container, and its own size. */
+int
+st_fstat(int h, struct stat *st)
+{
+	if (!ST_SECT(h))
+		return fstat(h, st);
+	if (fstat(ct_fd, st) == -1)
+		return -1;
+	st->st_size = ct_sect[h - ST_HANDLE].len;
+	return 0;
+}
+
+/* ftruncate() - a section can only be shrunk. */
+int
+st_ftruncate(int h, off_t len)
+{
+	if (!ST_SECT(h))
+		return ftruncate(h, len);
+	if ((uint64_t)len > ct_sect[h - ST_HANDLE].len) {
+		errno = EINVAL;
+		return -1;
+	}
+	ct_sect[h - ST_HANDLE].len = len;
+	return ct_put_sect(h - ST_HANDLE);
+}
+
+int
+st_fdatasync(int h)
+{
+	return fdatasync(ST_SECT(h) ? ct_fd : h);
+}
+
+/* Identifies what h refers to: dev and inode of a file, or container id
+ * and gen of a section - they change when it is replaced.
+ */
+int
+st_ident(int h, uint64_t *id, uint64_t *gen)
+{
+	struct stat	st;
+
+	if (ST_SECT(h)) {
+		*id = ct_head.id;
+		*gen = ct_sect[h - ST_HANDLE].gen;
+		return 0;
+	}
+	if (fstat(h, &st) == -1)
+		return -1;
+	*id = st.st_dev;
+	*gen = st.st_ino;
+	return 0;
+}
+
+/* Maps path read-only. An empty file gives map NULL and len 0.
+ * Returns 0, or -1 on error.
+ */
+int
+st_map(const char *path, void **map, size_t *len)
+{
+	int		n, fd;
+	size_t		skew;
+	char		dir[PATH_MAX], *p;
+	struct stat	st;
+
+	*map = NULL;
+	*len = 0;
+	if ((n = st_section(path, dir, sizeof(dir))) != -1 && st_contained(dir)) {
+		if (ct_attach(dir, 0) == -1)
+			return -1;
+		if (!ct_sect[n].offset) {
+			errno = ENOENT;
+			return -1;
+		}
+		if (!ct_sect[n].len)
+			return 0;
+		skew = ct_sect[n].offset % sysconf(_SC_PAGESIZE);
+		if ((p = mmap(NULL, ct_sect[n].len + skew, PROT_READ, MAP_SHARED, ct_fd, ct_sect[n].offset - skew)) == MAP_FAILED)
+			return -1;
+		*map = p + skew;
+		*len = ct_sect[n].len;
+		return 0;
+	}
+
+	if ((fd = st_open(path, O_RDONLY, 0)) == -1)
+		return -1;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		close(fd);
+		errno = EISDIR;
+		return -1;
+	}
+	if (st.st_size && (*map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		*map = NULL;
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	*len = st.st_size;
+	return 0;
+}
+
+void
+st_unmap(void *map, size_t len)
+{
+	size_t		skew = (uintptr_t)map % sysconf(_SC_PAGESIZE);
+
+	if (map)
+		munmap((char *)map - skew, len + skew);
+}
+
+/* Maps the first len bytes of path read-write and shared, so that changes
+ * made through it are seen by the other processes at once. The file is
+ * grown to len if it is shorter. Of a container, only headdata can be
+ * mapped, as the section that never moves - and one mapping of it at a
+ * time, which is kept on it when the container is rewritten. Returns the
+ * mapping, or NULL on error.
+ */
+void *
+st_mapshared(const char *path, size_t len)
+{
+	int		n, fd;
+	size_t		skew;
+	char		dir[PATH_MAX], zero[ST_HEADCAP], *p;
+	struct stat	st;
+
+	if ((n = st_section(path, dir, sizeof(dir))) != -1 && st_contained(dir)) {
+		if (n != ST_HEADDATA || len > ST_HEADCAP || ct_wmap) {
+			errno = EINVAL;
+			return NULL;
+		}
+		if (ct_attach(dir, 1) == -1)
+			return NULL;
+		if (ct_sect[n].len < len) {
+			bzero(zero, sizeof(zero));
+			if (pwrite(ct_fd, zero, len - ct_sect[n].len, ct_sect[n].offset + ct_sect[n].len) != (ssize_t)(len - ct_sect[n].len))
+				return NULL;
+			ct_sect[n].len = len;
+			if (ct_put_sect(n) == -1)
+				return NULL;
+		}
+		skew = CONTAINER_DATA % sysconf(_SC_PAGESIZE);
+		if ((p = mmap(NULL, len + skew, PROT_READ | PROT_WRITE, MAP_SHARED, ct_fd, CONTAINER_DATA - skew)) == MAP_FAILED)
+			return NULL;
+		ct_wmap = p + skew;
+		ct_wlen = len;
+		ct_wdev = ct_dev;
+		ct_wino = ct_ino;
+		strlcpy(ct_wdir, dir, sizeof(ct_wdir));
+		return ct_wmap;
+	}
+
+	if ((fd = st_open(path, O_RDWR, 0)) == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1 || ((size_t)st.st_size < len && ftruncate(fd, len) == -1)) {
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+void
+st_unmapshared(void *map, size_t len)
+{
+	if (map && map == ct_wmap)
+		ct_wmap = NULL;
+	st_unmap(map, len);
+}
+
+/* Replaces path with the iovcnt buffers in iov, so that readers see either
+ * all of the old or all of the new contents. Returns 0 on success.
+ */
+int
+st_replace(const char *path, const struct iovec *iov, int iovcnt)
+{
+	int		n, i;
+	uint64_t	off, len = 0;
+	char		dir[PATH_MAX];
+	CONTAINER_SECT	*s;
+
+	if ((n = st_section(path, dir, sizeof(dir))) == -1)
+		return st_write_file(path, iov, iovcnt, 0);
+	if (!st_contained(dir)) {
+		if (access(path, F_OK) == -1 && errno == ENOENT)
+			ct_export(dir);
+		return st_write_file(path, iov, iovcnt, 0);
+	}
+
+	if (ct_attach(dir, 1) == -1) {
+		d_log("st_replace: no container for %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	s = &ct_sect[n];
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (n == ST_HEADDATA) {
+		if (len > s->cap) {
+			errno = EFBIG;
+			return -1;
+		}
+		off = s->offset;
+	} else
+		off = ct_alloc(ST_ROUND(len + len / 4 + 1));
+	for (i = 0; i < iovcnt; off += iov[i].iov_len, i++)
+		if (pwrite(ct_fd, iov[i].iov_base, iov[i].iov_len, off) != (ssize_t)iov[i].iov_len) {
+			d_log("st_replace: write to %scontainer failed: %s\n", dir, strerror(errno));
+			return -1;
+		}
+	if (n != ST_HEADDATA) {
+		s->offset = off - len;
+		s->cap = ST_ROUND(len + len / 4 + 1);
+	}
+	s->len = len;
+	s->gen++;
+	if (ct_put_sect(n) == -1) {
+		d_log("st_replace: write to %scontainer failed: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	ct_compact();
+	return 0;
+}
+
+/* Returns 1 if path exists, 0 if not. */
+int
+st_exists(const char *path)
+{
+	int		n;
+	char		dir[PATH_MAX];
+
+	if ((n = st_section(path, dir, sizeof(dir))) == -1)
+		return access(path, R_OK) == -1 ? 0 : 1;
+	if (!st_contained(dir))
+		return access(path, R_OK) != -1 || (errno == ENOENT && ct_export(dir) && access(path, R_OK) != -1);
+	return ct_attach(dir, 0) != -1 && ct_sect[n].offset;
+}
+
+int
+st_unlink(const char *path)
+{
+	int		n;
+	char		dir[PATH_MAX];
+
+	if ((n = st_section(path, dir, sizeof(dir))) == -1)
+		return unlink(path);
+	if (!st_contained(dir)) {
+		if (!unlink(path))
+			return 0;
+		return errno == ENOENT && ct_export(dir) ? unlink(path) : -1;
+	}
+
+	if (ct_attach(dir, 0) == -1)
+		return -1;
+	if (!ct_sect[n].offset) {
+		errno = ENOENT;
+		return -1;
+	}
+	/* the room of headdata is kept, as it never moves */
+	if (n != ST_HEADDATA)
+		ct_sect[n].offset = ct_sect[n].cap = 0;
+	ct_sect[n].len = 0;
+	ct_sect[n].gen++;
+	return ct_put_sect(n);
+}
+
+/* Copies the file from to path. Returns 0 on success, 1 on error - as
+ * copyfile() does.
+ */
+int
+st_import(const char *from, const char *path)
+{
+	int		ret;
+	ssize_t		len;
+	char		*buf;
+	struct iovec	iov;
+
+	if ((len = st_slurp(from, &buf)) == -1) {
+		d_log("st_import: cannot read %s: %s\n", from, strerror(errno));
+		return 1;
+	}
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	ret = st_replace(path, &iov, 1);
+	ng_free(buf);
+	return ret ? 1 : 0;
+}
+
+/* Copies path to the file to. Returns 0 on success, 1 on error. */
+int
+st_export(const char *path, const char *to)
+{
+	int		h, fd, ret = 1;
+	char		*buf;
+	struct stat	st;
+
+	if ((h = st_open(path, O_RDONLY, 0)) == -1) {
+		d_log("st_export: cannot open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (st_fstat(h, &st) != -1) {
+		buf = ng_realloc2(NULL, st.st_size + 1, 0, 1, 1);
+		if (st_pread(h, buf, st.st_size, 0) != st.st_size)
+			d_log("st_export: read(%s) failed: %s\n", path, strerror(errno));
+		else if ((fd = open(to, O_CREAT | O_TRUNC | O_WRONLY, 0666)) == -1)
+			d_log("st_export: open(%s): %s\n", to, strerror(errno));
+		else {
+			if (write(fd, buf, st.st_size) == st.st_size)
+				ret = 0;
+			else
+				d_log("st_export: write(%s) failed: %s\n", to, strerror(errno));
+			close(fd);
+		}
+		ng_free(buf);
+	}
+	st_close(h);
+	return ret;
+}
+
+/* Returns the file that holds path - for link() and the like. */
+const char *
+st_file(const char *path)
+{
+	static char	file[PATH_MAX + 16];
+	char		dir[PATH_MAX];
+
+	if (!storage_container || st_section(path, dir, sizeof(dir)) == -1)
+		return path;
+	snprintf(file, sizeof(file), "%scontainer", dir);
+	return file;
+}
+
+/* Makes the st_ functions use the container in fd for the race files in
+ * dir - the release the zsd daemon keeps in memory, in the upload it runs.
+ */
+void
+st_resident(const char *dir, int fd)
+{
+	strlcpy(ct_rdir, dir, sizeof(ct_rdir));
+	ct_rfd = fd;
+}
+
+/* Returns 1 if the race files in dir are those kept in memory. */
+int
+st_isresident(const char *dir)
+{
+	return ct_rfd != -1 && !strcmp(dir, ct_rdir);
+}
+
+/* Reads the race files in dir into fd, as a container to be given to
+ * st_resident(). The lock fields of headdata are cleared - they are of the
+ * lock held on the files. Returns 0, or -1 on error.
+ */
+int
+st_resident_load(const char *dir, int fd)
+{
+	int		n, h, ret = 0;
+	char		*buf, *data[CONTAINER_SECTS], path[PATH_MAX + 16];
+	uint64_t	len[CONTAINER_SECTS], size;
+	struct stat	st;
+	HEADDATA	*hd;
+
+	bzero(data, sizeof(data));
+	bzero(len, sizeof(len));
+	for (n = 0; n < ST_NAMES && !ret; n++) {
+		/* the journal is of the files, and empty while their lock is held */
+		if (n == ST_JOURNAL)
+			continue;
+		snprintf(path, sizeof(path), "%s%s", dir, st_names[n]);
+		if ((h = st_open(path, O_RDONLY, 0)) == -1) {
+			if (errno != ENOENT) {
+				d_log("st_resident_load: open(%s): %s\n", path, strerror(errno));
+				ret = -1;
+			}
+			continue;
+		}
+		if (st_fstat(h, &st) == -1)
+			ret = -1;
+		else {
+			data[n] = ng_realloc2(NULL, st.st_size + 1, 0, 1, 1);
+			len[n] = st.st_size;
+			if (st_pread(h, data[n], st.st_size, 0) != st.st_size) {
+				d_log("st_resident_load: read(%s) failed: %s\n", path, strerror(errno));
+				ret = -1;
+			}
+		}
+		st_close(h);
+	}
+	if (!ret) {
+		if (data[ST_HEADDATA] && len[ST_HEADDATA] >= sizeof(HEADDATA)) {
+			hd = (HEADDATA *)data[ST_HEADDATA];
+			hd->data_in_use = hd->data_incrementor = hd->data_queue = hd->data_qcurrent = hd->data_pid = 0;
+		}
+		buf = ct_image((uint32_t)(time(NULL) ^ (getpid() << 16)), NULL, data, len, &size);
+		if (pwrite(fd, buf, size, 0) != (ssize_t)size || ftruncate(fd, size) == -1) {
+			d_log("st_resident_load: write failed: %s\n", strerror(errno));
+			ret = -1;
+		}
+		ng_free(buf);
+	}
+	for (n = 0; n < ST_NAMES; n++)
+		ng_free(data[n]);
+	return ret;
+}
+
+/* Writes the race files kept in fd back to dir, and lays fd out anew
+ * without the room its sections no longer use. headdata is written in
+ * place, but for its lock fields. Only to be called with the lock of the
+ * release held, and nobody using fd. Returns 0, or -1 on error.
+ */
+int
+st_resident_save(const char *dir, int fd)
+{
+	int		n, h, ret = 0;
+	char		*buf, *data[CONTAINER_SECTS], path[PATH_MAX + 16];
+	uint32_t	gen[CONTAINER_SECTS];
+	uint64_t	len[CONTAINER_SECTS], size;
+	struct iovec	iov;
+	CONTAINER_HEAD	head;
+	CONTAINER_SECT	sect[CONTAINER_SECTS];
+	HEADDATA	*hd;
+
+	if (pread(fd, &head, sizeof(head), 0) != sizeof(head) || head.magic != CONTAINER_MAGIC ||
+	    head.sects != CONTAINER_SECTS || pread(fd, sect, sizeof(sect), sizeof(head)) != sizeof(sect)) {
+		d_log("st_resident_save: the race files of %s in memory are not a valid container\n", dir);
+		return -1;
+	}
+	bzero(data, sizeof(data));
+	for (n = 0; n < ST_NAMES; n++) {
+		gen[n] = sect[n].gen;
+		len[n] = sect[n].len;
+		if (!sect[n].offset || n == ST_JOURNAL)
+			continue;
+		data[n] = ng_realloc2(NULL, len[n] + 1, 0, 1, 1);
+		if (pread(fd, data[n], len[n], sect[n].offset) != (ssize_t)len[n]) {
+			d_log("st_resident_save: read failed: %s\n", strerror(errno));
+			ret = -1;
+		}
+	}
+
+	for (n = 0; n < ST_NAMES && !ret; n++) {
+		if (n == ST_JOURNAL)
+			continue;
+		snprintf(path, sizeof(path), "%s%s", dir, st_names[n]);
+		if (n == ST_HEADDATA) {
+			/* the lock fields are left to those waiting for the lock */
+			if (!data[n] || len[n] < sizeof(HEADDATA))
+				continue;
+			hd = (HEADDATA *)data[n];
+			if ((h = st_open(path, O_CREAT | O_RDWR, 0666)) == -1 ||
+			    st_pwrite(h, &hd->data_version, 2 * sizeof(unsigned int), offsetof(HEADDATA, data_version)) == -1 ||
+			    st_pwrite(h, &hd->data_completed, sizeof(unsigned int), offsetof(HEADDATA, data_completed)) == -1 ||
+			    (len[n] > sizeof(HEADDATA) &&
+			     st_pwrite(h, data[n] + sizeof(HEADDATA), len[n] - sizeof(HEADDATA), sizeof(HEADDATA)) != (ssize_t)(len[n] - sizeof(HEADDATA)))) {
+				d_log("st_resident_save: write to %s failed: %s\n", path, strerror(errno));
+				ret = -1;
+			}
+			if (h != -1)
+				st_close(h);
+		} else if (data[n]) {
+			iov.iov_base = data[n];
+			iov.iov_len = len[n];
+			ret = st_replace(path, &iov, 1);
+		} else if (st_exists(path) && st_unlink(path) == -1) {
+			d_log("st_resident_save: unlink(%s): %s\n", path, strerror(errno));
+			ret = -1;
+		}
+		if (!ret && journal_sync != JOURNAL_SYNC_NONE && (h = st_open(path, O_RDONLY, 0)) != -1) {
+			st_fdatasync(h);
+			st_close(h);
+		}
+	}
+
+	buf = ct_image(head.id, gen, data, len, &size);
+	if (pwrite(fd, buf, size, 0) != (ssize_t)size || ftruncate(fd, size) == -1) {
+		d_log("st_resident_save: write failed: %s\n", strerror(errno));
+		ret = -1;
+	}
+	ng_free(buf);
+	for (n = 0; n < ST_NAMES; n++)
+		ng_free(data[n]);
+	return ret;
+}
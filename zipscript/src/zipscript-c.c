@@ -22,6 +22,7 @@
 #include "helpfunctions.h"
 #include "zsfunctions.h"
 #include "race-file.h"
+#include "storage.h"
 #include "objects.h"
 #include "macros.h"
 
@@ -40,6 +41,8 @@
 #include "ng-version.h"
 #include "print_config.h"
 #include "audiosort.h"
+#include "zsd.h"
+#include "runner.h"
 
 #include "../conf/zsconfig.h"
 
@@ -55,8 +58,7 @@ int
 main(int argc, char **argv)
 {
 	GLOBAL		g; /* this motherfucker owns */
-	DIR		*dir, *parent;
-	struct dirent	*dp;
+	DIRSNAP		*dir, *parent;
 	
 #ifndef USING_GLFTPD
         char            temp_path[PATH_MAX];
@@ -65,6 +67,7 @@ main(int argc, char **argv)
 #endif
 	char           *fileext = NULL, *name_p, *temp_p = NULL;
 	char           *target = 0;
+	char           *unzip_argv[6] = { NULL };
 	char	       *vinfo = 0;
 	char	       *ext = 0;
         char           *crc_arg = NULL;
@@ -78,10 +81,6 @@ main(int argc, char **argv)
 	char           *complete_bar = 0;
 	char           *error_msg = 0;
 
-#ifdef USING_GLFTPD
-        unsigned int gnum = 0, unum = 0;
-#endif
-
 	unsigned int	crc, s_crc = 0;
 	unsigned char	exit_value = EXIT_SUCCESS;
 	unsigned char	no_check = FALSE;
@@ -102,7 +101,7 @@ main(int argc, char **argv)
 	char           *complete_announce = 0;
 	int		cnt, cnt2, n = 0, m = 0;
 	int		write_log = 0;
-	long		loc;
+	unsigned int	i, entries;
 #if ( enable_complete_script || enable_accept_script )
 	int		nfofound = 0;
 	int		accept_has_run = 0;
@@ -115,6 +114,16 @@ main(int argc, char **argv)
 
 #if ( benchmark_mode == TRUE )
 	struct timeval	bstart, bstop;
+#endif
+
+	/* the daemon comes back here in a child for each upload, with its args */
+	if (argc == 2 && !strcmp("--daemon", argv[1]))
+		argc = zsd_serve(&argv);
+	else if ((n = zsd_client(argc, argv)) != ZSD_NOTRUN)
+		return n;
+	n = 0;
+
+#if ( benchmark_mode == TRUE )
 	d_log("zipscript-c: Reading time for benchmark\n");
 	gettimeofday(&bstart, (struct timezone *)0);
 #endif
@@ -162,7 +171,8 @@ main(int argc, char **argv)
 	if (argc < 4) {
 		d_log("zipscript-c: Wrong number of arguments used\n");
 		printf(" - - PZS-NG ZipScript-C %s - -\n\nUsage: %s <filename> <path> <crc>\n", NG_VERSION, argv[0]);
-		printf("Usage: %s --(full)config - shows (full) config compiled.\n\n", argv[0]);
+		printf("Usage: %s --(full)config - shows (full) config compiled.\n", argv[0]);
+		printf("Usage: %s --daemon - serves the uploads sent to zsd_socket.\n\n", argv[0]);
 		exit(1);
 	}
 
@@ -196,7 +206,8 @@ main(int argc, char **argv)
 	if (argc < 8) {
 		d_log("zipscript-c: Wrong number of arguments used (ftpd-agnostic)\n");
 		printf(" - - PZS-NG ZipScript-C %s - -\n\nUsage: %s <absolute filepath> <crc> <user> <group> <tagline> <speed> <section>\n", NG_VERSION, argv[0]);
-		printf(" Usage: %s --(full)config - shows (full) config compiled.\n\n", argv[0]);
+		printf(" Usage: %s --(full)config - shows (full) config compiled.\n", argv[0]);
+		printf(" Usage: %s --daemon - serves the uploads sent to zsd_socket.\n\n", argv[0]);
 		exit(1);
 	}
         crc_arg = argv[2];
@@ -260,7 +271,7 @@ main(int argc, char **argv)
         sprintf(g.v.user.tagline, argv[5]);
         if (!(int)strlen(g.v.user.tagline))
                 memcpy(g.v.user.tagline, "No Tagline Set", 15);
-        g.v.file.speed = strtoul(argv[6], NULL, 0);
+        g.v.file.speed = strtoull(argv[6], NULL, 0);
         if (!g.v.file.speed)
                 g.v.file.speed = 2005;
 
@@ -289,8 +300,7 @@ main(int argc, char **argv)
 
 #else /* below here: glftpd specific */
 	d_log("zipscript-c: Reading data from environment variables\n");
-	unum = buffer_users(PASSWDFILE, 0);
-	gnum = buffer_groups(GROUPFILE, 0);
+	load_users_groups();
 	env_p = getenv("USER");
 	if (env_p == NULL || !(*env_p)) {
 		d_log("zipscript-c: Got NULL or empty string for $USER, trying to determine via uid.\n");
@@ -315,12 +325,12 @@ main(int argc, char **argv)
 		strlcpy(g.v.user.tagline, env_p, sizeof(g.v.user.tagline));
 	}
 	env_p = getenv("SPEED");
-	if (env_p == NULL || !(g.v.file.speed = strtoul(env_p, NULL, 0))) {
+	if (env_p == NULL || !(g.v.file.speed = strtoull(env_p, NULL, 0))) {
 		d_log("zipscript-c: Got NULL or 0 for $SPEED, falling back to default.\n");
 		g.v.file.speed = 2005;
 #if (debug_announce == TRUE)
 	} else {
-		printf("zipscript-c: DEBUG: Speed: %lukb/s (ENV: %skb/s)\n", g.v.file.speed, env_p);
+		printf("zipscript-c: DEBUG: Speed: %llukb/s (ENV: %skb/s)\n", (unsigned long long)g.v.file.speed, env_p);
 #endif
 	}
 	env_p = getenv("SECTION");
@@ -419,71 +429,43 @@ main(int argc, char **argv)
 	strtolower(fileext);
 #endif
 	d_log("zipscript-c: Reading directory structure\n");
-	dir = opendir(".");
-	parent = opendir("..");
+	dir = dirsnap_open(".");
+	parent = dirsnap_open("..");
 
 	d_log("zipscript-c: Caching release name\n");
 	getrelname(&g);
 
 	d_log("zipscript-c: Creating directory to store racedata in\n");
 	maketempdir(g.l.path);
+	zsd_resident(g.l.path);
+	crc_cache_init(g.l.path);
 
 	d_log("zipscript-c: Locking release\n");
 	while(1) {
-		if ((m = create_lock(&g.v, g.l.path, PROGTYPE_ZIPSCRIPT, 3, 0))) {
+		if ((m = create_lock(&g.v, g.l.path, PROGTYPE_ZIPSCRIPT, 3))) {
 			d_log("zipscript-c: Failed to lock release.\n");
 			if (m == 1) {
 				d_log("zipscript-c: version mismatch. Exiting.\n");
 				printf("Error. You need to \"rm -fR ftp-data/pzs-ng/\" before zipscript-c will work.\n");
 				exit(EXIT_FAILURE);
 			}
-			if (m == PROGTYPE_RESCAN) {
-				d_log("zipscript-c: Detected rescan running - will try to make it quit.\n");
-				update_lock(&g.v, 0, 0);
-			}
-			if (m == PROGTYPE_POSTDEL) {
-				n = (signed int)g.v.data_incrementor;
-				d_log("zipscript-c: Detected postdel running - sleeping for one second.\n");
-				if (!create_lock(&g.v, g.l.path, PROGTYPE_ZIPSCRIPT, 0, g.v.data_queue))
-					break;
-				usleep(1000000);
-				if (!create_lock(&g.v, g.l.path, PROGTYPE_ZIPSCRIPT, 0, g.v.data_queue))
-					break;
-				if ( n == (signed int)g.v.data_incrementor) {
-					d_log("zipscript-c: Failed to get lock. Forcing unlock.\n");
-					if (create_lock(&g.v, g.l.path, PROGTYPE_ZIPSCRIPT, 2, g.v.data_queue)) {
-						d_log("zipscript-c: Failed to force a lock.\n");
-						d_log("zipscript-c: Exiting with error.\n");
-						exit(EXIT_FAILURE);
-					}
-					break;
+			if (m == PROGTYPE_RESCAN || m == PROGTYPE_POSTDEL) {
+				d_log("zipscript-c: Failed to get lock. Forcing unlock.\n");
+				if (create_lock(&g.v, g.l.path, PROGTYPE_ZIPSCRIPT, 2)) {
+					d_log("zipscript-c: Failed to force a lock.\n");
+					d_log("zipscript-c: Exiting with error.\n");
+					exit(EXIT_FAILURE);
 				}
 			} else {
-				for ( n = 0; n <= max_seconds_wait_for_lock * 10; n++) {
-					d_log("zipscript-c: sleeping for .1 second before trying to get a lock.\n");
-					usleep(100000);
-					if (!(m = create_lock(&g.v, g.l.path, PROGTYPE_ZIPSCRIPT, 0, g.v.data_queue)))
-						break;
-
-				}
-				if (n >= max_seconds_wait_for_lock * 10) {
-					if (m == PROGTYPE_RESCAN) {
-						d_log("zipscript-c: Failed to get lock. Forcing unlock.\n");
-						if (create_lock(&g.v, g.l.path, PROGTYPE_ZIPSCRIPT, 2, g.v.data_queue))
-						d_log("zipscript-c: Failed to force a lock.\n");
-					} else
-						d_log("zipscript-c: Failed to get a lock.\n");
-					if (!g.v.data_in_use && !ignore_lock_timeout) {
-						d_log("zipscript-c: Exiting with error.\n");
-						exit(EXIT_FAILURE);
-					}
+				d_log("zipscript-c: Failed to get a lock.\n");
+				if (!ignore_lock_timeout) {
+					d_log("zipscript-c: Exiting with error.\n");
+					exit(EXIT_FAILURE);
 				}
 			}
 
-			rewinddir(dir);
-			rewinddir(parent);
+			dirsnap_changed();
 		}
-		usleep(10000);
 		if (update_lock(&g.v, 1, 0) != -1)
 			break;
 	}
@@ -644,8 +626,7 @@ main(int argc, char **argv)
 			d_log("zipscript-c: Executing sample_script (%s).\n", sample_script);
 			if (!fileexists(sample_script))
 				d_log("zipscript-c: Warning - sample_script (%s) - file does not exist!\n", sample_script);
-			sprintf(target, sample_script " \"%s\"", g.v.file.name);
-			if (execute(target) != 0)
+			if (run_job(sample_script, g.v.file.name) != 0)
 				d_log("zipscript-c: Failed to execute sample_script: %s\n", strerror(errno));
 		}
 	} else {
@@ -672,16 +653,20 @@ main(int argc, char **argv)
 				exit_value = 2;
 				break;
 			} else {
+				unzip_argv[0] = unzip_bin;
+				unzip_argv[1] = "-qqt";
+				unzip_argv[2] = g.v.file.name;
+				unzip_argv[3] = NULL;
 #if (test_for_password || extract_nfo)
 				if ((!findfileextcount(dir, ".nfo") ||
-				  findfileextcount(dir, ".zip")) && !mkdir(".unzipped", 0777))
-					sprintf(target, "%s -qqjo \"%s\" -d .unzipped", unzip_bin, g.v.file.name);
-				else
-					sprintf(target, "%s -qqt \"%s\"", unzip_bin, g.v.file.name);
-#else
-				sprintf(target, "%s -qqt \"%s\"", unzip_bin, g.v.file.name);
+				  findfileextcount(dir, ".zip")) && !mkdir(".unzipped", 0777)) {
+					unzip_argv[1] = "-qqjo";
+					unzip_argv[3] = "-d";
+					unzip_argv[4] = ".unzipped";
+					unzip_argv[5] = NULL;
+				}
 #endif
-				if (execute(target) != 0 || (allow_error2_in_unzip == TRUE && errno > 2 )) {
+				if (run_argv(unzip_argv, NULL, NULL) != 0 || (allow_error2_in_unzip == TRUE && errno > 2 )) {
 					d_log("zipscript-c: Integrity check failed (#%d): %s\n", errno, strerror(errno));
 					sprintf(g.v.misc.error_msg, BAD_ZIP);
 					mark_as_bad(g.v.file.name);
@@ -733,15 +718,14 @@ main(int argc, char **argv)
 			}
 			if (!fileexists("file_id.diz")) {
 				d_log("zipscript-c: file_id.diz does not exist, trying to extract it from %s\n", g.v.file.name);
-				sprintf(target, "%s -qqjnCLL \"%s\" file_id.diz 2>.delme", unzip_bin, g.v.file.name);
-				if (execute(target) != 0)
+				unzip_argv[1] = "-qqjnCLL";
+				unzip_argv[3] = "file_id.diz";
+				unzip_argv[4] = NULL;
+				if (run_argv(unzip_argv, NULL, ".delme") != 0)
 					d_log("zipscript-c: No file_id.diz found (#%d): %s\n", errno, strerror(errno));
 				else {
-					if ((loc = findfile(dir, "file_id.diz.bad"))) {
-						seekdir(dir, loc);
-						dp = readdir(dir);
-						unlink(dp->d_name);
-					}
+					if ((temp_p = findfile(dir, "file_id.diz.bad")) && !unlink(temp_p))
+						dirsnap_changed();
 					if (chmod("file_id.diz", 0666))
 						d_log("zipscript-c: Failed to chmod %s: %s\n", "file_id.diz", strerror(errno));
 				}
@@ -803,7 +787,7 @@ main(int argc, char **argv)
 				}
 			}
 
-			if (fileexists(g.l.sfv)) {
+			if (st_exists(g.l.sfv)) {
 				if (deny_double_sfv == TRUE && findfileextcount(dir, ".sfv") > 1 && sfv_compare_size(".sfv", g.v.file.size) > 0) {
 					write_log = g.v.misc.write_log;
 					g.v.misc.write_log = 1;
@@ -822,7 +806,7 @@ main(int argc, char **argv)
 					d_log("zipscript-c: Resume of sfv not allowed\n");
 					error_msg = convert(&g.v, g.ui, g.gi, deny_resumesfv_msg);
 					writelog(&g, error_msg, general_resumesfv_type);
-					if (copyfile(g.l.sfvbackup, g.v.file.name))
+					if (st_export(g.l.sfvbackup, g.v.file.name))
 						d_log("zipscript-c: failed to copy backed up sfv (%s)\n", g.v.file.name);
 					else
 						d_log("zipscript-c: copied backup of sfv to releasedir (%s)\n", g.v.file.name);
@@ -852,27 +836,27 @@ main(int argc, char **argv)
 					}
 					g.v.total.files = g.v.total.files_missing = 0;
 				} else {
-					if (!fileexists(g.l.sfv)) {
+					if (!st_exists(g.l.sfv)) {
 						d_log("zipscript-c: DEBUG: sfv_compare_size=%d\n", sfv_compare_size(".sfv", g.v.file.size));
 						d_log("zipscript-c: Hmm.. Seems the old .sfv was deleted. Allowing new one.\n");
-						unlink(g.l.race);
+						st_unlink(g.l.race);
 					} else
 						d_log("zipscript-c: Allowing the (late) sfv\n");
-					unlink(g.l.sfv);
-					rewinddir(dir);
-					while ((dp = readdir(dir))) {
-						cnt = cnt2 = (int)strlen(dp->d_name);
-						ext = dp->d_name;
+					st_unlink(g.l.sfv);
+					entries = dirsnap_read(dir);
+					for (i = 0; i < entries; i++) {
+						ext = (char *)dirsnap_name(dir, i);
+						cnt = cnt2 = (int)strlen(ext);
 						while (ext[cnt] != '-' && cnt > 0)
 							cnt--;
 						if (ext[cnt] != '-')
 							cnt = cnt2;
 						else
 							cnt++;
-						ext += cnt;
-						if (!strncmp(ext, "missing", 7))
-							unlink(dp->d_name);
+						if (!strncmp(ext + cnt, "missing", 7))
+							unlink(ext);
 					}
+					dirsnap_changed();
 				}
 			}
 
@@ -992,8 +976,7 @@ main(int argc, char **argv)
 				d_log("zipscript-c: Warning - nfo_script (%s) - file does not exist!\n", nfo_script);
 			}
 			d_log("zipscript-c: Executing nfo script (%s)\n", nfo_script);
-			sprintf(target, nfo_script " \"%s\"", g.v.file.name);
-			if (execute(target) != 0)
+			if (run_job(nfo_script, g.v.file.name) != 0)
 				d_log("zipscript-c: Failed to execute nfo_script: %s\n", strerror(errno));
 #endif
 
@@ -1009,7 +992,12 @@ main(int argc, char **argv)
 				d_log("zipscript-c: We did not get crc from ftp daemon, calculating crc for %s now.\n", g.v.file.name);
 				crc = calc_crc32(g.v.file.name);
 			}
-			if (fileexists(g.l.sfv)) {
+#if (allow_file_resume == TRUE)
+			else
+				/* lets a resumed upload of this file only crc the part added */
+				crc_cache_add(g.v.file.name, crc);
+#endif
+			if (st_exists(g.l.sfv)) {
 				s_crc = readsfv(g.l.sfv, &g.v, 0);
 				
 #if (sfv_calc_single_fname == TRUE)
@@ -1048,8 +1036,7 @@ main(int argc, char **argv)
 								if (!fileexists(unduper_script)) {
 									d_log("zipscript-c: Warning - undupe script (%s) does not exist.\n", unduper_script);
 								}
-								sprintf(target, unduper_script " \"%s\"", g.v.file.name);
-								if (execute(target) == 0)
+								if (run_cmd(unduper_script, g.v.file.name, NULL, NULL) == 0)
 									d_log("zipscript-c: undupe of %s successful.\n", g.v.file.name);
 								else
 									d_log("zipscript-c: undupe of %s failed.\n", g.v.file.name);
@@ -1102,9 +1089,9 @@ main(int argc, char **argv)
 					exit_value = 2;
 					break;
 #if (use_partial_on_noforce == TRUE)
-				} else if (matchpath(zip_dirs, g.l.path) && !fileexists(g.l.sfv) && !matchpartialpath(noforce_sfv_first_dirs, g.l.path)) {
+				} else if (matchpath(zip_dirs, g.l.path) && !st_exists(g.l.sfv) && !matchpartialpath(noforce_sfv_first_dirs, g.l.path)) {
 #else
-				} else if (matchpath(zip_dirs, g.l.path) && !fileexists(g.l.sfv) && !matchpath(noforce_sfv_first_dirs, g.l.path)) {
+				} else if (matchpath(zip_dirs, g.l.path) && !st_exists(g.l.sfv) && !matchpath(noforce_sfv_first_dirs, g.l.path)) {
 #endif
 					d_log("zipscript-c: This looks like a file uploaded the wrong place - Not allowing it.\n");
 					strlcpy(g.v.misc.error_msg, SFV_FIRST, 80);
@@ -1193,7 +1180,7 @@ main(int argc, char **argv)
 						}
 						d_log("zipscript-c: Executing audio script (%s %s)\n", audio_script, convert(&g.v, g.ui, g.gi, audio_script_cookies));
 						sprintf(target, "%s %s", audio_script, convert(&g.v, g.ui, g.gi, audio_script_cookies));
-						if (execute(target) != 0)
+						if (run_job(target, NULL) != 0)
 							d_log("zipscript-c: Failed to execute audio_script: %s\n", strerror(errno));
 					}
 					if (!matchpath(audio_nocheck_dirs, g.l.path)) {
@@ -1716,8 +1703,7 @@ main(int argc, char **argv)
 					d_log("zipscript-c: Warning - accept_script (%s) - file does not exist!\n", accept_script);
 				}
 				d_log("zipscript-c: Executing accept script (before complete_script)\n");
-				sprintf(target, accept_script " \"%s\"", g.v.file.name);
-				if (execute(target) != 0)
+				if (run_cmd(accept_script, g.v.file.name, NULL, NULL) != 0)
 					d_log("zipscript-c: Failed to execute accept_script: %s\n", strerror(errno));
 			}
 #endif
@@ -1726,8 +1712,7 @@ main(int argc, char **argv)
 				d_log("zipscript-c: Warning - complete_script (%s) - file does not exist!\n", complete_script);
 			}
 			d_log("zipscript-c: Executing complete script\n");
-			sprintf(target, complete_script " \"%s\"", g.v.file.name);
-			if (execute(target) != 0)
+			if (run_job(complete_script, g.v.file.name) != 0)
 				d_log("zipscript-c: Failed to execute complete_script: %s\n", strerror(errno));
 
 #if ( enable_nfo_script == TRUE )
@@ -1736,8 +1721,7 @@ main(int argc, char **argv)
 					d_log("zipscript-c: Warning - nfo_script (%s) - file does not exist!\n", nfo_script);
 				}
 				d_log("zipscript-c: Executing nfo script (%s)\n", nfo_script);
-				sprintf(target, nfo_script " \"%s\"", g.v.file.name);
-				if (execute(target) != 0)
+				if (run_job(nfo_script, g.v.file.name) != 0)
 					d_log("zipscript-c: Failed to execute nfo_script: %s\n", strerror(errno));
 			}
 #endif
@@ -1805,6 +1789,7 @@ main(int argc, char **argv)
 
 		d_log("zipscript-c: Logging file as bad\n");
 		remove_from_race(g.l.race, g.v.file.name, &g.v);
+		compact_race(g.l.race);
 		printf("%s", convert(&g.v, g.ui, g.gi, zipscript_footer_error));
 	}
 #if ( enable_accept_script == TRUE )
@@ -1814,8 +1799,7 @@ main(int argc, char **argv)
 			d_log("zipscript-c: Warning - accept_script (%s) - file does not exist!\n", accept_script);
 		}
 		d_log("zipscript-c: Executing accept script\n");
-		sprintf(target, accept_script " \"%s\"", g.v.file.name);
-		if (execute(target) != 0)
+		if (run_cmd(accept_script, g.v.file.name, NULL, NULL) != 0)
 			d_log("zipscript-c: Failed to execute accept_script: %s\n", strerror(errno));
 
 #if ( enable_nfo_script == TRUE )
@@ -1824,8 +1808,7 @@ main(int argc, char **argv)
 				d_log("zipscript-c: Warning - nfo_script (%s) - file does not exist!\n", nfo_script);
 			}
 			d_log("zipscript-c: Executing nfo script (%s)\n", nfo_script);
-			sprintf(target, nfo_script " \"%s\"", g.v.file.name);
-			if (execute(target) != 0)
+			if (run_job(nfo_script, g.v.file.name) != 0)
 				d_log("zipscript-c: Failed to execute nfo_script: %s\n", strerror(errno));
 		}
 #endif
@@ -1848,8 +1831,7 @@ main(int argc, char **argv)
 			d_log("zipscript-c: Warning - affil_script (%s) - file does not exist!\n", affil_script);
 		}
 		d_log("zipscript-c: Executing affil script\n");
-		sprintf(target, affil_script " \"%s\"", g.v.file.name);
-		if (execute(target) != 0)
+		if (run_job(affil_script, g.v.file.name) != 0)
 			d_log("zipscript-c: Failed to execute affil_script: %s\n", strerror(errno));
 	}
 #endif
@@ -1860,8 +1842,7 @@ main(int argc, char **argv)
 			if (!fileexists(delbanned_script))
 				d_log("zipscript-c: Warning - delbanned script (%s) does not exist.\n", delbanned_script);
 
-			sprintf(target, delbanned_script " \"%s\"", g.l.path);
-			if (execute(target) == 0)
+			if (run_cmd(delbanned_script, g.l.path, NULL, NULL) == 0)
 				d_log("zipscript-c: marking deleted of %s successful.\n", g.l.path);
 			else {
 				d_log("zipscript-c: marking deleted of %s failed.\n", g.l.path);
@@ -1874,28 +1855,20 @@ main(int argc, char **argv)
 			move_progress_bar(1, &g.v, g.ui, g.gi);
 			if (g.l.incomplete)
 				unlink(g.l.incomplete);
-			closedir(dir);
-			dir = opendir(".");
+			dirsnap_changed();
 			del_releasedir(dir, g.l.path);
 		}
 	}
 #endif
 
 	d_log("zipscript-c: Releasing memory and removing lock\n");
-	closedir(dir);
-	closedir(parent);
+	dirsnap_close(dir);
+	dirsnap_close(parent);
 	remove_lock(&g.v);
 
 	if (fileexists(".delme"))
 		unlink(".delme");
 
-#ifdef USING_GLFTPD
-        /* Only under glftpd do we have a uid/gid-lookup, so these
-         * are only needed there. */
-	buffer_groups(GROUPFILE, gnum);
-	buffer_users(PASSWDFILE, unum);
-#endif
-
 	updatestats_free(&g);
 	ng_free(fileext);
 	ng_free(target);
@@ -0,0 +1,963 @@
+#define _GNU_SOURCE	/* struct ucred */
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <signal.h>
+#include <poll.h>
+#include <grp.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "zsd.h"
+#include "lockshm.h"
+#include "zsfunctions.h"
+#include "race-file.h"
+#include "storage.h"
+
+#include "../conf/zsconfig.h"
+#include "../include/zsconfig.defaults.h"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifndef HAVE_STRLCPY
+# include "strl/strl.h"
+#endif
+
+#ifdef _WITH_SS5
+# include "constants.ss5.h"
+#else
+# include "constants.h"
+#endif
+
+extern char	**environ;
+
+/* an upload sent to the daemon */
+typedef struct zsd_upload {
+	int			fd,		// the connection, answered when it is done.
+				fds[3],		// its stdin, stdout and stderr.
+				plain;		// done without its release in memory.
+	int			argc;
+	uid_t			uid;
+	gid_t			gid;
+	char			*buf,		// the working dir, then what argv and env
+				**argv,		// point into.
+				**env;
+	struct zsd_upload	*next;
+} ZSD_UPLOAD;
+
+/* a release a worker keeps in memory, with zsd_flush - its race files are a
+ * container in fd (see storage.h), and its keeper is a child holding the
+ * lock of the release, which writes them back to storage when told to */
+typedef struct zsd_release {
+	char			path[PATH_MAX];	// the release dir, as zipscript-c locks it.
+	int			fd,		// the container.
+				ctl,		// to the keeper.
+				worker,
+				ready,		// the keeper holds the lock, and read the files.
+				wanted;		// somebody else waits for the lock.
+	pid_t			pid;		// of the keeper.
+	dev_t			dev;		// of the storage dir - an upload only uses
+	ino_t			ino;		// the container if it is of its own.
+	time_t			dirty,		// written to since it was last saved - 0 if not.
+				used;		// last uploaded to.
+	struct zsd_release	*next;
+} ZSD_RELEASE;
+
+/* what the daemon and a keeper tell each other */
+#define ZSD_READY		'R'		/* keeper: got the lock, and read the files */
+#define ZSD_WANTED		'W'		/* keeper: somebody else waits for the lock */
+#define ZSD_SAVE		'S'		/* write them back - and the reply when done */
+#define ZSD_LEAVE		'L'		/* give up the lock, and exit */
+
+/* the children of the daemon, the connections to answer when they exit, and
+ * the uploads waiting for each - with zsd_workers, a release always goes to
+ * the same one, which keeps the releases in rels in memory. A worker waiting
+ * for a reply of the keeper of one of them does nothing else meanwhile.
+ */
+static struct {
+	pid_t		pid;
+	int		fd;
+	ZSD_UPLOAD	*head,
+			*tail;
+	ZSD_RELEASE	*rels,
+			*wait;
+}		zsd_child[ZSD_CHILDREN];
+static int	zsd_pipe[2] = { -1, -1 },
+		zsd_queued = 0,
+		zsd_kept = 0;
+static volatile sig_atomic_t	zsd_stop = 0;
+
+/* in an upload: the container of its release, and the storage dir it is of */
+static int	zsd_rfd = -1;
+static dev_t	zsd_rdev;
+static ino_t	zsd_rino;
+
+/* -1 if zsd_socket is not set, or too long */
+static int
+zsd_addr(struct sockaddr_un *sa)
+{
+	const char	*path = zsd_socket;
+
+	if (path == DISABLED)
+		return -1;
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	if (strlcpy(sa->sun_path, path, sizeof(sa->sun_path)) >= sizeof(sa->sun_path)) {
+		d_log("zsd: socket path %s is too long\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+zsd_write(int fd, const void *buf, size_t len)
+{
+	ssize_t		n;
+
+	while (len) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+zsd_read(int fd, void *buf, size_t len)
+{
+	ssize_t		n;
+
+	while (len) {
+		if ((n = read(fd, buf, len)) <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Hands the upload to the daemon. Returns its exit value, or ZSD_NOTRUN if
+ * the daemon is not there or did not take it - and then it is done here.
+ * Once it is sent, the daemon may have done it, so it is never done here
+ * again: no reply is a failure.
+ */
+int
+zsd_client(int argc, char **argv)
+{
+	int			fd, i, fds[3] = { 0, 1, 2 };
+	int32_t			status;
+	size_t			len, n;
+	char			cwd[PATH_MAX], *buf, *p;
+	ZSD_REQUEST		req;
+	struct sockaddr_un	sa;
+	struct msghdr		msg;
+	struct iovec		iov[2];
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(sizeof(fds))];
+	}			cm;
+
+	if (zsd_addr(&sa) == -1 || !getcwd(cwd, sizeof(cwd)))
+		return ZSD_NOTRUN;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return ZSD_NOTRUN;
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		d_log("zsd_client: connect(%s): %s - doing it here\n", sa.sun_path, strerror(errno));
+		close(fd);
+		return ZSD_NOTRUN;
+	}
+
+	req.magic = ZSD_MAGIC;
+	req.argc = (uint32_t)argc;
+	len = strlen(cwd) + 1;
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	for (req.envc = 0; environ[req.envc]; req.envc++)
+		len += strlen(environ[req.envc]) + 1;
+	if (len > ZSD_MAXLEN) {
+		close(fd);
+		return ZSD_NOTRUN;
+	}
+	req.len = (uint32_t)len;
+	p = buf = ng_realloc2(NULL, len, 0, 1, 1);
+	n = strlen(cwd) + 1;
+	memcpy(p, cwd, n);
+	p += n;
+	for (i = 0; i < argc; i++) {
+		n = strlen(argv[i]) + 1;
+		memcpy(p, argv[i], n);
+		p += n;
+	}
+	for (i = 0; i < (int)req.envc; i++) {
+		n = strlen(environ[i]) + 1;
+		memcpy(p, environ[i], n);
+		p += n;
+	}
+
+	/* the request goes with our stdin, stdout and stderr */
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	memset(&cm, 0, sizeof(cm));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = cm.buf;
+	msg.msg_controllen = sizeof(cm.buf);
+	CMSG_FIRSTHDR(&msg)->cmsg_level = SOL_SOCKET;
+	CMSG_FIRSTHDR(&msg)->cmsg_type = SCM_RIGHTS;
+	CMSG_FIRSTHDR(&msg)->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(CMSG_FIRSTHDR(&msg)), fds, sizeof(fds));
+	while ((n = sendmsg(fd, &msg, 0)) == (size_t)-1 && errno == EINTR)
+		;
+	if (n == (size_t)-1 || (n < sizeof(req) + len &&
+	    (n < sizeof(req) || zsd_write(fd, buf + (n - sizeof(req)), len - (n - sizeof(req))) == -1))) {
+		d_log("zsd_client: sendmsg(): %s - doing it here\n", strerror(errno));
+		ng_free(buf);
+		close(fd);
+		return ZSD_NOTRUN;
+	}
+	ng_free(buf);
+
+	if (zsd_read(fd, &status, sizeof(status)) == -1) {
+		d_log("zsd_client: no reply from the daemon\n");
+		status = EXIT_FAILURE;
+	}
+	close(fd);
+	return (int)status;
+}
+
+static void
+zsd_sigchld(int sig)
+{
+	int	e = errno;
+
+	(void)sig;
+	if (write(zsd_pipe[1], "", 1) == -1) {
+		/* full already - the loop reaps them all */
+	}
+	errno = e;
+}
+
+/* SIGTERM and SIGINT: what is queued is done, and what is kept in memory
+ * written back, before the daemon exits */
+static void
+zsd_sigterm(int sig)
+{
+	(void)sig;
+	zsd_stop = 1;
+	zsd_sigchld(sig);
+}
+
+/* tells each client whose child exited how it went */
+static void
+zsd_reap(void)
+{
+	int		i, st;
+	int32_t		status;
+	pid_t		pid;
+
+	while ((pid = waitpid(-1, &st, WNOHANG)) > 0)
+		for (i = 0; i < ZSD_CHILDREN; i++)
+			if (zsd_child[i].pid == pid) {
+				status = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+				zsd_write(zsd_child[i].fd, &status, sizeof(status));
+				close(zsd_child[i].fd);
+				zsd_child[i].pid = 0;
+				break;
+			}
+}
+
+static void
+zsd_free(ZSD_UPLOAD *u)
+{
+	int	i;
+
+	for (i = 0; i < 3; i++)
+		if (u->fds[i] != -1)
+			close(u->fds[i]);
+	ng_free(u->buf);
+	ng_free(u->argv);
+	ng_free(u->env);
+	ng_free(u);
+}
+
+/* Reads what the client sent. NULL, with the client told to do it itself,
+ * if it was not a request.
+ */
+static ZSD_UPLOAD *
+zsd_recv(int cfd)
+{
+	int			i, nfds = 0, *fds = NULL;
+	int32_t			status = ZSD_NOTRUN;
+	ssize_t			n;
+	char			*p, *end;
+	ZSD_REQUEST		req;
+	ZSD_UPLOAD		*u;
+	struct msghdr		msg;
+	struct iovec		iov;
+	struct cmsghdr		*c;
+	struct timeval		tv = { 1, 0 };
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(3 * sizeof(int))];
+	}			cm;
+#ifdef SO_PEERCRED
+	struct ucred		cred;
+	socklen_t		credlen = sizeof(cred);
+#endif
+
+	/* a client is not let to hold up the others */
+	setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cm.buf;
+	msg.msg_controllen = sizeof(cm.buf);
+	while ((n = recvmsg(cfd, &msg, 0)) == -1 && errno == EINTR)
+		;
+	if (n <= 0)
+		goto fail;
+	for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+			fds = (int *)CMSG_DATA(c);
+			nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		}
+	u = ng_realloc2(NULL, sizeof(ZSD_UPLOAD), 1, 1, 1);
+	u->fd = cfd;
+	for (i = 0; i < 3; i++)
+		u->fds[i] = i < nfds ? fds[i] : -1;
+	for (; i < nfds; i++)
+		close(fds[i]);
+	if (nfds != 3 || ((size_t)n < sizeof(req) && zsd_read(cfd, (char *)&req + n, sizeof(req) - n) == -1) ||
+	    req.magic != ZSD_MAGIC || !req.argc || req.len > ZSD_MAXLEN) {
+		d_log("zsd: bad request\n");
+		goto bad;
+	}
+	u->argc = (int)req.argc;
+	u->buf = ng_realloc2(NULL, req.len + 1, 0, 1, 1);
+	u->argv = ng_realloc2(NULL, (req.argc + 1) * sizeof(char *), 0, 1, 1);
+	u->env = ng_realloc2(NULL, (req.envc + 1) * sizeof(char *), 0, 1, 1);
+	if (zsd_read(cfd, u->buf, req.len) == -1)
+		goto bad;
+	u->buf[req.len] = '\0';
+	end = u->buf + req.len;
+	p = u->buf + strlen(u->buf) + 1;
+	for (i = 0; i < (int)req.argc && p < end; i++, p += strlen(p) + 1)
+		u->argv[i] = p;
+	u->argv[i] = NULL;
+	for (i = 0; i < (int)req.envc && p < end; i++, p += strlen(p) + 1)
+		u->env[i] = p;
+	u->env[i] = NULL;
+	if (!u->argv[req.argc - 1] || (req.envc && !u->env[req.envc - 1])) {
+		d_log("zsd: short request\n");
+		goto bad;
+	}
+	u->uid = (uid_t)-1;
+#ifdef SO_PEERCRED
+	if (!getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen)) {
+		u->uid = cred.uid;
+		u->gid = cred.gid;
+	}
+#endif
+	return u;
+
+bad:
+	u->fd = -1;
+	zsd_free(u);
+fail:
+	zsd_write(cfd, &status, sizeof(status));
+	close(cfd);
+	return NULL;
+}
+
+/* Puts the dir of the release the upload is to in path - the one
+ * zipscript-c will lock.
+ */
+static void
+zsd_path(ZSD_UPLOAD *u, char *path, size_t len)
+{
+	char		*p;
+#ifdef USING_GLFTPD
+	const char	*dir = u->argc > 2 ? u->argv[2] : "";
+
+	if (combine_path == TRUE && strrchr(u->argv[1], '/'))
+		snprintf(path, len, "%s/%s", *u->argv[1] != '/' ? dir : sitepath_dir, u->argv[1]);
+	else
+		snprintf(path, len, "%s/", dir);
+#else
+	char		tmp[PATH_MAX];
+
+	if (*u->argv[1] == '/')
+		strlcpy(tmp, u->argv[1], sizeof(tmp));
+	else
+		snprintf(tmp, sizeof(tmp), "%s/%s", u->buf, u->argv[1]);
+	if (!realpath(tmp, path))
+		strlcpy(path, tmp, len);
+#endif
+	if ((p = strrchr(path, '/')))
+		*p = '\0';
+	/* '/site/rel' and '/site/rel/' are the same release */
+	while ((p = strrchr(path, '/')) && p != path && !p[1])
+		*p = '\0';
+}
+
+/* the worker of the release the upload is to */
+static int
+zsd_worker(ZSD_UPLOAD *u, int workers)
+{
+	char	path[PATH_MAX];
+
+	zsd_path(u, path, sizeof(path));
+	return (int)(ls_hash(path) % (uint64_t)workers);
+}
+
+/* In a child: closes what is the daemon's, but for the container of keep,
+ * and sets the signals back.
+ */
+static void
+zsd_close_fds(int lfd, const ZSD_RELEASE *keep)
+{
+	int			i;
+	ZSD_UPLOAD		*w;
+	ZSD_RELEASE		*r;
+	struct sigaction	sig;
+
+	close(lfd);
+	close(zsd_pipe[0]);
+	close(zsd_pipe[1]);
+	for (i = 0; i < ZSD_CHILDREN; i++) {
+		if (zsd_child[i].pid)
+			close(zsd_child[i].fd);
+		for (w = zsd_child[i].head; w; w = w->next) {
+			close(w->fd);
+			close(w->fds[0]);
+			close(w->fds[1]);
+			close(w->fds[2]);
+		}
+		for (r = zsd_child[i].rels; r; r = r->next) {
+			close(r->ctl);
+			if (r != keep)
+				close(r->fd);
+		}
+	}
+	memset(&sig, 0, sizeof(sig));
+	sigemptyset(&sig.sa_mask);
+	sig.sa_handler = SIG_DFL;
+	sigaction(SIGCHLD, &sig, NULL);
+	sigaction(SIGPIPE, &sig, NULL);
+	sigaction(SIGTERM, &sig, NULL);
+	sigaction(SIGINT, &sig, NULL);
+}
+
+/* Run as root, the upload is done as the one who sent it. -1 if it can't. */
+static int
+zsd_become(ZSD_UPLOAD *u)
+{
+	if (!geteuid() && u->uid != (uid_t)-1 &&
+	    (setgroups(0, NULL) == -1 || setgid(u->gid) == -1 || setuid(u->uid) == -1)) {
+		d_log("zsd: could not change to uid/gid %d/%d: %s\n", (int)u->uid, (int)u->gid, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* In the child: closes what is the daemon's, takes over the fds of the
+ * upload, and returns its argc - or exits, telling the client to do it
+ * itself. With r, its release is kept in memory - see zsd_resident().
+ */
+static int
+zsd_child_init(ZSD_UPLOAD *u, ZSD_RELEASE *r, int lfd, char ***argvp)
+{
+	int			i;
+	int32_t			status = ZSD_NOTRUN;
+
+	zsd_close_fds(lfd, r);
+	if (zsd_become(u) == -1) {
+		zsd_write(u->fd, &status, sizeof(status));
+		_exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < 3; i++) {
+		dup2(u->fds[i], i);
+		if (u->fds[i] > 2)
+			close(u->fds[i]);
+	}
+	if (chdir(u->buf) == -1)
+		d_log("zsd: chdir(%s): %s\n", u->buf, strerror(errno));
+	environ = u->env;
+	close(u->fd);
+	if (r) {
+		zsd_rfd = r->fd;
+		zsd_rdev = r->dev;
+		zsd_rino = r->ino;
+	}
+	*argvp = u->argv;
+	return u->argc;
+}
+
+/* Called by zipscript-c with the release it locks: in an upload the daemon
+ * runs with the release kept in memory, the race files are used from there,
+ * with no lock to take - the keeper holds it.
+ */
+void
+zsd_resident(const char *path)
+{
+	char		dir[PATH_MAX];
+	struct stat	st;
+
+	if (zsd_rfd == -1)
+		return;
+	snprintf(dir, sizeof(dir), "%s/%s/", storage, path);
+	if (stat(dir, &st) == -1 || st.st_dev != zsd_rdev || st.st_ino != zsd_rino) {
+		d_log("zsd_resident: %s is not the release kept in memory\n", dir);
+		return;
+	}
+	st_resident(dir, zsd_rfd);
+}
+
+/* The keeper of r, talking to the daemon on ctl: gets the lock of the
+ * release, reads its race files into r->fd, and holds the lock until it is
+ * told to leave - writing the files back when told to. Tells the daemon
+ * when somebody else waits for the lock. If the daemon goes away, writes
+ * the files back and leaves. Never returns.
+ */
+static void
+zsd_keeper(ZSD_RELEASE *r, ZSD_UPLOAD *u, int lfd, int ctl)
+{
+	int		n, wanted = 0;
+	char		c, dir[PATH_MAX];
+	struct VARS	v;
+	struct stat	st;
+	struct pollfd	pfd;
+
+	zsd_close_fds(lfd, r);
+	if (zsd_become(u) == -1)
+		_exit(EXIT_FAILURE);
+	if (chdir(u->buf) == -1)
+		d_log("zsd: chdir(%s): %s\n", u->buf, strerror(errno));
+	memset(&v, 0, sizeof(v));
+	snprintf(dir, sizeof(dir), "%s/%s/", storage, r->path);
+	maketempdir(r->path);
+	if (create_lock(&v, r->path, PROGTYPE_ZIPSCRIPT, 3)) {
+		d_log("zsd: could not lock %s - its uploads will lock it themselves\n", r->path);
+		_exit(EXIT_FAILURE);
+	}
+	if (st_resident_load(dir, r->fd) == -1 || stat(dir, &st) == -1) {
+		remove_lock(&v);
+		_exit(EXIT_FAILURE);
+	}
+	r->dev = st.st_dev;
+	r->ino = st.st_ino;
+	d_log("zsd: keeping %s in memory\n", r->path);
+	c = ZSD_READY;
+	zsd_write(ctl, &c, 1);
+
+	while (1) {
+		pfd.fd = ctl;
+		pfd.events = POLLIN;
+		if ((n = poll(&pfd, 1, 1000)) == -1 && errno == EINTR)
+			continue;
+		if (!n) {
+			if (!wanted && lock_wanted(&v)) {
+				wanted = 1;
+				c = ZSD_WANTED;
+				zsd_write(ctl, &c, 1);
+			}
+			continue;
+		}
+		while ((n = read(ctl, &c, 1)) == -1 && errno == EINTR)
+			;
+		if (n == 1 && c == ZSD_LEAVE)
+			break;
+		if (lock_wanted(&v) == -1) {
+			d_log("zsd: the lock of %s was forced from its keeper - what was not written back is lost\n", r->path);
+			_exit(EXIT_FAILURE);
+		}
+		/* never over a release made again in its place */
+		if (stat(dir, &st) == -1 || st.st_dev != r->dev || st.st_ino != r->ino) {
+			d_log("zsd: %s was removed - what was kept of it is dropped\n", r->path);
+			remove_lock(&v);
+			_exit(EXIT_FAILURE);
+		}
+		if (st_resident_save(dir, r->fd) == -1)
+			d_log("zsd: could not write back the race files of %s\n", r->path);
+		update_lock(&v, 1, 0);		/* for the data_completed written */
+		if (n != 1)
+			break;
+		zsd_write(ctl, &c, 1);
+	}
+	d_log("zsd: giving back %s\n", r->path);
+	remove_lock(&v);
+	_exit(EXIT_SUCCESS);
+}
+
+/* A file to keep the race files of a release in - in memory, where there is
+ * memfd_create(). -1 if there is none.
+ */
+static int
+zsd_memfd(void)
+{
+	int	fd;
+#ifdef MFD_CLOEXEC
+	fd = memfd_create("zsd", MFD_CLOEXEC);
+#else
+	char	path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/.zsd.%d", storage, (int)getpid());
+	if ((fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0600)) != -1) {
+		unlink(path);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+#endif
+	return fd;
+}
+
+/* Starts the keeper of the release at path, for worker i. NULL if it
+ * could not be.
+ */
+static ZSD_RELEASE *
+zsd_keep(int i, ZSD_UPLOAD *u, const char *path, int lfd)
+{
+	int		sv[2];
+	ZSD_RELEASE	*r;
+
+	r = ng_realloc2(NULL, sizeof(ZSD_RELEASE), 1, 1, 1);
+	strlcpy(r->path, path, sizeof(r->path));
+	r->worker = i;
+	r->used = time(NULL);		/* idle from now, not since the epoch */
+	if ((r->fd = zsd_memfd()) == -1) {
+		d_log("zsd: no file to keep %s in: %s\n", path, strerror(errno));
+		ng_free(r);
+		return NULL;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		d_log("zsd: socketpair(): %s\n", strerror(errno));
+		close(r->fd);
+		ng_free(r);
+		return NULL;
+	}
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+	r->ctl = sv[0];
+	r->next = zsd_child[i].rels;
+	zsd_child[i].rels = r;
+	zsd_kept++;
+	switch ((r->pid = fork())) {
+	case -1:
+		d_log("zsd: fork(): %s\n", strerror(errno));
+		zsd_child[i].rels = r->next;
+		zsd_kept--;
+		close(sv[0]);
+		close(sv[1]);
+		close(r->fd);
+		ng_free(r);
+		return NULL;
+	case 0:
+		zsd_keeper(r, u, lfd, sv[1]);
+	}
+	close(sv[1]);
+	return r;
+}
+
+/* The keeper of r is gone - what it holds goes with it. */
+static void
+zsd_drop(ZSD_RELEASE *r)
+{
+	ZSD_RELEASE	**rp;
+
+	if (r->dirty)
+		d_log("zsd: the keeper of %s went away with what was not written back\n", r->path);
+	if (!r->ready && zsd_child[r->worker].head)
+		zsd_child[r->worker].head->plain = 1;	/* it did not get the lock */
+	if (zsd_child[r->worker].wait == r)
+		zsd_child[r->worker].wait = NULL;
+	for (rp = &zsd_child[r->worker].rels; *rp != r; rp = &(*rp)->next)
+		;
+	*rp = r->next;
+	zsd_kept--;
+	close(r->ctl);
+	close(r->fd);
+	ng_free(r);
+}
+
+/* Reads what the keeper of r says. */
+static void
+zsd_heard(ZSD_RELEASE *r)
+{
+	int		n;
+	char		c, dir[PATH_MAX];
+	struct stat	st;
+
+	while ((n = read(r->ctl, &c, 1)) == -1 && errno == EINTR)
+		;
+	if (n != 1) {
+		zsd_drop(r);
+		return;
+	}
+	switch (c) {
+	case ZSD_WANTED:
+		r->wanted = 1;
+		return;
+	case ZSD_READY:
+		snprintf(dir, sizeof(dir), "%s/%s/", storage, r->path);
+		if (stat(dir, &st) == -1) {
+			d_log("zsd: stat(%s): %s\n", dir, strerror(errno));
+			r->wanted = 1;		/* no upload could use it */
+		} else {
+			r->dev = st.st_dev;
+			r->ino = st.st_ino;
+		}
+		r->ready = 1;
+		break;
+	case ZSD_SAVE:
+		r->dirty = 0;
+		break;
+	}
+	if (zsd_child[r->worker].wait == r)
+		zsd_child[r->worker].wait = NULL;
+}
+
+/* 1 if the storage dir of r is not the one its keeper read - the release
+ * was removed, and maybe made again */
+static int
+zsd_stale(const ZSD_RELEASE *r)
+{
+	char		dir[PATH_MAX];
+	struct stat	st;
+
+	snprintf(dir, sizeof(dir), "%s/%s/", storage, r->path);
+	return stat(dir, &st) == -1 || st.st_dev != r->dev || st.st_ino != r->ino;
+}
+
+/* when r is to be written back, or given back */
+static time_t
+zsd_due(const ZSD_RELEASE *r)
+{
+	if (r->wanted || zsd_stop)
+		return 0;
+	return r->dirty ? r->dirty + zsd_flush : r->used + ZSD_IDLE;
+}
+
+/* Tells the keeper of r what to do, and has its worker wait for it. */
+static void
+zsd_tell(ZSD_RELEASE *r, char c)
+{
+	if (zsd_write(r->ctl, &c, 1) == -1)
+		return;			/* gone - the loop finds out */
+	zsd_child[r->worker].wait = r;
+}
+
+/* 'zipscript-c --daemon': listens on zsd_socket, and forks for each upload
+ * sent to it - with zsd_workers, at most that many at once, one at a time
+ * for each release, and with zsd_flush, each worker keeps the releases it
+ * gets in memory. Returns only in a child, with the argc of the upload, and
+ * its arguments in *argvp.
+ */
+int
+zsd_serve(char ***argvp)
+{
+	int			lfd, cfd, i, n, nul, timeout, workers = zsd_workers;
+	int32_t			status = ZSD_NOTRUN;
+	char			c[64], path[PATH_MAX];
+	time_t			now, due;
+	pid_t			pid;
+	ZSD_UPLOAD		*u;
+	ZSD_RELEASE		*r, *rel[ZSD_CHILDREN + 2];
+	struct sockaddr_un	sa;
+	struct sigaction	sig;
+	struct pollfd		pfd[ZSD_CHILDREN + 2];
+
+	if (zsd_addr(&sa) == -1) {
+		fprintf(stderr, "zsd: zsd_socket is not set in zsconfig.h, or too long\n");
+		exit(EXIT_FAILURE);
+	}
+	if (workers > ZSD_CHILDREN)
+		workers = ZSD_CHILDREN;
+	unlink(sa.sun_path);
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 || bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+	    chmod(sa.sun_path, 0777) == -1 || listen(lfd, 128) == -1) {
+		fprintf(stderr, "zsd: %s: %s\n", sa.sun_path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (pipe(zsd_pipe) == -1 || fcntl(zsd_pipe[0], F_SETFL, O_NONBLOCK) == -1 || fcntl(zsd_pipe[1], F_SETFL, O_NONBLOCK) == -1) {
+		fprintf(stderr, "zsd: pipe(): %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* detach */
+	switch ((pid = fork())) {
+	case -1:
+		fprintf(stderr, "zsd: fork(): %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	case 0:
+		break;
+	default:
+		printf("zsd: listening on %s, pid %d\n", sa.sun_path, (int)pid);
+		exit(EXIT_SUCCESS);
+	}
+	setsid();
+	if ((nul = open("/dev/null", O_RDWR)) != -1) {
+		dup2(nul, 0);
+		dup2(nul, 1);
+		dup2(nul, 2);
+		if (nul > 2)
+			close(nul);
+	}
+
+	memset(&sig, 0, sizeof(sig));
+	sigemptyset(&sig.sa_mask);
+	sig.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sig, NULL);
+	sig.sa_handler = zsd_sigchld;
+	sig.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sig, NULL);
+	sig.sa_handler = zsd_sigterm;
+	sigaction(SIGTERM, &sig, NULL);
+	sigaction(SIGINT, &sig, NULL);
+
+	while (1) {
+		/* the keepers are heard, and the releases of a worker that is free
+		 * woken for when they are due */
+		now = time(NULL);
+		timeout = -1;
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = zsd_pipe[0];
+		pfd[1].events = POLLIN;
+		n = 2;
+		for (i = 0; i < ZSD_CHILDREN; i++)
+			for (r = zsd_child[i].rels; r; r = r->next) {
+				pfd[n].fd = r->ctl;
+				pfd[n].events = POLLIN;
+				rel[n++] = r;
+				if (!r->ready || zsd_child[i].pid || zsd_child[i].wait)
+					continue;
+				due = zsd_due(r);
+				if (timeout == -1 || due <= now || (due - now) * 1000 < timeout)
+					timeout = due <= now ? 0 : (int)(due - now) * 1000;
+			}
+		if (poll(pfd, n, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			d_log("zsd: poll(): %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (pfd[1].revents & POLLIN) {
+			while (read(zsd_pipe[0], c, sizeof(c)) > 0)
+				;
+			zsd_reap();
+		}
+		for (i = 2; i < n; i++)
+			if (pfd[i].revents)
+				zsd_heard(rel[i]);
+		if (zsd_stop && lfd != -1) {
+			/* new uploads are done by the clients themselves */
+			d_log("zsd: stopping\n");
+			close(lfd);
+			unlink(sa.sun_path);
+			lfd = -1;
+		}
+		if (lfd != -1 && (pfd[0].revents & POLLIN) && (cfd = accept(lfd, NULL, NULL)) != -1 && (u = zsd_recv(cfd))) {
+			if (workers > 0)
+				i = zsd_queued < ZSD_CHILDREN ? zsd_worker(u, workers) : ZSD_CHILDREN;
+			else
+				for (i = 0; i < ZSD_CHILDREN && (zsd_child[i].pid || zsd_child[i].head); i++)
+					;
+			if (i == ZSD_CHILDREN) {
+				zsd_write(cfd, &status, sizeof(status));
+				close(cfd);
+				zsd_free(u);
+			} else {
+				if (zsd_child[i].tail)
+					zsd_child[i].tail->next = u;
+				else
+					zsd_child[i].head = u;
+				zsd_child[i].tail = u;
+				zsd_queued++;
+			}
+		}
+
+		/* start the next upload of each worker that is free - or first
+		 * write back, or give back, a release of it that is due */
+		now = time(NULL);
+		for (i = 0, n = 0; i < ZSD_CHILDREN; i++) {
+			n += zsd_child[i].pid || zsd_child[i].head || zsd_child[i].rels;
+			if (zsd_child[i].pid || zsd_child[i].wait)
+				continue;
+			for (r = zsd_child[i].rels; r && !(r->ready && zsd_due(r) <= now); r = r->next)
+				;
+			if (r) {
+				zsd_tell(r, r->dirty ? ZSD_SAVE : ZSD_LEAVE);
+				continue;
+			}
+			if (!(u = zsd_child[i].head))
+				continue;
+			if (workers > 0 && zsd_flush > 0 && !u->plain && !zsd_stop) {
+				zsd_path(u, path, sizeof(path));
+				for (r = zsd_child[i].rels; r && strcmp(r->path, path); r = r->next)
+					;
+				if (!r && zsd_kept < ZSD_CHILDREN && !(r = zsd_keep(i, u, path, lfd)))
+					u->plain = 1;
+				if (r && !r->ready) {
+					zsd_child[i].wait = r;
+					continue;
+				}
+				if (r && zsd_stale(r)) {
+					/* what it kept is of a release that is gone */
+					r->dirty = 0;
+					zsd_tell(r, ZSD_LEAVE);
+					continue;
+				}
+			}
+			if (!(zsd_child[i].head = u->next))
+				zsd_child[i].tail = NULL;
+			zsd_queued--;
+#ifdef USING_GLFTPD
+			load_users_groups();	/* mapped again only if changed */
+#endif
+			switch ((pid = fork())) {
+			case -1:
+				d_log("zsd: fork(): %s\n", strerror(errno));
+				zsd_write(u->fd, &status, sizeof(status));
+				close(u->fd);
+				break;
+			case 0:
+				return zsd_child_init(u, u->plain ? NULL : r, lfd, argvp);
+			default:
+				zsd_child[i].pid = pid;
+				zsd_child[i].fd = u->fd;
+				if (!u->plain && r) {
+					r->used = now;
+					if (!r->dirty)
+						r->dirty = now;
+				}
+			}
+			zsd_free(u);
+		}
+		if (zsd_stop && !n) {
+			d_log("zsd: stopped\n");
+			exit(EXIT_SUCCESS);
+		}
+	}
+}
@@ -15,6 +15,7 @@
 #include "convert.h"
 #include "race-file.h"
 #include "crc.h"
+#include "pwcache.h"
 
 #ifdef HAVE_CONFIG_H
 # include "config.h"
@@ -26,15 +27,6 @@
 
 #include <stdarg.h>
 
-int		num_groups = 0, num_users = 0;
-
-#ifdef USING_GLFTPD
-        /* Only under glftpd do we have a uid/gid-lookup, so these
-         * are only needed there. */
-struct USER   **user;
-struct GROUP  **group;
-#endif
-
 /*
  * d_log - create/put comments in a .debug file
  * Last revised by: js
@@ -105,25 +97,13 @@ create_missing(char *f)
  *         Revision: r1 (2002.01.16)
  */
 char *
-findfileext(DIR *dir, char *fileext)
+findfileext(DIRSNAP *dir, char *fileext)
 {
-	int			k;
-	static struct dirent	*dp;
-
-	errno = 0;
-	rewinddir(dir);
-	while ((dp = readdir(dir))) {
-		if ((k = NAMLEN(dp)) < 4)
-			continue;
-		if (strcasecmp(dp->d_name + k - strlen(fileext), fileext) == 0) {
-			return dp->d_name;
-		}
-	}
-
-	if (errno)
-		d_log("zsfunctions.c: findfileext() - readdir(dir) returned an error: %s\n", strerror(errno));
+	int		i;
 
-	return NULL;
+	if ((i = dirsnap_ext(dir, fileext, -1)) == -1)
+		return NULL;
+	return (char *)dirsnap_name(dir, i);
 }
 /*
  * findfileextfromlist - find a filename with a matching extension
@@ -131,7 +111,7 @@ findfileext(DIR *dir, char *fileext)
  * Last Modified by: Sked 2011.12.06 (YYYY.MM.DD)
  */
 char *
-findfileextfromlist(DIR *dir, char *extlist)
+findfileextfromlist(DIRSNAP *dir, char *extlist)
 {
 	int pos = 1;
 	char *filename = NULL;
@@ -231,21 +211,12 @@ findfileextsub(const char *dir, char *filetypes, char *subdirs)
 }
 
 int
-check_dupefile(DIR *dir, char *fname)
+check_dupefile(DIRSNAP *dir, char *fname)
 {
-	int			 found = 0;
-	static struct dirent	*dp;
+	int		found = 0, i = -1;
 
-        errno = 0;
-
-	rewinddir(dir);
-	while ((dp = readdir(dir))) {
-		if (strcasecmp(dp->d_name, fname) == 0)
-			found++;
-	}
-
-        if (errno)
-            d_log("zipscript-c: check_dupefile() - readdir(dir) returned an error: %s\n", strerror(errno));
+	while ((i = dirsnap_find(dir, fname, DIRSNAP_NOCASE, i)) != -1)
+		found++;
 
 	return (found - 1);
 }
@@ -257,26 +228,13 @@ check_dupefile(DIR *dir, char *fname)
  *         Revision: ?? (2004.10.06)
  */
 char           *
-findfileextparent(DIR *dir, char *fileext)
+findfileextparent(DIRSNAP *dir, char *fileext)
 {
-	int			k;
-	static struct dirent	*dp;
-
-        errno = 0;
-
-	rewinddir(dir);
-	while ((dp = readdir(dir))) {
-		if ((k = NAMLEN(dp)) < 4)
-			continue;
-		if (strcasecmp(dp->d_name + k - 4, fileext) == 0) {
-			return dp->d_name;
-		}
-	}
+	int		i;
 
-        if (errno)
-            d_log("zipscript-c: findfileextparent() - readdir(dir) returned an error: %s\n", strerror(errno));
-
-	return NULL;
+	if ((i = dirsnap_ext(dir, fileext, -1)) == -1)
+		return NULL;
+	return (char *)dirsnap_name(dir, i);
 }
 
 /*
@@ -285,40 +243,30 @@ findfileextparent(DIR *dir, char *fileext)
  *         Revision: ?? (2003.12.11)
  */
 int 
-findfileextcount(DIR *dir, char *fileext)
+findfileextcount(DIRSNAP *dir, char *fileext)
 {
-	int		fnamelen, c = 0;
-	struct dirent	*dp;
+	int		c = 0, i = -1;
 
-        errno = 0;
-
-	rewinddir(dir);
-	while ((dp = readdir(dir))) {
-		if ((fnamelen = NAMLEN(dp)) < 4)
-			continue;
-		if (!strcasecmp((dp->d_name + fnamelen - 4), fileext))
-			c++;
-	}
-
-        if (errno)
-            d_log("zipscript-c: findfileextparent() - readdir(dir) returned an error: %s\n", strerror(errno));
+	while ((i = dirsnap_ext(dir, fileext, i)) != -1)
+		c++;
 
 	return c;
 }
 
 int 
-file_count(DIR *dir)
+file_count(DIRSNAP *dir)
 {
 	int		c = 0;
-	struct dirent	*dp;
-	char		*fp;
+	unsigned int	i, n = dirsnap_read(dir);
+	const char	*name;
+	size_t		len;
 
-	rewinddir(dir);
-	while ((dp = readdir(dir))) {
-		fp = dp->d_name + NAMLEN(dp) - 4;
-		if (*dp->d_name == '.')
+	for (i = 0; i < n; i++) {
+		name = dirsnap_name(dir, i);
+		if (*name == '.')
 			continue;
-		if (strcomp(ignored_types, fp) || strcomp(allowed_types, fp))
+		len = strlen(name);
+		if (strcomp(ignored_types, (char *)name + (len < 4 ? 0 : len - 4)) || strcomp(allowed_types, (char *)name + (len < 4 ? 0 : len - 4)))
 			continue;
 		c++;
 	}
@@ -386,13 +334,14 @@ selector(struct dirent *d)
  *         Revision: ??
  */
 void 
-del_releasedir(DIR *dir, char *relname)
+del_releasedir(DIRSNAP *dir, char *relname)
 {
-	struct dirent *dp;
+	unsigned int	i, n = dirsnap_read(dir);
 
-	while ((dp = readdir(dir)))
-		unlink(dp->d_name);
+	for (i = 0; i < n; i++)
+		unlink(dirsnap_name(dir, i));
 	rmdir(relname);
+	dirsnap_changed();
 }
 
 
@@ -431,37 +380,33 @@ space_to_dot(char *s)
 void 
 unlink_missing(char *s)
 {
-	char		t[NAME_MAX];
-	long		loc;
-	DIR		*dir;
-	struct dirent	*dp;
+	char		t[NAME_MAX], *name;
+	DIRSNAP		*dir;
+
+	/* the snapshot is asked before the unlinks, so it's read once at most */
+	dir = dirsnap_open(".");
 
 	snprintf(t, NAME_MAX, "%s-missing", s);
+	name = dir ? findfile(dir, t) : NULL;
 	unlink(t);
 #if (sfv_cleanup_lowercase)
 	strtolower(t);
 	unlink(t);
 #endif
-	dir = opendir(".");
-	if ((loc = findfile(dir, t))) {
-		seekdir(dir, loc);
-		dp = readdir(dir);
-		unlink(dp->d_name);
-	}
+	if (name)
+		unlink(name);
 
 	snprintf(t, NAME_MAX, "%s.bad", s);
+	name = dir ? findfile(dir, t) : NULL;
 	unlink(t);
 #if (sfv_cleanup_lowercase)
 	strtolower(t);
 	unlink(t);
 #endif
-	rewinddir(dir);
-	if ((loc = findfile(dir, t))) {
-		seekdir(dir, loc);
-		dp = readdir(dir);
-		unlink(dp->d_name);
-	}
-	closedir(dir);
+	if (name)
+		unlink(name);
+	dirsnap_changed();
+	dirsnap_close(dir);
 }
 
 /*
@@ -536,8 +481,9 @@ move_progress_bar(unsigned char delete, struct VARS *raceI, struct USERINFO **us
 	regex_t		preg;
 	regmatch_t	pmatch[1];
 
-	DIR		*dir;
-	struct dirent *dp;
+	DIRSNAP		*dir;
+	const char	*name;
+	unsigned int	i, n;
 
 	if (raceI->misc.release_type == RTYPE_AUDIO) {
 		d_log("move_progress_bar: del_progressmeter_audio: %s\n", del_progressmeter_audio);
@@ -549,14 +495,14 @@ move_progress_bar(unsigned char delete, struct VARS *raceI, struct USERINFO **us
 	d_log("move_progress_bar: delbar: %s\n", delbar);
 	regret = regcomp(&preg, delbar, REG_NEWLINE | REG_EXTENDED);
 	if (!regret) {
-		if ((dir = opendir("."))) {
-
+		if ((dir = dirsnap_open("."))) {
+			n = dirsnap_read(dir);
 			if (delete) {
-				while ((dp = readdir(dir))) {
-					if ((int)strlen(dp->d_name) && regexec(&preg, dp->d_name, 1, pmatch, 0) == 0) {
+				for (i = 0; i < n; i++) {
+					name = dirsnap_name(dir, i);
+					if (*name && regexec(&preg, name, 1, pmatch, 0) == 0) {
 						d_log("move_progress_bar: Found progress bar, removing\n");
-						remove(dp->d_name);
-						*dp->d_name = 0;
+						remove(name);
 						m = 1;
 					}
 				}
@@ -564,7 +510,7 @@ move_progress_bar(unsigned char delete, struct VARS *raceI, struct USERINFO **us
 					d_log("move_progress_bar: Progress bar could not be deleted, not found!\n");
 			} else {
 				if (!raceI->total.files) {
-					closedir(dir);
+					dirsnap_close(dir);
 					regfree(&preg);
 					return;
 				}
@@ -573,16 +519,16 @@ move_progress_bar(unsigned char delete, struct VARS *raceI, struct USERINFO **us
 					bar = convert(raceI, userI, groupI, progressmeter_audio);
 				else
 					bar = convert(raceI, userI, groupI, progressmeter);
-				while ((dp = readdir(dir))) {
-					if ((int)strlen(dp->d_name) && regexec(&preg, dp->d_name, 1, pmatch, 0) == 0) {
+				for (i = 0; i < n; i++) {
+					name = dirsnap_name(dir, i);
+					if (*name && regexec(&preg, name, 1, pmatch, 0) == 0) {
 						if (!m) {
 							d_log("move_progress_bar: Found progress bar, renaming.\n");
-							rename(dp->d_name, bar);
+							rename(name, bar);
 							m = 1;
 						} else {
 							d_log("move_progress_bar: Found (extra) progress bar, removing\n");
-							remove(dp->d_name);
-							*dp->d_name = 0;
+							remove(name);
 							m = 2;
 						}
 					}
@@ -592,7 +538,9 @@ move_progress_bar(unsigned char delete, struct VARS *raceI, struct USERINFO **us
 					createstatusbar(bar);
 				}
 			}
-			closedir(dir);
+			if (m)
+				dirsnap_changed();
+			dirsnap_close(dir);
 		} else
 			d_log("move_progress_bar: opendir() failed : %s\n", strerror(errno));
 		d_log("move_progress_bar: Freeing regpointer\n");
@@ -605,52 +553,45 @@ move_progress_bar(unsigned char delete, struct VARS *raceI, struct USERINFO **us
 
 /*
  * Modified: Unknown
+ * Returns the name of the entry lenient_compare() matches with filename.
  */
-long
-findfile(DIR *dir, char *filename)
+char *
+findfile(DIRSNAP *dir, char *filename)
 {
-	struct dirent	*dp;
+	int		i;
 
-	rewinddir(dir);
-	while ((dp = readdir(dir))) {
-//#if (sfv_cleanup_lowercase)
-//		if (!strcasecmp(dp->d_name, filename))
-//#else
-//		if (!strcmp(dp->d_name, filename))
-//#endif
-		if (lenient_compare(dp->d_name, filename))
-			return telldir(dir);
-	}
-	return 0;
+	if ((i = dirsnap_find(dir, filename, DIRSNAP_LENIENT, -1)) == -1)
+		return NULL;
+	return (char *)dirsnap_name(dir, i);
 }
 
 void
-removedotfiles(DIR *dir)
+removedotfiles(DIRSNAP *dir)
 {
-	struct dirent *dp;
+	unsigned int	i, n = dirsnap_read(dir);
+	const char	*name;
 
-	rewinddir(dir);
-	while ((dp = readdir(dir)))
-		if ((!strncasecmp(dp->d_name, ".", 1)) &&
-		    ((int)strlen(dp->d_name) > 2))
-			unlink(dp->d_name);
+	for (i = 0; i < n; i++) {
+		name = dirsnap_name(dir, i);
+		if (*name == '.' && (int)strlen(name) > 2)
+			unlink(name);
+	}
+	dirsnap_changed();
 }
 
 char *
 findfilename(char *filename, char *dest, struct VARS *raceI)
 {
-	DIR		*dir;
-	struct dirent 	*dp;
-
-	dir = opendir(".");
-	while ((dp = readdir(dir))) {
-		if ((int)strlen(dp->d_name) && !strcasecmp(dp->d_name, filename)) {
-			dest = ng_realloc(dest, (int)sizeof(dp->d_name) + 1, 1, 1, raceI, 0);
-			strncpy(dest, dp->d_name, sizeof(dp->d_name));
-			break;
-		}
+	int		i;
+	DIRSNAP		*dir;
+
+	if (!*filename || !(dir = dirsnap_open(".")))
+		return dest;
+	if ((i = dirsnap_find(dir, filename, DIRSNAP_NOCASE, -1)) != -1) {
+		dest = ng_realloc(dest, NAME_MAX + 1, 1, 1, raceI, 0);
+		strlcpy(dest, dirsnap_name(dir, i), NAME_MAX + 1);
 	}
-	closedir(dir);
+	dirsnap_close(dir);
 	return dest;
 }
 
@@ -691,8 +632,9 @@ removecomplete(int rtype)
 	regmatch_t	pmatch[1];
 	int		regret;
 
-	DIR		*dir;
-	struct dirent	*dp;
+	DIRSNAP		*dir;
+	const char	*name;
+	unsigned int	i, n;
 
         struct stat     fileinfo;
         char            deref_link[PATH_MAX];
@@ -730,16 +672,17 @@ removecomplete(int rtype)
 		d_log("removecomplete: del_*_completebar (type: %d): %s\n", rtype, mydelbar);
 		regret = regcomp(&preg, mydelbar, REG_NEWLINE | REG_EXTENDED);
 		if (!regret) {
-			if ((dir = opendir("."))) {
-				while ((dp = readdir(dir))) {
-					if (regexec(&preg, dp->d_name, 1, pmatch, 0) == 0) {
-						if ((int)pmatch[0].rm_so == 0 && (int)pmatch[0].rm_eo == (int)NAMLEN(dp)) {
-							remove(dp->d_name);
-							*dp->d_name = 0;
-						}
+			if ((dir = dirsnap_open("."))) {
+				n = dirsnap_read(dir);
+				for (i = 0; i < n; i++) {
+					name = dirsnap_name(dir, i);
+					if (regexec(&preg, name, 1, pmatch, 0) == 0) {
+						if ((int)pmatch[0].rm_so == 0 && (int)pmatch[0].rm_eo == (int)strlen(name))
+							remove(name);
 					}
 				}
-				closedir(dir);
+				dirsnap_changed();
+				dirsnap_close(dir);
 			} else
 				d_log("removecomplete: opendir failed : %s\n", strerror(errno));
 		} else {
@@ -1074,7 +1017,7 @@ readsfv_ffile(struct VARS *raceI)
 			ext_start, n;
 	char		*buf = NULL, *fname;
 
-	DIR		*dir;
+	DIRSNAP		*dir;
 
 	fd = open(raceI->file.name, O_RDONLY);
 	buf = ng_realloc(buf, raceI->file.size + 2, 1, 1, raceI, 1);
@@ -1083,7 +1026,7 @@ readsfv_ffile(struct VARS *raceI)
 	}
 	close(fd);
 
-	dir = opendir(".");
+	dir = dirsnap_open(".");
 
 	for (n = 0; n <= raceI->file.size; n++) {
 		if (buf[n] == '\n' || n == raceI->file.size) {
@@ -1109,7 +1052,7 @@ readsfv_ffile(struct VARS *raceI)
 					raceI->total.files++;
 					if (!strcomp(ignored_types, fname + ext_start) || !strcomp("nfo", fname + ext_start)) {
 //					if (!strcomp(ignored_types, fname + ext_start) && !(strcomp(allowed_types, fname + ext_start) && matchpath(allowed_types_exemption_dirs, raceI->misc.current_path))) {
-						if (findfile(dir, fname)) {
+						if (dir && findfile(dir, fname)) {
 							raceI->total.files_missing--;
 						}
 					}
@@ -1124,7 +1067,7 @@ readsfv_ffile(struct VARS *raceI)
 		raceI->total.files_missing = 0;
 	}
 	ng_free(buf);
-	closedir(dir);
+	dirsnap_close(dir);
 }
 
 /*
@@ -1149,210 +1092,35 @@ get_rar_info(char *filename, struct VARS *raceI)
 	}
 }
 
-/*
- * Modified   : 27.02.2005 Author     : js
- * 
- * Description: Executes external program and returns return value
- * 
- */
-int 
-execute(char *s)
-{
-	int	i = 0;
-
-	if ((i = system(s)) == -1)
-		d_log("execute (old): %s\n", strerror(errno));
-	return i;
-}
-
 #ifdef USING_GLFTPD
 /* Only under glftpd do we have a uid/gid-lookup, so these
  * are only needed there. */
 char           *
 get_g_name(int gid)
 {
-	int		n;
-	for (n = 0; n < num_groups; n++)
-		if ((int)group[n]->id / 100 == (int)gid / 100)
-			return group[n]->name;
-	return "NoGroup";
+	const char	*name = pwc_gname((gid_t)gid, 0);
+
+	return name ? (char *)name : "NoGroup";
 }
 
 char           *
 get_u_name(int uid)
 {
-	int		n;
-	for (n = 0; n < num_users; n++)
-		if (user[n]->id == (unsigned int)uid)
-			return user[n]->name;
-	return "Unknown";
-}
-#endif
-
-#ifdef USING_GLFTPD
-/* Only under glftpd do we have a uid/gid-lookup, so these
- * are only needed there. */
-
-/* Buffer groups file */
-int 
-buffer_groups(char *groupfile, int setfree)
-{
-	char           *f_buf = NULL, *g_name;
-	gid_t		g_id;
-	ssize_t		f_buf_len;
-	int		f, n, m, g_n_size, l_start = 0;
-	int		GROUPS = 0;
-	struct stat	fileinfo;
-
-	if (setfree != 0) {
-		for (n = 0; n < setfree; n++) {
-			ng_free(group[n]->name);
-			ng_free(group[n]);
-		}
-		ng_free(group);
-		return 0;
-	}
-
-	f = open(groupfile, O_NONBLOCK);
-	if (f == -1) {
-	    d_log("buffer_groups: open(%s) failed: %s\n", groupfile, strerror(errno));
-	    return 0;
-	}
-
-	if (fstat(f, &fileinfo) == -1) {
-	    d_log("buffer_groups: fstat(%s) failed: %s\n", groupfile, strerror(errno));
-	    close(f);
-	    return 0;
-	}
-	f_buf = ng_realloc2(f_buf, fileinfo.st_size, 1, 1, 1);
-
-	f_buf_len = read(f, f_buf, fileinfo.st_size);
-	if (f_buf_len == -1) {
-	    d_log("buffer_groups: read(%s) failed: %s\n", groupfile, strerror(errno));
-	    ng_free(f_buf);
-	    close(f);
-	    return 0;
-	}
-
-	for (n = 0; n < f_buf_len; n++)
-		if (f_buf[n] == '\n')
-			GROUPS++;
-	group = ng_realloc2(group, GROUPS * sizeof(struct GROUP *), 1, 1, 1);
-
-	for (n = 0; n < f_buf_len; n++) {
-		if (f_buf[n] == '\n' || n == f_buf_len) {
-			f_buf[n] = 0;
-			m = l_start;
-			while (f_buf[m] != ':' && m < n)
-				m++;
-			if (m != l_start) {
-				f_buf[m] = 0;
-				g_name = f_buf + l_start;
-				g_n_size = m - l_start;
-				m = n;
-				while (f_buf[m] != ':' && m > l_start)
-					m--;
-				f_buf[m] = 0;
-				while (f_buf[m] != ':' && m > l_start)
-					m--;
-				if (m != n) {
-					g_id = strtol(f_buf + m + 1, NULL, 10);
-					group[num_groups] = ng_realloc2(group[num_groups], sizeof(struct GROUP), 1, 1, 1);
-					group[num_groups]->name = ng_realloc2(group[num_groups]->name, g_n_size + 1, 1, 1, 1);
-					strcpy(group[num_groups]->name, g_name);
-					group[num_groups]->id = g_id;
-					num_groups++;
-				}
-			}
-			l_start = n + 1;
-		}
-	}
+	const char	*name = pwc_uname((uid_t)uid);
 
-	close(f);
-	ng_free(f_buf);
-	return num_groups;
+	return name ? (char *)name : "Unknown";
 }
 
-/* Buffer users file */
-int
-buffer_users(char *passwdfile, int setfree)
-{ 
-	char           *f_buf = NULL, *u_name;
-	uid_t		u_id;
-	ssize_t		f_buf_len;
-	int		f, n, m, l, u_n_size, l_start = 0;
-	int		USERS = 0;
-	struct stat	fileinfo;
-
-	if (setfree != 0) {
-		for (n = 0; n < setfree; n++) {
-			ng_free(user[n]->name);
-			ng_free(user[n]);
-		}
-		ng_free(user);
-		return 0;
-	}
-
-	f = open(passwdfile, O_NONBLOCK);
-	if (f == -1) {
-	    d_log("buffer_users: open(%s) failed: %s\n", passwdfile, strerror(errno));
-	    return 0;
-	}
-
-	if (fstat(f, &fileinfo) == -1) {
-	    d_log("buffer_users: fstat(%s) failed: %s\n", passwdfile, strerror(errno));
-	    close(f);
-	    return 0;
-	}
-	f_buf = ng_realloc2(f_buf, fileinfo.st_size, 1, 1, 1);
-
-	f_buf_len = read(f, f_buf, fileinfo.st_size);
-	if (f_buf_len == -1) {
-	    d_log("buffer_users: read(%s) failed: %s\n", passwdfile, strerror(errno));
-	    ng_free(f_buf);
-	    close(f);
-	    return 0;
-	}
-
-	for (n = 0; n < f_buf_len; n++)
-		if (f_buf[n] == '\n')
-			USERS++;
-	user = ng_realloc2(user, USERS * sizeof(struct USER *), 1, 1, 1);
-
-	for (n = 0; n < f_buf_len; n++) {
-		if (f_buf[n] == '\n' || n == f_buf_len) {
-			f_buf[n] = 0;
-			m = l_start;
-			while (f_buf[m] != ':' && m < n)
-				m++;
-			if (m != l_start) {
-				f_buf[m] = 0;
-				u_name = f_buf + l_start;
-				u_n_size = m - l_start;
-				m = n;
-				for (l = 0; l < 4; l++) {
-					while (f_buf[m] != ':' && m > l_start)
-						m--;
-					f_buf[m] = 0;
-				}
-				while (f_buf[m] != ':' && m > l_start)
-					m--;
-				if (m != n) {
-					u_id = strtol(f_buf + m + 1, NULL, 10);
-					user[num_users] = ng_realloc2(user[num_users], sizeof(struct USER), 1, 1, 1);
-					user[num_users]->name = ng_realloc2(user[num_users], u_n_size + 1, 1, 1, 1);
-					strcpy(user[num_users]->name, u_name);
-					user[num_users]->id = u_id;
-					num_users++;
-				}
-			}
-			l_start = n + 1;
-		}
-	}
+/* Maps the users and groups - from .pwcache in storage, which is made again
+ * only when passwd or group changed. */
+void
+load_users_groups(void)
+{
+	char	cache[PATH_MAX];
 
-	close(f);
-	ng_free(f_buf);
-	return num_users;
+	snprintf(cache, sizeof(cache), "%s/.pwcache", storage);
+	if (pwc_load(cache, PASSWDFILE, GROUPFILE) == -1)
+		d_log("load_users_groups: could not read %s or %s: %s\n", PASSWDFILE, GROUPFILE, strerror(errno));
 }
 #endif
 
@@ -1365,29 +1133,24 @@ buffer_users(char *passwdfile, int setfree)
 off_t
 sfv_compare_size(char *fileext, off_t fsize)
 {
-	int k = 0;
+	int i = -1;
 	off_t l = 0;
 	struct stat filestat;
-	DIR *dir;
-	struct dirent *dp;
+	DIRSNAP *dir;
 
-	dir = opendir(".");
+	if (!(dir = dirsnap_open(".")))
+		return 0;
 
-	while ((dp = readdir(dir))) {
-		if ((k = NAMLEN(dp)) < 4)
-			continue;
-		if (strcasecmp(dp->d_name + k - 4, fileext) == 0) {
-			if (stat(dp->d_name, &filestat) != 0)
-				filestat.st_size = 1;
-			l += filestat.st_size;
-			continue;
-		}
+	while ((i = dirsnap_ext(dir, fileext, i)) != -1) {
+		if (dirsnap_stat(dir, i, DW_SIZE, &filestat) != 0)
+			filestat.st_size = 1;
+		l += filestat.st_size;
 	}
 
 	if (!(l = l - fsize) > 0)
 		l = 0;
 
-	closedir(dir);
+	dirsnap_close(dir);
 
 	return l;
 }
@@ -1773,65 +1536,62 @@ extractDirname(char *dirname, char *absoluteDirname)
 }
 
 int make_sfv(char *reldir) {
-	static struct dirent	*dp;
-	static struct stat	stat_buf;
-	DIR			*dirp;
-	int			fd, fcount = 0;
+	DIRWALK			w;
+	int			fd, n, fcount = 0;
+	size_t			len;
 	static char		buf[PATH_MAX + 3];
 	char			*fp;
 
-	if (!(dirp = opendir("."))) {
+	if (dirwalk_open(&w, AT_FDCWD, ".") == -1) {
 		d_log("make_sfv: Failed to open current dir: %s\n", strerror(errno));
 		return 1;
 	}
-	if ((fd = open("pzs-ng.sfv", O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1) {
+	if ((fd = openat(w.fd, "pzs-ng.sfv", O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1) {
 		d_log("make_sfv: Failed to create pzs-ng.sfv: %s\n", strerror(errno));
-		(void)closedir(dirp);
+		dirwalk_close(&w);
 		return 1;
 	}
-	while ((dp = readdir(dirp)) != NULL) {
-		fp = dp->d_name + NAMLEN(dp) - 3;
-		if (NAMLEN(dp) > 2 && *dp->d_name != '.' &&
+	dirsnap_changed();
+	while ((n = dirwalk_next(&w)) > 0) {
+		len = strlen(w.name);
+		fp = (char *)w.name + len - 3;
+		if (len > 2 && *w.name != '.' &&
 		    !strcomp(ignored_types, fp) &&
 		    (!strcomp(allowed_types, fp) || (strcomp(allowed_types, fp) && matchpath(allowed_types_exemption_dirs, reldir))) &&
-		    strcmp(dp->d_name, "pzs-ng.sfv") &&
-		    (dp->d_type == DT_REG || (!stat(dp->d_name, &stat_buf) && S_ISREG(stat_buf.st_mode) )) &&
+		    strcmp(w.name, "pzs-ng.sfv") &&
+		    S_ISREG(dirwalk_type(w.fd, w.name, w.type, 0)) &&
 		    strcmp(fp, "nfo")) {
-			d_log("make_sfv: Adding \"%-20s 00000000\" to sfv\n", dp->d_name);
-			snprintf(buf, sizeof(buf), "%-20s 00000000\n", dp->d_name);
+			d_log("make_sfv: Adding \"%-20s 00000000\" to sfv\n", w.name);
+			snprintf(buf, sizeof(buf), "%-20s 00000000\n", w.name);
 			fcount++;
 		        if ((write(fd, buf, strlen(buf))) == -1) {
 		                d_log("make_sfv: write failed: %s\n", strerror(errno));
 				(void)close(fd);
-				(void)closedir(dirp);
+				dirwalk_close(&w);
 				return 1;
 			}
 		} else
-			d_log("make_sfv: Ignoring %s (check allowed_types and ignored_types if this is wrong)\n", dp->d_name);
+			d_log("make_sfv: Ignoring %s (check allowed_types and ignored_types if this is wrong)\n", w.name);
 	}
+	if (n == -1)
+		d_log("make_sfv: Failed to read current dir: %s\n", strerror(errno));
 	if (!fcount) {
 		d_log("make_sfv: Did not find anything to put in the sfv - removing sfv\n");
-		unlink("pzs-ng.sfv");
+		unlinkat(w.fd, "pzs-ng.sfv", 0);
 	}
 	(void)close(fd);
-	(void)closedir(dirp);
+	dirwalk_close(&w);
 	return 0;
 }
 
 unsigned int
-match_lenient(DIR *dir, char *fname)
+match_lenient(DIRSNAP *dir, char *fname)
 {
-	unsigned int		crc = 0;
-	static struct dirent   *dp;
+	int		i;
 
-	rewinddir(dir);
-	while ((dp = readdir(dir))) {
-		if (lenient_compare(dp->d_name, fname)) {
-			crc = calc_crc32(dp->d_name);
-			return crc;
-		}
-	}
-	return 0;
+	if ((i = dirsnap_find(dir, fname, DIRSNAP_LENIENT, -1)) == -1)
+		return 0;
+	return calc_crc32_parallel((char *)dirsnap_name(dir, i));
 }
 unsigned int
 insampledir(char *dirname)
@@ -1887,6 +1647,7 @@ createstatusbar(const char *bar)
         tmp = strtok(NULL, "\n");
     }
     free(newbar);
+    dirsnap_changed();
 #endif
 }
 
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <string.h>
+#include <time.h>
+
+#include "lockstats.h"
+
+/* by the bit of their PROGTYPE_ in constants.h */
+static const char *progtypes[8] = { "", "zipscript", "postdel", "cleanup", "datacleaner", "rescan", "", "" };
+
+static const char *
+usecs(unsigned long long us, char *buf, size_t len)
+{
+	if (us < 10000)
+		snprintf(buf, len, "%lluus", us);
+	else if (us < 10000000)
+		snprintf(buf, len, "%llums", us / 1000);
+	else
+		snprintf(buf, len, "%llus", us / 1000000);
+	return buf;
+}
+
+static void
+histogram(const char *title, const uint64_t *hist, unsigned int n, int times)
+{
+	unsigned int	i, first, last;
+	uint64_t	max = 0;
+	char		label[32], buf[16];
+
+	for (first = 0; first < n && !hist[first]; first++)
+		;
+	for (last = n; last > first && !hist[last - 1]; last--)
+		;
+	for (i = first; i < last; i++)
+		if (hist[i] > max)
+			max = hist[i];
+	printf("\n%s:\n", title);
+	if (!max) {
+		printf("  (none)\n");
+		return;
+	}
+	for (i = first; i < last; i++) {
+		if (times)
+			snprintf(label, sizeof(label), "<%s", usecs((unsigned long long)1 << i, buf, sizeof(buf)));
+		else
+			snprintf(label, sizeof(label), i == n - 1 ? "%u+" : "%u", i);
+		printf("  %8s %10llu %.*s\n", label, (unsigned long long)hist[i], (int)((hist[i] * 50 + max - 1) / max),
+		       "##################################################");
+	}
+}
+
+static int
+relcmp(const void *a, const void *b)
+{
+	const LOCKSTAT_REL	*ra = *(const LOCKSTAT_REL * const *)a, *rb = *(const LOCKSTAT_REL * const *)b;
+
+	if (ra->wait_us != rb->wait_us)
+		return ra->wait_us < rb->wait_us ? 1 : -1;
+	return ra->hold_us < rb->hold_us ? 1 : ra->hold_us > rb->hold_us ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	LOCKSTATS *ls;
+	LOCKSTAT_REL **rel;
+	FILE *f;
+	time_t started;
+	unsigned int i, n, top;
+	char b1[16], b2[16], b3[16], b4[16];
+
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: %s <lock_stats_file> [releases]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	top = argc == 3 ? (unsigned int)strtoul(argv[2], NULL, 10) : 10;
+
+	if (!(f = fopen(argv[1], "r"))) {
+		perror("fopen");
+		return EXIT_FAILURE;
+	}
+	if (!(ls = malloc(sizeof(LOCKSTATS))) || !(rel = malloc(LOCKSTAT_RELEASES * sizeof(*rel)))) {
+		perror("malloc");
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+	if (fread(ls, sizeof(LOCKSTATS), 1, f) != 1 || ls->magic != LOCKSTAT_MAGIC || ls->version != LOCKSTAT_VERSION ||
+	    ls->releases != LOCKSTAT_RELEASES) {
+		fprintf(stderr, "%s: not a lock stats file of this version\n", argv[1]);
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+	fclose(f);
+
+	started = (time_t)ls->started;
+	printf("Since:       %s", ctime(&started));
+	printf("Locks:       %llu, timed out: %llu, forced: %llu, lost: %llu, holder died: %llu\n",
+	       (unsigned long long)ls->locks, (unsigned long long)ls->timeouts, (unsigned long long)ls->forced,
+	       (unsigned long long)ls->lost, (unsigned long long)ls->ownerdead);
+	printf("Suggested:   %llu, left when suggested: %llu\n", (unsigned long long)ls->suggested, (unsigned long long)ls->yielded);
+	printf("Waited:      %llu of %llu, retries: %llu\n", (unsigned long long)ls->waited,
+	       (unsigned long long)(ls->locks + ls->timeouts), (unsigned long long)ls->retries);
+	printf("update_lock: %llu written, %llu left out by lock_optimize\n", (unsigned long long)ls->touches, (unsigned long long)ls->skips);
+	if (ls->locks + ls->timeouts)
+		printf("Average:     waited %s, held %s\n", usecs(ls->wait_us / (ls->locks + ls->timeouts), b1, sizeof(b1)),
+		       usecs(ls->locks ? ls->hold_us / ls->locks : 0, b2, sizeof(b2)));
+	printf("By program: ");
+	for (i = 0; i < 8; i++)
+		if (ls->progtype[i])
+			printf(" %s %llu", *progtypes[i] ? progtypes[i] : "?", (unsigned long long)ls->progtype[i]);
+	printf("\n");
+
+	histogram("Time waited", ls->wait_hist, LOCKSTAT_BUCKETS, 1);
+	histogram("Time held", ls->hold_hist, LOCKSTAT_BUCKETS, 1);
+	histogram("Processes ahead in the queue", ls->queue_hist, LOCKSTAT_QUEUE, 0);
+
+	for (i = n = 0; i < LOCKSTAT_RELEASES; i++)
+		if (ls->rel[i].hash) {
+			ls->rel[i].path[LOCKSTAT_PATHLEN - 1] = '\0';
+			rel[n++] = &ls->rel[i];
+		}
+	qsort(rel, n, sizeof(*rel), relcmp);
+	printf("\nReleases by time waited (%u of %u kept):\n", n < top ? n : top, n);
+	printf("  %8s %8s %8s %8s %6s %5s %5s %5s %5s  %s\n", "waited", "max", "held", "max", "locks", "tmout", "force", "sugg", "queue", "release");
+	for (i = 0; i < n && i < top; i++)
+		printf("  %8s %8s %8s %8s %6llu %5llu %5llu %5llu %5llu  %s\n",
+		       usecs(rel[i]->wait_us, b1, sizeof(b1)), usecs(rel[i]->wait_max_us, b2, sizeof(b2)),
+		       usecs(rel[i]->hold_us, b3, sizeof(b3)), usecs(rel[i]->hold_max_us, b4, sizeof(b4)),
+		       (unsigned long long)rel[i]->locks, (unsigned long long)rel[i]->timeouts, (unsigned long long)rel[i]->forced,
+		       (unsigned long long)rel[i]->suggested, (unsigned long long)rel[i]->queue_max, rel[i]->path);
+
+	free(rel);
+	free(ls);
+
+	return EXIT_SUCCESS;
+}
@@ -2,13 +2,18 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <limits.h>
+#include <string.h>
 
 #include "race-file.h"
 
 int main(int argc, char **argv)
 {
-	RACEDATA rd;
+	RACEDATA *rd;
+	RACEDATA_HEAD rh;
 	FILE *f;
+	char *str;
+	const char *owner;
+	unsigned int n;
 	
 	if (argc != 2) {
 		fprintf(stderr, "Usage: %s <file>\n", argv[0]);
@@ -20,16 +25,39 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	while ((fread(&rd, sizeof(RACEDATA), 1, f))) {
-		printf("File:   %s\n", rd.fname);
-		printf("CRC32:  %.8x\n", rd.crc32);
-		printf("Size:   %llu\n", rd.size);
-		printf("Time:   %i\n", (int)rd.start_time);
-		printf("Status: %u\n", rd.status);
-		printf("Uname:  %s\n", rd.uname);
-		printf("Group:  %s\n\n", rd.group);
+	if (fread(&rh, sizeof(RACEDATA_HEAD), 1, f) != 1 || rh.magic != RACEDATA_MAGIC || !rh.strsize || rh.count > rh.capacity) {
+		fprintf(stderr, "%s: not a racedata file\n", argv[1]);
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+	printf("Records: %u (%u removed), capacity: %u, buckets: %u, strings: %u bytes\n\n", rh.count, rh.deleted, rh.capacity, rh.buckets, rh.strsize);
+
+	rd = malloc(rh.capacity * sizeof(RACEDATA) + 1);
+	str = malloc(rh.strsize);
+	if (!rd || !str || fseeko(f, RACEDATA_OFFSET(&rh, 0), SEEK_SET) == -1 ||
+	    fread(rd, sizeof(RACEDATA), rh.capacity, f) != rh.capacity || fread(str, 1, rh.strsize, f) != rh.strsize) {
+		fprintf(stderr, "%s: short file\n", argv[1]);
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+	str[rh.strsize - 1] = '\0';
+
+	for (n = 0; n < rh.count; n++) {
+		if (!rd[n].fname || rd[n].fname >= rh.strsize || rd[n].owner >= rh.strsize)
+			continue;
+		owner = str + rd[n].owner;
+		printf("File:   %s\n", str + rd[n].fname);
+		printf("CRC32:  %.8x\n", rd[n].crc32);
+		printf("Size:   %llu\n", (unsigned long long)rd[n].size);
+		printf("Speed:  %llu\n", (unsigned long long)rd[n].speed);
+		printf("Time:   %i\n", (int)rd[n].start_time);
+		printf("Status: %u\n", rd[n].status);
+		printf("Uname:  %s\n", owner);
+		printf("Group:  %s\n\n", owner + strlen(owner) + 1 < str + rh.strsize ? owner + strlen(owner) + 1 : "");
 	}
 
+	free(rd);
+	free(str);
 	fclose(f);
 
 	return EXIT_SUCCESS;
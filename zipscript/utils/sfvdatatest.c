@@ -7,8 +7,11 @@
 
 int main(int argc, char **argv)
 {
-	SFVDATA sd;
+	SFVDATA_HEAD sh;
+	SFVDATA *sd;
 	FILE *f;
+	char *str;
+	unsigned int n;
 	
 	if (argc != 2) {
 		fprintf(stderr, "Usage: %s <file>\n", argv[0]);
@@ -20,10 +23,26 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	while ((fread(&sd, sizeof(SFVDATA), 1, f))) {
-		printf("%s %.8x\n", sd.fname, sd.crc32);
+	if (fread(&sh, sizeof(SFVDATA_HEAD), 1, f) != 1 || sh.magic != SFVDATA_MAGIC || !sh.strsize) {
+		fprintf(stderr, "%s: not a sfvdata file\n", argv[1]);
+		fclose(f);
+		return EXIT_FAILURE;
 	}
 
+	sd = malloc(sh.count * sizeof(SFVDATA) + 1);
+	str = malloc(sh.strsize);
+	if (!sd || !str || fread(sd, sizeof(SFVDATA), sh.count, f) != sh.count || fread(str, 1, sh.strsize, f) != sh.strsize) {
+		fprintf(stderr, "%s: short file\n", argv[1]);
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+	str[sh.strsize - 1] = '\0';
+
+	for (n = 0; n < sh.count; n++)
+		printf("%s %.8x\n", sd[n].fname < sh.strsize ? str + sd[n].fname : "", sd[n].crc32);
+
+	free(sd);
+	free(str);
 	fclose(f);
 
 	return EXIT_SUCCESS;